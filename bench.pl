@@ -0,0 +1,131 @@
+#!/usr/bin/perl
+use 5.16.0;
+use warnings FATAL => 'all';
+
+use Time::HiRes qw(time);
+
+# Rough throughput numbers for the mounted file system. Run with `make bench`;
+# results are appended to bench_output.txt.
+
+my $ROUNDS = 50;
+
+sub mount {
+    my ($opts) = @_;
+    $opts //= "";
+    system("(make mount MOUNT_OPTS='$opts' 2>&1) > /dev/null &");
+    sleep 1;
+}
+
+sub unmount {
+    system("(make unmount 2>&1) > /dev/null");
+}
+
+sub record {
+    my ($line) = @_;
+    say $line;
+    open my $out, ">>", "bench_output.txt" or return;
+    $out->say($line);
+    close $out;
+}
+
+sub report {
+    my ($name, $bytes, $secs) = @_;
+    record(sprintf("%-24s %8.2f MB/s", $name, $bytes / $secs / (1024 * 1024)));
+}
+
+sub report_rate {
+    my ($name, $count, $secs) = @_;
+    record(sprintf("%-24s %8.0f stat/s", $name, $count / $secs));
+}
+
+# read the whole file in large chunks, reopening it every round so the
+# kernel page cache is dropped and every byte comes through nufs
+sub seq_read {
+    my ($name, $chunk) = @_;
+    my $total = 0;
+    my $start = time();
+    for (1 .. $ROUNDS) {
+        open my $fh, "<", "mnt/$name" or die "open mnt/$name: $!";
+        my $data;
+        while (my $got = sysread($fh, $data, $chunk)) {
+            $total += $got;
+        }
+        close $fh;
+    }
+    return ($total, time() - $start);
+}
+
+sub seq_write {
+    my ($name, $size, $chunk) = @_;
+    my $data = "x" x $chunk;
+    my $total = 0;
+    my $start = time();
+    for my $round (1 .. $ROUNDS) {
+        # only the first round creates the file, later rounds overwrite it
+        my $mode = ($round == 1) ? ">" : "+<";
+        open my $fh, $mode, "mnt/$name" or die "open mnt/$name: $!";
+        for (my $done = 0; $done < $size; $done += $chunk) {
+            $total += syswrite($fh, $data);
+        }
+        close $fh;
+    }
+    return ($total, time() - $start);
+}
+
+# a tree of small files, to stat over and over
+sub make_tree {
+    for my $dd (0 .. 3) {
+        mkdir "mnt/d$dd" or die "mkdir mnt/d$dd: $!";
+        for my $ff (0 .. 39) {
+            open my $fh, ">", "mnt/d$dd/f$ff" or die "open mnt/d$dd/f$ff: $!";
+            print $fh "file $dd/$ff\n";
+            close $fh;
+        }
+    }
+}
+
+# run a command that stats every file of the tree, counting the entries
+sub stat_walk {
+    my ($cmd) = @_;
+    my $total = 0;
+    my $start = time();
+    for (1 .. $ROUNDS) {
+        my @lines = `$cmd 2>/dev/null`;
+        $total += @lines;
+    }
+    return ($total, time() - $start);
+}
+
+system("rm -f data.nufs");
+mount();
+
+my $size = 768 * 1024;
+report("seq write 128K", seq_write("seq.bin", $size, 128 * 1024));
+report("seq read 128K", seq_read("seq.bin", 128 * 1024));
+report("seq read 4K", seq_read("seq.bin", 4 * 1024));
+
+# the same reads without verifying checksums, to see what they cost
+unmount();
+mount("-o noverify");
+report("seq read 128K noverify", seq_read("seq.bin", 128 * 1024));
+report("seq read 4K noverify", seq_read("seq.bin", 4 * 1024));
+
+# stat heavy walks; the attribute cache is off, so every stat reaches nufs
+unmount();
+mount("-o attr_timeout=0,entry_timeout=0");
+make_tree();
+report_rate("find -ls", stat_walk("find mnt -ls"));
+report_rate("ls -lR", stat_walk("ls -lR mnt"));
+
+# sequential I/O on an image aged by a seeded churn, whose free space is in
+# pieces; the same seed ages it the same way every run
+unmount();
+system("rm -f data.nufs");
+my ($aged) = grep { /^files:/ } `tools/nufs-age -c 2000 -s 1 data.nufs`;
+record("aged image: $aged") if $aged;
+mount();
+$size = 192 * 1024;
+report("aged seq write 64K", seq_write("aged.bin", $size, 64 * 1024));
+report("aged seq read 64K", seq_read("aged.bin", 64 * 1024));
+
+unmount();
@@ -9,6 +9,7 @@
 #include <string.h>
 
 #include <assert.h>
+#include <stddef.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
@@ -21,9 +22,76 @@
 #include "bitmap.h"
 #include "blocks.h"
 #include "inode.h"
+#include "prealloc.h"
+#include "dedup.h"
+#include "checksum.h"
+#include "snapshot.h"
+
+// layout of block 0 after the block bitmap. Before the inode table could
+// grow, the inode bitmap and the snapshot records sat at the V1 offsets;
+// init_inode_table moves them
+#define INODE_BITMAP_V1_OFFSET BLOCK_BITMAP_SIZE
+#define INODE_BITMAP_V1_SIZE 8
+#define FRAG_MAP_OFFSET (INODE_BITMAP_V1_OFFSET + INODE_BITMAP_V1_SIZE)
+#define REFCOUNT_OFFSET (FRAG_MAP_OFFSET + BLOCK_COUNT)
+#define DEDUP_HASH_OFFSET (REFCOUNT_OFFSET + BLOCK_COUNT * sizeof(uint16_t))
+#define SNAPSHOT_V1_OFFSET (DEDUP_HASH_OFFSET + BLOCK_COUNT * sizeof(uint64_t))
+#define SNAPSHOT_V1_SIZE 512
+#define CHECKSUM_OFFSET (SNAPSHOT_V1_OFFSET + SNAPSHOT_V1_SIZE)
+#define INODE_CHUNKS_OFFSET (CHECKSUM_OFFSET + CHECKSUM_AREA_SIZE)
+#define INODE_BITMAP_OFFSET (INODE_CHUNKS_OFFSET + INODE_CHUNKS_BLOCK0 * sizeof(int32_t))
+#define SNAPSHOT_OFFSET (INODE_BITMAP_OFFSET + INODE_CHUNKS_BLOCK0 * INODES_PER_CHUNK / 8)
+#define INODE_VERSION_OFFSET (SNAPSHOT_OFFSET + SNAPSHOT_AREA_SIZE)
+#define COUNTERS_OFFSET (INODE_VERSION_OFFSET + sizeof(int32_t))
+#define ORPHAN_OFFSET (COUNTERS_OFFSET + sizeof(blocks_counters_t))
+#define SIZE_OFFSET (ORPHAN_OFFSET + sizeof(int32_t))
+#define TABLES_OFFSET (SIZE_OFFSET + sizeof(int32_t))
+#define INODE_TABLES_OFFSET (TABLES_OFFSET + sizeof(blocks_run_t))
+
+// where the per-block tables, or the inode tables, are in block 0
+typedef struct blocks_run {
+  int32_t start;    // first block of the run; 0 for block 0
+  int32_t capacity; // blocks, or inodes, the tables have room for
+} blocks_run_t;
+
+_Static_assert(INODE_TABLES_OFFSET + sizeof(blocks_run_t) <= BLOCK_SIZE,
+               "block 0 overflows");
+_Static_assert(INODES_PER_CHUNK % 8 == 0, "the inode bitmap must be whole bytes");
+
+// layout of the run the per-block tables move to, for a capacity that is
+// a multiple of the checksums in a block
+#define RUN_SUMS(cap) 0
+#define RUN_BITMAP(cap) ((cap) * sizeof(uint32_t))
+#define RUN_STALE(cap) (RUN_BITMAP(cap) + (cap) / 8)
+#define RUN_FRAG(cap) (RUN_STALE(cap) + (cap) / 8)
+#define RUN_REFCOUNT(cap) (RUN_FRAG(cap) + (cap))
+#define RUN_DEDUP(cap) (RUN_REFCOUNT(cap) + (cap) * sizeof(uint16_t))
+#define RUN_SIZE(cap) (RUN_DEDUP(cap) + (cap) * sizeof(uint64_t))
+#define RUN_CAPACITY_STEP (BLOCK_SIZE / sizeof(uint32_t))
+_Static_assert(BLOCK_COUNT_MAX % RUN_CAPACITY_STEP == 0,
+               "the checksums must fill whole blocks");
+
+// layout of the run the inode tables move to, for a capacity in inodes
+#define INODE_RUN_CHUNKS(cap) 0
+#define INODE_RUN_BITMAP(cap) ((cap) / INODES_PER_CHUNK * sizeof(int32_t))
+#define INODE_RUN_SNAPSHOT(cap, slot) (INODE_RUN_BITMAP(cap) + (1 + (slot)) * (cap) / 8)
+#define INODE_RUN_SIZE(cap) INODE_RUN_SNAPSHOT(cap, SNAPSHOT_MAX)
 
 static int blocks_fd = -1;
+static void *inode_table = NULL; // replaces the inode table of the image
 static void *blocks_base = 0;
+static long alloc_calls = 0;
+static int reserved_blocks = 0;
+static int grow_step = 0; // blocks added when the image runs out, 0 for never
+
+// blocks held in preallocation windows; free on disk, skipped by first fit
+static uint8_t held_bitmap[BLOCK_COUNT_MAX / 8];
+
+// blocks freed since the last discard, whose bytes the image file still
+// holds on the host
+static uint8_t discard_bitmap[BLOCK_COUNT_MAX / 8];
+static int discard_ok = 1; // the host file system can punch holes
+static long discarded = 0;
 
 // Get the number of blocks needed to store the given number of bytes.
 int bytes_to_blocks(int bytes) {
@@ -36,20 +104,71 @@ int bytes_to_blocks(int bytes) {
   }
 }
 
+// the number of blocks in the image, after the orphan list in block 0
+static int32_t *image_size() {
+  uint8_t *block = blocks_get_block(0);
+  return (int32_t *) (block + SIZE_OFFSET);
+}
+
+// where the per-block tables are, after the image size
+static blocks_run_t *tables_run() {
+  uint8_t *block = blocks_get_block(0);
+  return (blocks_run_t *) (block + TABLES_OFFSET);
+}
+
+// where the inode tables are, after the per-block tables
+static blocks_run_t *inode_run() {
+  uint8_t *block = blocks_get_block(0);
+  return (blocks_run_t *) (block + INODE_TABLES_OFFSET);
+}
+
+// a table in the given run at the given offset, or in block 0 at the other
+// one while they have not moved
+static void *run_table_at(blocks_run_t *run, size_t run_offset, size_t block0_offset) {
+  if (!run->start) {
+    return (uint8_t *) blocks_get_block(0) + block0_offset;
+  }
+  return (uint8_t *) blocks_get_block(run->start) + run_offset;
+}
+
+// a per-block table; see run_table_at
+static void *table_at(size_t run_offset, size_t block0_offset) {
+  return run_table_at(tables_run(), run_offset, block0_offset);
+}
+
 // Load and initialize the given disk image.
 void blocks_init(const char *image_path) {
   blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
   assert(blocks_fd != -1);
 
-  // make sure the disk image is exactly 1MB
-  int rv = ftruncate(blocks_fd, NUFS_SIZE);
+  // a new, empty file becomes a whole 1MB image
+  struct stat st;
+  int rv = fstat(blocks_fd, &st);
   assert(rv == 0);
+  if (st.st_size < BLOCK_SIZE) {
+    st.st_size = NUFS_SIZE;
+    rv = ftruncate(blocks_fd, NUFS_SIZE);
+    assert(rv == 0);
+  }
 
-  // map the image to memory
-  blocks_base =
-      mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
+  // map all the blocks the image may grow to, so growing never moves a
+  // block; the file only backs the ones the image has
+  blocks_base = mmap(0, (size_t) BLOCK_SIZE * BLOCK_COUNT_MAX, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, blocks_fd, 0);
   assert(blocks_base != MAP_FAILED);
 
+  // images from before they could grow have every block; a new one gets
+  // the size of its file, if mkfs made it smaller
+  int32_t *size = image_size();
+  if (*size < BLOCK_COUNT_MIN || *size > blocks_capacity()) {
+    int blocks = st.st_size / BLOCK_SIZE;
+    *size = (st.st_size % BLOCK_SIZE == 0 && blocks >= BLOCK_COUNT_MIN && blocks < BLOCK_COUNT)
+                ? blocks : BLOCK_COUNT;
+    bitmap_put(get_checksum_stale(), 0, 1);
+  }
+  rv = ftruncate(blocks_fd, (off_t) BLOCK_SIZE * *size);
+  assert(rv == 0);
+
   // DEBUGGING: make sure bitmap is free
   // printf("Bitmap for blocks (initial 10):\n");
   // bitmap_print(get_blocks_bitmap(), 16);
@@ -62,89 +181,651 @@ void blocks_init(const char *image_path) {
   // DEBUGGING: make sure first two bit is used and only the first two
   // bitmap_print(bbm, 5);
   // printf("\n");
-  
+
+  // the counters may be behind the bitmaps if the last mount stopped in an
+  // operation, and images from before them read 0 for both
+  blocks_counters_t *counters = get_blocks_counters();
+  int recount = bitmap_get(get_checksum_stale(), 0) ||
+                (!counters->free_blocks && !counters->free_inodes);
+
   // block 1 - max_blocks stores the inode table
   init_inode_table();
+  if (recount) {
+    blocks_recount();
+  }
 }
 
 // Close the disk image.
 void blocks_free() {
-  int rv = munmap(blocks_base, NUFS_SIZE);
+  int rv = munmap(blocks_base, (size_t) BLOCK_SIZE * BLOCK_COUNT_MAX);
   assert(rv == 0);
 }
 
+// Get the number of blocks in the image.
+int blocks_count() { return *image_size(); }
+
+// Get the number of blocks the per-block tables have room for.
+int blocks_capacity() {
+  blocks_run_t *run = tables_run();
+  return run->start ? run->capacity : BLOCK_COUNT;
+}
+
+// Get the run of the per-block tables after the checksums, if they moved.
+int blocks_tables(int *len) {
+  blocks_run_t *run = tables_run();
+  if (!run->start) {
+    *len = 0;
+    return 0;
+  }
+  int sums = RUN_BITMAP(run->capacity) / BLOCK_SIZE;
+  *len = bytes_to_blocks(RUN_SIZE(run->capacity)) - sums;
+  return run->start + sums;
+}
+
+// Whether the block is block 0 or holds the per-block or inode tables.
+int blocks_is_table(int bnum) {
+  int len;
+  int start = blocks_tables(&len);
+  int inode_len;
+  int inode_start = blocks_inode_tables(&inode_len);
+  return bnum == 0 || (bnum >= start && bnum < start + len) ||
+         (bnum >= inode_start && bnum < inode_start + inode_len);
+}
+
+// Move the per-block tables to a run at the start of the blocks added to
+// the image, with room for count blocks or twice as many as before. The
+// run comes out of the added blocks; returns the new count, larger if they
+// are too few for it.
+static int blocks_move_tables(int count) {
+  int32_t *size = image_size();
+  blocks_run_t *run = tables_run();
+  checksum_area_t *area = get_checksum_area();
+  int old_cap = blocks_capacity();
+  int cap = (2 * old_cap > count) ? 2 * old_cap : count;
+  cap = (cap + RUN_CAPACITY_STEP - 1) / RUN_CAPACITY_STEP * RUN_CAPACITY_STEP;
+  cap = (cap < BLOCK_COUNT_MAX) ? cap : BLOCK_COUNT_MAX;
+  int len = bytes_to_blocks(RUN_SIZE(cap));
+  count = (count > *size + len) ? count : *size + len;
+  assert(count <= cap);
+  if (ftruncate(blocks_fd, (off_t) BLOCK_SIZE * count) < 0) {
+    fprintf(stderr, "ERROR: blocks_move_tables(%d) -> %s\n", count, strerror(errno));
+    return -1;
+  }
+
+  // the new blocks read as zeros, so only what is there moves
+  int start = *size;
+  uint8_t *to = blocks_get_block(start);
+  memcpy(to + RUN_BITMAP(cap), get_blocks_bitmap(), old_cap / 8);
+  memcpy(to + RUN_STALE(cap), get_checksum_stale(), old_cap / 8);
+  if (area->block > 0) {
+    memcpy(to + RUN_SUMS(cap), blocks_get_block(area->block), *size * sizeof(uint32_t));
+  } else {
+    memset(to + RUN_STALE(cap), 0xff, cap / 8); // every block gets one at the first seal
+  }
+  memcpy(to + RUN_FRAG(cap), get_frag_map(), old_cap);
+  memcpy(to + RUN_REFCOUNT(cap), get_refcount_table(), old_cap * sizeof(uint16_t));
+  memcpy(to + RUN_DEDUP(cap), get_dedup_hashes(), old_cap * sizeof(uint64_t));
+
+  // the old checksums, with the old tables if they were a run, are freed
+  int old_start = run->start ? run->start : area->block;
+  int old_len = run->start ? bytes_to_blocks(RUN_SIZE(old_cap)) : (area->block > 0);
+  run->start = start;
+  run->capacity = cap;
+  area->block = start;
+  void *bbm = get_blocks_bitmap();
+  for (int ii = old_start; ii < old_start + old_len; ++ii) {
+    bitmap_put(bbm, ii, 0);
+    bitmap_put(discard_bitmap, ii, 1);
+  }
+  for (int ii = start; ii < start + len; ++ii) {
+    bitmap_put(bbm, ii, 1);
+  }
+  blocks_counters_t *counters = get_blocks_counters();
+  __atomic_fetch_add(&counters->free_blocks, old_len, __ATOMIC_RELAXED);
+  *size = start + len;
+  printf("DEBUG: blocks_move_tables(%d) -> %d blocks at %d, room for %d\n", count, len, start,
+         cap);
+  return count;
+}
+
+// Grow the image to the given number of blocks.
+int blocks_grow(int count) {
+  int32_t *size = image_size();
+  count = count < BLOCK_COUNT_MAX ? count : BLOCK_COUNT_MAX;
+  if (count <= *size) {
+    return *size;
+  }
+  int from = *size;
+  if (count > blocks_capacity() && (count = blocks_move_tables(count)) < 0) {
+    return -1;
+  }
+  if (ftruncate(blocks_fd, (off_t) BLOCK_SIZE * count) < 0) {
+    fprintf(stderr, "ERROR: blocks_grow(%d) -> %s\n", count, strerror(errno));
+    return -1;
+  }
+
+  // the new blocks read as zeros and are free
+  void *bbm = get_blocks_bitmap();
+  for (int ii = *size; ii < count; ++ii) {
+    bitmap_put(bbm, ii, 0);
+  }
+  blocks_counters_t *counters = get_blocks_counters();
+  __atomic_fetch_add(&counters->free_blocks, count - *size, __ATOMIC_RELAXED);
+  printf("DEBUG: blocks_grow(%d) -> from %d blocks\n", count, from);
+  *size = count;
+  return count;
+}
+
+// Set how many blocks the image grows by when it runs out, 0 for never.
+void blocks_set_grow_step(int step) { grow_step = step; }
+
+// With a grow step, grow the image until need blocks are free beyond the
+// reserved ones; returns the number of blocks added
+static int blocks_make_room(int need) {
+  int added = 0;
+  while (grow_step > 0 && blocks_free_count() - reserved_blocks < need &&
+         blocks_count() < BLOCK_COUNT_MAX) {
+    int size = blocks_count();
+    if (blocks_grow(size + grow_step) < 0) {
+      break;
+    }
+    added += blocks_count() - size;
+  }
+  return added;
+}
+
 // Get the given block, returning a pointer to its start.
 void *blocks_get_block(int bnum) { return blocks_base + BLOCK_SIZE * bnum; }
 
+// Get the given block for writing; its checksum goes stale until the next seal.
+void *blocks_write_block(int bnum) {
+  checksum_dirty(bnum);
+  return blocks_get_block(bnum);
+}
+
+// Hint that the given run of blocks will be read soon.
+void blocks_prefetch(int bnum, int count) {
+  long page = sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t) blocks_get_block(bnum) & ~(page - 1);
+  uintptr_t end = (uintptr_t) blocks_get_block(bnum + count);
+  int rv = madvise((void *) start, end - start, MADV_WILLNEED);
+  if (rv != 0) {
+    fprintf(stderr, "ERROR: blocks_prefetch(%d, %d) -> %d\n", bnum, count, errno);
+  }
+}
+
+// Get the file descriptor of the disk image.
+int blocks_get_fd() { return blocks_fd; }
+
 // Return a pointer to the beginning of the block bitmap.
-// The size is BLOCK_BITMAP_SIZE bytes.
-void *get_blocks_bitmap() { return blocks_get_block(0); }
+// The size is blocks_capacity() / 8 bytes.
+void *get_blocks_bitmap() { return table_at(RUN_BITMAP(tables_run()->capacity), 0); }
+
+// Get the number of inodes the inode tables have room for.
+int blocks_inode_capacity() {
+  blocks_run_t *run = inode_run();
+  return run->start ? run->capacity : INODE_CHUNKS_BLOCK0 * INODES_PER_CHUNK;
+}
+
+// Get the run of the inode tables, if they moved.
+int blocks_inode_tables(int *len) {
+  blocks_run_t *run = inode_run();
+  *len = run->start ? bytes_to_blocks(INODE_RUN_SIZE(run->capacity)) : 0;
+  return run->start;
+}
 
 // Return a pointer to the beginning of the inode table bitmap.
 void *get_inode_bitmap() {
+  blocks_run_t *run = inode_run();
+
+  // The inode bitmap is stored immediately after the chunk index
+  return run_table_at(run, INODE_RUN_BITMAP(run->capacity), INODE_BITMAP_OFFSET);
+}
+
+// Return a pointer to the chunk index of the inode table.
+void *get_inode_chunks() {
+  blocks_run_t *run = inode_run();
+  return run_table_at(run, INODE_RUN_CHUNKS(run->capacity), INODE_CHUNKS_OFFSET);
+}
+
+// Return a pointer to the inode bitmap of a snapshot.
+void *get_snapshot_inodes(int slot) {
+  blocks_run_t *run = inode_run();
+  if (!run->start) {
+    return ((snapshot_t *) get_snapshot_table())[slot].inodes;
+  }
+  return (uint8_t *) blocks_get_block(run->start) + INODE_RUN_SNAPSHOT(run->capacity, slot);
+}
+
+// Return a pointer to the version of the inode format.
+void *get_inode_version() {
+  uint8_t *block = blocks_get_block(0);
+  return (void *) (block + INODE_VERSION_OFFSET);
+}
+
+// Return a pointer to the free space counters.
+void *get_blocks_counters() {
+  uint8_t *block = blocks_get_block(0);
+  return (void *) (block + COUNTERS_OFFSET);
+}
+
+// Return a pointer to the first inode of the orphan list.
+void *get_orphan_list() {
+  uint8_t *block = blocks_get_block(0);
+  return (void *) (block + ORPHAN_OFFSET);
+}
+
+// Count the free blocks and inodes in the bitmaps again.
+void blocks_recount() {
+  blocks_counters_t *counters = get_blocks_counters();
+  void *bbm = get_blocks_bitmap();
+  void *ibm = get_inode_bitmap();
+  int blocks = 0;
+  for (int ii = 1; ii < blocks_count(); ++ii) {
+    blocks += !bitmap_get(bbm, ii);
+  }
+  int inodes = 0;
+  for (int ii = 0; ii < blocks_inode_capacity(); ++ii) {
+    inodes += !bitmap_get(ibm, ii);
+  }
+  counters->free_blocks = blocks;
+  counters->free_inodes = inodes;
+  printf("DEBUG: blocks_recount() -> %d blocks, %d inodes free\n", blocks, inodes);
+}
+
+// Return a pointer to the fragment map, one byte per block.
+void *get_frag_map() {
+  // The fragment map is stored where the first inode bitmap ended
+  return table_at(RUN_FRAG(tables_run()->capacity), FRAG_MAP_OFFSET);
+}
+
+// Return a pointer to the reference count table, one uint16_t per block.
+void *get_refcount_table() {
+  return table_at(RUN_REFCOUNT(tables_run()->capacity), REFCOUNT_OFFSET);
+}
+
+// Return a pointer to the dedup hash table, one uint64_t per block.
+void *get_dedup_hashes() {
+  return table_at(RUN_DEDUP(tables_run()->capacity), DEDUP_HASH_OFFSET);
+}
+
+// Return a pointer to the snapshot records.
+void *get_snapshot_table() {
+  uint8_t *block = blocks_get_block(0);
+  return (void *) (block + SNAPSHOT_OFFSET);
+}
+
+// Return a pointer to the checksum area.
+void *get_checksum_area() {
   uint8_t *block = blocks_get_block(0);
+  return (void *) (block + CHECKSUM_OFFSET);
+}
 
-  // The inode bitmap is stored immediately after the block bitmap
-  return (void *) (block + BLOCK_BITMAP_SIZE);
+// Return a pointer to the stale marks of the checksums.
+void *get_checksum_stale() {
+  return table_at(RUN_STALE(tables_run()->capacity),
+                  CHECKSUM_OFFSET + offsetof(checksum_area_t, stale));
 }
-// Return a pointer to the beginning of the inode table.
+
+// Return the copy of the inode table served instead of the image, if any.
 void *get_inode_table() {
-  return blocks_get_block(1);
+  return inode_table;
 }
 
-// Initialize the inode table and return the beginning of the table.
-void *init_inode_table() {
-  // Assumes the first two blocks are in use for superblock and bitmap
-  assert(bitmap_get(get_blocks_bitmap(), 0));
+// Serve the inode table from a copy in memory instead of the image.
+void blocks_use_inode_table(void *table) {
+  inode_table = table;
+}
 
-  int max_blocks = bytes_to_blocks(INODE_LIMIT * sizeof(inode_t));
-  printf("Max Blocks: %u\n", max_blocks);
+// Move the inode tables to a run of free blocks with room for the given
+// chunk, and twice as many inodes as before.
+static int blocks_move_inode_tables(int chunk) {
+  blocks_run_t *run = inode_run();
+  int old_cap = blocks_inode_capacity();
+  int cap = (2 * old_cap > (chunk + 1) * INODES_PER_CHUNK) ? 2 * old_cap
+                                                           : (chunk + 1) * INODES_PER_CHUNK;
+  cap = (cap < INODE_LIMIT) ? cap : INODE_LIMIT;
+  int len = bytes_to_blocks(INODE_RUN_SIZE(cap));
+  int got;
+  int start = blocks_find_run(1, len, &got);
+  if (start < 0 || got < len) {
+    fprintf(stderr, "ERROR: blocks_move_inode_tables(%d) -> No room for the tables.\n", chunk);
+    return -1;
+  }
+  blocks_take(start, len);
 
-  // DEBUG: Make sure the next two blocks are free
-  // printf("Bitmap for blocks:\n");
-  // bitmap_print(get_blocks_bitmap(), 5);
-  // printf("\n");
+  uint8_t *to = blocks_get_block(start);
+  memset(to, 0, len * BLOCK_SIZE);
+  memcpy(to + INODE_RUN_CHUNKS(cap), get_inode_chunks(),
+         old_cap / INODES_PER_CHUNK * sizeof(int32_t));
+  memcpy(to + INODE_RUN_BITMAP(cap), get_inode_bitmap(), old_cap / 8);
+  for (int ii = 0; ii < SNAPSHOT_MAX; ++ii) {
+    memcpy(to + INODE_RUN_SNAPSHOT(cap, ii), get_snapshot_inodes(ii), old_cap / 8);
+  }
+
+  int old_len;
+  int old_start = blocks_inode_tables(&old_len);
+  run->start = start;
+  run->capacity = cap;
+  for (int ii = old_start; ii < old_start + old_len; ++ii) {
+    free_block(ii);
+  }
+  blocks_count_inodes(cap - old_cap);
+  printf("DEBUG: blocks_move_inode_tables(%d) -> %d blocks at %d, room for %d inodes\n", chunk,
+         len, start, cap);
+  return 0;
+}
+
+// Give the inode table another chunk, as one run of blocks.
+int blocks_add_inode_chunk(int chunk) {
+  assert(chunk >= 0 && chunk < INODE_CHUNK_MAX);
+  if (chunk >= blocks_inode_capacity() / INODES_PER_CHUNK && blocks_move_inode_tables(chunk) < 0) {
+    return -1;
+  }
+  int32_t *chunks = get_inode_chunks();
+  int len;
+  int start = blocks_find_run(1, INODE_CHUNK_BLOCKS, &len);
+  if (start < 0 || len < INODE_CHUNK_BLOCKS) {
+    fprintf(stderr, "ERROR: blocks_add_inode_chunk(%d) -> No room for the chunk.\n", chunk);
+    return -1;
+  }
+  // nothing is cleared: alloc_inode_at clears an inode when it is taken
+  blocks_take(start, INODE_CHUNK_BLOCKS);
+  chunks[chunk] = start;
+  printf("DEBUG: blocks_add_inode_chunk(%d) -> %d (+%d)\n", chunk, start, (int)INODE_CHUNK_BLOCKS);
+  return 0;
+}
 
-  // allocate blocks for 'max_blocks' blocks
-  for(int ii = 0; ii < max_blocks; ++ii) {
-    // DEBUG: Make sure the next two blocks are free
-    // bitmap_print(get_blocks_bitmap(), 5);
-    // printf("\n");
+// Initialize the inode table.
+void init_inode_table() {
+  // Assumes the first block is in use for superblock and bitmap
+  void *bbm = get_blocks_bitmap();
+  assert(bitmap_get(bbm, 0));
+  int32_t *chunks = get_inode_chunks();
+  int32_t *version = get_inode_version();
+
+  if (!chunks[0] && !bitmap_get(bbm, 1)) {
+    // a new image
+    int rv = blocks_add_inode_chunk(0);
+    assert(rv == 0);
+    *version = INODE_VERSION;
+    return;
+  }
+
+  if (!chunks[0]) {
+    // an image from before the table could grow: its table in blocks 1 and 2
+    // is the first chunk, and the bitmap and snapshot records move
+    uint8_t *block = blocks_get_block(0);
+    chunks[0] = 1;
+    memcpy(get_inode_bitmap(), block + INODE_BITMAP_V1_OFFSET, INODE_BITMAP_V1_SIZE);
+    memset(block + INODE_BITMAP_V1_OFFSET, 0, INODE_BITMAP_V1_SIZE);
+    snapshot_upgrade(block + SNAPSHOT_V1_OFFSET);
+    memset(block + SNAPSHOT_V1_OFFSET, 0, SNAPSHOT_V1_SIZE);
+    printf("DEBUG: init_inode_table() -> Moved the inode bitmap and snapshot records\n");
+  } else if (*version == INODE_VERSION) {
+    return;
+  }
+
+  // inodes of an older version are rewritten; a later version cannot be read
+  assert(*version < INODE_VERSION);
+  int rv = inode_upgrade();
+  assert(rv == 0);
+  *version = INODE_VERSION;
+
+  // block 0 no longer matches its checksum; as after a crash in an
+  // operation, it gets a new one when checksums are loaded
+  bitmap_put(get_checksum_stale(), 0, 1);
+}
+
+// Whether the block is neither allocated nor held in someone's window.
+static int block_available(void *bbm, int bnum) {
+  return !bitmap_get(bbm, bnum) && !bitmap_get(held_bitmap, bnum);
+}
+
+// Find a run of up to count available blocks, searching from goal on.
+int blocks_find_run(int goal, int count, int *len) {
+  assert(count > 0);
+  alloc_calls++;
 
-    // make sure the bitmaps of those blocks are free
-    if(!bitmap_get(get_blocks_bitmap(), ii + 1)) {
-      alloc_block();
+  // the last free blocks may be promised to someone else
+  if (reserved_blocks > 0) {
+    int avail = blocks_free_count() - reserved_blocks;
+    if (avail <= 0 && blocks_make_room(count) > 0) {
+      avail = blocks_free_count() - reserved_blocks;
     }
+    if (avail <= 0) {
+      fprintf(stderr, "ERROR: blocks_find_run(%d) -> Remaining blocks are reserved\n", count);
+      return -1;
+    }
+    count = (count < avail) ? count : avail;
+  }
+
+  // growing the image may have moved the bitmap
+  void *bbm = get_blocks_bitmap();
+  int end = blocks_count();
+  if (goal < 1 || goal >= end) {
+    goal = 1; // first one is being used for bitmap
   }
 
-  // make sure the first max_blocks + 1 bits are in-use
-  for(int ii = 0; ii < max_blocks + 1; ++ii) {
-    assert(bitmap_get(get_blocks_bitmap(), ii));
+  // first fit from the goal to the end, then from the start up to the
+  // goal, remembering the longest run in case nothing fits
+  int best = -1;
+  int best_len = 0;
+  for (int pass = 0; pass < 2 && best_len < count; ++pass) {
+    int ii = (pass == 0) ? goal : 1;
+    int stop = (pass == 0) ? end : goal;
+    while (ii < stop && best_len < count) {
+      if (!block_available(bbm, ii)) {
+        ++ii;
+        continue;
+      }
+      int start = ii;
+      while (ii < end && ii - start < count && block_available(bbm, ii)) {
+        ++ii;
+      }
+      if (ii - start > best_len) {
+        best = start;
+        best_len = ii - start;
+      }
+    }
   }
 
-  return get_inode_table();
+  if (best < 0 && blocks_held_count() > 0) {
+    // space is low: take back every preallocation window and retry
+    printf("DEBUG: blocks_find_run(%d) -> Releasing preallocation windows\n", count);
+    prealloc_release_all();
+    alloc_calls--;
+    return blocks_find_run(goal, count, len);
+  }
+  if (best < 0 && blocks_make_room(count) > 0) {
+    alloc_calls--;
+    return blocks_find_run(goal, count, len);
+  }
+  if (best < 0) {
+    return -1;
+  }
+
+  *len = best_len;
+  return best;
+}
+
+// Mark the given run of blocks as allocated.
+void blocks_take(int bnum, int count) {
+  void *bbm = get_blocks_bitmap();
+  for (int ii = bnum; ii < bnum + count; ++ii) {
+    assert(!bitmap_get(bbm, ii));
+    bitmap_put(bbm, ii, 1);
+    bitmap_put(held_bitmap, ii, 0);
+    bitmap_put(discard_bitmap, ii, 0);
+    checksum_dirty(ii); // whatever is in it now is about to be replaced
+  }
+  blocks_counters_t *counters = get_blocks_counters();
+  __atomic_fetch_sub(&counters->free_blocks, count, __ATOMIC_RELAXED);
+}
+
+// Hold or unhold the given run of free blocks.
+void blocks_hold(int bnum, int count, int held) {
+  for (int ii = bnum; ii < bnum + count; ++ii) {
+    bitmap_put(held_bitmap, ii, held);
+  }
+}
+
+// Count the blocks held in preallocation windows.
+int blocks_held_count() {
+  int count = 0;
+  for (int ii = 1; ii < blocks_count(); ++ii) {
+    count += bitmap_get(held_bitmap, ii);
+  }
+  return count;
 }
 
 // Allocate a new block and return its index.
 int alloc_block() {
-  void *bbm = get_blocks_bitmap();
+  int len;
+  int bnum = blocks_find_run(1, 1, &len);
+  if (bnum < 0) {
+    fprintf(stderr, "ERROR: alloc_block() -> (-1)\n");
+    return -1;
+  }
 
-  // first one is being used for bitmap
-  for (int ii = 1; ii < BLOCK_COUNT; ++ii) {
-    if (!bitmap_get(bbm, ii)) {
-      bitmap_put(bbm, ii, 1);
-      printf("DEBUG: alloc_block() -> %d\n", ii);
-      return ii;
-    }
+  blocks_take(bnum, 1);
+  printf("DEBUG: alloc_block() -> %d\n", bnum);
+  return bnum;
+}
+
+// Allocate a run of up to count contiguous blocks and return its first index.
+int alloc_run(int count, int *got) {
+  int start = blocks_find_run(1, count, got);
+  if (start < 0) {
+    fprintf(stderr, "ERROR: alloc_run(%d) -> (-1)\n", count);
+    return -1;
   }
 
-  fprintf(stderr, "ERROR: alloc_block() -> (-1)\n");
-  return -1;
+  blocks_take(start, *got);
+  printf("DEBUG: alloc_run(%d) -> %d (+%d)\n", count, start, *got);
+  return start;
+}
+
+// Count the free blocks.
+int blocks_free_count() {
+  blocks_counters_t *counters = get_blocks_counters();
+  return __atomic_load_n(&counters->free_blocks, __ATOMIC_RELAXED);
+}
+
+// Count the free inodes.
+int blocks_free_inodes() {
+  blocks_counters_t *counters = get_blocks_counters();
+  return __atomic_load_n(&counters->free_inodes, __ATOMIC_RELAXED);
+}
+
+// Count inodes taken (-1) or freed (+1) in the inode bitmap.
+void blocks_count_inodes(int delta) {
+  blocks_counters_t *counters = get_blocks_counters();
+  __atomic_fetch_add(&counters->free_inodes, delta, __ATOMIC_RELAXED);
+}
+
+// Get the number of reserved blocks.
+int blocks_reserved_count() { return reserved_blocks; }
+
+// Reserve free blocks for a later allocation.
+int blocks_reserve(int count) {
+  blocks_make_room(count);
+  if (blocks_free_count() - reserved_blocks < count) {
+    return -1;
+  }
+  reserved_blocks += count;
+  return 0;
 }
 
-// Deallocate the block with the given index.
+// Give back reserved blocks.
+void blocks_unreserve(int count) {
+  reserved_blocks -= count;
+  assert(reserved_blocks >= 0);
+}
+
+// Get the number of allocator calls so far.
+long blocks_alloc_calls() { return alloc_calls; }
+
+// Drop a reference to the block with the given index, freeing it with the last one.
 void free_block(int bnum) {
+  assert(!bitmap_get(held_bitmap, bnum));
+  uint16_t *refs = get_refcount_table();
+  if (refs[bnum] > 0) {
+    refs[bnum]--;
+    printf("DEBUG: free_block(%d) -> %d references left\n", bnum, refs[bnum] + 1);
+    return;
+  }
   printf("DEBUG: free_block(%d)\n", bnum);
+  dedup_forget(bnum);
   void *bbm = get_blocks_bitmap();
   bitmap_put(bbm, bnum, 0);
+  bitmap_put(discard_bitmap, bnum, 1);
+  blocks_counters_t *counters = get_blocks_counters();
+  __atomic_fetch_add(&counters->free_blocks, 1, __ATOMIC_RELAXED);
+}
+
+// Punch a run of blocks out of the image file; it reads back as zeros.
+static int blocks_punch(int bnum, int count) {
+  int rv = fallocate(blocks_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                     (off_t) BLOCK_SIZE * bnum, (off_t) BLOCK_SIZE * count);
+  if (rv < 0) {
+    fprintf(stderr, "ERROR: blocks_punch(%d, %d) -> %s\n", bnum, count, strerror(errno));
+    discard_ok = errno != EOPNOTSUPP;
+    return -1;
+  }
+  printf("DEBUG: blocks_punch(%d, %d)\n", bnum, count);
+  discarded += count;
+  return count;
+}
+
+// Punch out the free runs of at least minlen blocks in the given range, or
+// only the blocks freed since the last discard if pending is set.
+static int blocks_punch_free(int start, int count, int minlen, int pending) {
+  void *bbm = get_blocks_bitmap();
+  int end = start + count > blocks_count() ? blocks_count() : start + count;
+  int punched = 0;
+  int run = 0;
+  for (int ii = start < 1 ? 1 : start; ii <= end && discard_ok; ++ii) {
+    if (ii < end && !bitmap_get(bbm, ii) && (!pending || bitmap_get(discard_bitmap, ii))) {
+      run++;
+      continue;
+    }
+    // blocks left out of a punch stay pending for the next discard
+    if (run >= minlen && run > 0 && blocks_punch(ii - run, run) > 0) {
+      for (int jj = ii - run; jj < ii; ++jj) {
+        bitmap_put(discard_bitmap, jj, 0);
+      }
+      punched += run;
+    }
+    run = 0;
+  }
+  return punched;
+}
+
+// Punch the blocks freed since the last discard out of the image file.
+int blocks_discard() { return blocks_punch_free(1, blocks_count() - 1, 1, 1); }
+
+// Punch the free runs of at least minlen blocks in a range out of the image file.
+int blocks_trim(int start, int count, int minlen) {
+  return blocks_punch_free(start, count, minlen, 0);
+}
+
+// Get the number of blocks punched out of the image file so far.
+long blocks_discarded() { return discarded; }
+
+// Get the number of extra references to a block.
+int blocks_refs(int bnum) {
+  uint16_t *refs = get_refcount_table();
+  return refs[bnum];
+}
+
+// Add a reference to an allocated block.
+int blocks_ref(int bnum) {
+  assert(bitmap_get(get_blocks_bitmap(), bnum));
+  uint16_t *refs = get_refcount_table();
+  if (refs[bnum] == UINT16_MAX) {
+    return -1;
+  }
+  refs[bnum]++;
+  return 0;
 }
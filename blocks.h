@@ -9,19 +9,39 @@
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
+#include <stdint.h>
+
 #define KBtoB 1024
 #define BLOCK_SIZE (4 * KBtoB) //4KB (4096 B)
 
 //#define INODE_LIMIT BLOCK_SIZE - (BLOCK_BITMAP_SIZE * 8)
+// the inode table grows a chunk of inodes at a time, up to INODE_CHUNK_MAX
+// chunks, each a run of blocks found through the chunk index
+#define INODES_PER_CHUNK 64
+#define INODE_CHUNK_MAX 1024
+
+// the chunk index and the inode bitmaps in block 0 have room for this many
+// chunks; an image that needs more moves them to a run of blocks
+#define INODE_CHUNKS_BLOCK0 4
+
 // max number of inodes
-#define INODE_LIMIT 64
+#define INODE_LIMIT (INODES_PER_CHUNK * INODE_CHUNK_MAX)
 
-// we split the "disk" into 256 blocks
+// we split the "disk" into 256 blocks; as many as the tables kept in
+// block 0 have room for
 #define BLOCK_COUNT 256 
 
 // = 1MB
 #define NUFS_SIZE (BLOCK_SIZE * BLOCK_COUNT) 
 
+// an image may start smaller and grow up to BLOCK_COUNT_MAX blocks; the
+// smallest holds block 0, the root directory, the checksums and an inode
+// chunk, with room to spare
+#define BLOCK_COUNT_MIN 16
+
+// the most blocks an image can grow to (256MB), and the size of the mapping
+#define BLOCK_COUNT_MAX 65536
+
 // Note: assumes block count is divisible by 8
 #define BLOCK_BITMAP_SIZE (BLOCK_COUNT / 8)
 
@@ -46,6 +66,74 @@ void blocks_init(const char *image_path);
  */
 void blocks_free();
 
+/**
+ * Get the number of blocks in the image.
+ *
+ * Between BLOCK_COUNT_MIN and BLOCK_COUNT_MAX; blocks from here on are
+ * not in the image file and must not be touched.
+ *
+ * @return The number of blocks.
+ */
+int blocks_count();
+
+/**
+ * Get the number of blocks the per-block tables have room for.
+ *
+ * @return BLOCK_COUNT while the tables are in block 0, or the capacity of
+ *         the run they moved to.
+ */
+int blocks_capacity();
+
+/**
+ * Get the run of blocks the per-block tables moved to.
+ *
+ * When the image grows past the capacity of its tables, they move to a
+ * new run in the added blocks, large enough for twice as many blocks, and
+ * the old one is freed. The run starts with the checksums, whose block is
+ * in the checksum area; the blocks after them hold the block bitmap, the
+ * stale marks of the checksums, the fragment map, the reference counts
+ * and the dedup hashes. Like block 0 they change in every operation.
+ *
+ * @param len Set to the number of blocks after the checksums, 0 while the
+ *            tables are in block 0.
+ *
+ * @return The first block after the checksums, or 0.
+ */
+int blocks_tables(int *len);
+
+/**
+ * Whether a block holds tables that change in every operation: block 0,
+ * or one of the blocks of blocks_tables() or blocks_inode_tables().
+ *
+ * @param bnum The block number.
+ *
+ * @return 1 if it does, 0 otherwise.
+ */
+int blocks_is_table(int bnum);
+
+/**
+ * Grow the image to the given number of blocks, at most BLOCK_COUNT_MAX.
+ *
+ * The image file is extended and the new blocks are free, but for the
+ * run the tables move to when they run out of room. The whole of
+ * BLOCK_COUNT_MAX blocks is mapped from the start, so pointers to blocks
+ * stay valid; pointers to the tables do not.
+ *
+ * @param count The number of blocks the image should have.
+ *
+ * @return The number of blocks it has now, or -1 if the file could not
+ *         be extended.
+ */
+int blocks_grow(int count);
+
+/**
+ * Set how many blocks the image grows by when an allocation or a
+ * reservation finds too few free blocks.
+ *
+ * @param step The number of blocks, or 0 to never grow on its own.
+ */
+void blocks_set_grow_step(int step);
+
 /**
  * Get the block with the given index, returning a pointer to its start.
  *
@@ -55,33 +143,180 @@ void blocks_free();
  */
 void *blocks_get_block(int bnum);
 
+/**
+ * Get a block that is about to be written, returning a pointer to its start.
+ *
+ * The checksum of the block is marked stale until the next checksum_seal(),
+ * so every write into the mapping has to get its block this way.
+ *
+ * @param bnum Block number (index).
+ *
+ * @return Pointer to the beginning of the block in memory.
+ */
+void *blocks_write_block(int bnum);
+
+/**
+ * Hint that a run of blocks will be read soon.
+ *
+ * Starts faulting the blocks of the mapping in ahead of time, so that the
+ * reader does not stall on a page fault for every new block.
+ *
+ * @param bnum First block number of the run.
+ * @param count Number of blocks in the run.
+ */
+void blocks_prefetch(int bnum, int count);
+
+/**
+ * Get the file descriptor of the open disk image.
+ *
+ * Block bnum starts at byte offset BLOCK_SIZE * bnum in this file, so the
+ * descriptor can be handed to splice-capable readers and writers.
+ *
+ * @return The file descriptor of the disk image.
+ */
+int blocks_get_fd();
+
 /**
  * Return a pointer to the beginning of the block bitmap.
  *
+ * The bitmap has blocks_capacity() bits, at the start of block 0 or in
+ * the run of blocks_tables().
+ *
  * @return A pointer to the beginning of the free blocks bitmap.
  */
 void *get_blocks_bitmap();
 
+/**
+ * Get the number of inodes the inode tables have room for.
+ *
+ * The chunk index, the inode bitmap and the inode bitmaps of the snapshots
+ * start out in block 0 with room for INODE_CHUNKS_BLOCK0 chunks. When the
+ * table needs a chunk past that, they move to a run of blocks with room
+ * for twice as many, up to INODE_LIMIT inodes, and the old run is freed.
+ * Like block 0 the run changes in every operation.
+ *
+ * @return A multiple of INODES_PER_CHUNK.
+ */
+int blocks_inode_capacity();
+
+/**
+ * Get the run of blocks the inode tables moved to.
+ *
+ * @param len Set to the number of blocks, 0 while they are in block 0.
+ *
+ * @return The first block of the run, or 0.
+ */
+int blocks_inode_tables(int *len);
+
 /**
  * Return a pointer to the beginning of the inode table bitmap.
  *
+ * The bitmap has blocks_inode_capacity() bits and follows the chunk index.
+ *
  * @return A pointer to the beginning of the free inode bitmap.
  */
 void *get_inode_bitmap();
 
 /**
- * Return a pointer to the beginning of the inode table.
- * 
- * @return A pointer to the beginning of the inode table
+ * Return a pointer to the fragment map.
+ *
+ * The map has one byte per block, stored after the first inode bitmap or
+ * in the run of blocks_tables(). Bit i of
+ * a block's byte is set while fragment i of that block is in use.
+ *
+ * @return A pointer to the beginning of the fragment map.
+ */
+void *get_frag_map();
+
+/**
+ * Return a pointer to the chunk index of the inode table.
+ *
+ * The index has blocks_inode_capacity() / INODES_PER_CHUNK int32_t
+ * entries: the first block of the
+ * chunk holding inodes [ii * INODES_PER_CHUNK, (ii + 1) * INODES_PER_CHUNK),
+ * or 0 if the table has not grown that far.
+ *
+ * @return A pointer to the first entry.
+ */
+void *get_inode_chunks();
+
+// the free space counters of block 0
+typedef struct blocks_counters {
+  int32_t free_blocks; // blocks clear in the block bitmap
+  int32_t free_inodes; // inode numbers clear in the inode bitmap
+} blocks_counters_t;
+
+/**
+ * Return a pointer to the free space counters.
+ *
+ * The counters follow the inode format version. They change along with
+ * the bitmaps, so statfs needs no count, and are counted again at mount
+ * when the last mount stopped in the middle of an operation.
+ *
+ * @return A pointer to the blocks_counters_t.
+ */
+void *get_blocks_counters();
+
+/**
+ * Return a pointer to the first inode of the orphan list.
+ *
+ * An int32_t after the free space counters, 0 when the list is empty.
+ *
+ * @return A pointer to the inode number.
+ */
+void *get_orphan_list();
+
+/**
+ * Return a pointer to the version of the inode format of the image.
+ *
+ * An int32_t after the snapshot records: INODE_VERSION, or 0 on an image
+ * made before inodes had a version. init_inode_table rewrites the inodes of
+ * older images.
+ *
+ * @return A pointer to the version.
+ */
+void *get_inode_version();
+
+/**
+ * Return the copy of the inode table being served instead of the image.
+ *
+ * @return The copy, with blocks_inode_capacity() inodes, or NULL if the
+ *         inodes are read
+ *         from their chunks.
  */
 void *get_inode_table();
 
 /**
- * Initialize the Inode Table and return the beginning of the table.
- * 
- * @return A pointer to the beginning of the inode table
+ * Serve the inode table from a copy in memory instead of the image.
+ *
+ * Used to mount a snapshot read only: nothing written to the inodes (such
+ * as access times) reaches the image.
+ *
+ * @param table The copy, or NULL to go back to the table in the image.
+ */
+void blocks_use_inode_table(void *table);
+
+/**
+ * Initialize the Inode Table.
+ *
+ * A new image gets its first chunk. An image made before the table could
+ * grow has its inode bitmap and snapshot records moved to where they are
+ * now, and its table becomes the first chunk. The inodes of an image from
+ * before INODE_VERSION, in the chunks and in the snapshot tables, are
+ * rewritten in the current format.
  */
-void *init_inode_table();
+void init_inode_table();
+
+/**
+ * Give the inode table another chunk.
+ *
+ * The inode tables move first if the chunk index has no room for it.
+ *
+ * @param chunk Index of the chunk in the chunk index, below INODE_CHUNK_MAX.
+ *
+ * @return 0 on success, or -1 if there is no run of free blocks for it.
+ */
+int blocks_add_inode_chunk(int chunk);
 
 /**
  * Allocate a new block and return its number.
@@ -93,10 +328,248 @@ void *init_inode_table();
 int alloc_block();
 
 /**
- * Deallocate the block with the given number.
+ * Find a run of contiguous available blocks without allocating it.
+ *
+ * Blocks held in preallocation windows are skipped. The search starts at
+ * the goal block and wraps around to the start of the disk, taking the
+ * first run that is long enough or else the longest run found. If only
+ * held blocks are left, every window is released first.
+ *
+ * @param goal Block number to start searching at.
+ * @param count The number of blocks wanted.
+ * @param len Set to the number of blocks in the run.
+ *
+ * @return The index of the first block of the run, or -1 if the disk is full.
+ */
+int blocks_find_run(int goal, int count, int *len);
+
+/**
+ * Mark a run of free blocks as allocated.
+ *
+ * @param bnum First block number of the run.
+ * @param count Number of blocks in the run.
+ */
+void blocks_take(int bnum, int count);
+
+/**
+ * Hold a run of free blocks for a preallocation window, or release it.
+ *
+ * Held blocks stay free on disk but are skipped by the allocator.
+ *
+ * @param bnum First block number of the run.
+ * @param count Number of blocks in the run.
+ * @param held 1 to hold the blocks, 0 to release them.
+ */
+void blocks_hold(int bnum, int count, int held);
+
+/**
+ * Count the blocks held in preallocation windows.
+ *
+ * @return The number of held blocks.
+ */
+int blocks_held_count();
+
+/**
+ * Allocate a run of contiguous blocks and return the first block number.
+ *
+ * Takes the first free run that is long enough, or the longest free run
+ * if there is none, so the run may be shorter than requested.
+ *
+ * @param count The number of blocks wanted.
+ * @param got Set to the number of blocks in the allocated run.
+ *
+ * @return The index of the first block of the run, or -1 if the disk is full.
+ */
+int alloc_run(int count, int *got);
+
+/**
+ * Count the blocks that are not allocated.
+ *
+ * Reads the counter in block 0, without going through the bitmap.
+ *
+ * @return The number of free blocks.
+ */
+int blocks_free_count();
+
+/**
+ * Count the inode numbers that are not allocated, up to
+ * blocks_inode_capacity().
+ *
+ * Reads the counter in block 0, without going through the bitmap.
+ *
+ * @return The number of free inodes.
+ */
+int blocks_free_inodes();
+
+/**
+ * Count inodes taken or freed in the inode bitmap.
+ *
+ * @param delta -1 for an inode taken, 1 for an inode freed.
+ */
+void blocks_count_inodes(int delta);
+
+/**
+ * Count the free blocks and inodes in the bitmaps again, for the counters.
+ */
+void blocks_recount();
+
+/**
+ * Get the number of blocks reserved by blocks_reserve().
+ *
+ * @return The number of reserved blocks.
+ */
+int blocks_reserved_count();
+
+/**
+ * Reserve free blocks for a later allocation.
+ *
+ * Reserved blocks stay free in the bitmap but cannot be handed out to
+ * anyone else until they are unreserved again.
+ *
+ * @param count The number of blocks to reserve.
+ *
+ * @return 0 on success, -1 if there are not enough unreserved free blocks.
+ */
+int blocks_reserve(int count);
+
+/**
+ * Give back blocks reserved by blocks_reserve().
+ *
+ * @param count The number of blocks to unreserve.
+ */
+void blocks_unreserve(int count);
+
+/**
+ * Get the number of calls made into the block allocator so far.
+ *
+ * @return The number of block searches made by the allocator.
+ */
+long blocks_alloc_calls();
+
+/**
+ * Drop a reference to the block with the given number.
+ *
+ * A block shared by several files only goes back to the free pool once
+ * its last reference is dropped.
  *
  * @param bnun The block number to deallocate.
  */
 void free_block(int bnum);
 
+/**
+ * Return a pointer to the reference count table.
+ *
+ * The table has one uint16_t per block, stored after the fragment map. It
+ * counts the references beyond the first, so a block owned by one file
+ * reads 0.
+ *
+ * @return A pointer to the beginning of the reference count table.
+ */
+void *get_refcount_table();
+
+/**
+ * Punch the blocks freed since the last discard out of the image file.
+ *
+ * Their bytes go back to the host file system and read as zeros after,
+ * so the image only takes as much room on the host as the blocks in use.
+ * Blocks taken again since they were freed are left alone.
+ *
+ * @return The number of blocks punched.
+ */
+int blocks_discard();
+
+/**
+ * Punch every free run of at least minlen blocks in a range out of the
+ * image file, whether it was freed in this mount or not.
+ *
+ * @param start First block number of the range.
+ * @param count Number of blocks in the range.
+ * @param minlen Shortest run worth punching.
+ *
+ * @return The number of blocks punched.
+ */
+int blocks_trim(int start, int count, int minlen);
+
+/**
+ * Get the number of blocks punched out of the image file so far.
+ *
+ * @return The number of blocks discarded or trimmed.
+ */
+long blocks_discarded();
+
+/**
+ * Get the number of extra references to a block.
+ *
+ * @param bnum The block number.
+ *
+ * @return 0 if at most one file uses the block.
+ */
+int blocks_refs(int bnum);
+
+/**
+ * Add a reference to an allocated block.
+ *
+ * @param bnum The block number.
+ *
+ * @return 0 on success, or -1 if the count is saturated.
+ */
+int blocks_ref(int bnum);
+
+/**
+ * Return a pointer to the dedup hash table.
+ *
+ * The table has one uint64_t content hash per block, stored after the
+ * reference count table. 0 means the block is not indexed.
+ *
+ * @return A pointer to the beginning of the hash table.
+ */
+void *get_dedup_hashes();
+
+// bytes of block 0 kept for the snapshot records, after the inode bitmap
+#define SNAPSHOT_AREA_SIZE 576
+
+/**
+ * Return a pointer to the snapshot records.
+ *
+ * The records take SNAPSHOT_AREA_SIZE bytes after the inode bitmap.
+ *
+ * @return A pointer to the first record.
+ */
+void *get_snapshot_table();
+
+/**
+ * Return a pointer to the inode bitmap of a snapshot.
+ *
+ * A bitmap of blocks_inode_capacity() bits, in the snapshot record or in
+ * the run of blocks_inode_tables().
+ *
+ * @param slot Index of the snapshot record.
+ *
+ * @return A pointer to the beginning of the bitmap.
+ */
+void *get_snapshot_inodes(int slot);
+
+// bytes of block 0 kept for the checksum area, after the dedup hashes
+#define CHECKSUM_AREA_SIZE 64
+
+/**
+ * Return a pointer to the checksum area.
+ *
+ * The area takes CHECKSUM_AREA_SIZE bytes after the dedup hashes and the
+ * bytes the snapshot records took before they moved.
+ *
+ * @return A pointer to the checksum_area_t.
+ */
+void *get_checksum_area();
+
+/**
+ * Return a pointer to the stale marks of the checksums.
+ *
+ * A bitmap of blocks_capacity() bits, in the checksum area or in the run
+ * of blocks_tables().
+ *
+ * @return A pointer to the beginning of the bitmap.
+ */
+void *get_checksum_stale();
+
 #endif
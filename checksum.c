@@ -0,0 +1,320 @@
+/**
+ * @file checksum.c
+ * @author Alston Liu
+ *
+ * Implementation of the block checksums
+ */
+#include <stdio.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "checksum.h"
+#include "bitmap.h"
+
+_Static_assert(sizeof(checksum_area_t) <= CHECKSUM_AREA_SIZE,
+               "checksum area does not fit in block 0");
+
+#define CRC32C_POLY 0x82F63B78 // Castagnoli polynomial, bit reversed
+
+static uint32_t table[8][256]; // slicing-by-8 tables, built on first use
+static int tables_ready = 0;
+static int hw = 0;
+static int hw_off = 0; // the tables are used even where hw is set
+
+static int enabled = 0;   // the image has checksums
+static int read_only = 0;
+static int verify = 1;
+static uint8_t checked[BLOCK_COUNT_MAX / 8]; // metadata verified since the last seal
+static int cursor = 0;                     // next block for the scrubber
+static int failed = 0;                     // metadata was corrupt in this operation
+static checksum_stats_t stats;
+
+// build the tables; table[k][b] is the CRC of byte b followed by k zeros
+static void crc32c_setup() {
+    for (int ii = 0; ii < 256; ++ii) {
+        uint32_t crc = ii;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        }
+        table[0][ii] = crc;
+    }
+    for (int ii = 0; ii < 256; ++ii) {
+        for (int kk = 1; kk < 8; ++kk) {
+            table[kk][ii] = (table[kk - 1][ii] >> 8) ^ table[0][table[kk - 1][ii] & 0xff];
+        }
+    }
+#if defined(__x86_64__)
+    hw = __builtin_cpu_supports("sse4.2");
+#elif defined(__ARM_FEATURE_CRC32)
+    hw = 1;
+#endif
+    tables_ready = 1;
+}
+
+// eight bytes per step, one table lookup per byte (little endian)
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len >= 8) {
+        uint32_t lo;
+        uint32_t hi;
+        memcpy(&lo, p, sizeof(lo));
+        memcpy(&hi, p + 4, sizeof(hi));
+        lo ^= crc;
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+              table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+              table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = crc64;
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = __crc32cd(crc, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+// compute the CRC32C of a buffer
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    if (!tables_ready) {
+        crc32c_setup();
+    }
+#if defined(__x86_64__) || defined(__ARM_FEATURE_CRC32)
+    if (hw && !hw_off) {
+        return ~crc32c_hw(~crc, data, len);
+    }
+#endif
+    return ~crc32c_sw(~crc, data, len);
+}
+
+// whether crc32c uses a CRC instruction
+int checksum_hw() {
+    if (!tables_ready) {
+        crc32c_setup();
+    }
+    return hw && !hw_off;
+}
+
+// make crc32c use the CRC instruction where there is one, or not
+void checksum_use_hw(int on) {
+    hw_off = !on;
+}
+
+static checksum_area_t *checksum_area() {
+    return get_checksum_area();
+}
+
+static uint32_t *checksum_sums() {
+    return blocks_get_block(checksum_area()->block);
+}
+
+// whether a block holds checksums, which have none of their own
+int checksum_holds(int bnum) {
+    int len;
+    int tables = blocks_tables(&len);
+    int block = checksum_area()->block;
+    return block > 0 && (bnum == block || (bnum > block && bnum < tables));
+}
+
+// whether a block has a checksum that can be checked; the tables, like
+// block 0, are stale while an operation runs
+static int checksum_covers(int bnum) {
+    uint8_t *stale = get_checksum_stale();
+    if (!enabled || bnum >= blocks_count() || checksum_holds(bnum)) {
+        return 0;
+    } else if (blocks_is_table(bnum)) {
+        return !bitmap_get(stale, 0);
+    }
+    return !bitmap_get(stale, bnum) && bitmap_get(get_blocks_bitmap(), bnum);
+}
+
+// compare a block with its checksum
+static int checksum_check(int bnum) {
+    uint32_t crc = crc32c(0, blocks_get_block(bnum), BLOCK_SIZE);
+    uint32_t sum = checksum_sums()[bnum];
+    if (crc == sum) {
+        return 0;
+    }
+    stats.errors++;
+    fprintf(stderr, "ERROR: checksum_check(%i) -> Block is corrupt (stored %08x, computed %08x)\n",
+        bnum, sum, crc);
+    return -1;
+}
+
+// check, or compute, the checksums of the runs of tables outside block 0
+static void checksum_tables(int check) {
+    uint32_t *sums = checksum_sums();
+    int runs[2][2];
+    runs[0][0] = blocks_tables(&runs[0][1]);
+    runs[1][0] = blocks_inode_tables(&runs[1][1]);
+    for (int rr = 0; rr < 2; ++rr) {
+        for (int ii = runs[rr][0]; ii < runs[rr][0] + runs[rr][1]; ++ii) {
+            if (check) {
+                checksum_check(ii);
+            } else {
+                sums[ii] = crc32c(0, blocks_get_block(ii), BLOCK_SIZE);
+            }
+        }
+    }
+}
+
+// load the checksums of the image, or compute them all if it has none
+void checksum_init(int ro, int on) {
+    read_only = ro;
+    verify = on;
+    memset(checked, 0, sizeof(checked));
+    checksum_area_t *area = checksum_area();
+    enabled = area->block > 0 && area->block < blocks_count() &&
+              bitmap_get(get_blocks_bitmap(), area->block);
+
+    if (!enabled) {
+        // an image made before checksums: every block gets one now
+        int bnum = read_only ? -1 : alloc_block();
+        if (bnum < 0) {
+            fprintf(stderr, "ERROR: checksum_init() -> No checksums on this image.\n");
+            return;
+        }
+        area->block = bnum;
+        memset(get_checksum_stale(), 0xff, blocks_capacity() / 8);
+        enabled = 1;
+        checksum_seal();
+        printf("DEBUG: checksum_init() -> Checksums in block %i (%s)\n",
+            bnum, checksum_hw() ? "crc instruction" : "slicing-by-8");
+        return;
+    }
+
+    if (bitmap_get(get_checksum_stale(), 0)) {
+        printf("DEBUG: checksum_init() -> Last mount stopped in an operation\n");
+    } else {
+        checksum_check(0);
+        checksum_tables(1);
+    }
+    checksum_seal();
+    printf("DEBUG: checksum_init() -> Checksums in block %i (%s)\n",
+        area->block, checksum_hw() ? "crc instruction" : "slicing-by-8");
+}
+
+// mark the start of an operation, which may write block 0
+void checksum_begin() {
+    failed = 0;
+    if (enabled && !read_only) {
+        bitmap_put(get_checksum_stale(), 0, 1);
+    }
+}
+
+// mark the checksum of a block stale before it is written
+void checksum_dirty(int bnum) {
+    if (enabled && !read_only) {
+        bitmap_put(get_checksum_stale(), bnum, 1);
+    }
+}
+
+// compute the stale checksums and the checksums of block 0 and the tables
+// again
+void checksum_seal() {
+    memset(checked, 0, sizeof(checked));
+    if (!enabled || read_only) {
+        return;
+    }
+    uint8_t *stale = get_checksum_stale();
+    uint32_t *sums = checksum_sums();
+    void *bbm = get_blocks_bitmap();
+    for (int ii = 1; ii < blocks_count(); ++ii) {
+        if (!stale[ii / 8]) {
+            ii += 7 - ii % 8; // nothing stale in this byte
+            continue;
+        }
+        if (bitmap_get(stale, ii) && !checksum_holds(ii) && !blocks_is_table(ii) &&
+            bitmap_get(bbm, ii)) {
+            sums[ii] = crc32c(0, blocks_get_block(ii), BLOCK_SIZE);
+        }
+    }
+    memset(stale, 0, blocks_capacity() / 8);
+    checksum_tables(0);
+    sums[0] = crc32c(0, blocks_get_block(0), BLOCK_SIZE);
+}
+
+// verify a data block against its checksum
+int checksum_verify(int bnum) {
+    if (!verify || bnum <= 0 || !checksum_covers(bnum)) {
+        return 0;
+    }
+    stats.verified++;
+    return checksum_check(bnum);
+}
+
+// verify a metadata block the first time it is used since the last seal;
+// a corrupt one fails every time, so it is never taken for good later
+int checksum_verify_meta(int bnum) {
+    if (bnum < 0 || bitmap_get(checked, bnum)) {
+        return 0;
+    }
+    if (checksum_verify(bnum) < 0) {
+        failed = 1;
+        return -1;
+    }
+    bitmap_put(checked, bnum, 1);
+    return 0;
+}
+
+// whether a metadata block failed its checksum since the operation began
+int checksum_failed() {
+    return failed;
+}
+
+// verify the next blocks of the image
+int checksum_scrub(int count) {
+    int bad = 0;
+    for (int ii = 0; enabled && ii < count; ++ii) {
+        int bnum = cursor;
+        cursor = (cursor + 1) % blocks_count();
+        if (cursor == 0) {
+            stats.passes++;
+        }
+        if (checksum_covers(bnum)) {
+            stats.scrubbed++;
+            bad += checksum_check(bnum) < 0;
+        }
+    }
+    return bad;
+}
+
+// get the checksum counters
+checksum_stats_t *checksum_get_stats() {
+    return &stats;
+}
@@ -0,0 +1,160 @@
+/**
+ * @file checksum.h
+ * @author Alston Liu
+ *
+ * CRC32C checksums of every block.
+ *
+ * The checksums live in a block of their own, found through block 0, or
+ * at the start of the run of the per-block tables once the image outgrows
+ * block 0. Code that writes a block through the mapping gets it with
+ * blocks_write_block, which marks its checksum stale, and checksum_seal
+ * computes the stale checksums again when an operation ends. The stale
+ * marks are kept with the block bitmap, so after a crash only the blocks
+ * that were being written go unchecked instead of being reported as
+ * corrupt. The checksum blocks themselves are not covered.
+ *
+ * Data blocks are verified on every read, metadata blocks (the inode table,
+ * directory and indirect blocks) the first time an operation uses them,
+ * and block 0 at mount. A scrubber on the cleaner thread goes through the
+ * whole image a few blocks at a time while it stays mounted.
+ */
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blocks.h"
+
+// blocks the scrubber verifies per step, and the pause between steps
+#define CHECKSUM_SCRUB_BLOCKS 8
+#define CHECKSUM_SCRUB_MS 100
+
+// the checksum area of block 0
+typedef struct checksum_area {
+  int32_t block;                     // first block of the checksums, 0 if none yet
+  uint8_t stale[BLOCK_BITMAP_SIZE];  // blocks written since the last seal, while
+                                     // the tables are in block 0; bit 0 is set
+                                     // while an operation runs
+} checksum_area_t;
+
+// checksum counters
+typedef struct checksum_stats {
+  long verified; // blocks verified on read
+  long errors;   // blocks that did not match their checksum
+  long scrubbed; // blocks verified by the scrubber
+  long passes;   // times the scrubber went through the whole image
+} checksum_stats_t;
+
+/**
+ * Compute the CRC32C (Castagnoli) of a buffer.
+ *
+ * Uses the SSE4.2 or ARMv8 CRC instructions where the CPU has them, and
+ * slicing-by-8 tables otherwise.
+ *
+ * @param crc CRC of the data before, 0 to start.
+ * @param data The buffer.
+ * @param len Its length in bytes.
+ *
+ * @return The CRC of everything so far.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+/**
+ * Whether crc32c uses a CRC instruction.
+ */
+int checksum_hw();
+
+/**
+ * Make crc32c use the CRC instruction where the CPU has one (the
+ * default), or the slicing-by-8 tables even there.
+ *
+ * @param on Whether to use the instruction.
+ */
+void checksum_use_hw(int on);
+
+/**
+ * Load the checksums of the image, or compute them all if it has none.
+ *
+ * Block 0 and the tables are verified, unless the last mount stopped in the
+ * middle of an operation, and checksums left stale by it are computed again.
+ *
+ * @param read_only Nothing is written to the image, as for a snapshot mount.
+ * @param verify Whether reads are verified; checksums are kept either way.
+ */
+void checksum_init(int read_only, int verify);
+
+/**
+ * Mark the start of an operation, which may write block 0.
+ */
+void checksum_begin();
+
+/**
+ * Mark the checksum of a block stale before it is written.
+ *
+ * @param bnum The block number.
+ */
+void checksum_dirty(int bnum);
+
+/**
+ * Compute the stale checksums and the checksum of block 0 again.
+ */
+void checksum_seal();
+
+/**
+ * Whether a block holds checksums.
+ *
+ * @param bnum The block number.
+ *
+ * @return 1 if it does, 0 otherwise.
+ */
+int checksum_holds(int bnum);
+
+/**
+ * Verify a data block against its checksum.
+ *
+ * Free blocks and blocks written since the last seal always pass.
+ *
+ * @param bnum The block number.
+ *
+ * @return 0 if the block is fine, or -1 if it is corrupt.
+ */
+int checksum_verify(int bnum);
+
+/**
+ * Verify a metadata block the first time it is used since the last seal.
+ *
+ * A corrupt block fails every time it is used.
+ *
+ * @param bnum The block number.
+ *
+ * @return 0 if the block is fine, or -1 if it is corrupt.
+ */
+int checksum_verify_meta(int bnum);
+
+/**
+ * Whether a metadata block failed its checksum since the operation began.
+ *
+ * @return 1 if one did, 0 otherwise.
+ */
+int checksum_failed();
+
+/**
+ * Verify the next blocks of the image, going round it over and over.
+ *
+ * Checksums have to be sealed.
+ *
+ * @param count Number of blocks to look at.
+ *
+ * @return The number of corrupt blocks found.
+ */
+int checksum_scrub(int count);
+
+/**
+ * Get the checksum counters.
+ *
+ * @return A pointer to the counters.
+ */
+checksum_stats_t *checksum_get_stats();
+
+#endif
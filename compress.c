@@ -0,0 +1,505 @@
+/**
+ * @file compress.c
+ * @author Alston Liu
+ *
+ * Implementation of the LZ codec and compressed clusters
+ */
+#include <assert.h>
+
+#include "compress.h"
+#include "dedup.h"
+#include "checksum.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xFFFF
+
+// a decompressed cluster in the cache
+typedef struct cache_slot {
+    int valid;
+    int inum;
+    int cluster;
+    long used; // last use, for LRU
+    uint8_t *data;
+} cache_slot_t;
+
+// clusters of an inode written since it was last compressed
+typedef struct compress_dirty {
+    int inum;
+    int first; // first cluster written
+    int last;  // last cluster written
+    struct compress_dirty *next;
+} compress_dirty_t;
+
+static cache_slot_t cache[COMPRESS_CACHE_SLOTS];
+static long cache_clock = 0;
+static compress_dirty_t *dirty = NULL;
+static compress_stats_t stats;
+
+// scratch space for a cluster and its compressed stream
+static uint8_t raw[CLUSTER_SIZE];
+static uint8_t stream[CLUSTER_SIZE];
+
+static uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// writes the extra bytes of a length that does not fit in its nibble
+static uint8_t *lz_put_length(uint8_t *op, uint8_t *oend, int len) {
+    len -= 15;
+    while (len >= 255) {
+        if (op >= oend) {
+            return NULL;
+        }
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend) {
+        return NULL;
+    }
+    *op++ = len;
+    return op;
+}
+
+// writes a sequence of literals followed by a match; the last sequence of a
+// stream has no match (mlen 0)
+static uint8_t *lz_put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, int nlit,
+                                int offset, int mlen) {
+    if (op >= oend) {
+        return NULL;
+    }
+    uint8_t *token = op++;
+    int ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+    *token = ((nlit < 15 ? nlit : 15) << 4) | (ml < 15 ? ml : 15);
+    if (nlit >= 15 && !(op = lz_put_length(op, oend, nlit))) {
+        return NULL;
+    }
+    if (oend - op < nlit) {
+        return NULL;
+    }
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (mlen) {
+        if (oend - op < 2) {
+            return NULL;
+        }
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+        if (ml >= 15 && !(op = lz_put_length(op, oend, ml))) {
+            return NULL;
+        }
+    }
+    return op;
+}
+
+// compress a buffer
+int lz_compress(const uint8_t *src, int len, uint8_t *dst, int cap) {
+    int table[1 << LZ_HASH_BITS];
+    memset(table, 0xFF, sizeof(table)); // every position starts out as -1
+
+    uint8_t *op = dst;
+    uint8_t *oend = dst + cap;
+    int ip = 0;
+    int anchor = 0;
+    int misses = 0;
+    while (ip + LZ_MIN_MATCH <= len) {
+        uint32_t seq = lz_read32(src + ip);
+        int h = lz_hash(seq);
+        int ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || lz_read32(src + ref) != seq) {
+            // step faster through data that does not compress
+            ip += 1 + (misses++ >> 5);
+            continue;
+        }
+        misses = 0;
+
+        int mlen = LZ_MIN_MATCH;
+        while (ip + mlen < len && src[ref + mlen] == src[ip + mlen]) {
+            mlen++;
+        }
+        op = lz_put_sequence(op, oend, src + anchor, ip - anchor, ip - ref, mlen);
+        if (!op) {
+            return -1;
+        }
+        ip += mlen;
+        anchor = ip;
+    }
+
+    op = lz_put_sequence(op, oend, src + anchor, len - anchor, 0, 0);
+    return op ? op - dst : -1;
+}
+
+// reads the extra bytes of a length that did not fit in its nibble
+static int lz_get_length(const uint8_t *src, int len, int *ip) {
+    int total = 0;
+    int b;
+    do {
+        if (*ip >= len) {
+            return -1;
+        }
+        b = src[(*ip)++];
+        total += b;
+    } while (b == 255);
+    return total;
+}
+
+// decompress a buffer
+int lz_decompress(const uint8_t *src, int len, uint8_t *dst, int cap) {
+    int ip = 0;
+    int op = 0;
+    while (ip < len) {
+        int token = src[ip++];
+        int nlit = token >> 4;
+        if (nlit == 15) {
+            int extra = lz_get_length(src, len, &ip);
+            if (extra < 0) {
+                return -1;
+            }
+            nlit += extra;
+        }
+        if (nlit > len - ip || nlit > cap - op) {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == len) {
+            break; // the last sequence has no match
+        }
+
+        if (len - ip < 2) {
+            return -1;
+        }
+        int offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        int mlen = token & 15;
+        if (mlen == 15) {
+            int extra = lz_get_length(src, len, &ip);
+            if (extra < 0) {
+                return -1;
+            }
+            mlen += extra;
+        }
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || mlen > cap - op) {
+            return -1;
+        }
+
+        // byte by byte, the match may overlap what it is copying
+        for (int ii = 0; ii < mlen; ++ii) {
+            dst[op + ii] = dst[op - offset + ii];
+        }
+        op += mlen;
+    }
+    return op;
+}
+
+// number of logical blocks in the cluster
+static int cluster_blocks(inode_t *node, int cluster) {
+    int left = node->blocks - cluster * CLUSTER_BLOCKS;
+    return (left < CLUSTER_BLOCKS) ? left : CLUSTER_BLOCKS;
+}
+
+// whether the cluster is stored compressed
+static int cluster_compressed(inode_t *node, int cluster) {
+    if (cluster * CLUSTER_BLOCKS >= node->blocks) {
+        return 0;
+    }
+    int entry = inode_get_entry(node, cluster * CLUSTER_BLOCKS);
+    return entry >= 0 && !(entry & BNUM_FRAG) && (entry & BNUM_COMPR);
+}
+
+// find the cached copy of the cluster
+static cache_slot_t *cache_find(int inum, int cluster) {
+    for (int ii = 0; ii < COMPRESS_CACHE_SLOTS; ++ii) {
+        if (cache[ii].valid && cache[ii].inum == inum && cache[ii].cluster == cluster) {
+            cache[ii].used = ++cache_clock;
+            return &cache[ii];
+        }
+    }
+    return NULL;
+}
+
+// take the least recently used slot for the cluster
+static cache_slot_t *cache_take(int inum, int cluster) {
+    cache_slot_t *slot = &cache[0];
+    for (int ii = 0; ii < COMPRESS_CACHE_SLOTS; ++ii) {
+        if (!cache[ii].valid) {
+            slot = &cache[ii];
+            break;
+        }
+        if (cache[ii].used < slot->used) {
+            slot = &cache[ii];
+        }
+    }
+    if (!slot->data) {
+        slot->data = (uint8_t *) malloc(CLUSTER_SIZE);
+    }
+    slot->valid = 1;
+    slot->inum = inum;
+    slot->cluster = cluster;
+    slot->used = ++cache_clock;
+    return slot;
+}
+
+// drop the cached copy of the cluster
+static void cache_drop(int inum, int cluster) {
+    cache_slot_t *slot = cache_find(inum, cluster);
+    if (slot) {
+        slot->valid = 0;
+    }
+}
+
+// get the decompressed data of a compressed cluster
+static uint8_t *cluster_load(inode_t *node, int cluster) {
+    int inum = inode_get_inum(node);
+    cache_slot_t *slot = cache_find(inum, cluster);
+    if (slot) {
+        stats.cache_hits++;
+        return slot->data;
+    }
+    stats.cache_misses++;
+
+    // gather the stream from the blocks that hold it
+    int first = cluster * CLUSTER_BLOCKS;
+    int n = cluster_blocks(node, cluster);
+    int k = 0;
+    for (int entry; k < n && (entry = inode_get_entry(node, first + k)) >= 0 &&
+                    (entry & BNUM_COMPR); ++k) {
+        if (checksum_verify(entry & ~BNUM_COMPR) < 0) {
+            return NULL;
+        }
+        memcpy(stream + k * BLOCK_SIZE, blocks_get_block(entry & ~BNUM_COMPR), BLOCK_SIZE);
+    }
+    uint32_t len;
+    memcpy(&len, stream, sizeof(len));
+
+    slot = cache_take(inum, cluster);
+    if (len > k * BLOCK_SIZE - sizeof(len) ||
+        lz_decompress(stream + sizeof(len), len, slot->data, CLUSTER_SIZE) != n * BLOCK_SIZE) {
+        fprintf(stderr, "ERROR: cluster_load(%i, %i) -> Corrupt cluster.\n", inum, cluster);
+        slot->valid = 0;
+        return NULL;
+    }
+    return slot->data;
+}
+
+// compress a cluster of written blocks into its first blocks and free the
+// rest. Returns 1 if the cluster got compressed, 0 if it is left raw
+static int cluster_compress(inode_t *node, int cluster) {
+    int first = cluster * CLUSTER_BLOCKS;
+    int n = cluster_blocks(node, cluster);
+    if (n < 2) {
+        return 0; // nothing to save
+    }
+    int entries[CLUSTER_BLOCKS];
+    for (int ii = 0; ii < n; ++ii) {
+        entries[ii] = inode_get_entry(node, first + ii);
+        if (entries[ii] < 0 || (entries[ii] & (BNUM_UNWRITTEN | BNUM_FRAG | BNUM_COMPR))) {
+            return 0; // holes, packed tails and compressed data stay as they are
+        }
+        if (blocks_refs(entries[ii]) > 0) {
+            return 0; // so do blocks shared with other files
+        }
+        memcpy(raw + ii * BLOCK_SIZE, blocks_get_block(entries[ii]), BLOCK_SIZE);
+    }
+
+    // it has to save at least one block
+    uint32_t len;
+    int rv = lz_compress(raw, n * BLOCK_SIZE, stream + sizeof(len),
+                         (n - 1) * BLOCK_SIZE - sizeof(len));
+    if (rv < 0) {
+        stats.raw++;
+        return 0;
+    }
+    len = rv;
+    memcpy(stream, &len, sizeof(len));
+    int k = bytes_to_blocks(len + sizeof(len));
+    printf("DEBUG: cluster_compress(%i) -> %i blocks into %i\n", cluster, n, k);
+
+    for (int ii = 0; ii < n; ++ii) {
+        if (ii < k) {
+            dedup_forget(entries[ii]); // no longer holds file data
+            memcpy(blocks_write_block(entries[ii]), stream + ii * BLOCK_SIZE, BLOCK_SIZE);
+            inode_set_bnum(node, first + ii, entries[ii] | BNUM_COMPR);
+        } else {
+            free_block(entries[ii]);
+            inode_set_bnum(node, first + ii, BNUM_HOLE);
+        }
+    }
+
+    // the data just compressed is what the next read wants
+    cache_slot_t *slot = cache_find(inode_get_inum(node), cluster);
+    if (!slot) {
+        slot = cache_take(inode_get_inum(node), cluster);
+    }
+    memcpy(slot->data, raw, n * BLOCK_SIZE);
+
+    stats.clusters++;
+    stats.saved += n - k;
+    return 1;
+}
+
+// write a compressed cluster back out into raw blocks
+static int cluster_expand(inode_t *node, int cluster) {
+    int first = cluster * CLUSTER_BLOCKS;
+    int n = cluster_blocks(node, cluster);
+    uint8_t *data = cluster_load(node, cluster);
+    if (!data) {
+        return -1;
+    }
+    printf("DEBUG: cluster_expand(%i) -> Called Function\n", cluster);
+
+    // the stream blocks become the first raw blocks, so the holes after
+    // them get blocks right behind them; stream blocks shared with a clone
+    // stay with the clone and are replaced
+    int stream[CLUSTER_BLOCKS];
+    int k = 0;
+    for (int entry; k < n && (entry = inode_get_entry(node, first + k)) >= 0 &&
+                    (entry & BNUM_COMPR); ++k) {
+        stream[k] = entry & ~BNUM_COMPR;
+        if (blocks_refs(stream[k]) > 0) {
+            free_block(stream[k]);
+            inode_set_bnum(node, first + k, BNUM_HOLE);
+        } else {
+            inode_set_bnum(node, first + k, stream[k]);
+        }
+    }
+    if (inode_alloc_range(node, first, n) < 0) {
+        for (int ii = 0; ii < n; ++ii) {
+            int entry = inode_get_entry(node, first + ii);
+            if (ii < k && entry == stream[ii]) {
+                inode_set_bnum(node, first + ii, entry | BNUM_COMPR);
+                continue;
+            }
+            inode_punch(node, first + ii, 1);
+            if (ii < k) {
+                blocks_ref(stream[ii]);
+                inode_set_bnum(node, first + ii, stream[ii] | BNUM_COMPR);
+            }
+        }
+        return -1;
+    }
+
+    for (int ii = 0; ii < n; ++ii) {
+        int bnum = inode_get_entry(node, first + ii) & ~BNUM_UNWRITTEN;
+        memcpy(blocks_write_block(bnum), data + ii * BLOCK_SIZE, BLOCK_SIZE);
+        inode_set_bnum(node, first + ii, bnum);
+    }
+
+    // the cluster is about to be written; it gets compressed again on flush
+    cache_drop(inode_get_inum(node), cluster);
+    compress_dirty(inode_get_inum(node), first * BLOCK_SIZE, (first + n) * BLOCK_SIZE);
+    stats.expanded++;
+    return 0;
+}
+
+// whether the cluster holding the byte at this offset is compressed
+int compress_is_compressed(inode_t *node, int offset) {
+    return cluster_compressed(node, offset / CLUSTER_SIZE);
+}
+
+// get the decompressed data of the cluster holding the byte at offset
+const char *compress_read(inode_t *node, int offset) {
+    uint8_t *data = cluster_load(node, offset / CLUSTER_SIZE);
+    return data ? (const char *) data + offset % CLUSTER_SIZE : NULL;
+}
+
+// expand the compressed clusters overlapping [start, end) into raw blocks
+int compress_expand(inode_t *node, int start, int end) {
+    if (node->blocks == 0 || end <= start) {
+        return 0;
+    }
+    int first = start / CLUSTER_SIZE;
+    int last = (end - 1) / CLUSTER_SIZE;
+    int last_cluster = (node->blocks - 1) / CLUSTER_BLOCKS;
+
+    // whatever grows the block map appends to the last cluster
+    if (end > node->blocks * BLOCK_SIZE) {
+        last = last_cluster;
+        first = (first < last) ? first : last;
+    }
+    for (int cc = first; cc <= last && cc <= last_cluster; ++cc) {
+        if (cluster_compressed(node, cc) && cluster_expand(node, cc) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// remember that the bytes in [start, end) of the inode were written
+void compress_dirty(int inum, int start, int end) {
+    if (end <= start) {
+        return;
+    }
+    int first = start / CLUSTER_SIZE;
+    int last = (end - 1) / CLUSTER_SIZE;
+    for (compress_dirty_t *cd = dirty; cd; cd = cd->next) {
+        if (cd->inum == inum) {
+            cd->first = (first < cd->first) ? first : cd->first;
+            cd->last = (last > cd->last) ? last : cd->last;
+            return;
+        }
+    }
+    compress_dirty_t *cd = (compress_dirty_t *) malloc(sizeof(compress_dirty_t));
+    cd->inum = inum;
+    cd->first = first;
+    cd->last = last;
+    cd->next = dirty;
+    dirty = cd;
+}
+
+// take the written range of the inode off the list
+static int dirty_take(int inum, int *first, int *last) {
+    compress_dirty_t **prev = &dirty;
+    while (*prev && (*prev)->inum != inum) {
+        prev = &(*prev)->next;
+    }
+    compress_dirty_t *cd = *prev;
+    if (!cd) {
+        return 0;
+    }
+    *first = cd->first;
+    *last = cd->last;
+    *prev = cd->next;
+    free(cd);
+    return 1;
+}
+
+// compress the written clusters of a file with INODE_COMPR set
+void compress_file(inode_t *node) {
+    int first;
+    int last;
+    if (!dirty_take(inode_get_inum(node), &first, &last) || !(node->flags & INODE_COMPR)) {
+        return;
+    }
+    printf("DEBUG: compress_file() -> Clusters %i to %i\n", first, last);
+    for (int cc = first; cc <= last && cc * CLUSTER_BLOCKS < node->blocks; ++cc) {
+        cluster_compress(node, cc);
+    }
+}
+
+// forget the cached clusters and written ranges of the inode
+void compress_forget(int inum) {
+    for (int ii = 0; ii < COMPRESS_CACHE_SLOTS; ++ii) {
+        if (cache[ii].valid && cache[ii].inum == inum) {
+            cache[ii].valid = 0;
+        }
+    }
+    int first;
+    int last;
+    dirty_take(inum, &first, &last);
+}
+
+// get the compression counters
+compress_stats_t *compress_get_stats() {
+    return &stats;
+}
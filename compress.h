@@ -0,0 +1,127 @@
+/**
+ * @file compress.h
+ * @author Alston Liu
+ *
+ * Transparent compression of file data.
+ *
+ * Files with INODE_COMPR set are compressed in clusters of 64KB (16
+ * blocks) when they are flushed. A cluster compressed into k blocks keeps
+ * its stream in its first k blocks, marked BNUM_COMPR, and the rest of its
+ * block map entries become holes. Clusters that do not save a block are
+ * left raw. Decompressed clusters are kept in a small cache, and a cluster
+ * that gets written is expanded back into raw blocks first.
+ *
+ * The codec is a byte-oriented LZ77 in the style of LZ4: each sequence is
+ * a token (literal length << 4 | match length - 4), the literals, and a
+ * 2 byte offset back to the match. The last sequence has literals only.
+ */
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+
+#include "inode.h"
+
+#define CLUSTER_BLOCKS 16
+#define CLUSTER_SIZE (CLUSTER_BLOCKS * BLOCK_SIZE)
+
+// decompressed clusters kept in memory
+#define COMPRESS_CACHE_SLOTS 8
+
+// compression counters
+typedef struct compress_stats {
+  long clusters;     // clusters compressed
+  long raw;          // clusters left raw because they did not compress
+  long saved;        // blocks freed by compression
+  long expanded;     // clusters expanded back for a write
+  long cache_hits;   // reads served by the cluster cache
+  long cache_misses; // reads that had to decompress
+} compress_stats_t;
+
+/**
+ * Compress a buffer.
+ *
+ * @param src Data to compress.
+ * @param len Number of bytes of data.
+ * @param dst Buffer for the compressed stream.
+ * @param cap Size of dst.
+ *
+ * @return The length of the compressed stream, or -1 if it does not fit.
+ */
+int lz_compress(const uint8_t *src, int len, uint8_t *dst, int cap);
+
+/**
+ * Decompress a buffer.
+ *
+ * @param src Compressed stream.
+ * @param len Length of the stream.
+ * @param dst Buffer for the data.
+ * @param cap Size of dst.
+ *
+ * @return The number of bytes of data, or -1 if the stream is corrupt.
+ */
+int lz_decompress(const uint8_t *src, int len, uint8_t *dst, int cap);
+
+/**
+ * Whether the cluster holding the byte at this offset is compressed.
+ *
+ * @param node The inode.
+ * @param offset Byte offset in the file.
+ */
+int compress_is_compressed(inode_t *node, int offset);
+
+/**
+ * Get the decompressed data of the cluster holding the byte at offset.
+ *
+ * @param node The inode.
+ * @param offset Byte offset in a compressed cluster.
+ *
+ * @return A pointer to the byte at offset in the cluster cache, valid until
+ *         the next call, or NULL if the cluster is corrupt.
+ */
+const char *compress_read(inode_t *node, int offset);
+
+/**
+ * Expand the compressed clusters overlapping [start, end) back into raw
+ * blocks, and the last cluster too if end lies past the block map.
+ *
+ * @param node The inode.
+ * @param start First byte offset.
+ * @param end End byte offset.
+ *
+ * @return 0 on success, or -1 if the disk is full.
+ */
+int compress_expand(inode_t *node, int start, int end);
+
+/**
+ * Remember that the bytes in [start, end) of the inode were written, so the
+ * clusters get compressed on the next compress_file.
+ *
+ * @param inum The inode number.
+ * @param start First byte offset.
+ * @param end End byte offset.
+ */
+void compress_dirty(int inum, int start, int end);
+
+/**
+ * Compress the written clusters of a file with INODE_COMPR set.
+ *
+ * @param node The inode.
+ */
+void compress_file(inode_t *node);
+
+/**
+ * Forget the cached clusters and written ranges of the inode.
+ *
+ * @param inum The inode number.
+ */
+void compress_forget(int inum);
+
+/**
+ * Get the compression counters.
+ *
+ * @return A pointer to the counters.
+ */
+compress_stats_t *compress_get_stats();
+
+#endif
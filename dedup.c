@@ -0,0 +1,153 @@
+/**
+ * @file dedup.c
+ * @author Alston Liu
+ *
+ * Implementation of inline block deduplication
+ */
+#include <assert.h>
+
+#include "dedup.h"
+#include "bitmap.h"
+
+#define DEDUP_PRIME1 0x9E3779B185EBCA87ULL
+#define DEDUP_PRIME2 0xC2B2AE3D27D4EB4FULL
+
+static int enabled = 0;
+static int heads[DEDUP_BUCKETS]; // first block of every bucket
+static int chain[BLOCK_COUNT_MAX]; // next block in the same bucket
+static dedup_stats_t stats;
+
+static uint64_t dedup_rotl(uint64_t v, int r) {
+    return (v << r) | (v >> (64 - r));
+}
+
+// hash the content of a block
+uint64_t dedup_hash(const void *data) {
+    const uint8_t *p = data;
+    uint64_t lanes[4] = {DEDUP_PRIME1, DEDUP_PRIME2, 0, -DEDUP_PRIME1};
+
+    // 32 bytes per round, one word per lane
+    for (int ii = 0; ii < BLOCK_SIZE; ii += 4 * sizeof(uint64_t)) {
+        for (int ll = 0; ll < 4; ++ll) {
+            uint64_t word;
+            memcpy(&word, p + ii + ll * sizeof(uint64_t), sizeof(word));
+            lanes[ll] = dedup_rotl(lanes[ll] + word * DEDUP_PRIME2, 31) * DEDUP_PRIME1;
+        }
+    }
+
+    uint64_t h = dedup_rotl(lanes[0], 1) + dedup_rotl(lanes[1], 7) +
+                 dedup_rotl(lanes[2], 12) + dedup_rotl(lanes[3], 18);
+    h ^= h >> 33;
+    h *= DEDUP_PRIME2;
+    h ^= h >> 29;
+    return h ? h : 1; // 0 marks blocks that are not indexed
+}
+
+static int dedup_bucket(uint64_t hash) {
+    return hash % DEDUP_BUCKETS;
+}
+
+// put the block at the front of its bucket
+static void dedup_insert(int bnum, uint64_t hash) {
+    uint64_t *hashes = get_dedup_hashes();
+    hashes[bnum] = hash;
+    chain[bnum] = heads[dedup_bucket(hash)];
+    heads[dedup_bucket(hash)] = bnum;
+}
+
+// rebuild the lookup buckets from the hashes stored on disk
+void dedup_init(int on) {
+    enabled = on;
+    for (int ii = 0; ii < DEDUP_BUCKETS; ++ii) {
+        heads[ii] = -1;
+    }
+
+    uint64_t *hashes = get_dedup_hashes();
+    void *bbm = get_blocks_bitmap();
+    int indexed = 0;
+    for (int ii = 1; ii < blocks_count(); ++ii) {
+        if (hashes[ii] && bitmap_get(bbm, ii)) {
+            dedup_insert(ii, hashes[ii]);
+            indexed++;
+        } else {
+            hashes[ii] = 0;
+        }
+    }
+    printf("DEBUG: dedup_init(%i) -> %i blocks indexed\n", on, indexed);
+}
+
+// whether blocks get deduplicated
+int dedup_enabled() {
+    return enabled;
+}
+
+// find an indexed block other than bnum with the same content
+static int dedup_lookup(int bnum, uint64_t hash) {
+    uint64_t *hashes = get_dedup_hashes();
+    const void *data = blocks_get_block(bnum);
+    for (int ii = heads[dedup_bucket(hash)]; ii >= 0; ii = chain[ii]) {
+        // the content is compared too: blocks written in place keep their
+        // old hash until they are freed
+        if (ii != bnum && hashes[ii] == hash && !memcmp(blocks_get_block(ii), data, BLOCK_SIZE)) {
+            return ii;
+        }
+    }
+    return -1;
+}
+
+// deduplicate a range of the block map of the inode
+void dedup_blocks(inode_t *node, int first, int count) {
+    if (!enabled) {
+        return;
+    }
+    uint64_t *hashes = get_dedup_hashes();
+    for (int ii = first; ii < first + count && ii < node->blocks; ++ii) {
+        int bnum = inode_get_entry(node, ii);
+        if (bnum < 0 || (bnum & (BNUM_UNWRITTEN | BNUM_FRAG | BNUM_COMPR)) || blocks_refs(bnum) > 0) {
+            continue;
+        }
+
+        uint64_t hash = dedup_hash(blocks_get_block(bnum));
+        stats.hashed++;
+        int match = dedup_lookup(bnum, hash);
+        if (match >= 0 && blocks_ref(match) == 0) {
+            printf("DEBUG: dedup_blocks() -> Block %i is a copy of %i\n", bnum, match);
+            inode_set_bnum(node, ii, match);
+            free_block(bnum);
+            stats.matched++;
+        } else if (hashes[bnum] != hash) {
+            dedup_forget(bnum);
+            dedup_insert(bnum, hash);
+        }
+    }
+}
+
+// take a block out of the index
+void dedup_forget(int bnum) {
+    uint64_t *hashes = get_dedup_hashes();
+    if (!hashes[bnum]) {
+        return;
+    }
+    int *prev = &heads[dedup_bucket(hashes[bnum])];
+    while (*prev != bnum) {
+        assert(*prev >= 0);
+        prev = &chain[*prev];
+    }
+    *prev = chain[bnum];
+    hashes[bnum] = 0;
+}
+
+// count a shared block that was copied before a write
+void dedup_count_cow() {
+    stats.cow++;
+}
+
+// get the number of bytes of memory the index uses
+long dedup_index_bytes() {
+    return sizeof(heads) + blocks_count() * sizeof(chain[0]);
+}
+
+// get the deduplication counters
+dedup_stats_t *dedup_get_stats() {
+    return &stats;
+}
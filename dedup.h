@@ -0,0 +1,91 @@
+/**
+ * @file dedup.h
+ * @author Alston Liu
+ *
+ * Inline block deduplication.
+ *
+ * When enabled (mount option -o dedup), every block written out by a flush
+ * is hashed and looked up in the hash index. A block whose content is
+ * already stored elsewhere is dropped and the file points at the stored
+ * block instead, which gains a reference. The hash of every indexed block
+ * is kept on disk next to the reference counts in block 0, and the lookup
+ * buckets are rebuilt from it at mount. Shared blocks are copied before
+ * they are written.
+ */
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+
+#include "inode.h"
+
+// lookup buckets of the in-memory index
+#define DEDUP_BUCKETS 128
+
+// deduplication counters
+typedef struct dedup_stats {
+  long hashed;  // blocks hashed
+  long matched; // blocks found in the index and shared
+  long cow;     // shared blocks copied before a write
+} dedup_stats_t;
+
+/**
+ * Hash the content of a block.
+ *
+ * Four independent 64 bit lanes are mixed in parallel, which compilers turn
+ * into vector instructions where the target has them.
+ *
+ * @param data The block.
+ *
+ * @return A hash, never 0.
+ */
+uint64_t dedup_hash(const void *data);
+
+/**
+ * Rebuild the lookup buckets from the hashes stored on disk.
+ *
+ * @param enabled Whether blocks get deduplicated.
+ */
+void dedup_init(int enabled);
+
+/**
+ * Whether blocks get deduplicated.
+ */
+int dedup_enabled();
+
+/**
+ * Deduplicate a range of the block map of the inode.
+ *
+ * Only written, unshared blocks are looked at.
+ *
+ * @param node The inode.
+ * @param first First block index in the file.
+ * @param count Number of blocks.
+ */
+void dedup_blocks(inode_t *node, int first, int count);
+
+/**
+ * Take a block out of the index.
+ *
+ * @param bnum The block number.
+ */
+void dedup_forget(int bnum);
+
+/**
+ * Count a shared block that was copied before a write.
+ */
+void dedup_count_cow();
+
+/**
+ * Get the number of bytes of memory the index uses.
+ */
+long dedup_index_bytes();
+
+/**
+ * Get the deduplication counters.
+ *
+ * @return A pointer to the counters.
+ */
+dedup_stats_t *dedup_get_stats();
+
+#endif
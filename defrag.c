@@ -0,0 +1,93 @@
+/**
+ * @file defrag.c
+ * @author Alston Liu
+ *
+ * Implementation of online defragmentation
+ */
+#include <sys/stat.h>
+
+#include "defrag.h"
+#include "prealloc.h"
+#include "checksum.h"
+
+static defrag_stats_t stats;
+
+// whether the block behind a block map entry can move: a plain block, or
+// one allocated but never written, that no one else references
+static int defrag_movable(int entry) {
+    return entry >= 0 && !(entry & (BNUM_FRAG | BNUM_COMPR)) &&
+           blocks_refs(entry & ~BNUM_UNWRITTEN) == 0;
+}
+
+// move the blocks of a file into one free run
+int defrag_inode(inode_t *node) {
+    if (!S_ISREG(node->mode) || (node->flags & (INODE_INLINE | INODE_COMPR))) {
+        return 0;
+    }
+    int extents = inode_extents(node);
+    if (extents <= 1) {
+        return 0;
+    }
+
+    // a shared block could not move, and the file would stay in pieces
+    int count = 0;
+    for (int ii = 0; ii < node->blocks; ++ii) {
+        int entry = inode_get_entry(node, ii);
+        if (entry >= 0 && !(entry & BNUM_FRAG) && !defrag_movable(entry)) {
+            stats.skipped++;
+            return 0;
+        }
+        count += entry >= 0 && !(entry & BNUM_FRAG);
+    }
+
+    // the window behind the file is given back, it may be part of the run
+    prealloc_release(inode_get_inum(node));
+    int len;
+    int start = blocks_find_run(1, count, &len);
+    if (start < 0 || len < count) {
+        printf("DEBUG: defrag_inode(%i) -> No free run of %i blocks\n", inode_get_inum(node), count);
+        stats.skipped++;
+        return 0;
+    }
+    blocks_take(start, count);
+
+    // copy the data over first; blocks never written have nothing to copy
+    int dst = start;
+    for (int ii = 0; ii < node->blocks; ++ii) {
+        int entry = inode_get_entry(node, ii);
+        if (entry < 0 || (entry & BNUM_FRAG)) {
+            continue;
+        }
+        if (!(entry & BNUM_UNWRITTEN)) {
+            if (checksum_verify(entry) < 0) {
+                for (int bb = start; bb < start + count; ++bb) {
+                    free_block(bb);
+                }
+                return -1;
+            }
+            memcpy(blocks_write_block(dst), blocks_get_block(entry), BLOCK_SIZE);
+        }
+        dst++;
+    }
+
+    // then point the block map at the copies
+    dst = start;
+    for (int ii = 0; ii < node->blocks; ++ii) {
+        int entry = inode_get_entry(node, ii);
+        if (entry < 0 || (entry & BNUM_FRAG)) {
+            continue;
+        }
+        inode_set_bnum(node, ii, dst++ | (entry & BNUM_UNWRITTEN));
+        free_block(entry & ~BNUM_UNWRITTEN);
+    }
+    stats.files++;
+    stats.moved += count;
+    printf("DEBUG: defrag_inode(%i) -> %i blocks from %i extents to %i\n",
+        inode_get_inum(node), count, extents, start);
+    return count;
+}
+
+// get the defragmenter counters
+defrag_stats_t *defrag_get_stats() {
+    return &stats;
+}
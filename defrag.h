@@ -0,0 +1,50 @@
+/**
+ * @file defrag.h
+ * @author Alston Liu
+ *
+ * Online defragmentation of regular files.
+ *
+ * A file whose blocks are spread over several runs gets a free run long
+ * enough for all of them. Its data is copied there first and only then is
+ * the block map pointed at the copies and the old blocks freed, all under
+ * the storage lock, so readers see either the old blocks or the new ones
+ * and a crash in between only leaves the new run allocated but unused.
+ *
+ * Blocks shared with a snapshot, a clone or a deduplicated file are left
+ * alone, since moving them would store them twice, and so are compressed
+ * clusters, inline files and packed tails.
+ */
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include "inode.h"
+
+// defragmenter counters
+typedef struct defrag_stats {
+  long files;   // files moved into one run
+  long moved;   // blocks copied
+  long skipped; // fragmented files left alone: shared blocks or no free run
+} defrag_stats_t;
+
+/**
+ * Move the blocks of a file into one free run.
+ *
+ * Holes stay holes and a packed tail stays in its fragment block; the
+ * blocks around them end up next to each other. Nothing happens to a file
+ * that is already in one run, or that has no free run to go to.
+ *
+ * @param node The inode of the file; its appends must have been flushed.
+ *
+ * @return The number of blocks moved, or -1 if a block did not match its
+ *         checksum.
+ */
+int defrag_inode(inode_t *node);
+
+/**
+ * Get the defragmenter counters.
+ *
+ * @return A pointer to the counters.
+ */
+defrag_stats_t *defrag_get_stats();
+
+#endif
@@ -0,0 +1,217 @@
+/**
+ * @file delalloc.c
+ * @author Alston Liu
+ *
+ * Implementation of delayed allocation for appending writes
+ */
+#include <assert.h>
+
+#include "delalloc.h"
+#include "dedup.h"
+
+static delalloc_t *buffers = NULL;
+static delalloc_stats_t stats;
+
+// blocks needed to grow the inode so it holds the file up to end bytes
+static int delalloc_blocks_needed(inode_t *node, int end) {
+    int nBlocks = bytes_to_blocks(end);
+    int need = nBlocks - node->blocks;
+    if (nBlocks > MAX_BLOCKS && node->indirect == -1) {
+        need++; // the indirect block
+    }
+    return (need > 0) ? need : 0;
+}
+
+// unlink the buffer from the list and free it
+static void delalloc_remove(delalloc_t *da) {
+    delalloc_t **prev = &buffers;
+    while (*prev != da) {
+        prev = &(*prev)->next;
+    }
+    *prev = da->next;
+
+    blocks_unreserve(da->blocks);
+    stats.buffered -= da->len;
+    free(da->data);
+    free(da);
+}
+
+// get the buffered appends of the inode
+delalloc_t *delalloc_get(int inum) {
+    for (delalloc_t *da = buffers; da; da = da->next) {
+        if (da->inum == inum) {
+            return da;
+        }
+    }
+    return NULL;
+}
+
+// buffer a write past the allocated blocks of the inode
+int delalloc_write(int inum, inode_t *node, const char *buf, size_t size, off_t offset) {
+    printf("DEBUG: delalloc_write(%i, %zu, %ld) -> Called Function\n", inum, size, offset);
+    delalloc_t *da = delalloc_get(inum);
+    assert(offset >= node->blocks * BLOCK_SIZE);
+
+    int end = offset + size;
+    if (bytes_to_blocks(end) > MAX_BLOCKS + INDIRECT_COUNT) {
+        fprintf(stderr, "ERROR: delalloc_write(%i) -> Exceeds max file size.\n", inum);
+        return -1;
+    }
+
+    // reserve the blocks the flush is going to need
+    int have = da ? da->blocks : 0;
+    int need = delalloc_blocks_needed(node, (da && da->start + da->len > end) ? da->start + da->len : end);
+    if (need > have && blocks_reserve(need - have) < 0) {
+        fprintf(stderr, "ERROR: delalloc_write(%i) -> No space left to reserve.\n", inum);
+        return -1;
+    }
+
+    if (!da) {
+        da = (delalloc_t *) calloc(1, sizeof(delalloc_t));
+        da->inum = inum;
+        da->start = node->blocks * BLOCK_SIZE;
+        da->next = buffers;
+        buffers = da;
+    }
+    if (need > have) {
+        da->blocks = need;
+    }
+
+    // grow the buffer geometrically so appends stay cheap
+    int new_len = end - da->start;
+    if (new_len > da->cap) {
+        int cap = (da->cap > 0) ? da->cap * 2 : BLOCK_SIZE;
+        while (cap < new_len) {
+            cap *= 2;
+        }
+        da->data = realloc(da->data, cap);
+        da->cap = cap;
+    }
+
+    int pos = offset - da->start;
+    if (pos > da->len) {
+        memset(da->data + da->len, 0, pos - da->len);
+    }
+    memcpy(da->data + pos, buf, size);
+    if (new_len > da->len) {
+        stats.buffered += new_len - da->len;
+        da->len = new_len;
+    }
+
+    // under memory pressure, write out the largest buffers
+    while (stats.buffered > DELALLOC_MAX_BYTES) {
+        delalloc_t *largest = buffers;
+        for (delalloc_t *it = buffers; it; it = it->next) {
+            if (it->len > largest->len) {
+                largest = it;
+            }
+        }
+        if (delalloc_flush(largest->inum) < 0) {
+            break;
+        }
+    }
+
+    return size;
+}
+
+// copy buffered bytes of the inode into buf; unbuffered bytes read as zeros
+int delalloc_read(int inum, char *buf, size_t size, off_t offset) {
+    delalloc_t *da = delalloc_get(inum);
+    int copied = 0;
+    if (da && offset < da->start + da->len) {
+        assert(offset >= da->start);
+        copied = da->start + da->len - offset;
+        if (copied > size) {
+            copied = size;
+        }
+        memcpy(buf, da->data + (offset - da->start), copied);
+    }
+    memset(buf + copied, 0, size - copied);
+    return size;
+}
+
+// allocate blocks for the buffered appends of the inode and write them out
+int delalloc_flush(int inum) {
+    delalloc_t *da = delalloc_get(inum);
+    if (!da) {
+        return 0;
+    }
+    printf("DEBUG: delalloc_flush(%i) -> Flushing %i bytes\n", inum, da->len);
+
+    inode_t *node = get_inode(inum);
+    if (!node) {
+        return -1; // the data stays buffered
+    }
+    assert(node->blocks * BLOCK_SIZE == da->start);
+
+    // the reservation is handed back right before allocating against it
+    blocks_unreserve(da->blocks);
+    int old_blocks = node->blocks;
+    if (da->len > 0 && grow_inode(node, da->len) < 0) {
+        // roll back the partial allocation and keep the data buffered
+        if (node->blocks > old_blocks) {
+            shrink_inode(node, (node->blocks - old_blocks) * BLOCK_SIZE);
+        }
+        if (blocks_reserve(da->blocks) < 0) {
+            da->blocks = 0;
+        }
+        fprintf(stderr, "ERROR: delalloc_flush(%i) -> Failed to allocate blocks.\n", inum);
+        return -1;
+    }
+    da->blocks = 0;
+
+    // copy the data block by block into the new run
+    int done = 0;
+    while (done < da->len) {
+        int pos = da->start + done;
+        char *block = blocks_write_block(inode_get_bnum(node, pos));
+        int chunk = BLOCK_SIZE - (pos % BLOCK_SIZE);
+        if (chunk > da->len - done) {
+            chunk = da->len - done;
+        }
+        memcpy(block + (pos % BLOCK_SIZE), da->data + done, chunk);
+        done += chunk;
+
+        // the rest of the last block may hold old data; it has to read as
+        // zeros once the file grows over it
+        if (done == da->len && (pos + chunk) % BLOCK_SIZE) {
+            memset(block + (pos + chunk) % BLOCK_SIZE, 0, BLOCK_SIZE - (pos + chunk) % BLOCK_SIZE);
+        }
+    }
+
+    // blocks already stored elsewhere are shared instead
+    dedup_blocks(node, da->start / BLOCK_SIZE, node->blocks - da->start / BLOCK_SIZE);
+
+    stats.flushes++;
+    delalloc_remove(da);
+    return 0;
+}
+
+// flush the buffered appends of every inode; a buffer that cannot get
+// its blocks stays, so a later flush can try again
+int delalloc_flush_all() {
+    int rv = 0;
+    delalloc_t *da = buffers;
+    while (da) {
+        delalloc_t *next = da->next;
+        if (delalloc_flush(da->inum) < 0) {
+            rv = -1;
+        }
+        da = next;
+    }
+    return rv;
+}
+
+// throw away the buffered appends of the inode
+void delalloc_drop(int inum) {
+    delalloc_t *da = delalloc_get(inum);
+    if (da) {
+        printf("DEBUG: delalloc_drop(%i) -> Dropping %i bytes\n", inum, da->len);
+        delalloc_remove(da);
+    }
+}
+
+// get the delayed allocation counters
+delalloc_stats_t *delalloc_get_stats() {
+    return &stats;
+}
@@ -0,0 +1,110 @@
+/**
+ * @file delalloc.h
+ * @author Alston Liu
+ *
+ * Delayed allocation for appending writes.
+ *
+ * Data written past the blocks a file already owns is buffered in memory
+ * and only gets blocks once the file is flushed. The blocks are then taken
+ * as one contiguous run sized to the buffered data, instead of one at a
+ * time as every small append crosses into a new block.
+ */
+#ifndef DELALLOC_H
+#define DELALLOC_H
+
+#include <sys/types.h>
+
+#include "inode.h"
+
+// buffered bytes over all files before the largest buffer is flushed
+#define DELALLOC_MAX_BYTES (256 * KBtoB)
+
+// buffered appends of one inode
+typedef struct delalloc {
+  int inum;    // inode the data belongs to
+  int start;   // file offset of the first buffered byte (end of its blocks)
+  int len;     // bytes buffered
+  int cap;     // bytes the buffer can hold
+  int blocks;  // blocks reserved for flushing the buffer
+  char *data;  // the buffered bytes
+  struct delalloc *next;
+} delalloc_t;
+
+// delayed allocation counters
+typedef struct delalloc_stats {
+  long buffered; // bytes currently buffered
+  long flushes;  // buffers written out to newly allocated blocks
+} delalloc_stats_t;
+
+/**
+ * Get the buffered appends of the given inode.
+ *
+ * @param inum The inode number.
+ *
+ * @return The buffer of the inode, or NULL if nothing is buffered.
+ */
+delalloc_t *delalloc_get(int inum);
+
+/**
+ * Buffer a write past the allocated blocks of the inode.
+ *
+ * The write must start at or after the end of the blocks the inode owns.
+ * Gaps between the buffered data and the write are filled with zeros.
+ * Blocks for the buffer are reserved so that the flush cannot run out
+ * of space.
+ *
+ * @param inum The inode number.
+ * @param node The inode being written.
+ * @param buf The data to write.
+ * @param size Number of bytes to write.
+ * @param offset File offset of the write.
+ *
+ * @return Number of bytes buffered, or -1 if there is no room for them.
+ */
+int delalloc_write(int inum, inode_t *node, const char *buf, size_t size, off_t offset);
+
+/**
+ * Copy buffered bytes of the inode into the given buffer.
+ *
+ * @param inum The inode number.
+ * @param buf Destination buffer.
+ * @param size Number of bytes to read.
+ * @param offset File offset to read from.
+ *
+ * @return Number of bytes copied.
+ */
+int delalloc_read(int inum, char *buf, size_t size, off_t offset);
+
+/**
+ * Allocate blocks for the buffered appends of the inode and write them out.
+ *
+ * @param inum The inode number.
+ *
+ * @return 0 on success, -1 if the blocks could not be allocated.
+ */
+int delalloc_flush(int inum);
+
+/**
+ * Flush the buffered appends of every inode.
+ *
+ * The buffers that cannot get their blocks are kept.
+ *
+ * @return 0 on success, -1 if any buffer could not be flushed.
+ */
+int delalloc_flush_all();
+
+/**
+ * Throw away the buffered appends of the inode without writing them.
+ *
+ * @param inum The inode number.
+ */
+void delalloc_drop(int inum);
+
+/**
+ * Get the delayed allocation counters.
+ *
+ * @return Pointer to the global delayed allocation counters.
+ */
+delalloc_stats_t *delalloc_get_stats();
+
+#endif
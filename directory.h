@@ -26,8 +26,8 @@ typedef struct direntry {
 void directory_init();
 int directory_lookup(inode_t *di, const char *name);
 int directory_put(inode_t *di, const char *name, int inum);
+int directory_remove(inode_t *di, const char *name);
 int directory_delete(inode_t *di, const char *name);
-int delete_entry(dirent_t* entry);
 slist_t *directory_list(const char *path);
 void print_directory(inode_t *dd);
 int path_lookup(const char* path);
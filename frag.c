@@ -0,0 +1,112 @@
+/**
+ * @file frag.c
+ * @author Alston Liu
+ *
+ * Implementation of the fragment allocator for packed tails
+ */
+#include <assert.h>
+#include <stdio.h>
+
+#include "frag.h"
+
+// fragment block the last run was allocated from
+static int last_block = -1;
+
+// get the number of fragments needed to store the given number of bytes
+int bytes_to_frags(int bytes) {
+    return (bytes + FRAG_SIZE - 1) / FRAG_SIZE;
+}
+
+// mask of count fragments starting at index
+static uint8_t frag_mask(int index, int count) {
+    return ((1 << count) - 1) << index;
+}
+
+// find count free fragments in a row in the fragment block, or -1
+static int frag_find(uint8_t used, int count) {
+    for (int ii = 0; ii + count <= FRAGS_PER_BLOCK; ++ii) {
+        if (!(used & frag_mask(ii, count))) {
+            return ii;
+        }
+    }
+    return -1;
+}
+
+// allocate a run of contiguous fragments inside one fragment block
+int frag_alloc(int count) {
+    assert(count > 0 && count < FRAGS_PER_BLOCK);
+    uint8_t *map = get_frag_map();
+
+    // stay in the last fragment block, then try every other one. Blocks a
+    // snapshot still references are left alone, their free fragments may
+    // hold tails the snapshot reads
+    int bnum = -1;
+    int index = -1;
+    if (last_block > 0 && map[last_block] && !blocks_refs(last_block)) {
+        index = frag_find(map[last_block], count);
+        bnum = (index >= 0) ? last_block : -1;
+    }
+    for (int ii = 1; bnum < 0 && ii < blocks_count(); ++ii) {
+        if (map[ii] && !blocks_refs(ii) && (index = frag_find(map[ii], count)) >= 0) {
+            bnum = ii;
+        }
+    }
+
+    // start a new fragment block
+    if (bnum < 0) {
+        bnum = alloc_block();
+        if (bnum < 0) {
+            fprintf(stderr, "ERROR: frag_alloc(%i) -> No blocks left.\n", count);
+            return -1;
+        }
+        index = 0;
+        map = get_frag_map(); // growing the image may have moved it
+    }
+
+    map[bnum] |= frag_mask(index, count);
+    last_block = bnum;
+    printf("DEBUG: frag_alloc(%i) -> block %i, fragment %i\n", count, bnum, index);
+    return bnum * FRAGS_PER_BLOCK + index;
+}
+
+// free a run of fragments, and the fragment block once it is empty
+void frag_free(int addr, int count) {
+    uint8_t *map = get_frag_map();
+    int bnum = addr / FRAGS_PER_BLOCK;
+    uint8_t mask = frag_mask(addr % FRAGS_PER_BLOCK, count);
+    assert((map[bnum] & mask) == mask);
+
+    printf("DEBUG: frag_free(%i, %i) -> Called Function\n", addr, count);
+    map[bnum] &= ~mask;
+    if (!map[bnum]) {
+        free_block(bnum);
+    }
+}
+
+// get a pointer to the start of a fragment
+void *frag_get(int addr) {
+    char *block = blocks_get_block(addr / FRAGS_PER_BLOCK);
+    return block + (addr % FRAGS_PER_BLOCK) * FRAG_SIZE;
+}
+
+// get a pointer to the start of a fragment that is about to be written
+void *frag_write(int addr) {
+    char *block = blocks_write_block(addr / FRAGS_PER_BLOCK);
+    return block + (addr % FRAGS_PER_BLOCK) * FRAG_SIZE;
+}
+
+// count the fragment blocks and the fragments in use
+int frag_count(int *used) {
+    uint8_t *map = get_frag_map();
+    int blocks = 0;
+    *used = 0;
+    for (int ii = 1; ii < blocks_count(); ++ii) {
+        if (map[ii]) {
+            blocks++;
+            for (int jj = 0; jj < FRAGS_PER_BLOCK; ++jj) {
+                *used += (map[ii] >> jj) & 1;
+            }
+        }
+    }
+    return blocks;
+}
@@ -0,0 +1,83 @@
+/**
+ * @file frag.h
+ * @author Alston Liu
+ *
+ * Tail packing for small files.
+ *
+ * The last partial block of a small file can be moved into fragments, 512B
+ * pieces of a shared fragment block, so that many small files fill one
+ * block instead of one block each. Which fragments of a block are in use
+ * is tracked by the fragment map in block 0. A fragment block is freed
+ * once its last fragment is.
+ */
+#ifndef FRAG_H
+#define FRAG_H
+
+#include <stdint.h>
+
+#include "blocks.h"
+
+#define FRAG_SIZE 512
+#define FRAGS_PER_BLOCK (BLOCK_SIZE / FRAG_SIZE)
+
+// only files smaller than this get their tail packed
+#define FRAG_MAX_FILE (4 * BLOCK_SIZE)
+
+/**
+ * Get the number of fragments needed to store the given number of bytes.
+ *
+ * @param bytes Number of bytes.
+ *
+ * @return Number of fragments.
+ */
+int bytes_to_frags(int bytes);
+
+/**
+ * Allocate a run of contiguous fragments inside one fragment block.
+ *
+ * The fragment block the last run came from is tried first, so tails
+ * packed one after another end up next to each other.
+ *
+ * @param count Number of fragments, less than FRAGS_PER_BLOCK.
+ *
+ * @return The fragment address (block * FRAGS_PER_BLOCK + index), or -1
+ *         if the disk is full.
+ */
+int frag_alloc(int count);
+
+/**
+ * Free a run of fragments, and the fragment block once it is empty.
+ *
+ * @param addr Fragment address of the run.
+ * @param count Number of fragments in the run.
+ */
+void frag_free(int addr, int count);
+
+/**
+ * Get a pointer to the start of a fragment.
+ *
+ * @param addr Fragment address.
+ *
+ * @return A pointer into the disk image.
+ */
+void *frag_get(int addr);
+
+/**
+ * Get a pointer to the start of a fragment that is about to be written.
+ *
+ * @param addr Fragment address.
+ *
+ * @return A pointer into the disk image.
+ */
+void *frag_write(int addr);
+
+/**
+ * Count the fragment blocks and the fragments in use.
+ *
+ * @param used Set to the number of fragments in use.
+ *
+ * @return Number of fragment blocks.
+ */
+int frag_count(int *used);
+
+#endif
@@ -1,230 +1,734 @@
-/**
- * @file inode.c
- * @author Alston Liu
- * 
- * Implementation of Inode Data Structure
- */
-#include <assert.h>
-
-#include "inode.h"
-
-// Prints information about the inode
-void print_inode(inode_t *node) {
-    assert(node);
-    printf("Inode Address: %p\n", node);
-    printf("# of refs: %d\n", node->refs);
-    printf("Permission & File Type: %d\n", node->mode);
-    printf("Size: %d\n", node->size);
-    for(int ii = 0; ii < MAX_BLOCKS; ++ii)
-        printf("Block bnum %d: %i\n", ii,(node->block[ii]));
-    printf("Indirect bnum: %d\n", node->indirect);
-}
-
-// gets the inode from the given index number
-// table is from block 
-inode_t *get_inode(int inum) {
-    assert(inum < INODE_LIMIT);
-    inode_t* table = (inode_t *) get_inode_table();
-
-    printf("DEBUG: get_inode(%i) -> %p\n", inum, table+inum);
-    return table + inum;
-}
-
-// creates a new inode and returns the index number of the inode.
-int alloc_inode() {
-    printf("DEBUG: alloc_inode() -> called function!\n");
-    int inum = -1;
-    // find an available inode from the bitmap
-    for(int ii = 0; ii < INODE_LIMIT; ++ii) {
-        if (!bitmap_get(get_inode_bitmap(), ii)) {
-            // set the inode status as used
-            bitmap_put(get_inode_bitmap(), ii, 1);
-            inum = ii;
-            break;
-        }
-    }
-
-    // if theres no more inodes left
-    if(inum == -1) {
-        fprintf(stderr, "ERROR: alloc_inode() -> No more inodes left!\n");
-        return inum;
-    }
-    // Initialize inode information
-    inode_t* new_inode = get_inode(inum);
-    memset(new_inode, 0, sizeof(inode_t)); // clear any previous information
-    new_inode->refs = 1;
-    new_inode->size = 0;
-    new_inode->mode = 0;
-    new_inode->blocks = 0;
-    new_inode->indirect = -1; // nonexistent bnum
-
-    // set time of creation
-    time_t curr = time(NULL);
-    new_inode->ctime = curr;
-    new_inode->atime = curr;
-    new_inode->mtime = curr;
-
-    // set every block bnum to -1
-    for(int ii = 0; ii < MAX_BLOCKS; ++ii) {
-        new_inode->block[ii] = -1; 
-    }
-
-    // set the first block as a new block
-    new_inode->block[0] = alloc_block();
-    
-    // if the block sucessfully allocated the block
-    if(new_inode->block[0] > 0) {
-        new_inode->blocks++;
-    } else {
-        fprintf(stderr, "ERROR: alloc_inode() -> No available blocks to fill.\n");
-        // TODO: make sure to reset this inode
-        return -1;
-    }
-    printf("DEBUG: alloc_inode() -> %d\n", inum);
-
-    // return index number
-    return inum;
-}
-
-// clear inode bitmap at the given inum and clear block location
-void free_inode(int inum) {
-    assert(bitmap_get(get_inode_bitmap(), inum));
-    
-    // clear the block location in the inode
-    inode_t* node = get_inode(inum);
-
-    // Shrink the inode size to 0
-    shrink_inode(node, node->blocks*BLOCK_SIZE);
-
-    // clear the bit at the given index number
-    bitmap_put(get_inode_bitmap(), inum, 0); // set inode bit to free 
-    printf("DEBUG: free_inode(%d)\n", inum);
-}
-
-// grows the inode by the given size in bytes
-int grow_inode(inode_t *node, int size) {
-    assert(node);
-    assert(node->block[0] != -1);
-    assert(size > 0);
-    printf("DEBUG: grow_inode(%i) -> Called Function\n", size);
-
-    // new_size of inodes
-    int new_size = node->blocks * BLOCK_SIZE + size;
-    printf("DEBUG: grow_inode(%i) -> new_size: %i\n", size, new_size);
-
-    // its new size in blocks
-    uint8_t nBlocks = bytes_to_blocks(new_size); 
-    printf("DEBUG: grow_inode(%i) -> New Size in Blocks: %i\n", size, nBlocks);
-
-    // adding to direct pointers
-    if(node->blocks < MAX_BLOCKS) {
-        int allocBlocks;
-        
-        // Case where the new number of blocks is greater than MAX_BLOCKS
-        if(nBlocks >= MAX_BLOCKS) {
-            allocBlocks = MAX_BLOCKS - node->blocks;
-        } else {
-            allocBlocks = nBlocks - node->blocks;
-        }
-        printf("DEBUG: grow_inode(%i) -> # of new blocks: %i\n", size, allocBlocks);
-        // allocate the blocks to the direct pointers
-        for(int ii = 0; ii < allocBlocks; ++ii) {
-            node->block[node->blocks + ii] = alloc_block();
-        }
-        
-        // update the number of blocks in the inode
-        node->blocks += allocBlocks;
-        printf("DEBUG: grow_inode(%i) -> # of blocks in this node: %i\n", size, node->blocks);
-    }
-    
-    // adding to indirect pointers
-    if (node->blocks >= MAX_BLOCKS || nBlocks > MAX_BLOCKS) {
-        // create indirect pointer block if it doesn't exist
-        if(node->indirect == -1) {
-            node->indirect = alloc_block();
-            if(!node->indirect) {
-                node->blocks = nBlocks;
-                return -1; // when fs can't allocate more blocks
-            }
-        }
-
-        // create new blocks to the indirect pointers
-        int* ptr_block = blocks_get_block(node->indirect);
-        int allocBlocks = nBlocks - MAX_BLOCKS;
-        for (int idx = node->blocks - MAX_BLOCKS; idx < allocBlocks; ++idx) {
-            ptr_block[idx] = alloc_block();
-            if(!node->block[idx]) {
-                node->blocks += (idx + 1);
-                return -1; // when fs can't allocate more blocks
-            }
-        }
-    }
-
-    return 0;
-}
-
-// shrinks the inode by the given size in bytes
-int shrink_inode(inode_t *node, int size) {
-    assert(node);
-    assert(size > 0);
-    printf("DEBUG: shrink_inode(%i) -> Called Function\n", size);
-    // new size of inodes
-    int new_size = node->blocks * BLOCK_SIZE - size;
-    new_size = (new_size > 0) ? new_size : 0;
-
-    // new size in blocks
-    uint16_t new_size_blocks = bytes_to_blocks(new_size);
-    printf("DEBUG: shirnk_inode(%i) -> New size in blocks: %i\n", size, new_size_blocks);
-
-    // shrink the indirect pointers
-    int* ptr_block = blocks_get_block(node->indirect);
-    if (node->blocks >= MAX_BLOCKS) {
-        printf("DEBUG: shrink_inode(%i) -> Shrinking indirect pointers.\n", size);
-        assert(node->indirect != -1);
-        int ind_blocks = node->blocks - MAX_BLOCKS;
-        int target = (new_size_blocks > MAX_BLOCKS) ? (new_size_blocks - MAX_BLOCKS) : 0;
-        int* ind_bnums = blocks_get_block(node->indirect);
-        for(int ii = ind_blocks - 1; ii >= target; --ii) {
-            free_block(ind_bnums[ii]);
-        }
-        node->blocks = (new_size_blocks > MAX_BLOCKS) ? new_size_blocks : MAX_BLOCKS;
-    }
-
-    // shrink the direct pointers
-    if (node->blocks < MAX_BLOCKS) {
-        printf("DEBUG: shrink_inode(%i) -> Shrinking direct pointers.\n", size);
-        for(int ii = node->blocks - 1; ii >= node->blocks - new_size_blocks; --ii) {
-            free_block(node->block[ii]);
-            node->block[ii] = -1;
-        }
-        node->blocks = new_size_blocks;
-    }
-
-    assert(node->blocks == new_size_blocks);
-    return 0;
-}
-
-// file block number is the offset in this inode in bytes
-int inode_get_bnum(inode_t *node, int offset) {
-    assert(offset >= 0);
-    printf("DEBUG: inode_get_bnum(%i) -> Called Function\n", offset);
-    int nBlocks = offset / BLOCK_SIZE;
-    if(nBlocks < MAX_BLOCKS) {
-        printf("DEBUG: inode_get_bnum(%i) -> Direct bnum: %i\n", offset, node->block[nBlocks]);
-        return node->block[nBlocks];
-    } else {
-        int *ind_block = blocks_get_block(node->indirect);
-        printf("DEBUG: inode_get_bnum(%i) -> Indirect bnum: %i\n", 
-            offset, ind_block[nBlocks - MAX_BLOCKS]);
-        return ind_block[nBlocks - MAX_BLOCKS];
-    }
-}
-
-// returns the pointer to the block given the block index of the inode
-void *inode_get_block(inode_t *node, int offset) {
-    printf("DEBUG: inode_get_block(%i) -> Called Function\n", offset);
-    void *ptr = blocks_get_block(inode_get_bnum(node, offset * BLOCK_SIZE));
-    printf("DEBUG: inode_get_block(%i) -> %p\n",
-        offset, ptr);
-    return ptr;
-}
+/**
+ * @file inode.c
+ * @author Alston Liu
+ * 
+ * Implementation of Inode Data Structure
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "inode.h"
+#include "delalloc.h"
+#include "prealloc.h"
+#include "frag.h"
+#include "compress.h"
+#include "dedup.h"
+#include "checksum.h"
+#include "snapshot.h"
+
+_Static_assert(FRAGS_PER_BLOCK <= 8, "fragment count must fit in 3 bits");
+
+// inline data runs from block[0] through indirect
+_Static_assert(offsetof(inode_t, indirect) == offsetof(inode_t, block) + MAX_BLOCKS * sizeof(int),
+    "indirect must follow the direct blocks");
+
+// the stat fields fill the first cache line and the block map starts the
+// second, so a chunk holds whole inodes that never straddle a line
+_Static_assert(sizeof(inode_t) == 128, "inodes are two cache lines");
+_Static_assert(offsetof(inode_t, block) == 64, "the block map starts the second line");
+_Static_assert(INODES_PER_CHUNK * sizeof(inode_t) % BLOCK_SIZE == 0,
+    "a chunk is whole blocks");
+
+// an inode of version 1, as images from before INODE_VERSION hold them
+typedef struct inode_v1 {
+  int refs;
+  int mode;
+  int size;
+  int blocks;
+  int block[MAX_BLOCKS];
+  int indirect;
+  int flags;
+  time_t ctime;
+  time_t atime;
+  time_t mtime;
+} inode_v1_t;
+_Static_assert(sizeof(inode_v1_t) == 96, "version 1 inodes are 96 bytes");
+
+// Prints information about the inode
+void print_inode(inode_t *node) {
+    assert(node);
+    printf("Inode Address: %p\n", node);
+    printf("# of refs: %d\n", node->refs);
+    printf("Permission & File Type: %d\n", node->mode);
+    printf("Size: %d\n", node->size);
+    for(int ii = 0; ii < MAX_BLOCKS; ++ii)
+        printf("Block bnum %d: %i\n", ii,(node->block[ii]));
+    printf("Indirect bnum: %d\n", node->indirect);
+    printf("Flags: %#x\n", node->flags);
+    printf("Generation: %u\n", node->gen);
+}
+
+// gets the inode from the given index number: its chunk, then its place
+// in the chunk. NULL if the inode or its indirect block is corrupt
+inode_t *get_inode(int inum) {
+    assert(inum >= 0 && inum < blocks_inode_capacity());
+    inode_t* table = (inode_t *) get_inode_table();
+    if (table) {
+        // a mounted snapshot has its own copy, the indirect block is shared
+        inode_t *node = table + inum;
+        return (checksum_verify_meta(node->indirect) < 0) ? NULL : node;
+    }
+
+    int chunk = ((int32_t *) get_inode_chunks())[inum / INODES_PER_CHUNK];
+    assert(chunk > 0);
+    int offset = (inum % INODES_PER_CHUNK) * INODE_SIZE;
+    inode_t *node = (inode_t *) ((char *) blocks_get_block(chunk) + offset);
+
+    // verified before the caller may write the inode, a corrupt block
+    // would get a checksum of what is in it now
+    int first = chunk + offset / BLOCK_SIZE;
+    int last = chunk + (offset + INODE_SIZE - 1) / BLOCK_SIZE;
+    for (int bnum = first; bnum <= last; ++bnum) {
+        if (checksum_verify_meta(bnum) < 0) {
+            fprintf(stderr, "ERROR: get_inode(%i) -> Inode table block %i is corrupt.\n", inum, bnum);
+            return NULL;
+        }
+    }
+    if (checksum_verify_meta(node->indirect) < 0) {
+        fprintf(stderr, "ERROR: get_inode(%i) -> Indirect block %i is corrupt.\n", inum, node->indirect);
+        return NULL;
+    }
+    for (int bnum = first; bnum <= last; ++bnum) {
+        checksum_dirty(bnum);
+    }
+
+    printf("DEBUG: get_inode(%i) -> %p\n", inum, node);
+    return node;
+}
+
+// gets the index number of the given inode
+int inode_get_inum(inode_t *node) {
+    inode_t* table = (inode_t *) get_inode_table();
+    if (table) {
+        assert(node >= table && node < table + blocks_inode_capacity());
+        return node - table;
+    }
+    int32_t *chunks = get_inode_chunks();
+    for (int ii = 0; ii < blocks_inode_capacity() / INODES_PER_CHUNK; ++ii) {
+        inode_t *first = chunks[ii] ? blocks_get_block(chunks[ii]) : NULL;
+        if (first && node >= first && node < first + INODES_PER_CHUNK) {
+            return ii * INODES_PER_CHUNK + (node - first);
+        }
+    }
+    assert(0 && "not an inode of the table");
+    return -1;
+}
+
+// creates a new inode with the given mode and returns the index number of the inode.
+// regular files start out inline and only get blocks once they outgrow the inode.
+int alloc_inode(int mode) {
+    return alloc_inode_near(0, mode);
+}
+
+// creates a new inode with the given mode, preferring the first free one
+// from goal on in its chunk (such as the inode of the parent directory),
+// then the other chunks, and growing the table only when all are full
+int alloc_inode_near(int goal, int mode) {
+    printf("DEBUG: alloc_inode_near(%d) -> called function!\n", goal);
+    assert(goal >= 0 && goal < blocks_inode_capacity());
+    int32_t *chunks = get_inode_chunks();
+    void *bm = get_inode_bitmap();
+    int home = goal / INODES_PER_CHUNK;
+    int room = blocks_inode_capacity() / INODES_PER_CHUNK; // chunks the index has room for
+    for (int ii = 0; ii < room; ++ii) {
+        int chunk = (home + ii) % room;
+        if (!chunks[chunk]) {
+            continue;
+        }
+        int start = (chunk == home) ? goal % INODES_PER_CHUNK : 0;
+        for (int jj = 0; jj < INODES_PER_CHUNK; ++jj) {
+            int inum = chunk * INODES_PER_CHUNK + (start + jj) % INODES_PER_CHUNK;
+            if (!bitmap_get(bm, inum)) {
+                return alloc_inode_at(inum, mode);
+            }
+        }
+    }
+
+    // every chunk is full: the table grows, and the index with it
+    for (int chunk = 0; chunk < INODE_CHUNK_MAX; ++chunk) {
+        if (chunk >= room || !chunks[chunk]) {
+            return alloc_inode_at(chunk * INODES_PER_CHUNK, mode);
+        }
+    }
+
+    // if theres no more inodes left
+    fprintf(stderr, "ERROR: alloc_inode_near(%d) -> No more inodes left!\n", goal);
+    return -1;
+}
+
+// creates a new inode with the given mode at the given free index number,
+// such as the number an inode has on the image a stream was sent from
+int alloc_inode_at(int inum, int mode) {
+    assert(inum >= 0 && inum < INODE_LIMIT);
+    int chunk = inum / INODES_PER_CHUNK;
+    if ((chunk >= blocks_inode_capacity() / INODES_PER_CHUNK ||
+         !((int32_t *) get_inode_chunks())[chunk]) && blocks_add_inode_chunk(chunk) < 0) {
+        fprintf(stderr, "ERROR: alloc_inode_at(%d) -> No blocks for the inode table.\n", inum);
+        return -1;
+    }
+    assert(!bitmap_get(get_inode_bitmap(), inum));
+    // the other inodes in its block must not be laundered
+    inode_t* new_inode = get_inode(inum);
+    if (!new_inode) {
+        return -1;
+    }
+    // set the inode status as used
+    bitmap_put(get_inode_bitmap(), inum, 1);
+    blocks_count_inodes(-1);
+
+    // Initialize inode information
+    uint32_t gen = new_inode->gen + 1; // tells this file from the last one with the number
+    memset(new_inode, 0, sizeof(inode_t)); // clear any previous information
+    new_inode->gen = gen;
+    new_inode->refs = 1;
+    new_inode->size = 0;
+    new_inode->mode = mode;
+    new_inode->blocks = 0;
+    new_inode->indirect = -1; // nonexistent bnum
+
+    // set time of creation
+    inode_touch(new_inode, INODE_ATIME | INODE_MTIME | INODE_CTIME);
+
+    // set every block bnum to -1
+    for(int ii = 0; ii < MAX_BLOCKS; ++ii) {
+        new_inode->block[ii] = -1; 
+    }
+
+    if (S_ISREG(mode)) {
+        inode_set_inline(new_inode, NULL, 0);
+        printf("DEBUG: alloc_inode() -> %d (inline)\n", inum);
+        return inum;
+    }
+
+    // set the first block as a new block
+    new_inode->block[0] = alloc_block();
+    
+    // if the block sucessfully allocated the block
+    if(new_inode->block[0] > 0) {
+        new_inode->blocks++;
+    } else {
+        fprintf(stderr, "ERROR: alloc_inode() -> No available blocks to fill.\n");
+        bitmap_put(get_inode_bitmap(), inum, 0);
+        blocks_count_inodes(1);
+        return -1;
+    }
+    printf("DEBUG: alloc_inode() -> %d\n", inum);
+
+    // return index number
+    return inum;
+}
+
+// clear inode bitmap at the given inum and clear block location
+void free_inode(int inum) {
+    assert(bitmap_get(get_inode_bitmap(), inum));
+    
+    // clear the block location in the inode; a corrupt one keeps its
+    // blocks for nufs-fsck to sort out
+    inode_t* node = get_inode(inum);
+    if (!node) {
+        return;
+    }
+
+    // appends that never got blocks die with the inode, and so does its window
+    delalloc_drop(inum);
+    prealloc_release(inum);
+    compress_forget(inum);
+
+    // Shrink the inode size to 0
+    if(node->blocks > 0) {
+        shrink_inode(node, node->blocks*BLOCK_SIZE);
+    }
+
+    node->flags = 0;
+
+    // clear the bit at the given index number
+    bitmap_put(get_inode_bitmap(), inum, 0); // set inode bit to free 
+    blocks_count_inodes(1);
+    printf("DEBUG: free_inode(%d)\n", inum);
+}
+
+// stamps the given times (INODE_ATIME, ...) of the inode with the current time
+void inode_touch(inode_t *node, int which) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (which & INODE_ATIME) {
+        node->atime = now.tv_sec;
+        node->atime_ns = now.tv_nsec;
+    }
+    if (which & INODE_MTIME) {
+        node->mtime = now.tv_sec;
+        node->mtime_ns = now.tv_nsec;
+    }
+    if (which & INODE_CTIME) {
+        node->ctime = now.tv_sec;
+        node->ctime_ns = now.tv_nsec;
+    }
+}
+
+// rewrites the first count inodes of a table of version 1 in the current
+// format, in place. The table must have room for them. The last one goes
+// first, as each inode only grows into the room of those after it.
+void inode_upgrade_table(void *table, int count) {
+    for (int ii = count - 1; ii >= 0; --ii) {
+        inode_v1_t old;
+        memcpy(&old, (inode_v1_t *) table + ii, sizeof(old));
+        inode_t *node = (inode_t *) table + ii;
+        memset(node, 0, sizeof(inode_t));
+        node->mode = old.mode;
+        node->refs = old.refs;
+        node->size = old.size;
+        node->blocks = old.blocks;
+        node->flags = old.flags;
+        node->ctime = old.ctime;
+        node->atime = old.atime;
+        node->mtime = old.mtime;
+        memcpy(node->block, old.block, sizeof(old.block)); // inline data too
+        node->indirect = old.indirect;
+    }
+}
+
+// rewrites the inodes of an image made before INODE_VERSION: the tables of
+// the snapshots first, as they may need more blocks, then the chunks, which
+// stay as large as they were
+int inode_upgrade() {
+    if (snapshot_upgrade_tables() < 0) {
+        fprintf(stderr, "ERROR: inode_upgrade() -> No room for the snapshot tables.\n");
+        return -1;
+    }
+    int32_t *chunks = get_inode_chunks();
+    uint8_t *stale = get_checksum_stale();
+    for (int ii = 0; ii < blocks_inode_capacity() / INODES_PER_CHUNK; ++ii) {
+        if (!chunks[ii]) {
+            continue;
+        }
+        inode_upgrade_table(blocks_get_block(chunks[ii]), INODES_PER_CHUNK);
+        // checksums are not loaded yet: mark the blocks for the first seal
+        for (int jj = 0; jj < (int) INODE_CHUNK_BLOCKS; ++jj) {
+            bitmap_put(stale, chunks[ii] + jj, 1);
+        }
+    }
+    printf("DEBUG: inode_upgrade() -> Inodes are version %d\n", INODE_VERSION);
+    return 0;
+}
+
+// gets the raw block map entry (including flags) of the given block index,
+// or -EIO if it is in a corrupt indirect block
+int inode_get_entry(inode_t *node, int file_bnum) {
+    if (file_bnum >= node->blocks) {
+        return BNUM_HOLE; // past the end of the block map
+    } else if (file_bnum < MAX_BLOCKS) {
+        return node->block[file_bnum];
+    } else if (checksum_verify_meta(node->indirect) < 0) {
+        return -EIO; // get_inode checks it, but not for every caller's table
+    } else {
+        int *ind_block = blocks_get_block(node->indirect);
+        return ind_block[file_bnum - MAX_BLOCKS];
+    }
+}
+
+// gets the disk block behind a block map entry (the fragment block for a
+// packed tail), or -1 for a hole
+int inode_entry_block(int entry) {
+    if (entry < 0) {
+        return -1;
+    } else if (entry & BNUM_FRAG) {
+        return FRAG_ENTRY_ADDR(entry) / FRAGS_PER_BLOCK;
+    }
+    return entry & ~(BNUM_UNWRITTEN | BNUM_COMPR);
+}
+
+// sets the block number of the given block index of the inode
+void inode_set_bnum(inode_t *node, int file_bnum, int bnum) {
+    if (file_bnum < MAX_BLOCKS) {
+        node->block[file_bnum] = bnum;
+    } else {
+        assert(node->indirect != -1);
+        int *ind_block = blocks_write_block(node->indirect);
+        ind_block[file_bnum - MAX_BLOCKS] = bnum;
+    }
+}
+
+// grows the inode by the given size in bytes
+int grow_inode(inode_t *node, int size) {
+    assert(node);
+    assert(size > 0);
+    printf("DEBUG: grow_inode(%i) -> Called Function\n", size);
+
+    // its new size in blocks
+    int nBlocks = bytes_to_blocks(node->blocks * BLOCK_SIZE + size);
+    printf("DEBUG: grow_inode(%i) -> New Size in Blocks: %i\n", size, nBlocks);
+    if (nBlocks > MAX_BLOCKS + INDIRECT_COUNT) {
+        fprintf(stderr, "ERROR: grow_inode(%i) -> Exceeds max file size.\n", size);
+        return -1;
+    }
+
+    // the indirect block comes first so that it does not split the data run
+    if (nBlocks > MAX_BLOCKS && node->indirect == -1) {
+        node->indirect = alloc_block();
+        if (node->indirect < 0) {
+            return -1; // when fs can't allocate more blocks
+        }
+    }
+
+    // take the new blocks in as few contiguous runs as possible, right
+    // behind the end of the file
+    while (node->blocks < nBlocks) {
+        int got;
+        int start = prealloc_alloc(node, nBlocks - node->blocks, &got);
+        if (start < 0) {
+            // the blocks allocated so far stay with the inode
+            return -1; // when fs can't allocate more blocks
+        }
+        for (int ii = 0; ii < got; ++ii) {
+            inode_set_bnum(node, node->blocks, start + ii);
+            node->blocks++;
+        }
+    }
+    printf("DEBUG: grow_inode(%i) -> # of blocks in this node: %i\n", size, node->blocks);
+
+    return 0;
+}
+
+// shrinks the inode by the given size in bytes
+int shrink_inode(inode_t *node, int size) {
+    assert(node);
+    assert(size > 0);
+    printf("DEBUG: shrink_inode(%i) -> Called Function\n", size);
+    // new size of inodes
+    int new_size = node->blocks * BLOCK_SIZE - size;
+    new_size = (new_size > 0) ? new_size : 0;
+
+    // new size in blocks
+    int new_size_blocks = bytes_to_blocks(new_size);
+    printf("DEBUG: shrink_inode(%i) -> New size in blocks: %i\n", size, new_size_blocks);
+
+    // free blocks from the end of the file, skipping holes
+    while (node->blocks > new_size_blocks) {
+        int last = node->blocks - 1;
+        int entry = inode_get_entry(node, last);
+        if (entry >= 0 && (entry & BNUM_FRAG)) {
+            frag_free(FRAG_ENTRY_ADDR(entry), FRAG_ENTRY_COUNT(entry));
+        } else if (entry >= 0) {
+            free_block(entry & ~(BNUM_UNWRITTEN | BNUM_COMPR));
+        }
+        inode_set_bnum(node, last, BNUM_HOLE);
+        node->blocks--;
+    }
+
+    // the indirect block goes once nothing points through it
+    if (node->blocks <= MAX_BLOCKS && node->indirect != -1) {
+        printf("DEBUG: shrink_inode(%i) -> Freeing indirect block.\n", size);
+        free_block(node->indirect);
+        node->indirect = -1;
+    }
+
+    assert(node->blocks == new_size_blocks);
+    return 0;
+}
+
+// extends the block map of the inode with holes up to nBlocks blocks
+int inode_extend(inode_t *node, int nBlocks) {
+    printf("DEBUG: inode_extend(%i) -> Called Function\n", nBlocks);
+    if (nBlocks > MAX_BLOCKS + INDIRECT_COUNT) {
+        fprintf(stderr, "ERROR: inode_extend(%i) -> Exceeds max file size.\n", nBlocks);
+        return -1;
+    }
+    if (nBlocks > MAX_BLOCKS && node->indirect == -1) {
+        node->indirect = alloc_block();
+        if (node->indirect < 0) {
+            return -1; // when fs can't allocate more blocks
+        }
+    }
+    while (node->blocks < nBlocks) {
+        inode_set_bnum(node, node->blocks, BNUM_HOLE);
+        node->blocks++;
+    }
+    return 0;
+}
+
+// file block number is the offset in this inode in bytes.
+// packed tails and compressed clusters have no block of their own and map
+// to BNUM_HOLE, see inode_tail_ptr and compress_read. -EIO if the entry is
+// in a corrupt indirect block
+int inode_get_bnum(inode_t *node, int offset) {
+    assert(offset >= 0);
+    printf("DEBUG: inode_get_bnum(%i) -> Called Function\n", offset);
+    int entry = inode_get_entry(node, offset / BLOCK_SIZE);
+    printf("DEBUG: inode_get_bnum(%i) -> bnum: %i\n", offset, entry);
+    if (entry == -EIO) {
+        return -EIO;
+    }
+    return (entry < 0 || (entry & (BNUM_FRAG | BNUM_COMPR))) ? BNUM_HOLE : (entry & ~BNUM_UNWRITTEN);
+}
+
+// whether the block at this offset is allocated but was never written
+int inode_is_unwritten(inode_t *node, int offset) {
+    int entry = inode_get_entry(node, offset / BLOCK_SIZE);
+    return entry >= 0 && (entry & BNUM_UNWRITTEN);
+}
+
+// takes a free block for the given block index, right after the block
+// before it if possible
+static int inode_take_block(inode_t *node, int file_bnum) {
+    int prev = (file_bnum > 0) ? inode_get_bnum(node, (file_bnum - 1) * BLOCK_SIZE) : -1;
+    int len;
+    int bnum = blocks_find_run(prev + 1, 1, &len);
+    if (bnum >= 0) {
+        blocks_take(bnum, 1);
+    }
+    return bnum;
+}
+
+// gets the block at this offset ready to be written: holes get a block,
+// shared blocks get copied and unwritten blocks get zeroed, so the bytes
+// around the write read as before
+int inode_write_bnum(inode_t *node, int offset) {
+    int file_bnum = offset / BLOCK_SIZE;
+    assert(file_bnum < node->blocks);
+    int entry = inode_get_entry(node, file_bnum);
+    assert(entry < 0 || !(entry & (BNUM_FRAG | BNUM_COMPR)));
+
+    if (entry < 0) {
+        entry = inode_take_block(node, file_bnum);
+        if (entry < 0) {
+            fprintf(stderr, "ERROR: inode_write_bnum(%i) -> No blocks left.\n", offset);
+            return -1;
+        }
+        entry |= BNUM_UNWRITTEN;
+    } else if (blocks_refs(entry & ~BNUM_UNWRITTEN) > 0) {
+        // copy on write: the other files keep the shared block
+        int shared = entry & ~BNUM_UNWRITTEN;
+        int copy = inode_take_block(node, file_bnum);
+        if (copy < 0) {
+            fprintf(stderr, "ERROR: inode_write_bnum(%i) -> No blocks left to copy into.\n", offset);
+            return -1;
+        }
+        if (!(entry & BNUM_UNWRITTEN)) {
+            memcpy(blocks_write_block(copy), blocks_get_block(shared), BLOCK_SIZE);
+        }
+        free_block(shared);
+        entry = copy | (entry & BNUM_UNWRITTEN);
+        inode_set_bnum(node, file_bnum, entry);
+        dedup_count_cow();
+    }
+    if (entry & BNUM_UNWRITTEN) {
+        entry &= ~BNUM_UNWRITTEN;
+        memset(blocks_write_block(entry), 0, BLOCK_SIZE);
+        inode_set_bnum(node, file_bnum, entry);
+    }
+    return entry;
+}
+
+// allocates blocks for the holes in [first, first + count) of the block map
+// without writing them; they read as zeros until written
+int inode_alloc_range(inode_t *node, int first, int count) {
+    printf("DEBUG: inode_alloc_range(%i, %i) -> Called Function\n", first, count);
+    assert(first + count <= node->blocks);
+    int ii = first;
+    while (ii < first + count) {
+        if (inode_get_entry(node, ii) >= 0) {
+            ++ii;
+            continue;
+        }
+
+        // measure the hole and fill it with as few runs as possible
+        int hole = 1;
+        while (ii + hole < first + count && inode_get_entry(node, ii + hole) < 0) {
+            hole++;
+        }
+        int prev = (ii > 0) ? inode_get_bnum(node, (ii - 1) * BLOCK_SIZE) : -1;
+        int len;
+        int start = blocks_find_run(prev + 1, hole, &len);
+        if (start < 0) {
+            fprintf(stderr, "ERROR: inode_alloc_range(%i, %i) -> No blocks left.\n", first, count);
+            return -1;
+        }
+        blocks_take(start, len);
+        for (int jj = 0; jj < len; ++jj) {
+            inode_set_bnum(node, ii + jj, (start + jj) | BNUM_UNWRITTEN);
+        }
+        ii += len;
+    }
+    return 0;
+}
+
+// frees the blocks in [first, first + count) of the block map, leaving holes
+void inode_punch(inode_t *node, int first, int count) {
+    printf("DEBUG: inode_punch(%i, %i) -> Called Function\n", first, count);
+    for (int ii = first; ii < first + count && ii < node->blocks; ++ii) {
+        int bnum = inode_get_bnum(node, ii * BLOCK_SIZE);
+        if (bnum >= 0) {
+            free_block(bnum);
+            inode_set_bnum(node, ii, BNUM_HOLE);
+        }
+    }
+}
+
+// marks the allocated blocks in [first, first + count) as unwritten, so they
+// read as zeros without touching their data
+void inode_mark_unwritten(inode_t *node, int first, int count) {
+    for (int ii = first; ii < first + count && ii < node->blocks; ++ii) {
+        int entry = inode_get_entry(node, ii);
+        if (entry >= 0 && !(entry & (BNUM_FRAG | BNUM_COMPR))) {
+            inode_set_bnum(node, ii, entry | BNUM_UNWRITTEN);
+        }
+    }
+}
+
+// counts the runs of physically contiguous blocks the inode is stored in
+int inode_extents(inode_t *node) {
+    int extents = 0;
+    int prev = -2;
+    for (int ii = 0; ii < node->blocks; ++ii) {
+        int bnum = inode_get_bnum(node, ii * BLOCK_SIZE);
+        if (bnum >= 0 && bnum != prev + 1) {
+            extents++;
+        }
+        prev = bnum;
+    }
+    return extents;
+}
+
+// returns the pointer to the block given the block index of the inode, or
+// NULL if the block is corrupt
+void *inode_get_block(inode_t *node, int offset) {
+    printf("DEBUG: inode_get_block(%i) -> Called Function\n", offset);
+    int bnum = inode_get_bnum(node, offset * BLOCK_SIZE);
+    if (bnum < 0 || checksum_verify_meta(bnum) < 0) {
+        return NULL;
+    }
+    void *ptr = blocks_get_block(bnum);
+    printf("DEBUG: inode_get_block(%i) -> %p\n",
+        offset, ptr);
+    return ptr;
+}
+
+// returns a pointer to a block of the inode that is about to be written;
+// blocks shared with a snapshot or another file are copied first. NULL if
+// the block is corrupt, it would get a checksum of what is in it now
+void *inode_write_block(inode_t *node, int file_bnum) {
+    int old = inode_get_bnum(node, file_bnum * BLOCK_SIZE);
+    if (old == -EIO || checksum_verify_meta(old) < 0) {
+        return NULL;
+    }
+    int bnum = inode_write_bnum(node, file_bnum * BLOCK_SIZE);
+    return (bnum < 0) ? NULL : blocks_write_block(bnum);
+}
+
+// returns the end of the bytes a packed tail has room for, or -1 if the
+// last block of the inode is not packed
+int inode_tail_end(inode_t *node) {
+    if (node->blocks == 0) {
+        return -1;
+    }
+    int entry = inode_get_entry(node, node->blocks - 1);
+    if (entry < 0 || !(entry & BNUM_FRAG)) {
+        return -1;
+    }
+    return (node->blocks - 1) * BLOCK_SIZE + FRAG_ENTRY_COUNT(entry) * FRAG_SIZE;
+}
+
+// returns a pointer to the byte at this offset if it sits in a packed tail
+char *inode_tail_ptr(inode_t *node, int offset) {
+    int entry = inode_get_entry(node, offset / BLOCK_SIZE);
+    if (entry < 0 || !(entry & BNUM_FRAG)) {
+        return NULL;
+    }
+    assert(offset < inode_tail_end(node));
+    return (char *) frag_get(FRAG_ENTRY_ADDR(entry)) + offset % BLOCK_SIZE;
+}
+
+// returns a pointer to the byte at this offset of a packed tail that is
+// about to be written, or NULL if it is not in one
+char *inode_write_tail_ptr(inode_t *node, int offset) {
+    int entry = inode_get_entry(node, offset / BLOCK_SIZE);
+    if (entry < 0 || !(entry & BNUM_FRAG)) {
+        return NULL;
+    }
+    assert(offset < inode_tail_end(node));
+    return (char *) frag_write(FRAG_ENTRY_ADDR(entry)) + offset % BLOCK_SIZE;
+}
+
+// moves the partial last block of a small file into fragments and frees the
+// block. Returns 1 if the tail got packed, 0 if the file does not qualify
+int inode_pack_tail(inode_t *node) {
+    int tail = node->size % BLOCK_SIZE;
+    if (!S_ISREG(node->mode) || (node->flags & INODE_INLINE) || tail == 0 ||
+        node->size >= FRAG_MAX_FILE || node->blocks != bytes_to_blocks(node->size)) {
+        return 0;
+    }
+    int last = node->blocks - 1;
+    int entry = inode_get_entry(node, last);
+    int count = bytes_to_frags(tail);
+    if (entry < 0 || (entry & (BNUM_FRAG | BNUM_UNWRITTEN | BNUM_COMPR)) || count >= FRAGS_PER_BLOCK) {
+        return 0;
+    }
+
+    int addr = frag_alloc(count);
+    if (addr < 0) {
+        return 0; // the tail just stays in its block
+    }
+    printf("DEBUG: inode_pack_tail() -> Packing %i bytes into %i fragments\n", tail, count);
+    char *frag = frag_write(addr);
+    memcpy(frag, blocks_get_block(entry), tail);
+    memset(frag + tail, 0, count * FRAG_SIZE - tail);
+    free_block(entry);
+    inode_set_bnum(node, last, FRAG_ENTRY(addr, count));
+    return 1;
+}
+
+// moves a packed tail back into a block of its own
+int inode_unpack_tail(inode_t *node) {
+    if (inode_tail_end(node) < 0) {
+        return 0;
+    }
+    int last = node->blocks - 1;
+    int entry = inode_get_entry(node, last);
+
+    int bnum = inode_take_block(node, last);
+    if (bnum < 0) {
+        fprintf(stderr, "ERROR: inode_unpack_tail() -> No blocks left.\n");
+        return -1;
+    }
+
+    printf("DEBUG: inode_unpack_tail() -> Moving tail into block %i\n", bnum);
+    char *block = blocks_write_block(bnum);
+    int bytes = FRAG_ENTRY_COUNT(entry) * FRAG_SIZE;
+    memcpy(block, frag_get(FRAG_ENTRY_ADDR(entry)), bytes);
+    memset(block + bytes, 0, BLOCK_SIZE - bytes);
+    frag_free(FRAG_ENTRY_ADDR(entry), FRAG_ENTRY_COUNT(entry));
+    inode_set_bnum(node, last, bnum);
+    return 0;
+}
+
+// returns the data of an inline inode
+char *inode_inline_data(inode_t *node) {
+    assert(node->flags & INODE_INLINE);
+    return (char *) node->block;
+}
+
+// stores the data inline in the inode; the inode must not hold any blocks.
+// bytes past the data are kept zeroed so that growing the file reads zeros
+void inode_set_inline(inode_t *node, const char *data, int size) {
+    assert((node->flags & INODE_INLINE) || (node->blocks == 0 && node->indirect == -1));
+    assert(size <= INLINE_MAX);
+    printf("DEBUG: inode_set_inline(%i) -> Called Function\n", size);
+    memset(node->block, 0, INLINE_MAX);
+    if (size > 0) {
+        memcpy(node->block, data, size);
+    }
+    node->flags |= INODE_INLINE;
+}
+
+// empties the block map of an inline inode so it can hold blocks again
+void inode_clear_inline(inode_t *node) {
+    assert(node->flags & INODE_INLINE);
+    printf("DEBUG: inode_clear_inline() -> Called Function\n");
+    node->flags &= ~INODE_INLINE;
+    for (int ii = 0; ii < MAX_BLOCKS; ++ii) {
+        node->block[ii] = BNUM_HOLE;
+    }
+    node->indirect = -1;
+}
@@ -1,45 +1,108 @@
-// Inode manipulation routines.
-//
-// Feel free to use as inspiration. Provided as-is.
-
-// based on cs3650 starter code
-#ifndef INODE_H
-#define INODE_H
-
-// Required Libraries
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <string.h>
-#include <time.h>
-
-#include "blocks.h"
-#include "bitmap.h"
-
-// Global Variables
-#define INODE_SIZE sizeof(inode_t)
-#define MAX_BLOCKS 12 // max number of blocks (Max file size = 48KB)
-
-// inode structure
-typedef struct inode {
-  int refs;  // reference count (4B)
-  int mode;  // permission & type (4B)
-  int size;  // bytes contained (4B)
-  int blocks; // blocks allocated (4B)
-  int block[MAX_BLOCKS]; // 12 direct block number (if max file size <= 48KB)
-  int indirect; // single indirect block when file size >= 48KB
-  time_t ctime; // when the file was created
-  time_t atime; // when the file was last accessed
-  time_t mtime; // when the file was last modified
-} inode_t;
-
-void print_inode(inode_t *node);
-inode_t *get_inode(int inum);
-int alloc_inode();
-void free_inode(int inum);
-int grow_inode(inode_t *node, int size);
-int shrink_inode(inode_t *node, int size);
-int inode_get_bnum(inode_t *node, int offset);
-void *inode_get_block(inode_t *node, int file_bnum);
-
+// Inode manipulation routines.
+//
+// Feel free to use as inspiration. Provided as-is.
+
+// based on cs3650 starter code
+#ifndef INODE_H
+#define INODE_H
+
+// Required Libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "blocks.h"
+#include "bitmap.h"
+
+// Global Variables
+#define INODE_SIZE sizeof(inode_t)
+#define INODE_CHUNK_BLOCKS ((INODES_PER_CHUNK * INODE_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define MAX_BLOCKS 12 // max number of blocks (Max file size = 48KB)
+#define INDIRECT_COUNT (BLOCK_SIZE / sizeof(int)) // block numbers in the indirect block
+
+// block map entries
+#define BNUM_HOLE -1              // no block behind this part of the file
+#define BNUM_UNWRITTEN (1 << 30)  // flag: allocated, reads as zeros until written
+#define BNUM_FRAG (1 << 29)       // flag: packed tail, (fragment address << 3) | fragments
+#define BNUM_COMPR (1 << 28)      // flag: holds compressed data of its cluster
+
+// a packed tail entry holds the fragment address and the number of fragments
+#define FRAG_ENTRY(addr, count) (BNUM_FRAG | ((addr) << 3) | (count))
+#define FRAG_ENTRY_ADDR(entry) (((entry) & ~BNUM_FRAG) >> 3)
+#define FRAG_ENTRY_COUNT(entry) ((entry) & 7)
+
+// inode flags
+#define INODE_INLINE 0x1 // file data is stored in the block map itself
+#define INODE_COMPR 0x2  // file data is compressed; directories pass it on
+#define INODE_ORPHAN 0x4 // unlinked, on the orphan list until its blocks are freed
+#define INLINE_MAX ((MAX_BLOCKS + 1) * (int) sizeof(int)) // bytes that fit in block[] and indirect
+
+// version of the inode format, kept in block 0. Images from before the
+// inodes had a version read 0 and hold the 96 byte inodes of version 1.
+#define INODE_VERSION 2
+
+// what inode_touch stamps with the current time
+#define INODE_ATIME 0x1
+#define INODE_MTIME 0x2
+#define INODE_CTIME 0x4
+
+// inode structure: 128 bytes, two cache lines of a chunk. The first line
+// holds everything stat reads, the second the block map, which only reads
+// and writes of the data need.
+typedef struct inode {
+  int mode;  // permission & type (4B)
+  int refs;  // reference count (4B)
+  int size;  // bytes contained (4B)
+  int blocks; // blocks allocated (4B)
+  int flags; // INODE_* flags (4B)
+  uint32_t gen; // generation, goes up each time the inode number is reused (4B)
+  int64_t ctime; // when the file was created (8B)
+  int64_t atime; // when the file was last accessed (8B)
+  int64_t mtime; // when the file was last modified (8B)
+  int32_t ctime_ns; // nanoseconds of the times (4B each)
+  int32_t atime_ns;
+  int32_t mtime_ns;
+  int32_t orphan_next; // next inode on the orphan list, 0 at the end (4B)
+
+  int block[MAX_BLOCKS]; // 12 direct block number (if max file size <= 48KB)
+  int indirect; // single indirect block when file size >= 48KB
+  int32_t reserved[3]; // reserved for later versions, zero (12B)
+} inode_t;
+
+void print_inode(inode_t *node);
+inode_t *get_inode(int inum);
+int inode_get_inum(inode_t *node);
+int alloc_inode(int mode);
+int alloc_inode_near(int goal, int mode);
+int alloc_inode_at(int inum, int mode);
+void free_inode(int inum);
+void inode_touch(inode_t *node, int which);
+void inode_upgrade_table(void *table, int count);
+int inode_upgrade();
+int grow_inode(inode_t *node, int size);
+int shrink_inode(inode_t *node, int size);
+int inode_extend(inode_t *node, int nBlocks);
+int inode_get_entry(inode_t *node, int file_bnum);
+int inode_entry_block(int entry);
+void inode_set_bnum(inode_t *node, int file_bnum, int bnum);
+int inode_get_bnum(inode_t *node, int offset);
+int inode_is_unwritten(inode_t *node, int offset);
+int inode_write_bnum(inode_t *node, int offset);
+int inode_alloc_range(inode_t *node, int first, int count);
+void inode_punch(inode_t *node, int first, int count);
+void inode_mark_unwritten(inode_t *node, int first, int count);
+void *inode_get_block(inode_t *node, int file_bnum);
+void *inode_write_block(inode_t *node, int file_bnum);
+int inode_tail_end(inode_t *node);
+char *inode_tail_ptr(inode_t *node, int offset);
+char *inode_write_tail_ptr(inode_t *node, int offset);
+int inode_pack_tail(inode_t *node);
+int inode_unpack_tail(inode_t *node);
+char *inode_inline_data(inode_t *node);
+void inode_set_inline(inode_t *node, const char *data, int size);
+void inode_clear_inline(inode_t *node);
+int inode_extents(inode_t *node);
+
 #endif
\ No newline at end of file
@@ -1,253 +1,627 @@
-#include <assert.h>
-#include <bsd/string.h>
-#include <dirent.h>
-#include <errno.h>
-#include <stdio.h>
-#include <string.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <unistd.h>
-
-#define FUSE_USE_VERSION 26
-#include <fuse.h>
-#include "directory.h"
-#include "storage.h"
-
-// implementation for: man 2 access
-// Checks if a file exists.
-int nufs_access(const char *path, int mask) {
-  int rv = storage_access(path);
-  if(rv < 0) {
-    fprintf(stderr, "ERROR: nufs_access(%s, %04o) -> %d\n", path, mask, rv);
-    return -ENOENT;
-  }
-  printf("DEBUG: nufs_access(%s, %04o) -> %d\n", path, mask, rv);
-  return rv;
-}
-
-// Gets an object's attributes (type, permissions, size, etc).
-// Implementation for: man 2 stat
-// This is a crucial function.
-int nufs_getattr(const char *path, struct stat *st) {
-  printf("DEBUG: nufs_getattr(%s) -> Function called\n", path);
-  int rv = storage_stat(path, st);
-  if (rv < 0) {
-    fprintf(stderr, "ERROR: nufs_getattr(%s) -> (%i)\n", path, rv);
-    return -ENOENT;
-  } else {
-    printf("DEBUG: getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", 
-      path, rv, st->st_mode, st->st_size);
-    return rv;
-  }
-}
-
-// implementation for: man 2 readdir
-// lists the contents of a directory
-int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                 off_t offset, struct fuse_file_info *fi) {
-  struct stat st;
-  int rv;
-
-  printf("DEBUG: nufs_readdir(%s, %p, %ld) -> Called Function\n",
-    path, buf, offset);
-  // get the inode number from the path
-  int inum = path_lookup(path);
-  if(inum < 0) {
-      fprintf(stderr, "ERROR: nufs_readdir(%s, %p, %ld) -> Cannot get inode from path!\n",
-      path, buf, offset);
-      return -ENOENT;
-  }
-
-  // get the inode from the path
-  inode_t* node = get_inode(inum);
-  // make sure this inode is a directory inode
-  assert(S_ISDIR(node->mode));
-  print_inode(node);
-  print_directory(node);
-
-  // self reference to the current directory
-  rv = nufs_getattr(path, &st);
-  assert(!rv);
-  filler(buf, ".", &st, 0);
-
-  // get parent directory
-  char *parent = (char *) malloc(strlen(path) + 10);
-  get_parent(path, parent);
-
-  // if the directory has no parent directory(root)
-  if(strcmp(parent, "")) {
-    rv = nufs_getattr(parent, &st);
-    assert(!rv);
-    filler(buf, "..", &st, 0);
-  } else {
-    // root self references since it's the parent
-    filler(buf, "..", &st, 0);
-  }
-
-  // if the directory has entries beside the parent and self-ref
-  if(node->refs > 2) {
-    // get the entries in this directory
-    dirent_t* entries = inode_get_block(node, 0);
-
-    // go through each entry
-    for(int ii = 2; ii < node->refs; ++ii) {
-      dirent_t entry = entries[ii];
-      printf("DEBUG: nufs_readdir() -> Entry name: %s\n", entry.name);
-      printf("DEBUG: nufs_readdir() -> Path: %s\n", path);
-      char *child = strdup(entry.name);
-      char *child_path = (char *) malloc(DIR_NAME_LENGTH + strlen(path) + 1);
-      // clear the allocated memory
-      memset(child_path, 0, DIR_NAME_LENGTH + strlen(path) + 1);
-      if (strcmp(path, "/")) {
-        printf("DEBUG: nufs_readdir() -> adding slash to child path\n");
-        strcat(child_path, path);
-        strcat(child_path, "/");
-        strcat(child_path, child);
-      } else {
-        printf("DEBUG: nufs_readdir() -> directory is root\n");
-        strcat(child_path, "/");
-        strcat(child_path, child);
-      }
-      printf("DEBUG: nufs_readdir(%s, %p, %ld) -> Child Path: %s\n", 
-        path, buf, offset, child_path);
-      
-      // get attributes of this child
-      rv = nufs_getattr(child_path, &st);
-      assert(!rv);
-
-      filler(buf, child, &st, 0);
-      free(child_path);
-    }
-  }
-
-  return rv;
-}
-
-// mknod makes a filesystem object like a file or directory
-// called for: man 2 open, man 2 link
-// Note, for this assignment, you can alternatively implement the create
-// function.
-int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
-  printf("DEBUG: nufs_mknod(%s, %04o) -> Function called.\n", path, mode);
-  int rv = storage_mknod(path, mode);
-  printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
-  return rv;
-}
-
-// most of the following callbacks implement
-// another system call; see section 2 of the manual
-int nufs_mkdir(const char *path, mode_t mode) {
-  int rv = nufs_mknod(path, mode | 040000, 0);
-  printf("mkdir(%s) -> %d\n", path, rv);
-  return rv;
-}
-
-int nufs_unlink(const char *path) {
-  int rv = storage_unlink(path);
-  printf("unlink(%s) -> %d\n", path, rv);
-  return rv;
-}
-
-int nufs_link(const char *from, const char *to) {
-  int rv = storage_link(from, to);
-  printf("link(%s => %s) -> %d\n", from, to, rv);
-  return rv;
-}
-
-int nufs_rmdir(const char *path) {
-  int rv = nufs_unlink(path);
-  printf("rmdir(%s) -> %d\n", path, rv);
-  return rv;
-}
-
-// implements: man 2 rename
-// called to move a file within the same filesystem
-int nufs_rename(const char *from, const char *to) {
-  int rv = storage_rename(from,to);
-  printf("rename(%s => %s) -> %d\n", from, to, rv);
-  return rv;
-}
-
-int nufs_chmod(const char *path, mode_t mode) {
-  int rv = -1;
-  printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
-  return rv;
-}
-
-int nufs_truncate(const char *path, off_t size) {
-  int rv = storage_truncate(path, size);
-  printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
-  return rv;
-}
-
-// This is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
-// You can just check whether the file is accessible.
-int nufs_open(const char *path, struct fuse_file_info *fi) {
-  int rv = nufs_access(path, 0);
-  printf("open(%s) -> %d\n", path, rv);
-  return rv;
-}
-
-// Actually read data
-int nufs_read(const char *path, char *buf, size_t size, off_t offset,
-              struct fuse_file_info *fi) {
-  int rv = storage_read(path, buf, size, offset);
-  printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
-  return rv;
-}
-
-// Actually write data
-int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
-               struct fuse_file_info *fi) {
-  int rv = storage_write(path, buf, size, offset);
-  printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
-  return rv;
-}
-
-// Update the timestamps on a file or directory.
-int nufs_utimens(const char *path, const struct timespec ts[2]) {
-  int rv = storage_set_time(path, ts);
-  printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n", path, ts[0].tv_sec,
-         ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
-  return rv;
-}
-
-// Extended operations
-int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
-               unsigned int flags, void *data) {
-  int rv = -1;
-  printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
-  return rv;
-}
-
-void nufs_init_ops(struct fuse_operations *ops) {
-  memset(ops, 0, sizeof(struct fuse_operations));
-  ops->access = nufs_access;
-  ops->getattr = nufs_getattr;
-  ops->readdir = nufs_readdir;
-  ops->mknod = nufs_mknod;
-  // ops->create   = nufs_create; // alternative to mknod
-  ops->mkdir = nufs_mkdir;
-  ops->link = nufs_link;
-  ops->unlink = nufs_unlink;
-  ops->rmdir = nufs_rmdir;
-  ops->rename = nufs_rename;
-  ops->chmod = nufs_chmod;
-  ops->truncate = nufs_truncate;
-  ops->open = nufs_open;
-  ops->read = nufs_read;
-  ops->write = nufs_write;
-  ops->utimens = nufs_utimens;
-  ops->ioctl = nufs_ioctl;
-};
-
-struct fuse_operations nufs_ops;
-
-int main(int argc, char *argv[]) {
-  assert(argc > 2 && argc < 6);
-  storage_init(argv[--argc]);
-  nufs_init_ops(&nufs_ops);
-  return fuse_main(argc, argv, &nufs_ops, NULL);
-}
+#include <assert.h>
+#include <bsd/string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <linux/falloc.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+#include "directory.h"
+#include "storage.h"
+
+// Every callback holds the storage lock while it works, which keeps it
+// apart from the thread that gives back the blocks of deleted snapshots.
+
+// The error for a failed storage call: -EIO if metadata it went through
+// failed its checksum, err otherwise. Called before the lock is dropped.
+static int nufs_error(int err) {
+  return checksum_failed() ? -EIO : err;
+}
+
+// implementation for: man 2 access
+// Checks if a file exists.
+int nufs_access(const char *path, int mask) {
+  storage_lock();
+  int rv = storage_access(path);
+  if(rv < 0) {
+    fprintf(stderr, "ERROR: nufs_access(%s, %04o) -> %d\n", path, mask, rv);
+    rv = nufs_error(-ENOENT);
+    storage_unlock();
+    return rv;
+  }
+  printf("DEBUG: nufs_access(%s, %04o) -> %d\n", path, mask, rv);
+  storage_unlock();
+  return rv;
+}
+
+// Gets an object's attributes (type, permissions, size, etc).
+// Implementation for: man 2 stat
+// This is a crucial function.
+int nufs_getattr(const char *path, struct stat *st) {
+  storage_lock();
+  printf("DEBUG: nufs_getattr(%s) -> Function called\n", path);
+  int rv = storage_stat(path, st);
+  if (rv < 0) {
+    fprintf(stderr, "ERROR: nufs_getattr(%s) -> (%i)\n", path, rv);
+    rv = nufs_error(-ENOENT);
+    storage_unlock();
+    return rv;
+  } else {
+    printf("DEBUG: getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", 
+      path, rv, st->st_mode, st->st_size);
+    storage_unlock();
+    return rv;
+  }
+}
+
+// implementation for: man 2 statfs
+// answered from the free space counters, without the lock
+int nufs_statfs(const char *path, struct statvfs *st) {
+  storage_statfs(st);
+  printf("statfs(%s) -> {free blocks: %ld, free inodes: %ld}\n",
+    path, (long) st->f_bfree, (long) st->f_ffree);
+  return 0;
+}
+
+// implementation for: man 2 readdir
+// lists the contents of a directory
+int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                 off_t offset, struct fuse_file_info *fi) {
+  storage_lock();
+  struct stat st;
+  int rv;
+
+  printf("DEBUG: nufs_readdir(%s, %p, %ld) -> Called Function\n",
+    path, buf, offset);
+  // get the inode number from the path
+  int inum = path_lookup(path);
+  if(inum < 0) {
+      fprintf(stderr, "ERROR: nufs_readdir(%s, %p, %ld) -> Cannot get inode from path!\n",
+      path, buf, offset);
+      rv = nufs_error(-ENOENT);
+      storage_unlock();
+      return rv;
+  }
+
+  // get the inode from the path
+  inode_t* node = get_inode(inum);
+  if (!node) {
+    storage_unlock();
+    return -EIO;
+  }
+  // make sure this inode is a directory inode
+  assert(S_ISDIR(node->mode));
+  print_inode(node);
+  print_directory(node);
+
+  // self reference to the current directory
+  rv = nufs_getattr(path, &st);
+  assert(!rv);
+  filler(buf, ".", &st, 0);
+
+  // get parent directory
+  char *parent = (char *) malloc(strlen(path) + 10);
+  get_parent(path, parent);
+
+  // if the directory has no parent directory(root)
+  if(strcmp(parent, "")) {
+    rv = nufs_getattr(parent, &st);
+    assert(!rv);
+    filler(buf, "..", &st, 0);
+  } else {
+    // root self references since it's the parent
+    filler(buf, "..", &st, 0);
+  }
+
+  // if the directory has entries beside the parent and self-ref
+  if(node->refs > 2) {
+    // get the entries in this directory
+    dirent_t* entries = inode_get_block(node, 0);
+    if (!entries) {
+      free(parent);
+      storage_unlock();
+      return -EIO;
+    }
+
+    // go through each entry
+    for(int ii = 2; ii < node->refs; ++ii) {
+      dirent_t entry = entries[ii];
+      printf("DEBUG: nufs_readdir() -> Entry name: %s\n", entry.name);
+      printf("DEBUG: nufs_readdir() -> Path: %s\n", path);
+      char *child = strdup(entry.name);
+      char *child_path = (char *) malloc(DIR_NAME_LENGTH + strlen(path) + 1);
+      // clear the allocated memory
+      memset(child_path, 0, DIR_NAME_LENGTH + strlen(path) + 1);
+      if (strcmp(path, "/")) {
+        printf("DEBUG: nufs_readdir() -> adding slash to child path\n");
+        strcat(child_path, path);
+        strcat(child_path, "/");
+        strcat(child_path, child);
+      } else {
+        printf("DEBUG: nufs_readdir() -> directory is root\n");
+        strcat(child_path, "/");
+        strcat(child_path, child);
+      }
+      printf("DEBUG: nufs_readdir(%s, %p, %ld) -> Child Path: %s\n", 
+        path, buf, offset, child_path);
+      
+      // get attributes of this child
+      rv = nufs_getattr(child_path, &st);
+      assert(!rv);
+
+      filler(buf, child, &st, 0);
+      free(child_path);
+    }
+  }
+
+  storage_unlock();
+  return rv;
+}
+
+// mknod makes a filesystem object like a file or directory
+// called for: man 2 open, man 2 link
+// Note, for this assignment, you can alternatively implement the create
+// function.
+int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
+  storage_lock();
+  printf("DEBUG: nufs_mknod(%s, %04o) -> Function called.\n", path, mode);
+  int rv = storage_mknod(path, mode);
+  rv = (rv < 0) ? nufs_error(rv) : rv;
+  printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
+  storage_unlock();
+  return rv;
+}
+
+// most of the following callbacks implement
+// another system call; see section 2 of the manual
+int nufs_mkdir(const char *path, mode_t mode) {
+  int rv = nufs_mknod(path, mode | 040000, 0);
+  printf("mkdir(%s) -> %d\n", path, rv);
+  return rv;
+}
+
+int nufs_unlink(const char *path) {
+  storage_lock();
+  int rv = storage_unlink(path);
+  rv = (rv < 0) ? nufs_error(rv) : rv;
+  printf("unlink(%s) -> %d\n", path, rv);
+  storage_unlock();
+  return rv;
+}
+
+int nufs_link(const char *from, const char *to) {
+  storage_lock();
+  int rv = storage_link(from, to);
+  rv = (rv < 0) ? nufs_error(rv) : rv;
+  printf("link(%s => %s) -> %d\n", from, to, rv);
+  storage_unlock();
+  return rv;
+}
+
+int nufs_rmdir(const char *path) {
+  int rv = nufs_unlink(path);
+  printf("rmdir(%s) -> %d\n", path, rv);
+  return rv;
+}
+
+// implements: man 2 rename
+// called to move a file within the same filesystem
+int nufs_rename(const char *from, const char *to) {
+  storage_lock();
+  int rv = storage_rename(from,to);
+  rv = (rv < 0) ? nufs_error(rv) : rv;
+  printf("rename(%s => %s) -> %d\n", from, to, rv);
+  storage_unlock();
+  return rv;
+}
+
+int nufs_chmod(const char *path, mode_t mode) {
+  int rv = -1;
+  printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
+  return rv;
+}
+
+int nufs_truncate(const char *path, off_t size) {
+  storage_lock();
+  int rv = storage_truncate(path, size);
+  rv = (rv < 0) ? nufs_error(rv) : rv;
+  printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
+  storage_unlock();
+  return rv;
+}
+
+// This is called on open, but doesn't need to do much
+// since FUSE doesn't assume you maintain state for
+// open files.
+// You can just check whether the file is accessible.
+// The handle keeps per-open state such as sequential readahead.
+int nufs_open(const char *path, struct fuse_file_info *fi) {
+  storage_lock();
+  int rv = nufs_access(path, 0);
+  if (rv == 0) {
+    fi->fh = (uint64_t) (uintptr_t) storage_open(path);
+  }
+  printf("open(%s) -> %d\n", path, rv);
+  storage_unlock();
+  return rv;
+}
+
+// Called on every close() of a file descriptor; gives buffered appends
+// their blocks.
+int nufs_flush(const char *path, struct fuse_file_info *fi) {
+  storage_lock();
+  int rv = storage_flush((storage_file_t *) (uintptr_t) fi->fh);
+  rv = (rv < 0) ? nufs_error(-ENOSPC) : 0;
+  printf("flush(%s) -> %d\n", path, rv);
+  storage_unlock();
+  return rv;
+}
+
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  storage_lock();
+  int rv = storage_flush((storage_file_t *) (uintptr_t) fi->fh);
+  rv = (rv < 0) ? nufs_error(-ENOSPC) : 0;
+  printf("fsync(%s, %d) -> %d\n", path, datasync, rv);
+  storage_unlock();
+  return rv;
+}
+
+// Called once the last reference to an open file handle is gone.
+int nufs_release(const char *path, struct fuse_file_info *fi) {
+  storage_lock();
+  storage_release((storage_file_t *) (uintptr_t) fi->fh);
+  fi->fh = 0;
+  printf("release(%s) -> 0\n", path);
+  storage_unlock();
+  return 0;
+}
+
+// Actually read data
+int nufs_read(const char *path, char *buf, size_t size, off_t offset,
+              struct fuse_file_info *fi) {
+  storage_lock();
+  storage_readahead((storage_file_t *) (uintptr_t) fi->fh, offset, size);
+  int rv = storage_read(path, buf, size, offset);
+  rv = (rv < 0) ? nufs_error(-EIO) : rv;
+  printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  storage_unlock();
+  return rv;
+}
+
+// Actually write data
+int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
+               struct fuse_file_info *fi) {
+  storage_lock();
+  int rv = storage_write(path, buf, size, offset);
+  rv = (rv < 0) ? nufs_error(rv) : rv;
+  printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  storage_unlock();
+  return rv;
+}
+
+// Builds a bufvec with one fd-based segment per extent of the disk image.
+// The segments must not be memory-based: libfuse frees the mem pointer of
+// every buffer it is handed back, and these point into the mmapped image.
+static struct fuse_bufvec *nufs_extents_bufvec(storage_extent_t *exts, int count) {
+  struct fuse_bufvec *bv = malloc(sizeof(struct fuse_bufvec) +
+                                  count * sizeof(struct fuse_buf));
+  *bv = FUSE_BUFVEC_INIT(0);
+  if (count > 0) {
+    bv->count = count;
+  }
+  for (int ii = 0; ii < count; ++ii) {
+    bv->buf[ii].size = exts[ii].size;
+    bv->buf[ii].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    bv->buf[ii].mem = NULL;
+    bv->buf[ii].fd = blocks_get_fd();
+    bv->buf[ii].pos = exts[ii].pos;
+  }
+  return bv;
+}
+
+// Read data straight from the runs of blocks in the disk image. They are
+// copied out before the lock is dropped: once it is, the blocks can be
+// freed, reused or punched out before libfuse gets to read them.
+int nufs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                  off_t offset, struct fuse_file_info *fi) {
+  storage_lock();
+  storage_readahead((storage_file_t *) (uintptr_t) fi->fh, offset, size);
+  int max = bytes_to_blocks(size) + 1;
+  storage_extent_t *exts = malloc(max * sizeof(storage_extent_t));
+  int rv = storage_map(path, size, offset, 0, exts, max);
+  if (rv < 0) {
+    fprintf(stderr, "ERROR: read_buf(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+    free(exts);
+    storage_unlock();
+    return -EIO;
+  }
+  if (rv == 0) {
+    // no blocks to point at (such as buffered appends), copy instead
+    free(exts);
+    struct fuse_bufvec *bv = malloc(sizeof(struct fuse_bufvec));
+    *bv = FUSE_BUFVEC_INIT(size);
+    bv->buf[0].mem = malloc(size);
+    int bytes = storage_read(path, bv->buf[0].mem, size, offset);
+    if (bytes < 0) {
+      free(bv->buf[0].mem);
+      free(bv);
+      storage_unlock();
+      return -EIO;
+    }
+    bv->buf[0].size = bytes;
+    *bufp = bv;
+    printf("read_buf(%s, %ld bytes, @+%ld) -> copied %d\n", path, size, offset, bytes);
+    storage_unlock();
+    return 0;
+  }
+
+  struct fuse_bufvec *src = nufs_extents_bufvec(exts, rv);
+  free(exts);
+  struct fuse_bufvec *bv = malloc(sizeof(struct fuse_bufvec));
+  *bv = FUSE_BUFVEC_INIT(fuse_buf_size(src));
+  bv->buf[0].mem = malloc(bv->buf[0].size);
+  ssize_t bytes = fuse_buf_copy(bv, src, 0);
+  free(src);
+  if (bytes < 0) {
+    free(bv->buf[0].mem);
+    free(bv);
+    storage_unlock();
+    return -EIO;
+  }
+  bv->buf[0].size = bytes;
+  *bufp = bv;
+  printf("read_buf(%s, %ld bytes, @+%ld) -> %d segments, %ld bytes\n", path, size, offset,
+         rv, (long) bytes);
+  storage_unlock();
+  return 0;
+}
+
+// Write data by copying (or splicing) it from the request straight into
+// the blocks of the disk image.
+int nufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                   struct fuse_file_info *fi) {
+  storage_lock();
+  size_t size = fuse_buf_size(buf);
+  int max = bytes_to_blocks(size) + 1;
+  storage_extent_t *exts = malloc(max * sizeof(storage_extent_t));
+  int rv = storage_map(path, size, offset, 1, exts, max);
+  if (rv < 0) {
+    fprintf(stderr, "ERROR: write_buf(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+    free(exts);
+    storage_unlock();
+    return -EIO;
+  }
+
+  if (rv == 0) {
+    // appends are buffered until the file is flushed, copy them in
+    free(exts);
+    struct fuse_bufvec tmp = FUSE_BUFVEC_INIT(size);
+    tmp.buf[0].mem = malloc(size);
+    rv = fuse_buf_copy(&tmp, buf, 0);
+    if (rv > 0) {
+      rv = storage_write(path, tmp.buf[0].mem, rv, offset);
+      rv = (rv < 0) ? nufs_error(rv) : rv;
+    }
+    free(tmp.buf[0].mem);
+    printf("write_buf(%s, %ld bytes, @+%ld) -> copied %d\n", path, size, offset, rv);
+    storage_unlock();
+    return rv;
+  }
+
+  struct fuse_bufvec *dst = nufs_extents_bufvec(exts, rv);
+  rv = fuse_buf_copy(dst, buf, 0);
+  if (rv > 0) {
+    // only what was copied counts towards the size
+    storage_map_written(path, offset, rv);
+  }
+  free(dst);
+  free(exts);
+  printf("write_buf(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  storage_unlock();
+  return rv;
+}
+
+// implements: man 2 fallocate
+// Preallocates blocks that read as zeros, punches holes or zeroes a range.
+int nufs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                   struct fuse_file_info *fi) {
+  storage_lock();
+  int supported = FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE;
+  int rv;
+  if ((mode & ~supported) ||
+      ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))) {
+    rv = -EOPNOTSUPP;
+  } else if (offset < 0 || length <= 0) {
+    rv = -EINVAL;
+  } else {
+    rv = (storage_fallocate(path, mode, offset, length) < 0) ? nufs_error(-ENOSPC) : 0;
+  }
+  printf("fallocate(%s, %#x, %ld bytes, @+%ld) -> %d\n", path, mode, length, offset, rv);
+  storage_unlock();
+  return rv;
+}
+
+// Update the timestamps on a file or directory.
+int nufs_utimens(const char *path, const struct timespec ts[2]) {
+  storage_lock();
+  int rv = storage_set_time(path, ts);
+  rv = (rv < 0) ? nufs_error(rv) : rv;
+  printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n", path, ts[0].tv_sec,
+         ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
+  storage_unlock();
+  return rv;
+}
+
+// Extended operations
+int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+               unsigned int flags, void *data) {
+  storage_lock();
+  int rv = -ENOTTY;
+
+  // a mounted snapshot can only be looked at
+  unsigned int request = cmd;
+  int writes = request != NUFS_IOC_GET_STATS && request != NUFS_IOC_SNAP_LIST &&
+               request != FS_IOC_GETFLAGS;
+  if (writes && storage_read_only()) {
+    storage_unlock();
+    return -EROFS;
+  }
+
+  switch (request) {
+  case NUFS_IOC_GET_STATS:
+    storage_get_stats((nufs_stats_t *) data);
+    rv = 0;
+    break;
+  case NUFS_IOC_CLONE_RANGE: {
+    nufs_clone_range_t *req = (nufs_clone_range_t *) data;
+    char from[NUFS_PATH_MAX + 1];
+    req->src_path[NUFS_PATH_MAX - 1] = '\0';
+    snprintf(from, sizeof(from), "/%s", req->src_path + (req->src_path[0] == '/'));
+    rv = storage_clone(from, path, req->src_offset, req->src_length, req->dest_offset);
+    rv = (rv < 0) ? nufs_error(-EINVAL) : 0;
+    break;
+  }
+  case NUFS_IOC_SNAP_CREATE:
+  case NUFS_IOC_SNAP_DELETE: {
+    nufs_snap_t *snap = (nufs_snap_t *) data;
+    snap->name[NUFS_SNAP_NAME_MAX - 1] = '\0';
+    if (request == NUFS_IOC_SNAP_CREATE) {
+      rv = (storage_snapshot_create(snap->name) < 0) ? nufs_error(-ENOSPC) : 0;
+    } else {
+      rv = (storage_snapshot_delete(snap->name) < 0) ? -ENOENT : 0;
+    }
+    break;
+  }
+  case NUFS_IOC_SNAP_LIST:
+    storage_snapshot_list((nufs_snap_list_t *) data);
+    rv = 0;
+    break;
+  case NUFS_IOC_TRIM:
+    rv = (storage_trim((nufs_trim_t *) data) < 0) ? -EINVAL : 0;
+    break;
+  case NUFS_IOC_GROW:
+    rv = (storage_grow((nufs_grow_t *) data) < 0) ? -EFBIG : 0;
+    break;
+  case NUFS_IOC_DEFRAG:
+    rv = (storage_defrag(path, (nufs_defrag_t *) data) < 0) ? -EIO : 0;
+    break;
+  case FS_IOC_GETFLAGS:
+    rv = storage_get_flags(path);
+    if (rv >= 0) {
+      memset(data, 0, _IOC_SIZE(FS_IOC_GETFLAGS));
+      *(int *) data = rv;
+      rv = 0;
+    } else {
+      rv = nufs_error(-ENOENT);
+    }
+    break;
+  case FS_IOC_SETFLAGS:
+    rv = (storage_set_flags(path, *(int *) data) < 0) ? nufs_error(-EOPNOTSUPP) : 0;
+    break;
+  }
+  printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
+  storage_unlock();
+  return rv;
+}
+
+// Called once the connection is up, after fuse_main has daemonized; the
+// cleaner thread starts here so it is not lost in the fork. Ask for splice
+// so that the write_buf segments move pages from the kernel into the image.
+// Reads are copied out under the lock, so there is nothing for them to
+// splice.
+void *nufs_init(struct fuse_conn_info *conn) {
+  storage_start_cleaner();
+  conn->want |= conn->capable & FUSE_CAP_SPLICE_WRITE;
+  printf("init(want: %#x) -> 0\n", conn->want);
+  return NULL;
+}
+
+// Called on unmount; nothing buffered may be left behind.
+void nufs_destroy(void *private_data) {
+  storage_lock();
+  int rv = storage_flush_all();
+  if (rv < 0) {
+    fprintf(stderr, "ERROR: destroy() -> appends lost, no space to flush them\n");
+  }
+  printf("destroy() -> %d\n", rv);
+  storage_unlock();
+}
+
+void nufs_init_ops(struct fuse_operations *ops) {
+  memset(ops, 0, sizeof(struct fuse_operations));
+  ops->access = nufs_access;
+  ops->getattr = nufs_getattr;
+  ops->statfs = nufs_statfs;
+  ops->readdir = nufs_readdir;
+  ops->mknod = nufs_mknod;
+  // ops->create   = nufs_create; // alternative to mknod
+  ops->mkdir = nufs_mkdir;
+  ops->link = nufs_link;
+  ops->unlink = nufs_unlink;
+  ops->rmdir = nufs_rmdir;
+  ops->rename = nufs_rename;
+  ops->chmod = nufs_chmod;
+  ops->truncate = nufs_truncate;
+  ops->open = nufs_open;
+  ops->flush = nufs_flush;
+  ops->fsync = nufs_fsync;
+  ops->release = nufs_release;
+  ops->read = nufs_read;
+  ops->write = nufs_write;
+  ops->read_buf = nufs_read_buf;
+  ops->write_buf = nufs_write_buf;
+  ops->utimens = nufs_utimens;
+  ops->ioctl = nufs_ioctl;
+  ops->fallocate = nufs_fallocate;
+  ops->init = nufs_init;
+  ops->destroy = nufs_destroy;
+};
+
+struct fuse_operations nufs_ops;
+
+// mount options understood by nufs, e.g. -o dedup or -o snapshot=NAME
+#define NUFS_OPT(t, p) { t, offsetof(storage_options_t, p), 1 }
+#define NUFS_OPT_VAL(t, p, v) { t, offsetof(storage_options_t, p), v }
+static struct fuse_opt nufs_opts[] = {
+  NUFS_OPT("dedup", dedup),
+  NUFS_OPT("snapshot=%s", snapshot),
+  NUFS_OPT("noverify", noverify),
+  NUFS_OPT_VAL("relatime", atime, STORAGE_RELATIME),
+  NUFS_OPT_VAL("noatime", atime, STORAGE_NOATIME),
+  NUFS_OPT_VAL("strictatime", atime, STORAGE_STRICTATIME),
+  NUFS_OPT("lazytime", lazytime),
+  NUFS_OPT("discard", discard),
+  NUFS_OPT("grow=%i", grow),
+  FUSE_OPT_END
+};
+
+int main(int argc, char *argv[]) {
+  assert(argc > 2);
+  const char *image = argv[--argc];
+
+  // our options are taken out, the rest goes on to fuse
+  storage_options_t opts = {0};
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  if (fuse_opt_parse(&args, &opts, nufs_opts, NULL) < 0) {
+    return 1;
+  }
+
+  if (storage_init(image, &opts) < 0) {
+    fprintf(stderr, "nufs: no snapshot named %s\n", opts.snapshot);
+    return 1;
+  }
+  // snapshots are mounted read only, the kernel turns writes away
+  if (opts.snapshot) {
+    fuse_opt_add_arg(&args, "-oro");
+  }
+  nufs_init_ops(&nufs_ops);
+  int rv = fuse_main(args.argc, args.argv, &nufs_ops, NULL);
+  fuse_opt_free_args(&args);
+  return rv;
+}
@@ -0,0 +1,131 @@
+/**
+ * @file nufs_ioctl.h
+ * @author Alston Liu
+ *
+ * The ioctl interface of a mounted nufs.
+ *
+ * Commands are issued on any file inside the mount point, for example
+ * ioctl(fd, NUFS_IOC_GET_STATS, &stats).
+ */
+#ifndef NUFS_IOCTL_H
+#define NUFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define NUFS_IOC_MAGIC 'N'
+
+// counters reported by NUFS_IOC_GET_STATS
+typedef struct nufs_stats {
+  int64_t ra_streams;    // sequential streams detected
+  int64_t ra_prefetched; // blocks prefetched ahead of readers
+  int64_t ra_hits;       // prefetched blocks read afterwards
+  int64_t ra_wasted;     // prefetched blocks dropped unread
+  int64_t alloc_calls;   // calls into the block allocator
+  int64_t da_buffered;   // bytes of appends waiting for blocks
+  int64_t da_flushes;    // buffered appends written to new blocks
+  int64_t prealloc_held; // free blocks held in preallocation windows
+  int64_t files;         // regular files that own blocks
+  int64_t extents;       // contiguous runs those files are stored in
+  int64_t frag_blocks;   // blocks shared by packed tails
+  int64_t frags;         // fragments in use by packed tails
+  int64_t compr_clusters;     // clusters compressed
+  int64_t compr_raw;          // clusters left raw because they did not compress
+  int64_t compr_saved;        // blocks freed by compression
+  int64_t compr_cache_hits;   // compressed reads served by the cluster cache
+  int64_t compr_cache_misses; // compressed reads that had to decompress
+  int64_t dedup_hashed;       // blocks hashed for deduplication
+  int64_t dedup_matched;      // blocks found in the index and shared
+  int64_t dedup_cow;          // shared blocks copied before a write
+  int64_t dedup_shared;       // blocks used by more than one file
+  int64_t dedup_saved;        // blocks not stored thanks to sharing
+  int64_t dedup_ratio_pct;    // blocks the files point at per block stored, in percent
+  int64_t dedup_index_bytes;  // memory used by the dedup index
+  int64_t csum_verified;      // blocks verified against their checksum on read
+  int64_t csum_errors;        // blocks that did not match their checksum
+  int64_t csum_scrubbed;      // blocks verified by the scrubber
+  int64_t csum_passes;        // times the scrubber went through the whole image
+  int64_t discarded;          // free blocks punched out of the image file
+  int64_t defrag_files;       // files the defragmenter moved into one run
+  int64_t defrag_moved;       // blocks it copied
+  int64_t defrag_skipped;     // fragmented files it left alone
+} nufs_stats_t;
+
+#define NUFS_IOC_GET_STATS _IOR(NUFS_IOC_MAGIC, 1, nufs_stats_t)
+
+#define NUFS_PATH_MAX 256
+
+// request of NUFS_IOC_CLONE_RANGE, issued on the destination file. It
+// follows struct file_clone_range, except that the source is named by its
+// path inside the mount: a file descriptor of the caller means nothing to
+// the file system, and FICLONE never reaches a FUSE file system anyway
+typedef struct nufs_clone_range {
+  char src_path[NUFS_PATH_MAX]; // source file, relative to the mount point
+  uint64_t src_offset;          // block aligned
+  uint64_t src_length;          // 0 clones up to the end of the source
+  uint64_t dest_offset;         // block aligned
+} nufs_clone_range_t;
+
+#define NUFS_IOC_CLONE_RANGE _IOW(NUFS_IOC_MAGIC, 2, nufs_clone_range_t)
+
+#define NUFS_SNAP_NAME_MAX 24
+#define NUFS_SNAP_MAX 8
+
+// a snapshot, as created, deleted or listed through the ioctls below
+typedef struct nufs_snap {
+  char name[NUFS_SNAP_NAME_MAX];
+  int64_t ctime;    // when it was taken
+  int64_t deleting; // 1 while its blocks are given back in the background
+} nufs_snap_t;
+
+typedef struct nufs_snap_list {
+  int64_t count;
+  nufs_snap_t snaps[NUFS_SNAP_MAX];
+} nufs_snap_list_t;
+
+#define NUFS_IOC_SNAP_CREATE _IOW(NUFS_IOC_MAGIC, 3, nufs_snap_t)
+#define NUFS_IOC_SNAP_DELETE _IOW(NUFS_IOC_MAGIC, 4, nufs_snap_t)
+#define NUFS_IOC_SNAP_LIST _IOR(NUFS_IOC_MAGIC, 5, nufs_snap_list_t)
+
+// request of NUFS_IOC_TRIM, which works as FITRIM with struct fstrim_range:
+// the free runs of at least minlen bytes inside [start, start + len) of the
+// image are punched out of the image file on the host, and len comes back
+// as the bytes punched
+typedef struct nufs_trim {
+  uint64_t start;
+  uint64_t len;
+  uint64_t minlen;
+} nufs_trim_t;
+
+#define NUFS_IOC_TRIM _IOWR(NUFS_IOC_MAGIC, 6, nufs_trim_t)
+
+// request of NUFS_IOC_GROW: the image grows to size bytes, without going
+// past the largest image nufs was compiled for, and size comes back as the
+// size it has, so 0 only asks for it
+typedef struct nufs_grow {
+  uint64_t size;
+} nufs_grow_t;
+
+#define NUFS_IOC_GROW _IOWR(NUFS_IOC_MAGIC, 7, nufs_grow_t)
+
+// result of NUFS_IOC_DEFRAG, issued on a regular file: its blocks are moved
+// into one free run, unless some are shared or no run is long enough
+typedef struct nufs_defrag {
+  int64_t extents_before; // runs the file was stored in
+  int64_t extents_after;  // and is now
+  int64_t moved;          // blocks copied
+} nufs_defrag_t;
+
+#define NUFS_IOC_DEFRAG _IOR(NUFS_IOC_MAGIC, 8, nufs_defrag_t)
+
+// the generic inode flag ioctls used by chattr and lsattr; <linux/fs.h> is
+// not included since its BLOCK_SIZE clashes with ours
+#ifndef FS_IOC_GETFLAGS
+#define FS_IOC_GETFLAGS _IOR('f', 1, long)
+#define FS_IOC_SETFLAGS _IOW('f', 2, long)
+#endif
+#ifndef FS_COMPR_FL
+#define FS_COMPR_FL 0x00000004 // compress file
+#endif
+
+#endif
@@ -0,0 +1,91 @@
+/**
+ * @file orphan.c
+ * @author Alston Liu
+ *
+ * Implementation of the orphan list and its reclaimer
+ */
+#include <assert.h>
+#include <string.h>
+
+#include "orphan.h"
+#include "directory.h"
+#include "delalloc.h"
+#include "prealloc.h"
+#include "compress.h"
+
+// put an inode whose last entry is gone on the orphan list
+void orphan_add(int inum) {
+    assert(inum > 0 && inum < blocks_inode_capacity());
+    inode_t *node = get_inode(inum);
+    if (!node) {
+        return; // lost until nufs-fsck finds it, its blocks stay taken
+    }
+    assert(!(node->flags & INODE_ORPHAN));
+
+    // appends that never got blocks go now, and so do the windows
+    delalloc_drop(inum);
+    prealloc_release(inum);
+    compress_forget(inum);
+
+    int32_t *head = get_orphan_list();
+    node->flags |= INODE_ORPHAN;
+    node->orphan_next = *head;
+    *head = inum;
+    printf("DEBUG: orphan_add(%d) -> next %d\n", inum, node->orphan_next);
+}
+
+// free part of the first orphan on the list
+int orphan_reclaim() {
+    int32_t *head = get_orphan_list();
+    if (!*head) {
+        return 0;
+    }
+    int inum = *head;
+    inode_t *node = get_inode(inum);
+    if (!node) {
+        fprintf(stderr, "ERROR: orphan_reclaim() -> %d is corrupt, the list waits for nufs-fsck\n", inum);
+        return 0;
+    }
+
+    // the entries of a directory become orphans and go before it
+    if (S_ISDIR(node->mode) && !(node->flags & INODE_INLINE) && node->refs > 0) {
+        dirent_t *entries = inode_get_block(node, 0);
+        for (int ii = 0; entries && ii < node->refs && ii < BLOCK_SIZE / (int) sizeof(dirent_t); ++ii) {
+            int child = entries[ii].inum;
+            if (!entries[ii].used || child == inum || !strcmp(entries[ii].name, ".") ||
+                !strcmp(entries[ii].name, "..") || child <= 0 || child >= blocks_inode_capacity() ||
+                !bitmap_get(get_inode_bitmap(), child) || !get_inode(child) ||
+                (get_inode(child)->flags & INODE_ORPHAN)) {
+                continue;
+            }
+            orphan_add(child);
+        }
+        node->refs = 0;
+        node->size = 0;
+        printf("DEBUG: orphan_reclaim() -> %d: entries orphaned\n", inum);
+        return 1;
+    }
+
+    if (node->blocks > 0) {
+        int batch = (node->blocks < ORPHAN_BATCH) ? node->blocks : ORPHAN_BATCH;
+        shrink_inode(node, batch * BLOCK_SIZE);
+        printf("DEBUG: orphan_reclaim() -> %d: %d blocks left\n", inum, node->blocks);
+        return 1;
+    }
+
+    *head = node->orphan_next;
+    free_inode(inum);
+    printf("DEBUG: orphan_reclaim() -> %d: freed\n", inum);
+    return 1;
+}
+
+// count the inodes on the orphan list
+int orphan_count() {
+    int count = 0;
+    for (int inum = *(int32_t *) get_orphan_list();
+         inum && count < blocks_inode_capacity() && get_inode(inum);
+         inum = get_inode(inum)->orphan_next) {
+        count++;
+    }
+    return count;
+}
@@ -0,0 +1,53 @@
+/**
+ * @file orphan.h
+ * @author Alston Liu
+ *
+ * Files and directories that are unlinked but not freed yet.
+ *
+ * unlink and rmdir only take the entry out of its directory and put the
+ * inode on the orphan list; orphan_reclaim, which storage runs on the
+ * background thread, then frees its blocks a batch at a time. The entries
+ * of an orphaned directory become orphans themselves when the reclaimer
+ * gets to it, so removing a whole tree takes one step in the operation.
+ *
+ * The list starts in block 0 and goes on through the orphan_next field of
+ * each inode, and orphans carry INODE_ORPHAN, so after a crash or an
+ * unmount the next mount picks up where the last one stopped. 0 ends the
+ * list: the root is never an orphan.
+ */
+#ifndef ORPHAN_H
+#define ORPHAN_H
+
+#include "inode.h"
+
+// blocks freed per step of the reclaimer
+#define ORPHAN_BATCH 16
+
+/**
+ * Put an inode whose last entry is gone on the orphan list.
+ *
+ * Appends buffered for it are dropped right away, with their reservation.
+ *
+ * @param inum The inode number.
+ */
+void orphan_add(int inum);
+
+/**
+ * Free part of the first orphan on the list.
+ *
+ * A directory has its entries put on the list, a file or an emptied
+ * directory loses up to ORPHAN_BATCH blocks, and an orphan without blocks
+ * is freed and leaves the list.
+ *
+ * @return 1 if there was an orphan to work on, 0 if the list is empty.
+ */
+int orphan_reclaim();
+
+/**
+ * Count the inodes on the orphan list.
+ *
+ * @return The length of the list.
+ */
+int orphan_count();
+
+#endif
@@ -0,0 +1,108 @@
+/**
+ * @file prealloc.c
+ * @author Alston Liu
+ *
+ * Implementation of per-file preallocation windows
+ */
+#include <assert.h>
+
+#include "prealloc.h"
+
+static prealloc_t *windows = NULL;
+
+// get the window of the inode
+static prealloc_t *prealloc_get(int inum) {
+    for (prealloc_t *pa = windows; pa; pa = pa->next) {
+        if (pa->inum == inum) {
+            return pa;
+        }
+    }
+    return NULL;
+}
+
+// unlink the window from the list and free it
+static void prealloc_remove(prealloc_t *pa) {
+    prealloc_t **prev = &windows;
+    while (*prev != pa) {
+        prev = &(*prev)->next;
+    }
+    *prev = pa->next;
+    free(pa);
+}
+
+// allocate a run of blocks to append to the inode
+int prealloc_alloc(inode_t *node, int count, int *got) {
+    assert(count > 0);
+    int inum = inode_get_inum(node);
+
+    // the block right after the end of the file is where growth should go
+    int goal = 1;
+    if (node->blocks > 0) {
+        goal = inode_get_bnum(node, (node->blocks - 1) * BLOCK_SIZE) + 1;
+    }
+
+    // keep growing into the window while it sits right behind the file
+    prealloc_t *pa = prealloc_get(inum);
+    if (pa && pa->start == goal) {
+        int start = pa->start;
+        *got = (count < pa->len) ? count : pa->len;
+        blocks_take(start, *got);
+        pa->start += *got;
+        pa->len -= *got;
+        if (pa->len == 0) {
+            prealloc_remove(pa);
+        }
+        printf("DEBUG: prealloc_alloc(%i, %i) -> %i (+%i) from window\n", inum, count, start, *got);
+        return start;
+    }
+    if (pa) {
+        prealloc_release(inum); // the file moved on, the window is stale
+    }
+
+    // otherwise take a fresh run near the goal, with room for a window
+    int window = node->blocks + count;
+    if (window < PREALLOC_MIN_WINDOW) {
+        window = PREALLOC_MIN_WINDOW;
+    } else if (window > PREALLOC_MAX_WINDOW) {
+        window = PREALLOC_MAX_WINDOW;
+    }
+
+    int len;
+    int start = blocks_find_run(goal, count + window, &len);
+    if (start < 0) {
+        return -1;
+    }
+    *got = (count < len) ? count : len;
+    blocks_take(start, *got);
+
+    // hold whatever is left of the run as the new window
+    if (len > *got) {
+        pa = (prealloc_t *) malloc(sizeof(prealloc_t));
+        pa->inum = inum;
+        pa->start = start + *got;
+        pa->len = len - *got;
+        pa->next = windows;
+        windows = pa;
+        blocks_hold(pa->start, pa->len, 1);
+    }
+    printf("DEBUG: prealloc_alloc(%i, %i) -> %i (+%i), window of %i\n",
+        inum, count, start, *got, len - *got);
+    return start;
+}
+
+// release the window of the inode
+void prealloc_release(int inum) {
+    prealloc_t *pa = prealloc_get(inum);
+    if (pa) {
+        printf("DEBUG: prealloc_release(%i) -> %i (+%i)\n", inum, pa->start, pa->len);
+        blocks_hold(pa->start, pa->len, 0);
+        prealloc_remove(pa);
+    }
+}
+
+// release the windows of every inode
+void prealloc_release_all() {
+    while (windows) {
+        prealloc_release(windows->inum);
+    }
+}
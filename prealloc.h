@@ -0,0 +1,58 @@
+/**
+ * @file prealloc.h
+ * @author Alston Liu
+ *
+ * Per-file preallocation windows.
+ *
+ * A growing inode holds a run of free blocks right behind its last block,
+ * similar to ext4 reservations. Later growth is taken from that window, so
+ * files that grow at the same time do not interleave their blocks. Windows
+ * only live in memory: held blocks stay free on disk and are given back
+ * when the file is closed or the disk runs low on space.
+ */
+#ifndef PREALLOC_H
+#define PREALLOC_H
+
+#include "inode.h"
+
+// smallest and largest window held behind a growing file (in blocks)
+#define PREALLOC_MIN_WINDOW 4
+#define PREALLOC_MAX_WINDOW 32
+
+// the window held for one inode
+typedef struct prealloc {
+  int inum;  // inode the window belongs to
+  int start; // next block of the window
+  int len;   // blocks left in the window
+  struct prealloc *next;
+} prealloc_t;
+
+/**
+ * Allocate a run of blocks to append to the inode.
+ *
+ * Blocks come from the inode's window while it sits right behind the last
+ * block of the file. Otherwise a new run is taken near the end of the file,
+ * and what is left of it beyond count becomes the new window. The window
+ * grows with the file, between PREALLOC_MIN_WINDOW and PREALLOC_MAX_WINDOW.
+ *
+ * @param node The inode being grown.
+ * @param count Number of blocks wanted.
+ * @param got Set to the number of blocks in the allocated run.
+ *
+ * @return The first block number of the run, or -1 if the disk is full.
+ */
+int prealloc_alloc(inode_t *node, int count, int *got);
+
+/**
+ * Release the window of the inode.
+ *
+ * @param inum The inode number.
+ */
+void prealloc_release(int inum);
+
+/**
+ * Release the windows of every inode.
+ */
+void prealloc_release_all();
+
+#endif
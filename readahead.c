@@ -0,0 +1,124 @@
+/**
+ * @file readahead.c
+ * @author Alston Liu
+ *
+ * Implementation of sequential stream detection and readahead
+ */
+#include <assert.h>
+
+#include "readahead.h"
+
+static ra_stats_t stats;
+
+// drop whatever was prefetched but never read
+static void ra_collapse(ra_state_t *ra) {
+    if (ra->ra_end > ra->ra_start) {
+        stats.wasted += ra->ra_end - ra->ra_start;
+    }
+    ra->hits = 0;
+    ra->window = 0;
+    ra->ra_start = 0;
+    ra->ra_end = 0;
+}
+
+// prefetch the file blocks [start, end), one madvise per physical run
+static void ra_prefetch(inode_t *node, int start, int end) {
+    int run_start = -1;
+    int run_len = 0;
+    for (int ii = start; ii < end; ++ii) {
+        int bnum = inode_get_bnum(node, ii * BLOCK_SIZE);
+        if (bnum < 0) {
+            break;
+        }
+        if (run_start >= 0 && bnum == run_start + run_len) {
+            run_len++;
+            continue;
+        }
+        if (run_start >= 0) {
+            blocks_prefetch(run_start, run_len);
+        }
+        run_start = bnum;
+        run_len = 1;
+    }
+    if (run_start >= 0) {
+        blocks_prefetch(run_start, run_len);
+    }
+    stats.prefetched += end - start;
+}
+
+// reset the state of a new file handle
+void ra_init(ra_state_t *ra) {
+    assert(ra);
+    ra->next = 0;
+    ra->hits = 0;
+    ra->window = 0;
+    ra->ra_start = 0;
+    ra->ra_end = 0;
+}
+
+// record a read of [offset, offset + size) and read ahead of streams
+void ra_access(ra_state_t *ra, inode_t *node, off_t offset, size_t size) {
+    if (size == 0 || offset >= node->size) {
+        return;
+    }
+    int first = offset / BLOCK_SIZE;
+    int last = (offset + size - 1) / BLOCK_SIZE;
+
+    if (offset != ra->next) {
+        // random access: the stream (if any) is over
+        ra_collapse(ra);
+    }
+    ra->next = offset + size;
+    ra->hits++;
+
+    // count the blocks of this read that were already prefetched
+    if (last >= ra->ra_start && first < ra->ra_end) {
+        int lo = (first > ra->ra_start) ? first : ra->ra_start;
+        int hi = (last < ra->ra_end) ? last + 1 : ra->ra_end;
+        stats.hits += hi - lo;
+    }
+    if (last + 1 > ra->ra_start) {
+        ra->ra_start = last + 1;
+    }
+
+    if (ra->hits < RA_STREAM_HITS) {
+        return;
+    }
+    if (ra->hits == RA_STREAM_HITS) {
+        stats.streams++;
+        printf("DEBUG: ra_access(%ld, %zu) -> Sequential stream detected\n", offset, size);
+    }
+
+    // every confirmed sequential read doubles the window
+    ra->window = (ra->window == 0) ? RA_MIN_WINDOW : ra->window * 2;
+    if (ra->window > RA_MAX_WINDOW) {
+        ra->window = RA_MAX_WINDOW;
+    }
+
+    // prefetch up to window blocks past this read, skipping what is in flight
+    int file_blocks = bytes_to_blocks(node->size);
+    int start = (ra->ra_end > last + 1) ? ra->ra_end : last + 1;
+    int end = last + 1 + ra->window;
+    if (end > file_blocks) {
+        end = file_blocks;
+    }
+    if (start < end) {
+        printf("DEBUG: ra_access(%ld, %zu) -> Prefetching blocks [%i, %i)\n",
+            offset, size, start, end);
+        ra_prefetch(node, start, end);
+        if (ra->ra_end <= ra->ra_start) {
+            ra->ra_start = start;
+        }
+        ra->ra_end = end;
+    }
+}
+
+// account for the prefetched blocks of a closing file handle
+void ra_release(ra_state_t *ra) {
+    ra_collapse(ra);
+}
+
+// get the readahead counters
+ra_stats_t *ra_get_stats() {
+    return &stats;
+}
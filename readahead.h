@@ -0,0 +1,76 @@
+/**
+ * @file readahead.h
+ * @author Alston Liu
+ *
+ * Sequential stream detection and readahead for open files.
+ *
+ * Every open file handle keeps a small stream state. Once a handle reads
+ * the file sequentially, the blocks ahead of the reader are prefetched so
+ * that faulting them in from the disk image does not stall the next read.
+ */
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <sys/types.h>
+
+#include "inode.h"
+
+// first readahead window once a stream is detected (in blocks)
+#define RA_MIN_WINDOW 4
+// the window doubles with every sequential read up to this many blocks
+#define RA_MAX_WINDOW 64
+// sequential reads in a row before a handle counts as a stream
+#define RA_STREAM_HITS 2
+
+// readahead state of one open file handle
+typedef struct ra_state {
+  off_t next;   // offset a sequential reader would continue at
+  int hits;     // sequential reads in a row
+  int window;   // current readahead window (in blocks)
+  int ra_start; // first prefetched file block not read yet
+  int ra_end;   // one past the last prefetched file block
+} ra_state_t;
+
+// readahead counters over all open files
+typedef struct ra_stats {
+  long streams;    // sequential streams detected
+  long prefetched; // blocks prefetched
+  long hits;       // prefetched blocks that were read afterwards
+  long wasted;     // prefetched blocks dropped without being read
+} ra_stats_t;
+
+/**
+ * Reset the readahead state of a newly opened file handle.
+ *
+ * @param ra The readahead state to initialize.
+ */
+void ra_init(ra_state_t *ra);
+
+/**
+ * Record a read of the given range and prefetch ahead of a stream.
+ *
+ * A read that continues where the previous one stopped grows the window,
+ * any other read collapses it and drops what was prefetched.
+ *
+ * @param ra The readahead state of the file handle.
+ * @param node The inode being read.
+ * @param offset Offset of the read in bytes.
+ * @param size Size of the read in bytes.
+ */
+void ra_access(ra_state_t *ra, inode_t *node, off_t offset, size_t size);
+
+/**
+ * Release the readahead state of a file handle that is being closed.
+ *
+ * @param ra The readahead state of the file handle.
+ */
+void ra_release(ra_state_t *ra);
+
+/**
+ * Get the readahead counters.
+ *
+ * @return Pointer to the global readahead counters.
+ */
+ra_stats_t *ra_get_stats();
+
+#endif
@@ -0,0 +1,305 @@
+/**
+ * @file snapshot.c
+ * @author Alston Liu
+ *
+ * Implementation of copy-on-write snapshots
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "snapshot.h"
+#include "bitmap.h"
+#include "checksum.h"
+
+_Static_assert(SNAPSHOT_MAX * sizeof(snapshot_t) <= SNAPSHOT_AREA_SIZE,
+               "snapshot records do not fit in block 0");
+
+// a snapshot record of an image made before the inode table could grow
+typedef struct snapshot_v1 {
+  char name[SNAPSHOT_NAME_LENGTH];
+  int table;
+  int state;
+  int64_t ctime;
+  uint8_t inodes[8];
+} snapshot_v1_t;
+
+// get the snapshot records
+snapshot_t *snapshot_table() {
+    return (snapshot_t *) get_snapshot_table();
+}
+
+// get the inode bitmap of a snapshot
+uint8_t *snapshot_inodes(const snapshot_t *snap) {
+    return get_snapshot_inodes(snap - snapshot_table());
+}
+
+// find the record of the snapshot with this name, or -1
+static int snapshot_find(const char *name) {
+    snapshot_t *snaps = snapshot_table();
+    for (int ii = 0; ii < SNAPSHOT_MAX; ++ii) {
+        if (snaps[ii].table && !strncmp(snaps[ii].name, name, SNAPSHOT_NAME_LENGTH)) {
+            return ii;
+        }
+    }
+    return -1;
+}
+
+// drop the references a copied inode holds; the indirect block belongs to
+// the snapshot alone
+static void snapshot_release_inode(inode_t *node, int count) {
+    for (int ii = 0; ii < count; ++ii) {
+        int bnum = inode_entry_block(inode_get_entry(node, ii));
+        if (bnum > 0) {
+            free_block(bnum);
+        }
+    }
+    if (node->indirect > 0) {
+        free_block(node->indirect);
+    }
+}
+
+// give a copied inode its own indirect block and a reference to every other
+// block it points at
+static int snapshot_take_inode(inode_t *node) {
+    if (node->flags & INODE_INLINE) {
+        return 0; // the data is part of the copied table
+    }
+    if (node->indirect > 0) {
+        int copy = alloc_block();
+        if (copy < 0) {
+            return -1;
+        }
+        memcpy(blocks_write_block(copy), blocks_get_block(node->indirect), BLOCK_SIZE);
+        node->indirect = copy;
+    }
+    for (int ii = 0; ii < node->blocks; ++ii) {
+        int bnum = inode_entry_block(inode_get_entry(node, ii));
+        if (bnum > 0 && blocks_ref(bnum) < 0) {
+            snapshot_release_inode(node, ii);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// take a snapshot of the file system as it is on disk
+int snapshot_create(const char *name) {
+    printf("DEBUG: snapshot_create(%s) -> Called Function\n", name);
+    snapshot_t *snaps = snapshot_table();
+    int slot = -1;
+    for (int ii = 0; ii < SNAPSHOT_MAX && slot < 0; ++ii) {
+        slot = snaps[ii].table ? -1 : ii;
+    }
+    if (!*name || strlen(name) >= SNAPSHOT_NAME_LENGTH || snapshot_find(name) >= 0 || slot < 0) {
+        fprintf(stderr, "ERROR: snapshot_create(%s) -> Bad name or no free record.\n", name);
+        return -1;
+    }
+
+    // the copy of the table takes one run of blocks, up to the last chunk
+    int32_t *chunks = get_inode_chunks();
+    int count = 0;
+    for (int ii = 0; ii < blocks_inode_capacity() / INODES_PER_CHUNK; ++ii) {
+        count = chunks[ii] ? (ii + 1) * INODES_PER_CHUNK : count;
+    }
+    int blocks = bytes_to_blocks(count * INODE_SIZE);
+    int len;
+    int table = blocks_find_run(1, blocks, &len);
+    if (table < 0 || len < blocks) {
+        fprintf(stderr, "ERROR: snapshot_create(%s) -> No room for the inode table.\n", name);
+        return -1;
+    }
+    blocks_take(table, blocks);
+    inode_t *copy = blocks_get_block(table);
+    memset(copy, 0, blocks * BLOCK_SIZE);
+    for (int ii = 0; ii < count / INODES_PER_CHUNK; ++ii) {
+        if (chunks[ii]) {
+            memcpy(copy + ii * INODES_PER_CHUNK, blocks_get_block(chunks[ii]),
+                INODES_PER_CHUNK * INODE_SIZE);
+        }
+    }
+
+    snapshot_t *snap = &snaps[slot];
+    uint8_t *inodes = snapshot_inodes(snap);
+    memcpy(inodes, get_inode_bitmap(), blocks_inode_capacity() / 8);
+    for (int ii = 0; ii < count; ++ii) {
+        if (bitmap_get(inodes, ii) && (copy[ii].flags & INODE_ORPHAN)) {
+            bitmap_put(inodes, ii, 0); // unlinked already, only waiting to be freed
+        }
+    }
+    for (int ii = 0; ii < count; ++ii) {
+        if (bitmap_get(inodes, ii) && snapshot_take_inode(copy + ii) < 0) {
+            fprintf(stderr, "ERROR: snapshot_create(%s) -> No blocks left.\n", name);
+            for (int jj = 0; jj < ii; ++jj) {
+                if (bitmap_get(inodes, jj) && !(copy[jj].flags & INODE_INLINE)) {
+                    snapshot_release_inode(copy + jj, copy[jj].blocks);
+                }
+            }
+            for (int jj = 0; jj < blocks; ++jj) {
+                free_block(table + jj);
+            }
+            return -1;
+        }
+    }
+
+    memset(snap->name, 0, SNAPSHOT_NAME_LENGTH);
+    strcpy(snap->name, name);
+    snap->ctime = time(NULL);
+    snap->state = SNAPSHOT_ACTIVE;
+    snap->blocks = blocks;
+    snap->table = table; // set last: the record is valid from here on
+    printf("DEBUG: snapshot_create(%s) -> Table at block %i\n", name, table);
+    return 0;
+}
+
+// mark a snapshot for deletion
+int snapshot_delete(const char *name) {
+    int slot = snapshot_find(name);
+    if (slot < 0) {
+        fprintf(stderr, "ERROR: snapshot_delete(%s) -> No such snapshot.\n", name);
+        return -1;
+    }
+    snapshot_table()[slot].state = SNAPSHOT_DELETING;
+    printf("DEBUG: snapshot_delete(%s) -> Marked\n", name);
+    return 0;
+}
+
+// drop the references of one inode of a snapshot marked for deletion, or
+// free its record once no inode is left
+int snapshot_reclaim() {
+    snapshot_t *snaps = snapshot_table();
+    for (int ii = 0; ii < SNAPSHOT_MAX; ++ii) {
+        snapshot_t *snap = &snaps[ii];
+        if (!snap->table || snap->state != SNAPSHOT_DELETING) {
+            continue;
+        }
+
+        inode_t *copy = blocks_get_block(snap->table);
+        uint8_t *inodes = snapshot_inodes(snap);
+        for (int inum = 0; inum < blocks_inode_capacity(); ++inum) {
+            if (bitmap_get(inodes, inum)) {
+                if (!(copy[inum].flags & INODE_INLINE)) {
+                    snapshot_release_inode(copy + inum, copy[inum].blocks);
+                }
+                bitmap_put(inodes, inum, 0);
+                printf("DEBUG: snapshot_reclaim() -> %s: inode %i\n", snap->name, inum);
+                return 1;
+            }
+        }
+
+        for (int jj = 0; jj < snap->blocks; ++jj) {
+            free_block(snap->table + jj);
+        }
+        printf("DEBUG: snapshot_reclaim() -> %s: gone\n", snap->name);
+        memset(snap, 0, sizeof(snapshot_t));
+        return 1;
+    }
+    return 0;
+}
+
+// copy the inode table of a snapshot, for mounting it read only
+void *snapshot_open(const char *name) {
+    int slot = snapshot_find(name);
+    if (slot < 0 || snapshot_table()[slot].state != SNAPSHOT_ACTIVE) {
+        fprintf(stderr, "ERROR: snapshot_open(%s) -> No such snapshot.\n", name);
+        return NULL;
+    }
+    snapshot_t *snap = &snapshot_table()[slot];
+    for (int ii = 0; ii < snap->blocks; ++ii) {
+        if (checksum_verify_meta(snap->table + ii) < 0) {
+            fprintf(stderr, "ERROR: snapshot_open(%s) -> Inode table is corrupt.\n", name);
+            return NULL;
+        }
+    }
+    // inodes past the copy were never allocated
+    int count = snap->blocks * BLOCK_SIZE / INODE_SIZE;
+    count = (count < blocks_inode_capacity()) ? count : blocks_inode_capacity();
+    void *table = calloc(blocks_inode_capacity(), INODE_SIZE);
+    memcpy(table, blocks_get_block(snap->table), count * INODE_SIZE);
+    return table;
+}
+
+// move the snapshot records of an image made before the inode table could grow
+void snapshot_upgrade(const void *old) {
+    const snapshot_v1_t *v1 = old;
+    snapshot_t *snaps = snapshot_table();
+    memset(snaps, 0, SNAPSHOT_MAX * sizeof(snapshot_t));
+    for (int ii = 0; ii < SNAPSHOT_MAX; ++ii) {
+        if (!v1[ii].table) {
+            continue;
+        }
+        memcpy(snaps[ii].name, v1[ii].name, SNAPSHOT_NAME_LENGTH);
+        snaps[ii].table = v1[ii].table;
+        snaps[ii].state = v1[ii].state;
+        snaps[ii].blocks = 2;
+        snaps[ii].ctime = v1[ii].ctime;
+        memcpy(snaps[ii].inodes, v1[ii].inodes, sizeof(v1[ii].inodes));
+        printf("DEBUG: snapshot_upgrade() -> %s\n", snaps[ii].name);
+    }
+}
+
+// rewrite the inode tables of the snapshots in the current format
+int snapshot_upgrade_tables() {
+    snapshot_t *snaps = snapshot_table();
+    int counts[SNAPSHOT_MAX] = {0};
+    int runs[SNAPSHOT_MAX] = {0};
+    for (int ii = 0; ii < SNAPSHOT_MAX; ++ii) {
+        if (!snaps[ii].table) {
+            continue;
+        }
+        // the inodes past the last one in the snapshot are never read
+        for (int inum = 0; inum < blocks_inode_capacity(); ++inum) {
+            counts[ii] = bitmap_get(snapshot_inodes(&snaps[ii]), inum) ? inum + 1 : counts[ii];
+        }
+        int blocks = bytes_to_blocks(counts[ii] * INODE_SIZE);
+        if (blocks <= snaps[ii].blocks) {
+            runs[ii] = snaps[ii].table;
+            continue;
+        }
+        int len;
+        int start = blocks_find_run(1, blocks, &len);
+        if (start < 0 || len < blocks) {
+            // give back the runs taken for the tables before
+            for (int jj = 0; jj < ii; ++jj) {
+                if (runs[jj] == snaps[jj].table) {
+                    continue;
+                }
+                for (int kk = 0; kk < bytes_to_blocks(counts[jj] * INODE_SIZE); ++kk) {
+                    free_block(runs[jj] + kk);
+                }
+            }
+            return -1;
+        }
+        blocks_take(start, blocks);
+        runs[ii] = start;
+    }
+
+    for (int ii = 0; ii < SNAPSHOT_MAX; ++ii) {
+        snapshot_t *snap = &snaps[ii];
+        if (!snap->table) {
+            continue;
+        }
+        int blocks = snap->blocks;
+        if (runs[ii] != snap->table) {
+            blocks = bytes_to_blocks(counts[ii] * INODE_SIZE);
+            memcpy(blocks_get_block(runs[ii]), blocks_get_block(snap->table),
+                snap->blocks * BLOCK_SIZE);
+            for (int jj = 0; jj < snap->blocks; ++jj) {
+                free_block(snap->table + jj);
+            }
+        }
+        char *table = blocks_get_block(runs[ii]);
+        inode_upgrade_table(table, counts[ii]);
+        memset(table + counts[ii] * INODE_SIZE, 0, blocks * BLOCK_SIZE - counts[ii] * INODE_SIZE);
+        // checksums are not loaded yet: mark the blocks for the first seal
+        for (int jj = 0; jj < blocks; ++jj) {
+            bitmap_put(get_checksum_stale(), runs[ii] + jj, 1);
+        }
+        snap->blocks = blocks;
+        snap->table = runs[ii];
+        printf("DEBUG: snapshot_upgrade_tables() -> %s: %d inodes in %d blocks at %d\n",
+            snap->name, counts[ii], blocks, runs[ii]);
+    }
+    return 0;
+}
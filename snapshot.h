@@ -0,0 +1,121 @@
+/**
+ * @file snapshot.h
+ * @author Alston Liu
+ *
+ * Copy-on-write snapshots of the whole file system.
+ *
+ * A snapshot is a copy of the inode table and the inode bitmap taken at one
+ * point in time. Every data, directory and fragment block the copied inodes
+ * point at gains a reference, so the live file system copies those blocks
+ * before it writes them and the snapshot keeps reading the old contents.
+ * Indirect blocks are copied for the snapshot right away, which keeps the
+ * block maps of the live inodes writable in place. The copy of the table is
+ * one flat run of blocks, covering the chunks the live table had. The
+ * snapshot records live in block 0 after the inode bitmap, and their inode
+ * bitmaps with the live one.
+ *
+ * Deleting a snapshot only marks its record; snapshot_reclaim then drops
+ * its references one inode at a time, which storage runs on a background
+ * thread.
+ */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "inode.h"
+#include "nufs_ioctl.h"
+
+#define SNAPSHOT_MAX NUFS_SNAP_MAX
+#define SNAPSHOT_NAME_LENGTH NUFS_SNAP_NAME_MAX
+
+#define SNAPSHOT_ACTIVE 1   // can be mounted
+#define SNAPSHOT_DELETING 2 // its references are being dropped
+
+// a snapshot record in block 0
+typedef struct snapshot {
+  char name[SNAPSHOT_NAME_LENGTH];
+  int table;   // first block of the copied inode table, 0 for a free record
+  int16_t state;  // SNAPSHOT_ACTIVE or SNAPSHOT_DELETING
+  int16_t blocks; // length of the copied inode table in blocks
+  int64_t ctime; // when it was taken
+  uint8_t inodes[INODE_CHUNKS_BLOCK0 * INODES_PER_CHUNK / 8]; // inode bitmap while the
+                                                           // inode tables are in block 0
+} snapshot_t;
+
+/**
+ * Get the snapshot records.
+ *
+ * @return An array of SNAPSHOT_MAX records.
+ */
+snapshot_t *snapshot_table();
+
+/**
+ * Get the inode bitmap of a snapshot, cleared as its inodes are reclaimed.
+ *
+ * @param snap One of the records of snapshot_table().
+ *
+ * @return The bitmap, with blocks_inode_capacity() bits.
+ */
+uint8_t *snapshot_inodes(const snapshot_t *snap);
+
+/**
+ * Take a snapshot of the file system as it is on disk.
+ *
+ * Buffered writes have to be flushed first.
+ *
+ * @param name Name of the new snapshot.
+ *
+ * @return 0 on success, or -1 if the name is taken, all records are in use
+ *         or the disk is full.
+ */
+int snapshot_create(const char *name);
+
+/**
+ * Mark a snapshot for deletion. Its blocks are given back by
+ * snapshot_reclaim.
+ *
+ * @param name Name of the snapshot.
+ *
+ * @return 0 on success, or -1 if there is no such snapshot.
+ */
+int snapshot_delete(const char *name);
+
+/**
+ * Drop the references of one inode of a snapshot marked for deletion, or
+ * free its record once no inode is left.
+ *
+ * @return 1 if there was something to do, 0 if no snapshot is being deleted.
+ */
+int snapshot_reclaim();
+
+/**
+ * Copy the inode table of a snapshot, for mounting it read only.
+ *
+ * @param name Name of the snapshot.
+ *
+ * @return A malloc'd copy of the table with blocks_inode_capacity() inodes,
+ *         or NULL if there is no such snapshot.
+ */
+void *snapshot_open(const char *name);
+
+/**
+ * Move the snapshot records of an image made before the inode table could
+ * grow to where they are now.
+ *
+ * @param old The records as they were, with 64 inodes and two table blocks.
+ */
+void snapshot_upgrade(const void *old);
+
+/**
+ * Rewrite the inode tables of the snapshots of an image made before
+ * INODE_VERSION in the current format.
+ *
+ * A table that no longer fits its blocks moves to a larger run. All the
+ * room is found before any table changes.
+ *
+ * @return 0 on success, or -1 if there is no room for a table.
+ */
+int snapshot_upgrade_tables();
+
+#endif
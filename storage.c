@@ -1,474 +1,1557 @@
-/**
- * @file storage.c
- * @author Alston Liu
- * 
- * Implementation of the storage 
- */
-#include "storage.h"
-
-// initialize the storage
-void storage_init(const char *path) {
-    blocks_init(path);
-    directory_init();
-}
-
-// returns if the given path has access
-int storage_access(const char *path) {
-    int inum = path_lookup(path);
-
-    if (inum < 0) {
-        return -1;
-    }
-
-    inode_t *node = get_inode(inum);
-    node->atime = time(NULL);
-
-    return 0;
-}
-
-// set the stat for the given path
-int storage_stat(const char *path, struct stat *st) {
-    printf("DEBUG: storage_stat(%s) -> Called function.\n", path);
-    // makes sure the path is not empty
-    if(!strcmp(path, "")) {
-        fprintf(stderr, "ERROR: storage_stat() -> Given empty path name!\n");
-        return -1;
-    }
-
-    // gets the inode from the path
-    int inum = path_lookup(path);
-    if(inum >= 0) {
-        memset(st, 0, sizeof(struct stat));
-        inode_t* node = get_inode(inum);
-        st->st_uid = getuid();
-        st->st_size = node->size;
-        st->st_mode = node->mode;
-        st->st_nlink = node->refs;
-        st->st_ctime = node->ctime;
-        st->st_atime = node->atime;
-        st->st_mtime = node->mtime;
-        printf("DEBUG: storage_stat(%s) -> {inum: %i, mode: %i, size: %i, refs: %i}\n",
-            path, inum, node->mode, node->size, node->refs);
-        return 0;
-    }
-    fprintf(stderr, "ERROR: storage_stat(%s) -> (-1)\n", path);
-    return -1; // couldn't find file/directory
-}
-
-// read the file at this path for size amount of bytes and copies to the buffer
-int storage_read(const char *path, char *buf, size_t size, off_t offset) {
-    printf("DEBUG: storage_read(%s, %s, %zu, %d) -> Function called\n",
-        path, buf, size, (int)offset);
-    // get the node from the path
-    int inum = path_lookup(path);
-    if (inum < 0) {
-        fprintf(stderr, "ERROR: storage_read(%s, %s, %zu, %d) -> Cannot find file path\n",
-            path, buf, size, (int)offset);
-        return -1;
-    }
-
-    // get inode of the path
-    inode_t* node = get_inode(inum);
-    assert(S_ISREG(node->mode));
-
-    // ensure offset is valid
-    if (offset > node->blocks * BLOCK_SIZE || offset < 0) {
-        fprintf(stderr, "ERROR: storage_read() -> Offset invalid.\n");
-        return 0;
-    }
-
-    // read through the block
-    int bytesRead = 0;
-    int bytesRem = size;
-    while (bytesRead < size) {
-        // get address pointing to the offset in the data block
-        int bnum = inode_get_bnum(node, offset + bytesRead);
-        if (bnum < 0) {
-            fprintf(stderr, "ERROR: storage_read() -> cannot find bnum at this point: %ld\n", offset + bytesRead);
-            return bytesRead;
-        }
-        char* start = blocks_get_block(bnum);
-        char* end = start + BLOCK_SIZE;
-        char* file_ptr = (bytesRead > 0) ? start : start + (offset % BLOCK_SIZE);
-
-        int bytesToRead;
-        char* target = file_ptr + bytesRem;
-        if (target > end) {
-            bytesToRead = end - file_ptr;
-        } else {
-            bytesToRead = bytesRem;
-        }
-        printf("DEBUG: storage_read() -> bytes to read: %i\n", bytesToRead);
-
-        memcpy(buf + bytesRead, file_ptr, bytesToRead);
-        /*
-        int ii = 0;
-        while(ii < bytesToRead && file_ptr[ii + bytesRead] != '\0') {
-            memset(&buf[ii + bytesRead], file_ptr[ii + bytesRead], sizeof(char));
-            //printf("DEBUG: storage_read() -> Letter read: %c\n", buf[ii + bytesRead]);
-            ++ii;
-        } */
-        printf("DEBUG: storage_read() -> String read: %s\n", buf + bytesRead);
-        bytesRem -= bytesToRead;
-        bytesRead += bytesToRead;
-    }
-    printf("DEBUG: storage_read(%s, %zu, %d) -> (%i)\n",
-            path, size, (int)offset, bytesRead);
-    return bytesRead;
-}
-
-// writes the file at this path from the buffer with the number of size bytes.
-int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
-    printf("DEBUG: storage_write(%s, %zu, %d) -> Called Function.\n",
-        path, size, (int)offset);
-    assert(offset >= 0);
-    assert(size >= 0);
-
-    // case where the file can't be found
-    int inum = path_lookup(path);
-    if(inum < 0) {
-        fprintf(stderr, "ERROR: storage_write(%s, %zu, %d) -> Could not get inode from path.\n",
-            path, size, (int)offset);
-        return -1;
-    }
-
-    // if the file needs more space
-    inode_t* node = get_inode(inum);
-    int new_size = offset + size;
-    if(new_size > node->blocks * BLOCK_SIZE) {
-        printf("DEBUG: storage_write(%s, %zu, %d) -> Size change: %i\n",
-            path, size, (int)offset, new_size);
-        int size_change = storage_truncate(path, new_size);
-        if(size_change < 0) {
-            fprintf(stderr, "ERROR: storage_write(%s, %zu, %d) -> Failed to truncate file.\n",
-                path, size, (int)offset);
-            return -1;
-        }
-    }
-
-    // prepare writing variables
-    int bytesWritten = 0;
-    int bytesRem = size;
-    while (bytesWritten < size) {
-        // get address point to the offset in the data block
-        int bnum = inode_get_bnum(node, offset + bytesWritten);
-        if (bnum < 0) {
-            fprintf(stderr, "ERROR: storage_write() -> cannot find bnum\n");
-            return (bytesWritten > 0) ? bytesWritten : -1;
-        }
-        char* start = blocks_get_block(bnum);
-        char* end = start + BLOCK_SIZE;
-        char* file_ptr = (bytesWritten > 0) ? start : start + (offset % BLOCK_SIZE);
-        // printf("DEBUG: storage_write() -> {start: %p}\n", start);
-        // printf("DEBUG: storage_write() -> {file_ptr: %p}\n", file_ptr);
-        // printf("DEBUG: storage_write() -> {end: %p}\n", end);
-        
-        // calculate how many bytes to write to buffer
-        int bytesToWrite;
-        char* target = file_ptr + bytesRem;
-        if (target > end) {
-            bytesToWrite = end - file_ptr;
-        } else {
-            bytesToWrite = bytesRem;
-        }
-        printf("DEBUG: storage_write() -> bytes to write: %i\n", bytesToWrite);
-
-        // write to buffer and update inode
-        memcpy(file_ptr, buf + bytesWritten, bytesToWrite);
-        printf("DEBUG: storage_write() -> File pointer: %p\n", file_ptr);
-        printf("DEBUG: storage_write() -> Written:\"%s\"\n", file_ptr + bytesWritten);
-        
-        // update write variables
-        bytesWritten += bytesToWrite;
-        bytesRem -= bytesToWrite;
-    }
-
-    // update the inode with the new size
-    if (size + offset > node->size) {
-        node->size = size + offset;
-    }
-
-    printf("DEBUG: storage_write(%s, %zu, %d) -> (%i)\n", 
-        path, size, (int)offset, bytesWritten);
-    return bytesWritten;
-}
-
-// truncate the file to the given size
-int storage_truncate(const char *path, size_t size) {
-    printf("DEBUG: storage_truncate(%s, %zu) -> Called Function\n", path, size);
-    int inum = path_lookup(path);
-    if(inum < 0) {
-        fprintf(stderr, "ERROR: storage_truncate(%s, %zu) -> Could not get inode from path.\n",
-            path, size);
-        return -1;
-    }
-
-    // change depending on the size
-    inode_t* node = get_inode(inum);
-    int maxSize = node->blocks * BLOCK_SIZE;
-    if (size > maxSize) {
-        printf("DEBUG: storage_truncate(%s, %zu) -> Growing inode(%i) by %zu bytes\n", path, size, inum, (size - node->size));
-        return grow_inode(node, size - maxSize);
-    } else if (maxSize > size) {
-        printf("DEBUG: storage_truncate(%s, %zu) -> Shrinking inode(%i) by %zu bytes\n", path, size, inum, (node->size - size));
-        return shrink_inode(node, maxSize - size);
-    } else {
-        // Already equal in size
-        return 0;
-    }
-}
-
-// creates a new inode for an entry at the path depending on given mode
-int storage_mknod(const char *path, int mode) {
-    printf("DEBUG: storage_mknod(%s, %i) -> Called Function.\n", path, mode);
-    int inum = path_lookup(path);
-    if (inum >= 0) {
-        fprintf(stderr, "ERROR: storage_mknod(%s, %i) -> Inode already exists!\n", path, mode);
-        return -1;
-    }
-    
-    // get the names of the child and parent
-    printf("DEBUG: storage_mknod(%s, %i) -> Getting name of parent.\n", path, mode);
-    char dir[strlen(path)];
-    get_parent(path, dir);
-
-    printf("DEBUG: storage_mknod(%s, %i) -> Getting name of child.\n", path, mode);
-    char sub[DIR_NAME_LENGTH];
-    get_child(path, sub);   
-
-    // DEBUGGING
-    printf("DEBUG: storage_mknod(%s, %i) -> Parent: %s\n", path, mode, dir);
-    printf("DEBUG: storage_mknod(%s, %i) -> Child: %s\n", path, mode, sub);
-
-    // get the parent inode
-    int parent_inum = path_lookup(dir);
-    if (parent_inum < 0) {
-        fprintf(stderr, "ERROR: storage_mknod(%s, %i) -> Parent Inode cannot be found!\n", 
-            path, mode);
-        return -1;
-    }
-    inode_t* parent_node = get_inode(parent_inum);
-
-    // initialize the inode
-    int child_inum = alloc_inode();
-    inode_t* child_node = get_inode(child_inum);
-    child_node->mode = mode;
-    child_node->size = 0;
-    
-    // if the given path is a directory
-    if (S_ISDIR(mode)) {
-        printf("DEBUG: storage_mknod(%s, %i) -> Creating self and parent reference.\n", 
-            path, mode);
-        // set the child directory's default entries
-        directory_put(child_node, ".", child_inum);
-        directory_put(child_node, "..", parent_inum);
-        child_node->refs = 2;
-    } else {
-        child_node->refs = 1;
-    }
-
-    directory_put(parent_node, sub, child_inum);
-    printf("DEBUG: storage_mknod(%s, %i) -> Printing directory entries\n", path, mode);
-    print_directory(parent_node);
-    return 0;
-}
-
-// unlink the given path from the disk
-int storage_unlink(const char *path) {
-    printf("DEBUG: storage_unlink(%s) -> Called Function.\n", path);
-    // get the names of the child and parent
-    char* dir = (char *) malloc(strlen(path) + 10);
-    char* sub = (char *) malloc(strlen(path) + 10);
-    get_child(path, sub);
-    get_parent(path, dir);
-
-    int parent_inum = path_lookup(dir);
-    if (parent_inum < 0) {
-        fprintf(stderr, "ERROR: storage_unlink(%s) -> Parent Inode cannot be found!\n", path);
-        free(sub);
-        free(dir);
-        return -1;
-    }
-    
-    inode_t* parent_node = get_inode(parent_inum);
-    int del = directory_delete(parent_node, sub);
-    printf("DEBUG: storage_unlink(%s) -> (%i)\n", path, del);
-    free(sub);
-    free(dir);
-    return del;
-}
-
-// link the given name of the directories
-int storage_link(const char *from, const char *to) {
-    // if the paths are the same
-    if(!strcmp(from, to)) {
-        return 0;
-    }
-
-    // make sure from exist
-    int from_inum = path_lookup(from);
-    if (from_inum < 0) {
-        fprintf(stderr, "ERROR: storage_link(%s, %s) -> Could not find path \'from\'.\n", from, to);
-        return -1;
-    }
-
-    // make sure 'to' exist
-    int to_inum = path_lookup(to);
-
-    // case where the destination doesn't exist
-    if (to_inum < 0) {
-        fprintf(stderr, "ERROR: storage_link(%s, %s) -> Could not find path \'to\'.\n", from, to);
-        storage_mknod(to, DIR_MODE | 0775);
-        to_inum = path_lookup(to);
-    }
-
-    // get the inode for 'to' path
-    inode_t* to_node = get_inode(to_inum);
-    inode_t* from_inode = get_inode(from_inum);
-    inode_t* dir_inode;
-
-    // allocate memory for the 'to'  directory
-    char *dir = (char *) malloc(strlen(to) + 1);
-
-    // get the name of the file or directory
-    char *sub = (char *) malloc(DIR_NAME_LENGTH);
-    get_child(from, sub);
-
-    // if the 'to' path is a file
-    if(S_ISREG(to_node->mode)) {
-        // set parent and child names
-        get_parent(to, dir);
-        get_child(to, sub);
-
-        // get the directory inode of the 'to' path
-        dir_inode = get_inode(path_lookup(dir));
-
-        // add it to the directory with the name of the file
-        directory_put(dir_inode, sub, from_inum);
-    } else {
-        // assert that the 'to' path is a directory
-        assert(S_ISDIR(to_node->mode));
-
-        // add the file/directory to the entries
-        directory_put(to_node, sub, from_inum);
-    }
-
-    // clear the memory from the allocated variable
-    free(sub);
-    free(dir);
-    return 0;
-}
-
-// TODO: rename the directories
-int storage_rename(const char *from, const char *to) {
-    printf("DEBUG: storage_rename(%s, %s) -> Called function.\n", from, to);
-
-    // make sure the from path exists
-    int from_inum = path_lookup(from);
-    if(from_inum < 0) {
-        fprintf(stderr, "ERROR: storage_rename(%s, %s) -> Cannot find given \'from\' path\n");
-        return -1;
-    }
-    
-    // link the 'from' to 'to' path
-    storage_link(from, to);
-
-    // delete the file/directory from the parent entries
-    // get parent directory
-    char* dir = (char *) malloc(strlen(from) + 1);
-    get_parent(from, dir);
-
-    char* sub = (char *) malloc(DIR_NAME_LENGTH + 1);
-    get_child(from, sub);
-
-    int dir_inum = path_lookup(dir);
-    inode_t* dir_inode = get_inode(dir_inum);
-    dirent_t* entries = inode_get_block(dir_inode, 0);
-
-    // go through entries and find the name
-    for(int ii = 0; ii < dir_inode->refs; ++ii) {
-        dirent_t entry = entries[ii];
-        if(!strcmp(entry.name, sub)) {
-            entry.used = 0;
-            entry.inum = -1;
-            memset(&entry.name, 0, DIR_NAME_LENGTH);
-            return 0;
-        }
-    }
-
-    // couldn't find the name in the entry
-    return -1;
-}
-
-// set the time of the given file to the given timespec
-int storage_set_time(const char *path, const struct timespec ts[2]) {
-    int inum = path_lookup(path);
-    if (inum < 0) {
-        fprintf(stderr, "ERROR: storage_set_time(%s) -> Could not find inode of given path.\n", path);
-        return -1;
-    }
-
-    inode_t* node = get_inode(inum);
-    node->atime = ts[0].tv_sec;
-    node->mtime = ts[1].tv_sec;
-    printf("DEBUG: storage_set_time(%s) -> (0)\n", path);
-    return 0;
-}
-
-// return the names of the directories
-slist_t *storage_list(const char *path) {
-    return directory_list(path);
-}
-
-// set the parent path to the given str
-void get_parent(const char *path, char* str) {
-    printf("DEBUG: get_parent(%s) -> Called Function.\n", path);
-    slist_t* path_names = slist_explode(path, '/');
-    slist_t* copy = path_names;
-    str[0] = '\0';
-    // the case where the first string is a slash
-    if(!strcmp(copy->data, "") && copy->next) {
-        strcat(str, "/"); // will always add the root
-        copy = copy->next; // go to the next case
-    }
-
-    while (copy->next) {
-        printf("DEBUG: get_parent(%s) -> str: %s\n", path, str);
-        if (strcmp(str, "/")){
-            strcat(str, "/");
-        }
-        strncat(str, copy->data, strlen(copy->data) + 1);
-        copy = copy->next;
-    }
-
-    printf("DEBUG: get_parent(%s) -> Parent: %s\n", path, str);
-    slist_free(path_names);
-}
-
-// set the child name to the given str and given full path
-void get_child(const char *path, char* str) {
-    // DEBUG: Enter in the function
-    printf("DEBUG: get_child(%s) -> Called Function.\n", path);
-    slist_t* path_names = slist_explode(path, '/');
-    slist_t* copy = path_names;
-    printf("DEBUG: get_child(%s) -> Exploding path into an slist\n", path);
-    print_list(copy);
-
-    // the case where the first string is a slash
-    if(!strcmp(copy->data, "") && copy->next) {
-        copy = copy->next; // go to the next case
-    }
-
-    // go through the list until the last one
-    while(copy->next || !strcmp(copy->data, "")) {
-        printf("DEBUG: get_child(%s) -> Curr Name: %s\n", path, copy->data);
-        copy = copy->next; // skip to the end
-    }
-
-    // copy data into the string
-    strcpy(str, copy->data);
-    slist_free(path_names);
-
-    // DEBUG: Output of the function
-    printf("DEBUG: get_child(%s) -> Child: %s\n", path, str);
-}
+/**
+ * @file storage.c
+ * @author Alston Liu
+ * 
+ * Implementation of the storage 
+ */
+#include <errno.h>
+#include <linux/falloc.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "storage.h"
+
+// held by every file system operation and by the cleaner thread; recursive
+// since operations call each other
+static pthread_mutex_t lock;
+static pthread_cond_t cleaner_wake = PTHREAD_COND_INITIALIZER;
+static int read_only = 0;
+static int atime_mode = STORAGE_RELATIME;
+static int lazytime = 0;
+static int discard = 0;
+
+// access times held in memory with lazytime, until the inode is written for
+// another reason, its file is synced or LAZYTIME_SECS pass
+typedef struct lazy_atime {
+    struct timespec time; // tv_sec is 0 when nothing waits
+    uint32_t gen;         // generation of the inode the time belongs to
+} lazy_atime_t;
+static lazy_atime_t lazy[INODE_LIMIT];
+static time_t lazy_written = 0; // when they were last written back
+
+// writes the access time lazytime held back for this inode into it
+static void storage_lazy_write(int inum) {
+    lazy_atime_t *la = &lazy[inum];
+    if (!la->time.tv_sec) {
+        return;
+    }
+    // the inode may have been freed, or even reused, since
+    if (bitmap_get(get_inode_bitmap(), inum)) {
+        inode_t *node = get_inode(inum);
+        if (node && node->gen == la->gen) {
+            node->atime = la->time.tv_sec;
+            node->atime_ns = la->time.tv_nsec;
+        }
+    }
+    la->time.tv_sec = 0;
+}
+
+// writes back every access time lazytime holds
+static void storage_lazy_write_all() {
+    for (int inum = 0; inum < blocks_inode_capacity(); ++inum) {
+        storage_lazy_write(inum);
+    }
+    lazy_written = time(NULL);
+}
+
+// whether a time is at or before the given seconds and nanoseconds
+static int time_not_after(const struct timespec *ts, int64_t sec, int32_t nsec) {
+    return ts->tv_sec < sec || (ts->tv_sec == sec && ts->tv_nsec <= nsec);
+}
+
+// updates the access time of an inode that was accessed, as the mount
+// options say; with relatime only if the file changed since the last
+// update or it is RELATIME_SECS old
+static void storage_touch_atime(int inum) {
+    if (read_only || atime_mode == STORAGE_NOATIME) {
+        return;
+    }
+    inode_t *node = get_inode(inum);
+    if (!node) {
+        return;
+    }
+    lazy_atime_t *la = &lazy[inum];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct timespec atime = {node->atime, node->atime_ns};
+    if (la->time.tv_sec && la->gen == node->gen) {
+        atime = la->time;
+    }
+
+    if (atime_mode == STORAGE_RELATIME &&
+        !time_not_after(&atime, node->mtime, node->mtime_ns) &&
+        !time_not_after(&atime, node->ctime, node->ctime_ns) &&
+        now.tv_sec - atime.tv_sec < RELATIME_SECS) {
+        return;
+    }
+    if (lazytime) {
+        la->time = now;
+        la->gen = node->gen;
+        return;
+    }
+    inode_touch(node, INODE_ATIME);
+}
+
+// gives back the blocks of deleted snapshots and of orphans in the
+// background, one inode or batch at a time so operations get the lock in
+// between. With nothing to give back it punches freed blocks out of the
+// image file with discard, scrubs a few blocks every CHECKSUM_SCRUB_MS, and
+// writes back the access times lazytime holds every LAZYTIME_SECS
+static void *storage_cleaner(void *arg) {
+    storage_lock();
+    for (;;) {
+        while (!snapshot_reclaim() && !orphan_reclaim()) {
+            if (lazytime && time(NULL) - lazy_written >= LAZYTIME_SECS) {
+                storage_lazy_write_all();
+            }
+            if (discard) {
+                blocks_discard();
+            }
+            checksum_seal();
+            checksum_scrub(CHECKSUM_SCRUB_BLOCKS);
+
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += CHECKSUM_SCRUB_MS * 1000000L;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&cleaner_wake, &lock, &until);
+            checksum_begin();
+        }
+        storage_unlock();
+        sched_yield();
+        storage_lock();
+    }
+    return NULL;
+}
+
+// initialize the storage; opts may be NULL for the defaults. Returns -1 if
+// the snapshot to mount does not exist
+int storage_init(const char *path, const storage_options_t *opts) {
+    static int started = 0;
+    storage_options_t defaults = {0};
+    if (!opts) {
+        opts = &defaults;
+    }
+    if (!started) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+    blocks_init(path);
+    checksum_init(opts->snapshot != NULL, !opts->noverify);
+    atime_mode = opts->atime;
+    lazytime = opts->lazytime;
+    discard = opts->discard;
+    memset(lazy, 0, sizeof(lazy));
+    lazy_written = time(NULL);
+
+    // a snapshot is mounted from a private copy of its inode table, so
+    // nothing the mount touches reaches the image
+    if (opts->snapshot) {
+        void *table = snapshot_open(opts->snapshot);
+        if (!table) {
+            return -1;
+        }
+        blocks_use_inode_table(table);
+        read_only = 1;
+        return 0;
+    }
+    dedup_init(opts->dedup);
+    blocks_set_grow_step(opts->grow);
+    directory_init();
+
+    started = 1;
+    return 0;
+}
+
+// start the cleaner thread, or wake it if it is running. Threads do not
+// survive a fork, so fuse calls this from init once it has daemonized.
+// Snapshots deleted and files unlinked before the last unmount are still
+// being given back
+void storage_start_cleaner() {
+    static int running = 0;
+    if (read_only) {
+        return;
+    }
+    if (!running) {
+        pthread_t cleaner;
+        pthread_create(&cleaner, NULL, storage_cleaner, NULL);
+        pthread_detach(cleaner);
+        running = 1;
+    }
+    storage_lock();
+    pthread_cond_signal(&cleaner_wake);
+    storage_unlock();
+}
+
+// take the lock that keeps operations apart from the cleaner thread
+void storage_lock() {
+    pthread_mutex_lock(&lock);
+    checksum_begin();
+}
+
+// release the lock taken by storage_lock, once the blocks written under it
+// have their checksums
+void storage_unlock() {
+    checksum_seal();
+    pthread_mutex_unlock(&lock);
+}
+
+// whether a snapshot is mounted
+int storage_read_only() {
+    return read_only;
+}
+
+// returns if the given path has access
+int storage_access(const char *path) {
+    int inum = path_lookup(path);
+
+    if (inum < 0) {
+        return -1;
+    }
+
+    storage_touch_atime(inum);
+    return 0;
+}
+
+// set the stat for the given path
+int storage_stat(const char *path, struct stat *st) {
+    printf("DEBUG: storage_stat(%s) -> Called function.\n", path);
+    // makes sure the path is not empty
+    if(!strcmp(path, "")) {
+        fprintf(stderr, "ERROR: storage_stat() -> Given empty path name!\n");
+        return -1;
+    }
+
+    // gets the inode from the path
+    int inum = path_lookup(path);
+    inode_t* node = (inum >= 0) ? get_inode(inum) : NULL;
+    if(node) {
+        memset(st, 0, sizeof(struct stat));
+        st->st_uid = getuid();
+        st->st_size = node->size;
+        st->st_mode = node->mode;
+        st->st_nlink = node->refs;
+        st->st_ctim.tv_sec = node->ctime;
+        st->st_ctim.tv_nsec = node->ctime_ns;
+        st->st_atim.tv_sec = node->atime;
+        st->st_atim.tv_nsec = node->atime_ns;
+        if (lazy[inum].time.tv_sec && lazy[inum].gen == node->gen) {
+            st->st_atim = lazy[inum].time; // not written back yet
+        }
+        st->st_mtim.tv_sec = node->mtime;
+        st->st_mtim.tv_nsec = node->mtime_ns;
+        printf("DEBUG: storage_stat(%s) -> {inum: %i, mode: %i, size: %i, refs: %i}\n",
+            path, inum, node->mode, node->size, node->refs);
+        return 0;
+    }
+    fprintf(stderr, "ERROR: storage_stat(%s) -> (-1)\n", path);
+    return -1; // couldn't find file/directory
+}
+
+// fill in the sizes and free space of the file system from the counters in
+// block 0; takes no lock, the counters are read atomically
+void storage_statfs(struct statvfs *st) {
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = BLOCK_SIZE;
+    st->f_frsize = BLOCK_SIZE;
+    st->f_blocks = blocks_count();
+    st->f_bfree = blocks_free_count();
+    // reserved blocks hold appends that are buffered but not written out
+    int avail = blocks_free_count() - blocks_reserved_count();
+    st->f_bavail = (avail > 0) ? avail : 0;
+    // the inode tables grow to INODE_LIMIT as they are needed
+    st->f_files = INODE_LIMIT;
+    st->f_ffree = blocks_free_inodes() + INODE_LIMIT - blocks_inode_capacity();
+    st->f_favail = st->f_ffree;
+    st->f_namemax = DIR_NAME_LENGTH - 1;
+    if (read_only) {
+        st->f_flag |= ST_RDONLY;
+    }
+}
+
+// moves the data of an inline inode into the delayed allocation buffer, so
+// it gets blocks together with the write that outgrew the inode
+static int storage_uninline(int inum, inode_t *node) {
+    printf("DEBUG: storage_uninline(%i) -> Moving %i bytes out of the inode\n", inum, node->size);
+    char data[INLINE_MAX];
+    int size = node->size;
+    memcpy(data, inode_inline_data(node), size);
+    inode_clear_inline(node);
+    if (size > 0 && delalloc_write(inum, node, data, size, 0) < 0) {
+        inode_set_inline(node, data, size);
+        return -1;
+    }
+    return 0;
+}
+
+// read size bytes of the file with this inode number into the buffer
+int storage_read_inode(int inum, char *buf, size_t size, off_t offset) {
+    inode_t* node = get_inode(inum);
+    if (!node) {
+        return -1;
+    }
+    assert(S_ISREG(node->mode));
+
+    // ensure offset is valid
+    if (offset >= node->size || offset < 0) {
+        printf("DEBUG: storage_read() -> Offset at or past the end of file.\n");
+        return 0;
+    }
+
+    // never read past the end of the file
+    if (offset + size > node->size) {
+        size = node->size - offset;
+    }
+
+    // tiny files are read straight out of the inode
+    if (node->flags & INODE_INLINE) {
+        memcpy(buf, inode_inline_data(node) + offset, size);
+        printf("DEBUG: storage_read_inode(%i, %zu, %d) -> (%zu) inline\n",
+            inum, size, (int)offset, size);
+        return size;
+    }
+
+    // anything past the allocated blocks is still buffered in memory
+    int alloc_end = node->blocks * BLOCK_SIZE;
+
+    // read through the block
+    int bytesRead = 0;
+    int bytesRem = size;
+    while (bytesRead < size) {
+        if (offset + bytesRead >= alloc_end) {
+            bytesRead += delalloc_read(inum, buf + bytesRead, bytesRem, offset + bytesRead);
+            break;
+        }
+
+        // compressed clusters are read out of the cluster cache
+        if (compress_is_compressed(node, offset + bytesRead)) {
+            const char* data = compress_read(node, offset + bytesRead);
+            if (!data) {
+                return (bytesRead > 0) ? bytesRead : -1;
+            }
+            int in_cluster = (offset + bytesRead) % CLUSTER_SIZE;
+            int bytesToRead = (CLUSTER_SIZE - in_cluster < bytesRem) ? CLUSTER_SIZE - in_cluster : bytesRem;
+            memcpy(buf + bytesRead, data, bytesToRead);
+            bytesRem -= bytesToRead;
+            bytesRead += bytesToRead;
+            continue;
+        }
+
+        // a packed tail is read out of its fragments
+        char* tail = inode_tail_ptr(node, offset + bytesRead);
+        if (tail && checksum_verify(inode_entry_block(inode_get_entry(node, (offset + bytesRead) / BLOCK_SIZE))) < 0) {
+            return (bytesRead > 0) ? bytesRead : -1;
+        } else if (tail) {
+            memcpy(buf + bytesRead, tail, bytesRem);
+            bytesRead += bytesRem;
+            bytesRem = 0;
+            break;
+        }
+
+        // holes and unwritten blocks read as zeros
+        int bnum = inode_get_bnum(node, offset + bytesRead);
+        if (bnum == -EIO) {
+            return (bytesRead > 0) ? bytesRead : -1;
+        } else if (bnum < 0 || inode_is_unwritten(node, offset + bytesRead)) {
+            int in_block = (offset + bytesRead) % BLOCK_SIZE;
+            int bytesToRead = (BLOCK_SIZE - in_block < bytesRem) ? BLOCK_SIZE - in_block : bytesRem;
+            memset(buf + bytesRead, 0, bytesToRead);
+            bytesRem -= bytesToRead;
+            bytesRead += bytesToRead;
+            continue;
+        }
+        if (checksum_verify(bnum) < 0) {
+            fprintf(stderr, "ERROR: storage_read_inode(%i, %zu, %d) -> Block %i is corrupt\n",
+                inum, size, (int)(offset + bytesRead), bnum);
+            return (bytesRead > 0) ? bytesRead : -1;
+        }
+        char* start = blocks_get_block(bnum);
+        char* end = start + BLOCK_SIZE;
+        char* file_ptr = start + ((offset + bytesRead) % BLOCK_SIZE);
+
+        int bytesToRead;
+        char* target = file_ptr + bytesRem;
+        if (target > end) {
+            bytesToRead = end - file_ptr;
+        } else {
+            bytesToRead = bytesRem;
+        }
+        printf("DEBUG: storage_read() -> bytes to read: %i\n", bytesToRead);
+
+        memcpy(buf + bytesRead, file_ptr, bytesToRead);
+        /*
+        int ii = 0;
+        while(ii < bytesToRead && file_ptr[ii + bytesRead] != '\0') {
+            memset(&buf[ii + bytesRead], file_ptr[ii + bytesRead], sizeof(char));
+            //printf("DEBUG: storage_read() -> Letter read: %c\n", buf[ii + bytesRead]);
+            ++ii;
+        } */
+        printf("DEBUG: storage_read() -> String read: %s\n", buf + bytesRead);
+        bytesRem -= bytesToRead;
+        bytesRead += bytesToRead;
+    }
+    printf("DEBUG: storage_read_inode(%i, %zu, %d) -> (%i)\n",
+            inum, size, (int)offset, bytesRead);
+    return bytesRead;
+}
+
+// read the file at this path for size amount of bytes and copies to the buffer
+int storage_read(const char *path, char *buf, size_t size, off_t offset) {
+    printf("DEBUG: storage_read(%s, %zu, %d) -> Function called\n",
+        path, size, (int)offset);
+    // get the node from the path
+    int inum = path_lookup(path);
+    if (inum < 0) {
+        fprintf(stderr, "ERROR: storage_read(%s, %zu, %d) -> Cannot find file path\n",
+            path, size, (int)offset);
+        return -1;
+    }
+    return storage_read_inode(inum, buf, size, offset);
+}
+
+// writes size bytes from the buffer to the file with this inode number
+int storage_write_inode(int inum, const char *buf, size_t size, off_t offset) {
+    assert(offset >= 0);
+    assert(size >= 0);
+    storage_lazy_write(inum); // goes out with the other changes
+    inode_t* node = get_inode(inum);
+    if (!node) {
+        return -1;
+    }
+    int new_size = offset + size;
+    if (size > 0) {
+        inode_touch(node, INODE_MTIME | INODE_CTIME);
+    }
+
+    // tiny files stay inside the inode until a write outgrows it
+    if (node->flags & INODE_INLINE) {
+        if (new_size <= INLINE_MAX) {
+            memcpy(inode_inline_data(node) + offset, buf, size);
+            if (new_size > node->size) {
+                node->size = new_size;
+            }
+            printf("DEBUG: storage_write_inode(%i, %zu, %d) -> (%zu) inline\n",
+                inum, size, (int)offset, size);
+            return size;
+        } else if (storage_uninline(inum, node) < 0) {
+            fprintf(stderr, "ERROR: storage_write_inode(%i, %zu, %d) -> Failed to move data out of the inode.\n",
+                inum, size, (int)offset);
+            return -1;
+        }
+    }
+
+    // a packed tail takes writes up to the end of its fragments, anything
+    // further needs the whole block back, and so does a write into fragments
+    // a snapshot still reads
+    int tail_end = inode_tail_end(node);
+    int tail_block = (node->blocks - 1) * BLOCK_SIZE;
+    if (tail_end >= 0 &&
+        (new_size > tail_end ||
+         (offset + size > tail_block &&
+          blocks_refs(inode_entry_block(inode_get_entry(node, node->blocks - 1))) > 0)) &&
+        inode_unpack_tail(node) < 0) {
+        fprintf(stderr, "ERROR: storage_write_inode(%i, %zu, %d) -> Failed to unpack the tail.\n",
+            inum, size, (int)offset);
+        return -1;
+    }
+
+    // compressed clusters in the way are written out raw again, and
+    // compressed files remember what to compress on the next flush
+    if (compress_expand(node, offset, new_size) < 0) {
+        fprintf(stderr, "ERROR: storage_write_inode(%i, %zu, %d) -> Failed to expand a cluster.\n",
+            inum, size, (int)offset);
+        return -1;
+    }
+    if (node->flags & INODE_COMPR) {
+        compress_dirty(inum, offset, new_size);
+    }
+
+    // appends past the allocated blocks are buffered and only get blocks
+    // once the file is flushed
+    int alloc_end = node->blocks * BLOCK_SIZE;
+    int direct = size; // bytes that go straight into allocated blocks
+    int buffered = 0;
+    if(new_size > alloc_end) {
+        direct = (offset < alloc_end) ? alloc_end - offset : 0;
+        printf("DEBUG: storage_write_inode(%i, %zu, %d) -> Buffering %zu bytes\n",
+            inum, size, (int)offset, size - direct);
+        buffered = delalloc_write(inum, node, buf + direct, size - direct, offset + direct);
+        if(buffered < 0) {
+            fprintf(stderr, "ERROR: storage_write_inode(%i, %zu, %d) -> Failed to buffer append.\n",
+                inum, size, (int)offset);
+            return -1;
+        }
+    }
+
+    // prepare writing variables
+    int bytesWritten = 0;
+    int bytesRem = direct;
+    while (bytesWritten < direct) {
+        // get address point to the offset in the data block, filling holes
+        char* start;
+        char* file_ptr = inode_write_tail_ptr(node, offset + bytesWritten);
+        if (file_ptr) {
+            start = file_ptr - ((offset + bytesWritten) % BLOCK_SIZE);
+        } else {
+            int bnum = inode_write_bnum(node, offset + bytesWritten);
+            if (bnum < 0) {
+                fprintf(stderr, "ERROR: storage_write() -> cannot find bnum\n");
+                return (bytesWritten > 0) ? bytesWritten : -1;
+            }
+            start = blocks_write_block(bnum);
+            file_ptr = start + ((offset + bytesWritten) % BLOCK_SIZE);
+        }
+        char* end = start + BLOCK_SIZE;
+        // printf("DEBUG: storage_write() -> {start: %p}\n", start);
+        // printf("DEBUG: storage_write() -> {file_ptr: %p}\n", file_ptr);
+        // printf("DEBUG: storage_write() -> {end: %p}\n", end);
+        
+        // calculate how many bytes to write to buffer
+        int bytesToWrite;
+        char* target = file_ptr + bytesRem;
+        if (target > end) {
+            bytesToWrite = end - file_ptr;
+        } else {
+            bytesToWrite = bytesRem;
+        }
+        printf("DEBUG: storage_write() -> bytes to write: %i\n", bytesToWrite);
+
+        // write to buffer and update inode
+        memcpy(file_ptr, buf + bytesWritten, bytesToWrite);
+        printf("DEBUG: storage_write() -> File pointer: %p\n", file_ptr);
+        printf("DEBUG: storage_write() -> Written:\"%s\"\n", file_ptr + bytesWritten);
+        
+        // update write variables
+        bytesWritten += bytesToWrite;
+        bytesRem -= bytesToWrite;
+    }
+
+    // update the inode with the new size
+    if (size + offset > node->size) {
+        node->size = size + offset;
+    }
+
+    printf("DEBUG: storage_write_inode(%i, %zu, %d) -> (%i)\n", 
+        inum, size, (int)offset, bytesWritten + buffered);
+    return bytesWritten + buffered;
+}
+
+// writes the file at this path from the buffer with the number of size bytes.
+int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
+    printf("DEBUG: storage_write(%s, %zu, %d) -> Called Function.\n",
+        path, size, (int)offset);
+
+    // case where the file can't be found
+    int inum = path_lookup(path);
+    if(inum < 0) {
+        fprintf(stderr, "ERROR: storage_write(%s, %zu, %d) -> Could not get inode from path.\n",
+            path, size, (int)offset);
+        return -1;
+    }
+    return storage_write_inode(inum, buf, size, offset);
+}
+
+// maps the byte range of the file at this path to runs of blocks in the disk
+// image, merging physically adjacent blocks into one extent. Returns the
+// number of extents, or 0 if part of the range has no blocks yet (such as
+// buffered appends) and has to go through storage_read/storage_write.
+int storage_map(const char *path, size_t size, off_t offset, int write,
+                storage_extent_t *exts, int max) {
+    printf("DEBUG: storage_map(%s, %zu, %d, %i) -> Called Function.\n",
+        path, size, (int)offset, write);
+    assert(offset >= 0);
+
+    int inum = path_lookup(path);
+    if (inum < 0) {
+        fprintf(stderr, "ERROR: storage_map(%s, %zu, %d) -> Cannot find file path\n",
+            path, size, (int)offset);
+        return -1;
+    }
+
+    inode_t* node = get_inode(inum);
+    if (!node) {
+        return -1;
+    }
+    assert(S_ISREG(node->mode));
+
+    if (!write && offset >= node->size) {
+        return 0; // nothing to read past the end of the file
+    } else if (!write && offset + size > node->size) {
+        size = node->size - offset;
+    }
+
+    if (offset + size > node->blocks * BLOCK_SIZE) {
+        return 0;
+    }
+
+    // walk the range one block at a time, extending the current run while
+    // the next block sits right after it in the image
+    int count = 0;
+    size_t mapped = 0;
+    while (mapped < size) {
+        // holes and unwritten blocks have nothing to point at, and shared
+        // blocks have to be copied before they are written
+        int bnum = inode_get_bnum(node, offset + mapped);
+        if (bnum < 0 || inode_is_unwritten(node, offset + mapped) ||
+            (write && blocks_refs(bnum) > 0)) {
+            return 0;
+        }
+        if (write) {
+            checksum_dirty(bnum); // written behind our back by splice
+        } else if (checksum_verify(bnum) < 0) {
+            return -1;
+        }
+
+        int in_block = (offset + mapped) % BLOCK_SIZE;
+        size_t len = BLOCK_SIZE - in_block;
+        if (len > size - mapped) {
+            len = size - mapped;
+        }
+        off_t pos = (off_t) bnum * BLOCK_SIZE + in_block;
+
+        if (count > 0 && exts[count - 1].pos + exts[count - 1].size == pos) {
+            exts[count - 1].size += len;
+        } else if (count < max) {
+            exts[count].pos = pos;
+            exts[count].size = len;
+            count++;
+        } else {
+            break; // out of room; the caller gets a short mapping
+        }
+        mapped += len;
+    }
+
+    // the same bookkeeping as storage_write_inode; the size only grows
+    // once the data is in, in storage_map_written
+    if (write && count > 0) {
+        storage_lazy_write(inum);
+        inode_touch(node, INODE_MTIME | INODE_CTIME);
+        if (node->flags & INODE_COMPR) {
+            compress_dirty(inum, offset, offset + mapped);
+        }
+    }
+
+    printf("DEBUG: storage_map(%s, %zu, %d) -> (%i)\n", path, size, (int)offset, count);
+    return count;
+}
+
+// grows the file at this path to cover the bytes written at offset into
+// the extents storage_map handed out
+void storage_map_written(const char *path, off_t offset, size_t written) {
+    int inum = path_lookup(path);
+    if (inum < 0) {
+        return;
+    }
+    inode_t* node = get_inode(inum);
+    if (node && offset + written > node->size) {
+        node->size = offset + written;
+    }
+}
+
+// zeroes the partial blocks at the edges of [start, end) that hold data
+static int storage_zero(inode_t *node, off_t start, off_t end) {
+    off_t pos = start;
+    while (pos < end) {
+        int in_block = pos % BLOCK_SIZE;
+        off_t chunk = BLOCK_SIZE - in_block;
+        if (chunk > end - pos) {
+            chunk = end - pos;
+        }
+        int bnum = inode_get_bnum(node, pos);
+        if (chunk < BLOCK_SIZE && bnum >= 0 && !inode_is_unwritten(node, pos)) {
+            bnum = inode_write_bnum(node, pos); // shared blocks get copied
+            if (bnum < 0) {
+                return -1;
+            }
+            memset((char *) blocks_write_block(bnum) + in_block, 0, chunk);
+        }
+        pos += chunk;
+    }
+    return 0;
+}
+
+// truncate the file with this inode number to the given size
+int storage_truncate_inode(int inum, size_t size) {
+    storage_lazy_write(inum); // goes out with the other changes
+    inode_t* node = get_inode(inum);
+    if (!node) {
+        return -1;
+    }
+    inode_touch(node, INODE_MTIME | INODE_CTIME);
+
+    // a file cut down to a few bytes moves back into the inode, and is no
+    // longer compressed
+    if (S_ISREG(node->mode) && size <= INLINE_MAX) {
+        char data[INLINE_MAX];
+        int kept = storage_read_inode(inum, data, size, 0);
+        if (kept < 0) {
+            fprintf(stderr, "ERROR: storage_truncate_inode(%i, %zu) -> Failed to read the data kept.\n",
+                inum, size);
+            return -1;
+        }
+        memset(data + kept, 0, size - kept);
+        delalloc_drop(inum);
+        if (node->blocks > 0) {
+            shrink_inode(node, node->blocks * BLOCK_SIZE);
+        }
+        if (!(node->flags & INODE_INLINE)) {
+            prealloc_release(inum);
+        }
+        if (node->flags & INODE_COMPR) {
+            compress_forget(inum);
+            node->flags &= ~INODE_COMPR;
+        }
+        inode_set_inline(node, data, size);
+        node->size = size;
+        return 0;
+    }
+    if ((node->flags & INODE_INLINE) && storage_uninline(inum, node) < 0) {
+        fprintf(stderr, "ERROR: storage_truncate_inode(%i, %zu) -> Failed to move data out of the inode.\n",
+            inum, size);
+        return -1;
+    }
+
+    // the block map gets cut or extended, so the tail needs its block back,
+    // and so does the cluster at the new end
+    int keep = (size < node->size) ? size : node->size;
+    if (inode_unpack_tail(node) < 0 ||
+        compress_expand(node, keep, (size > keep) ? size : keep + 1) < 0) {
+        fprintf(stderr, "ERROR: storage_truncate_inode(%i, %zu) -> Failed to unpack the tail.\n",
+            inum, size);
+        return -1;
+    }
+
+    // buffered appends past the new size are dropped, the rest get blocks
+    delalloc_t* da = delalloc_get(inum);
+    if (da && size <= da->start) {
+        delalloc_drop(inum);
+    } else if (da && delalloc_flush(inum) < 0) {
+        fprintf(stderr, "ERROR: storage_truncate_inode(%i, %zu) -> Could not flush appends.\n",
+            inum, size);
+        return -1;
+    }
+
+    // clear the tail of the last block kept, so the bytes between the
+    // smaller and the larger size read as zeros
+    int tail = inode_get_bnum(node, keep);
+    if (keep % BLOCK_SIZE && tail >= 0 && !inode_is_unwritten(node, keep)) {
+        tail = inode_write_bnum(node, keep); // shared blocks get copied
+        if (tail < 0) {
+            return -1;
+        }
+        char* block = blocks_write_block(tail);
+        memset(block + keep % BLOCK_SIZE, 0, BLOCK_SIZE - keep % BLOCK_SIZE);
+    }
+
+    // growing leaves a hole, shrinking frees the blocks past the new end
+    int maxSize = node->blocks * BLOCK_SIZE;
+    int rv = 0;
+    if (size > maxSize) {
+        printf("DEBUG: storage_truncate_inode(%i, %zu) -> Growing by %zu bytes\n", inum, size, (size - node->size));
+        rv = inode_extend(node, bytes_to_blocks(size));
+    } else if (maxSize > size) {
+        printf("DEBUG: storage_truncate_inode(%i, %zu) -> Shrinking by %zu bytes\n", inum, size, (node->size - size));
+        rv = shrink_inode(node, maxSize - size);
+    }
+    if (rv < 0) {
+        return rv;
+    }
+    node->size = size;
+    return 0;
+}
+
+// truncate the file to the given size
+int storage_truncate(const char *path, size_t size) {
+    printf("DEBUG: storage_truncate(%s, %zu) -> Called Function\n", path, size);
+    int inum = path_lookup(path);
+    if(inum < 0) {
+        fprintf(stderr, "ERROR: storage_truncate(%s, %zu) -> Could not get inode from path.\n",
+            path, size);
+        return -1;
+    }
+    return storage_truncate_inode(inum, size);
+}
+
+// allocates, punches out or zeroes the given byte range of the file
+int storage_fallocate(const char *path, int mode, off_t offset, off_t length) {
+    printf("DEBUG: storage_fallocate(%s, %#x, %ld, %ld) -> Called Function\n",
+        path, mode, offset, length);
+    int inum = path_lookup(path);
+    if (inum < 0) {
+        fprintf(stderr, "ERROR: storage_fallocate(%s) -> Could not get inode from path.\n", path);
+        return -1;
+    }
+    return storage_fallocate_inode(inum, mode, offset, length);
+}
+
+// allocates, punches out or zeroes the given byte range of the file with
+// this inode number
+int storage_fallocate_inode(int inum, int mode, off_t offset, off_t length) {
+    assert(offset >= 0 && length > 0);
+    storage_lazy_write(inum); // goes out with the other changes
+    inode_t* node = get_inode(inum);
+    if (!node) {
+        return -1;
+    }
+    assert(S_ISREG(node->mode));
+    inode_touch(node, INODE_MTIME | INODE_CTIME);
+
+    // inline files only need zeros for a punch, anything else wants blocks
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && (node->flags & INODE_INLINE)) {
+        if (offset < node->size) {
+            int len = (offset + length < node->size) ? length : node->size - offset;
+            memset(inode_inline_data(node) + offset, 0, len);
+        }
+        return 0;
+    }
+    if ((node->flags & INODE_INLINE) && storage_uninline(inum, node) < 0) {
+        return -1;
+    }
+
+    // appends waiting for blocks are written out so the block map is whole
+    if (delalloc_flush(inum) < 0 || inode_unpack_tail(node) < 0 ||
+        compress_expand(node, offset, offset + length) < 0) {
+        return -1;
+    }
+
+    off_t end = offset + length;
+    int first = offset / BLOCK_SIZE;
+    int last = bytes_to_blocks(end); // one past the last block touched
+    // blocks covered entirely by the range
+    int full_first = bytes_to_blocks(offset);
+    int full_last = end / BLOCK_SIZE;
+
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        // partial blocks at the edges are zeroed, the rest is freed
+        if (storage_zero(node, offset, end) < 0) {
+            return -1;
+        }
+        if (full_last > full_first) {
+            inode_punch(node, full_first, full_last - full_first);
+        }
+        return 0; // punching never changes the size
+    }
+
+    if (last > node->blocks && inode_extend(node, last) < 0) {
+        return -1;
+    }
+    if (mode & FALLOC_FL_ZERO_RANGE) {
+        // whole blocks read as zeros again without writing them
+        if (storage_zero(node, offset, end) < 0) {
+            return -1;
+        }
+        if (full_last > full_first) {
+            inode_mark_unwritten(node, full_first, full_last - full_first);
+        }
+    }
+    if (inode_alloc_range(node, first, last - first) < 0) {
+        return -1;
+    }
+
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > node->size) {
+        node->size = end;
+    }
+    return 0;
+}
+
+// makes length bytes of the file at to, starting at dst_off, share the
+// blocks of the file at from, starting at src_off; copy on write keeps the
+// two files apart afterwards. Offsets must be block aligned, and so must the
+// length unless the range runs to the end of both files. A length of 0
+// clones up to the end of the source
+int storage_clone(const char *from, const char *to, off_t src_off, off_t length, off_t dst_off) {
+    printf("DEBUG: storage_clone(%s, %s, %ld, %ld, %ld) -> Called Function\n",
+        from, to, src_off, length, dst_off);
+    int src_inum = path_lookup(from);
+    int dst_inum = path_lookup(to);
+    if (src_inum < 0 || dst_inum < 0 || src_inum == dst_inum) {
+        fprintf(stderr, "ERROR: storage_clone(%s, %s) -> Need two different files.\n", from, to);
+        return -1;
+    }
+    inode_t* src = get_inode(src_inum);
+    inode_t* dst = get_inode(dst_inum);
+    if (!src || !dst) {
+        return -1;
+    } else if (!S_ISREG(src->mode) || !S_ISREG(dst->mode)) {
+        fprintf(stderr, "ERROR: storage_clone(%s, %s) -> Not regular files.\n", from, to);
+        return -1;
+    }
+
+    if (length == 0) {
+        length = src->size - src_off;
+    }
+    off_t end = src_off + length;
+    if (src_off < 0 || dst_off < 0 || length < 0 || end > src->size ||
+        src_off % BLOCK_SIZE || dst_off % BLOCK_SIZE ||
+        (length % BLOCK_SIZE && (end < src->size || dst_off + length < dst->size))) {
+        fprintf(stderr, "ERROR: storage_clone(%s, %s) -> Range not block aligned.\n", from, to);
+        return -1;
+    }
+    if (length == 0) {
+        return 0;
+    }
+
+    // inline data has no blocks to share, it is copied
+    if (src->flags & INODE_INLINE) {
+        char data[INLINE_MAX];
+        memcpy(data, inode_inline_data(src), length);
+        return (storage_write(to, data, length, dst_off) < 0) ? -1 : 0;
+    }
+
+    // a whole file clone takes the block map as it is, compressed clusters
+    // included. Other ranges need raw blocks on both sides, since the
+    // clusters would not line up
+    int whole = src_off == 0 && dst_off == 0 && length == src->size && dst->size <= length;
+    if (delalloc_flush(src_inum) < 0 || (!whole && compress_expand(src, src_off, end) < 0)) {
+        return -1;
+    }
+    if (whole) {
+        if (storage_truncate(to, 0) < 0) {
+            return -1;
+        }
+        compress_forget(dst_inum);
+        inode_clear_inline(dst);
+    } else if (((dst->flags & INODE_INLINE) && storage_uninline(dst_inum, dst) < 0) ||
+               delalloc_flush(dst_inum) < 0 || inode_unpack_tail(dst) < 0 ||
+               compress_expand(dst, dst_off, dst_off + length) < 0) {
+        return -1;
+    }
+
+    int first_src = src_off / BLOCK_SIZE;
+    int first_dst = dst_off / BLOCK_SIZE;
+    int count = bytes_to_blocks(length);
+    if (first_dst + count > dst->blocks && inode_extend(dst, first_dst + count) < 0) {
+        return -1;
+    }
+
+    int tail = -1; // a packed tail is copied, fragments are not shared
+    for (int ii = 0; ii < count; ++ii) {
+        int entry = inode_get_entry(src, first_src + ii);
+        if (entry >= 0 && (entry & BNUM_FRAG)) {
+            tail = ii;
+            entry = BNUM_HOLE;
+        } else if (entry >= 0 && blocks_ref(entry & ~(BNUM_UNWRITTEN | BNUM_COMPR)) < 0) {
+            // the block has as many references as it can count, so this
+            // file gets its own copy
+            int copy = alloc_block();
+            if (copy < 0) {
+                return -1;
+            }
+            int bnum = entry & ~(BNUM_UNWRITTEN | BNUM_COMPR);
+            memcpy(blocks_write_block(copy), blocks_get_block(bnum), BLOCK_SIZE);
+            entry = copy | (entry & (BNUM_UNWRITTEN | BNUM_COMPR));
+        }
+        inode_punch(dst, first_dst + ii, 1);
+        inode_set_bnum(dst, first_dst + ii, entry);
+    }
+
+    if (dst_off + length > dst->size) {
+        dst->size = dst_off + length;
+    }
+    inode_touch(dst, INODE_MTIME | INODE_CTIME);
+    if (tail >= 0) {
+        int offset = (first_src + tail) * BLOCK_SIZE;
+        if (storage_write(to, inode_tail_ptr(src, offset), end - offset,
+                          dst_off + tail * BLOCK_SIZE) < 0) {
+            return -1;
+        }
+    }
+    printf("DEBUG: storage_clone(%s, %s) -> %i blocks shared\n", from, to, count);
+    return 0;
+}
+
+// creates a new inode for an entry at the path depending on given mode
+int storage_mknod(const char *path, int mode) {
+    printf("DEBUG: storage_mknod(%s, %i) -> Called Function.\n", path, mode);
+    int inum = path_lookup(path);
+    if (inum >= 0) {
+        fprintf(stderr, "ERROR: storage_mknod(%s, %i) -> Inode already exists!\n", path, mode);
+        return -1;
+    }
+    
+    // get the names of the child and parent
+    printf("DEBUG: storage_mknod(%s, %i) -> Getting name of parent.\n", path, mode);
+    char dir[strlen(path)];
+    get_parent(path, dir);
+
+    printf("DEBUG: storage_mknod(%s, %i) -> Getting name of child.\n", path, mode);
+    char sub[DIR_NAME_LENGTH];
+    get_child(path, sub);   
+
+    // DEBUGGING
+    printf("DEBUG: storage_mknod(%s, %i) -> Parent: %s\n", path, mode, dir);
+    printf("DEBUG: storage_mknod(%s, %i) -> Child: %s\n", path, mode, sub);
+
+    // get the parent inode
+    int parent_inum = path_lookup(dir);
+    if (parent_inum < 0) {
+        fprintf(stderr, "ERROR: storage_mknod(%s, %i) -> Parent Inode cannot be found!\n", 
+            path, mode);
+        return -1;
+    }
+    inode_t* parent_node = get_inode(parent_inum);
+    if (!parent_node) {
+        return -1;
+    }
+
+    // initialize the inode
+    int child_inum = alloc_inode_near(parent_inum, mode);
+    if (child_inum < 0) {
+        fprintf(stderr, "ERROR: storage_mknod(%s, %i) -> Could not allocate an inode!\n",
+            path, mode);
+        return -1;
+    }
+    inode_t* child_node = get_inode(child_inum);
+
+    // new entries of a compressed directory are compressed as well
+    child_node->flags |= parent_node->flags & INODE_COMPR;
+    
+    // if the given path is a directory
+    if (S_ISDIR(mode)) {
+        printf("DEBUG: storage_mknod(%s, %i) -> Creating self and parent reference.\n", 
+            path, mode);
+        // set the child directory's default entries; refs counts the
+        // entries of a directory, and there are none yet
+        child_node->refs = 0;
+        directory_put(child_node, ".", child_inum);
+        directory_put(child_node, "..", parent_inum);
+    } else {
+        child_node->refs = 1;
+    }
+
+    // a parent that is full or corrupt gets no entry, and the inode goes
+    if (directory_put(parent_node, sub, child_inum) <= 0) {
+        fprintf(stderr, "ERROR: storage_mknod(%s, %i) -> Could not add the entry!\n", path, mode);
+        free_inode(child_inum);
+        return -1;
+    }
+    printf("DEBUG: storage_mknod(%s, %i) -> Printing directory entries\n", path, mode);
+    print_directory(parent_node);
+    return 0;
+}
+
+// unlink the given path from the disk
+int storage_unlink(const char *path) {
+    printf("DEBUG: storage_unlink(%s) -> Called Function.\n", path);
+    // get the names of the child and parent
+    char* dir = (char *) malloc(strlen(path) + 10);
+    char* sub = (char *) malloc(strlen(path) + 10);
+    get_child(path, sub);
+    get_parent(path, dir);
+
+    int parent_inum = path_lookup(dir);
+    if (parent_inum < 0) {
+        fprintf(stderr, "ERROR: storage_unlink(%s) -> Parent Inode cannot be found!\n", path);
+        free(sub);
+        free(dir);
+        return -1;
+    }
+    
+    inode_t* parent_node = get_inode(parent_inum);
+    int del = directory_delete(parent_node, sub);
+    if (del == 0) {
+        pthread_cond_signal(&cleaner_wake); // the orphan is freed from there
+    }
+    printf("DEBUG: storage_unlink(%s) -> (%i)\n", path, del);
+    free(sub);
+    free(dir);
+    return del;
+}
+
+// link the given name of the directories
+int storage_link(const char *from, const char *to) {
+    // if the paths are the same
+    if(!strcmp(from, to)) {
+        return 0;
+    }
+
+    // make sure from exist
+    int from_inum = path_lookup(from);
+    if (from_inum < 0) {
+        fprintf(stderr, "ERROR: storage_link(%s, %s) -> Could not find path \'from\'.\n", from, to);
+        return -1;
+    }
+
+    // make sure 'to' exist
+    int to_inum = path_lookup(to);
+
+    // case where the destination doesn't exist
+    if (to_inum < 0) {
+        fprintf(stderr, "ERROR: storage_link(%s, %s) -> Could not find path \'to\'.\n", from, to);
+        storage_mknod(to, DIR_MODE | 0775);
+        to_inum = path_lookup(to);
+    }
+
+    // get the inode for 'to' path
+    inode_t* to_node = (to_inum >= 0) ? get_inode(to_inum) : NULL;
+    inode_t* from_inode = get_inode(from_inum);
+    inode_t* dir_inode;
+    if (!to_node || !from_inode) {
+        return -1;
+    }
+
+    // allocate memory for the 'to'  directory
+    char *dir = (char *) malloc(strlen(to) + 1);
+
+    // get the name of the file or directory
+    char *sub = (char *) malloc(DIR_NAME_LENGTH);
+    get_child(from, sub);
+
+    // if the 'to' path is a file
+    if(S_ISREG(to_node->mode)) {
+        // set parent and child names
+        get_parent(to, dir);
+        get_child(to, sub);
+
+        // get the directory inode of the 'to' path
+        dir_inode = get_inode(path_lookup(dir));
+
+        // add it to the directory with the name of the file
+        directory_put(dir_inode, sub, from_inum);
+    } else {
+        // assert that the 'to' path is a directory
+        assert(S_ISDIR(to_node->mode));
+
+        // add the file/directory to the entries
+        directory_put(to_node, sub, from_inum);
+    }
+
+    // clear the memory from the allocated variable
+    free(sub);
+    free(dir);
+    return 0;
+}
+
+// renames the file or directory. What is at the new name is replaced if
+// POSIX allows it: a file by a file, an empty directory by a directory.
+// Returns 0, -ENOTEMPTY, -EISDIR or -ENOTDIR when the new name cannot be
+// replaced, or -1 otherwise
+int storage_rename(const char *from, const char *to) {
+    printf("DEBUG: storage_rename(%s, %s) -> Called function.\n", from, to);
+
+    // make sure the from path exists
+    int from_inum = path_lookup(from);
+    if(from_inum < 0) {
+        fprintf(stderr, "ERROR: storage_rename(%s, %s) -> Cannot find given \'from\' path\n", from, to);
+        return -1;
+    }
+    if (path_lookup(to) == from_inum) {
+        return 0; // the same name, or another link to the same file
+    }
+
+    // a directory cannot move into itself
+    size_t len = strlen(from);
+    if (!strncmp(from, to, len) && to[len] == '/') {
+        fprintf(stderr, "ERROR: storage_rename(%s, %s) -> Destination is inside the source\n", from, to);
+        return -1;
+    }
+
+    // get the names of the parents and the children
+    char* from_dir = (char *) malloc(strlen(from) + 10);
+    char* from_sub = (char *) malloc(strlen(from) + 10);
+    char* to_dir = (char *) malloc(strlen(to) + 10);
+    char* to_sub = (char *) malloc(strlen(to) + 10);
+    get_parent(from, from_dir);
+    get_child(from, from_sub);
+    get_parent(to, to_dir);
+    get_child(to, to_sub);
+    int from_parent = path_lookup(from_dir);
+    int to_parent = path_lookup(to_dir);
+
+    int rv = -1;
+    inode_t *node = get_inode(from_inum);
+    inode_t *from_pnode = (from_parent >= 0) ? get_inode(from_parent) : NULL;
+    inode_t *to_pnode = (to_parent >= 0) ? get_inode(to_parent) : NULL;
+    int to_inum = path_lookup(to);
+    inode_t *to_node = (to_inum >= 0) ? get_inode(to_inum) : NULL;
+    if (!node || !from_pnode || !to_pnode || strlen(to_sub) >= DIR_NAME_LENGTH ||
+        (to_inum >= 0 && !to_node)) {
+        fprintf(stderr, "ERROR: storage_rename(%s, %s) -> Cannot find the parents\n", from, to);
+    } else if (to_node && S_ISDIR(to_node->mode) != S_ISDIR(node->mode)) {
+        fprintf(stderr, "ERROR: storage_rename(%s, %s) -> Not the same type\n", from, to);
+        rv = S_ISDIR(to_node->mode) ? -EISDIR : -ENOTDIR;
+    } else if (to_node && S_ISDIR(to_node->mode) && to_node->refs > 2) {
+        // only "." and ".." may be left in a directory that is replaced
+        fprintf(stderr, "ERROR: storage_rename(%s, %s) -> Destination is not empty\n", from, to);
+        rv = -ENOTEMPTY;
+    } else if (!to_node || directory_delete(to_pnode, to_sub) == 0) {
+        if (to_node) {
+            pthread_cond_signal(&cleaner_wake); // what was replaced is an orphan
+        }
+        // the new entry goes in first, so the inode is never unnamed
+        if (directory_put(to_pnode, to_sub, from_inum) > 0) {
+            directory_remove(from_pnode, from_sub);
+            dirent_t *entries = S_ISDIR(node->mode) && from_parent != to_parent
+                ? inode_write_block(node, 0) : NULL;
+            for (int ii = 0; entries && ii < node->refs; ++ii) {
+                if (!strcmp(entries[ii].name, "..")) {
+                    entries[ii].inum = to_parent;
+                }
+            }
+            rv = 0;
+        }
+    }
+    printf("DEBUG: storage_rename(%s, %s) -> (%i)\n", from, to, rv);
+    free(from_dir);
+    free(from_sub);
+    free(to_dir);
+    free(to_sub);
+    return rv;
+}
+
+// set the time of the given file to the given timespec
+int storage_set_time(const char *path, const struct timespec ts[2]) {
+    int inum = path_lookup(path);
+    if (inum < 0) {
+        fprintf(stderr, "ERROR: storage_set_time(%s) -> Could not find inode of given path.\n", path);
+        return -1;
+    }
+
+    storage_lazy_write(inum);
+    inode_t* node = get_inode(inum);
+    if (!node) {
+        return -1;
+    }
+    if (ts[0].tv_nsec == UTIME_NOW || ts[1].tv_nsec == UTIME_NOW) {
+        inode_touch(node, (ts[0].tv_nsec == UTIME_NOW ? INODE_ATIME : 0) |
+                          (ts[1].tv_nsec == UTIME_NOW ? INODE_MTIME : 0));
+    }
+    if (ts[0].tv_nsec != UTIME_NOW && ts[0].tv_nsec != UTIME_OMIT) {
+        node->atime = ts[0].tv_sec;
+        node->atime_ns = ts[0].tv_nsec;
+    }
+    if (ts[1].tv_nsec != UTIME_NOW && ts[1].tv_nsec != UTIME_OMIT) {
+        node->mtime = ts[1].tv_sec;
+        node->mtime_ns = ts[1].tv_nsec;
+    }
+    printf("DEBUG: storage_set_time(%s) -> (0)\n", path);
+    return 0;
+}
+
+// get the attribute flags (FS_*_FL) of the inode at this path
+int storage_get_flags(const char *path) {
+    int inum = path_lookup(path);
+    if (inum < 0) {
+        fprintf(stderr, "ERROR: storage_get_flags(%s) -> Could not find inode of given path.\n", path);
+        return -1;
+    }
+    inode_t* node = get_inode(inum);
+    if (!node) {
+        return -1;
+    }
+    return (node->flags & INODE_COMPR) ? FS_COMPR_FL : 0;
+}
+
+// set the attribute flags (FS_*_FL) of the inode at this path; only
+// FS_COMPR_FL is supported. Data already on disk is compressed once it is
+// written again
+int storage_set_flags(const char *path, int flags) {
+    printf("DEBUG: storage_set_flags(%s, %#x) -> Called Function\n", path, flags);
+    int inum = path_lookup(path);
+    if (inum < 0 || (flags & ~FS_COMPR_FL)) {
+        fprintf(stderr, "ERROR: storage_set_flags(%s, %#x) -> Unsupported flags.\n", path, flags);
+        return -1;
+    }
+    inode_t* node = get_inode(inum);
+    if (!node) {
+        return -1;
+    }
+    if (flags & FS_COMPR_FL) {
+        node->flags |= INODE_COMPR;
+    } else {
+        node->flags &= ~INODE_COMPR;
+    }
+    return 0;
+}
+
+// return the names of the directories
+slist_t *storage_list(const char *path) {
+    return directory_list(path);
+}
+
+// creates the state of a new file handle for the file at this path
+storage_file_t *storage_open(const char *path) {
+    int inum = path_lookup(path);
+    if (inum < 0) {
+        fprintf(stderr, "ERROR: storage_open(%s) -> Could not find inode of given path.\n", path);
+        return NULL;
+    }
+
+    storage_file_t *file = (storage_file_t *) malloc(sizeof(storage_file_t));
+    file->inum = inum;
+    ra_init(&file->ra);
+    printf("DEBUG: storage_open(%s) -> %p\n", path, file);
+    return file;
+}
+
+// writes out the buffered appends of the file behind this handle
+int storage_flush(storage_file_t *file) {
+    if (!file || read_only) {
+        return 0;
+    }
+    if (delalloc_flush(file->inum) < 0) {
+        return -1;
+    }
+    storage_lazy_write(file->inum);
+
+    // compress what was written, then move the partial last block of a
+    // small file into a shared fragment block
+    inode_t *node = get_inode(file->inum);
+    if (!node) {
+        return -1;
+    }
+    compress_file(node);
+    inode_pack_tail(node);
+    return 0;
+}
+
+// writes out the buffered appends of every file; -1 if some of them could
+// not get blocks, they stay buffered
+int storage_flush_all() {
+    int rv = delalloc_flush_all();
+    storage_lazy_write_all();
+    if (rv < 0) {
+        fprintf(stderr, "ERROR: storage_flush_all() -> Could not flush every append.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// releases the state of a closed file handle
+void storage_release(storage_file_t *file) {
+    if (!file) {
+        return;
+    }
+    storage_flush(file);
+    prealloc_release(file->inum);
+    ra_release(&file->ra);
+    free(file);
+}
+
+// tracks a read through this file handle and prefetches ahead of streams
+void storage_readahead(storage_file_t *file, off_t offset, size_t size) {
+    if (!file) {
+        return;
+    }
+    inode_t *node = get_inode(file->inum);
+    if (node) {
+        ra_access(&file->ra, node, offset, size);
+    }
+}
+
+// takes a snapshot of the whole file system, buffered appends included
+int storage_snapshot_create(const char *name) {
+    if (read_only) {
+        return -1;
+    }
+    if (delalloc_flush_all() < 0) {
+        return -1;
+    }
+    return snapshot_create(name);
+}
+
+// deletes a snapshot; the cleaner thread gives its blocks back
+int storage_snapshot_delete(const char *name) {
+    if (read_only || snapshot_delete(name) < 0) {
+        return -1;
+    }
+    pthread_cond_signal(&cleaner_wake);
+    return 0;
+}
+
+// lists the snapshots for NUFS_IOC_SNAP_LIST
+void storage_snapshot_list(nufs_snap_list_t *list) {
+    memset(list, 0, sizeof(nufs_snap_list_t));
+    snapshot_t *snaps = snapshot_table();
+    for (int ii = 0; ii < SNAPSHOT_MAX; ++ii) {
+        if (snaps[ii].table) {
+            nufs_snap_t *snap = &list->snaps[list->count++];
+            memcpy(snap->name, snaps[ii].name, SNAPSHOT_NAME_LENGTH);
+            snap->ctime = snaps[ii].ctime;
+            snap->deleting = snaps[ii].state == SNAPSHOT_DELETING;
+        }
+    }
+}
+
+// punches the free runs asked for by NUFS_IOC_TRIM out of the image file;
+// the byte range is narrowed to whole blocks, and len comes back as the
+// bytes punched
+int storage_trim(nufs_trim_t *req) {
+    uint64_t end = req->start + req->len < req->start ? UINT64_MAX : req->start + req->len;
+    uint64_t first = (req->start + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint64_t last = end / BLOCK_SIZE;
+    int minlen = bytes_to_blocks(req->minlen < BLOCK_SIZE ? BLOCK_SIZE : req->minlen);
+    req->len = 0;
+    if (first >= (uint64_t) blocks_count() || last <= first || req->minlen > (uint64_t) BLOCK_SIZE * BLOCK_COUNT_MAX) {
+        return -1;
+    }
+    if (last > (uint64_t) blocks_count()) {
+        last = blocks_count();
+    }
+    int punched = blocks_trim(first, last - first, minlen);
+    req->len = (uint64_t) punched * BLOCK_SIZE;
+    printf("DEBUG: storage_trim(%i, %i) -> %i blocks\n", (int) first, (int) last, punched);
+    return 0;
+}
+
+// grows the image to the size asked for by NUFS_IOC_GROW, rounded up to
+// whole blocks; size comes back as the size of the image, so 0 asks for it
+int storage_grow(nufs_grow_t *req) {
+    if (req->size > (uint64_t) BLOCK_SIZE * BLOCK_COUNT_MAX) {
+        return -1;
+    }
+    int count = blocks_grow(bytes_to_blocks(req->size));
+    printf("DEBUG: storage_grow(%i) -> %i blocks\n", (int) req->size, count);
+    if (count < 0) {
+        return -1;
+    }
+    req->size = (uint64_t) count * BLOCK_SIZE;
+    return 0;
+}
+
+// moves the blocks of a file into one run for NUFS_IOC_DEFRAG; its buffered
+// appends are written out first, so they end up in the run too
+int storage_defrag(const char *path, nufs_defrag_t *res) {
+    memset(res, 0, sizeof(nufs_defrag_t));
+    int inum = path_lookup(path);
+    if (inum < 0 || delalloc_flush(inum) < 0) {
+        return -1;
+    }
+    inode_t *node = get_inode(inum);
+    if (!node) {
+        return -1;
+    }
+    res->extents_before = inode_extents(node);
+    int moved = defrag_inode(node);
+    res->extents_after = inode_extents(node);
+    res->moved = (moved > 0) ? moved : 0;
+    printf("DEBUG: storage_defrag(%s) -> %i blocks moved\n", path, moved);
+    return (moved < 0) ? -1 : 0;
+}
+
+// collects the counters reported through NUFS_IOC_GET_STATS
+void storage_get_stats(nufs_stats_t *stats) {
+    memset(stats, 0, sizeof(nufs_stats_t));
+    ra_stats_t *ra = ra_get_stats();
+    stats->ra_streams = ra->streams;
+    stats->ra_prefetched = ra->prefetched;
+    stats->ra_hits = ra->hits;
+    stats->ra_wasted = ra->wasted;
+
+    delalloc_stats_t *da = delalloc_get_stats();
+    stats->alloc_calls = blocks_alloc_calls();
+    stats->da_buffered = da->buffered;
+    stats->da_flushes = da->flushes;
+
+    // fragmentation: how many extents the regular files are stored in
+    stats->prealloc_held = blocks_held_count();
+    int frags;
+    stats->frag_blocks = frag_count(&frags);
+    stats->frags = frags;
+
+    compress_stats_t *cs = compress_get_stats();
+    stats->compr_clusters = cs->clusters;
+    stats->compr_raw = cs->raw;
+    stats->compr_saved = cs->saved;
+    stats->compr_cache_hits = cs->cache_hits;
+    stats->compr_cache_misses = cs->cache_misses;
+    long mapped = 0; // blocks the files point at, shared ones counted every time
+    for (int ii = 0; ii < blocks_inode_capacity(); ++ii) {
+        if (!bitmap_get(get_inode_bitmap(), ii)) {
+            continue;
+        }
+        inode_t *node = get_inode(ii);
+        if (node && S_ISREG(node->mode) && node->blocks > 0) {
+            stats->files++;
+            stats->extents += inode_extents(node);
+            for (int bb = 0; bb < node->blocks; ++bb) {
+                mapped += inode_get_bnum(node, bb * BLOCK_SIZE) >= 0;
+            }
+        }
+    }
+
+    // dedup: every extra reference is a block that is not stored twice
+    dedup_stats_t *dd = dedup_get_stats();
+    stats->dedup_hashed = dd->hashed;
+    stats->dedup_matched = dd->matched;
+    stats->dedup_cow = dd->cow;
+    stats->dedup_index_bytes = dedup_index_bytes();
+    for (int ii = 1; ii < blocks_count(); ++ii) {
+        int refs = blocks_refs(ii);
+        stats->dedup_shared += refs > 0;
+        stats->dedup_saved += refs;
+    }
+    stats->dedup_ratio_pct = (mapped > stats->dedup_saved)
+        ? mapped * 100 / (mapped - stats->dedup_saved) : 100;
+
+    checksum_stats_t *sums = checksum_get_stats();
+    stats->csum_verified = sums->verified;
+    stats->csum_errors = sums->errors;
+    stats->csum_scrubbed = sums->scrubbed;
+    stats->csum_passes = sums->passes;
+    stats->discarded = blocks_discarded();
+
+    defrag_stats_t *df = defrag_get_stats();
+    stats->defrag_files = df->files;
+    stats->defrag_moved = df->moved;
+    stats->defrag_skipped = df->skipped;
+}
+
+// set the parent path to the given str
+void get_parent(const char *path, char* str) {
+    printf("DEBUG: get_parent(%s) -> Called Function.\n", path);
+    slist_t* path_names = slist_explode(path, '/');
+    slist_t* copy = path_names;
+    str[0] = '\0';
+    // the case where the first string is a slash
+    if(!strcmp(copy->data, "") && copy->next) {
+        strcat(str, "/"); // will always add the root
+        copy = copy->next; // go to the next case
+    }
+
+    while (copy->next) {
+        printf("DEBUG: get_parent(%s) -> str: %s\n", path, str);
+        if (strcmp(str, "/")){
+            strcat(str, "/");
+        }
+        strncat(str, copy->data, strlen(copy->data) + 1);
+        copy = copy->next;
+    }
+
+    printf("DEBUG: get_parent(%s) -> Parent: %s\n", path, str);
+    slist_free(path_names);
+}
+
+// set the child name to the given str and given full path
+void get_child(const char *path, char* str) {
+    // DEBUG: Enter in the function
+    printf("DEBUG: get_child(%s) -> Called Function.\n", path);
+    slist_t* path_names = slist_explode(path, '/');
+    slist_t* copy = path_names;
+    printf("DEBUG: get_child(%s) -> Exploding path into an slist\n", path);
+    print_list(copy);
+
+    // the case where the first string is a slash
+    if(!strcmp(copy->data, "") && copy->next) {
+        copy = copy->next; // go to the next case
+    }
+
+    // go through the list until the last one
+    while(copy->next || !strcmp(copy->data, "")) {
+        printf("DEBUG: get_child(%s) -> Curr Name: %s\n", path, copy->data);
+        copy = copy->next; // skip to the end
+    }
+
+    // copy data into the string
+    strcpy(str, copy->data);
+    slist_free(path_names);
+
+    // DEBUG: Output of the function
+    printf("DEBUG: get_child(%s) -> Child: %s\n", path, str);
+}
@@ -8,6 +8,7 @@
 #define NUFS_STORAGE_H
 
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
@@ -18,19 +19,89 @@
 #include "directory.h"
 #include "bitmap.h"
 #include "inode.h"
+#include "readahead.h"
+#include "delalloc.h"
+#include "prealloc.h"
+#include "frag.h"
+#include "compress.h"
+#include "dedup.h"
+#include "snapshot.h"
+#include "checksum.h"
+#include "orphan.h"
+#include "defrag.h"
+#include "nufs_ioctl.h"
 
-void storage_init(const char *path);
+// how an access updates the access time (storage_options_t.atime)
+#define STORAGE_RELATIME 0    // once after each change of the file, and once a day
+#define STORAGE_NOATIME 1     // never
+#define STORAGE_STRICTATIME 2 // on every access
+
+#define RELATIME_SECS (24 * 60 * 60) // relatime updates an access time this old
+#define LAZYTIME_SECS (60 * 60)      // lazytime writes access times back this often
+
+// features chosen at mount time
+typedef struct storage_options {
+    int dedup;            // deduplicate blocks as they are written out
+    const char *snapshot; // mount this snapshot read only instead of the live tree
+    int noverify;         // keep checksums but do not verify reads against them
+    int atime;            // STORAGE_RELATIME, STORAGE_NOATIME or STORAGE_STRICTATIME
+    int lazytime;         // keep access times in memory until the inode is written
+    int discard;          // punch freed blocks out of the image file in the background
+    int grow;             // blocks the image grows by when it runs out, 0 for never
+} storage_options_t;
+
+// a contiguous run of file data inside the disk image
+typedef struct storage_extent {
+    off_t pos;   // byte offset of the run in the disk image
+    size_t size; // length of the run in bytes
+} storage_extent_t;
+
+// state kept for every open file handle
+typedef struct storage_file {
+    int inum;      // inode of the open file
+    ra_state_t ra; // sequential readahead of this handle
+} storage_file_t;
+
+int storage_init(const char *path, const storage_options_t *opts);
+void storage_start_cleaner();
+void storage_lock();
+void storage_unlock();
+int storage_read_only();
 int storage_access(const char *path);
 int storage_stat(const char *path, struct stat *st);
+void storage_statfs(struct statvfs *st);
 int storage_read(const char *path, char *buf, size_t size, off_t offset);
+int storage_read_inode(int inum, char *buf, size_t size, off_t offset);
 int storage_write(const char *path, const char *buf, size_t size, off_t offset);
+int storage_write_inode(int inum, const char *buf, size_t size, off_t offset);
 int storage_truncate(const char *path, size_t size);
+int storage_truncate_inode(int inum, size_t size);
+int storage_fallocate(const char *path, int mode, off_t offset, off_t length);
+int storage_fallocate_inode(int inum, int mode, off_t offset, off_t length);
+int storage_clone(const char *from, const char *to, off_t src_off, off_t length, off_t dst_off);
+int storage_map(const char *path, size_t size, off_t offset, int write,
+                storage_extent_t *exts, int max);
+void storage_map_written(const char *path, off_t offset, size_t written);
 int storage_mknod(const char *path, int mode);
 int storage_unlink(const char *path);
 int storage_link(const char *from, const char *to);
 int storage_rename(const char *from, const char *to);
 int storage_set_time(const char *path, const struct timespec ts[2]);
+int storage_get_flags(const char *path);
+int storage_set_flags(const char *path, int flags);
 slist_t *storage_list(const char *path);
+storage_file_t *storage_open(const char *path);
+int storage_flush(storage_file_t *file);
+int storage_flush_all();
+void storage_release(storage_file_t *file);
+void storage_readahead(storage_file_t *file, off_t offset, size_t size);
+void storage_get_stats(nufs_stats_t *stats);
+int storage_snapshot_create(const char *name);
+int storage_snapshot_delete(const char *name);
+void storage_snapshot_list(nufs_snap_list_t *list);
+int storage_trim(nufs_trim_t *req);
+int storage_grow(nufs_grow_t *req);
+int storage_defrag(const char *path, nufs_defrag_t *res);
 void get_parent(const char *path, char *str);
 void get_child(const char *path, char *str);
 
@@ -9,14 +9,14 @@ int main(int argc, char **argv) {
   blocks_init(TEST_NAME);
 
   printf("Block bitmap at the beginning:\n");
-  bitmap_print(get_blocks_bitmap(), BLOCK_COUNT);
+  bitmap_print(get_blocks_bitmap(), blocks_count());
 
   int block_num = alloc_block();
 
   printf("Allocated block no. %d\n", block_num);
 
   printf("Block bitmap after allocating:\n");
-  bitmap_print(get_blocks_bitmap(), BLOCK_COUNT);
+  bitmap_print(get_blocks_bitmap(), blocks_count());
 
   long *block = blocks_get_block(block_num);
 
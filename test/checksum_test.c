@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../checksum.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);          \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+// the CRC of the buffer with the tables, and with the instruction if the
+// CPU has one
+static uint32_t crc_sw(uint32_t crc, const void *data, size_t len) {
+  checksum_use_hw(0);
+  crc = crc32c(crc, data, len);
+  checksum_use_hw(1);
+  return crc;
+}
+
+int main(int argc, char **argv) {
+  int hw = checksum_hw();
+  printf("CRC instruction: %s\n", hw ? "yes" : "no");
+
+  // the check value of CRC-32C
+  CHECK(crc32c(0, "123456789", 9) == 0xe3069283);
+  CHECK(crc_sw(0, "123456789", 9) == 0xe3069283);
+  CHECK(crc32c(0, "", 0) == 0);
+  // a CRC can be carried on over the next piece
+  CHECK(crc32c(crc32c(0, "1234", 4), "56789", 5) == 0xe3069283);
+  CHECK(crc_sw(crc_sw(0, "12345", 5), "6789", 4) == 0xe3069283);
+
+  // both ways agree at every alignment and length around a word
+  static uint8_t buf[BLOCK_SIZE + 16];
+  srand(42);
+  for (int ii = 0; ii < (int) sizeof(buf); ++ii) {
+    buf[ii] = rand();
+  }
+  int lens[] = {0, 1, 3, 7, 8, 9, 15, 16, 17, 63, 64, 65, 1000, BLOCK_SIZE - 1, BLOCK_SIZE};
+  int checked = 0;
+  for (int off = 0; off < 16; ++off) {
+    for (int ii = 0; ii < (int) (sizeof(lens) / sizeof(lens[0])); ++ii) {
+      uint32_t want = crc_sw(0, buf + off, lens[ii]);
+      CHECK(crc32c(0, buf + off, lens[ii]) == want);
+      // and split at an odd place
+      int half = lens[ii] / 2 | 1;
+      if (half <= lens[ii]) {
+        CHECK(crc32c(crc32c(0, buf + off, half), buf + off + half, lens[ii] - half) == want);
+      }
+      checked++;
+    }
+  }
+  checksum_use_hw(0);
+  CHECK(!checksum_hw());
+  checksum_use_hw(1);
+  CHECK(checksum_hw() == hw);
+  printf("%d buffers compared\n", checked);
+
+  printf("checksum_test: %d failures\n", failures);
+  return failures != 0;
+}
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../compress.h"
+
+// room past the end of every output buffer that must stay untouched
+#define CANARY 64
+
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);          \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+static uint8_t src[CLUSTER_SIZE];
+static uint8_t packed[2 * CLUSTER_SIZE + CANARY];
+static uint8_t unpacked[CLUSTER_SIZE + CANARY];
+
+static uint32_t seed = 42;
+
+// xorshift, so every run sees the same data
+static uint32_t next() {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static int canary_intact(const uint8_t *end) {
+  for (int ii = 0; ii < CANARY; ++ii) {
+    if (end[ii] != 0xA5) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// words drawn at random from a short list, which compresses some
+static void fill_random(int len) {
+  static const char *words[] = {"inode", "block", "bitmap", "extent", " ", "\n", "nufs"};
+  int ii = 0;
+  while (ii < len) {
+    const char *word = words[next() % 7];
+    for (int jj = 0; word[jj] && ii < len; ++jj) {
+      src[ii++] = word[jj];
+    }
+  }
+}
+
+static void fill_repetitive(int len) {
+  for (int ii = 0; ii < len; ++ii) {
+    src[ii] = "abcabcabd"[ii % 9];
+  }
+}
+
+static void fill_incompressible(int len) {
+  for (int ii = 0; ii < len; ++ii) {
+    src[ii] = next();
+  }
+}
+
+// compress and decompress len bytes of src; returns the stream length
+static int round_trip(const char *name, int len) {
+  // worst case: one literal run with a length byte per 255
+  int cap = len + len / 255 + 16;
+  memset(packed, 0xA5, sizeof(packed));
+  memset(unpacked, 0xA5, sizeof(unpacked));
+  int plen = lz_compress(src, len, packed, cap);
+  CHECK(plen >= 0 && plen <= cap);
+  CHECK(canary_intact(packed + cap));
+  if (plen < 0) {
+    return -1;
+  }
+  int got = lz_decompress(packed, plen, unpacked, len);
+  CHECK(got == len);
+  CHECK(memcmp(unpacked, src, len) == 0);
+  CHECK(canary_intact(unpacked + len));
+  printf("%-14s %6d -> %6d bytes\n", name, len, plen);
+  return plen;
+}
+
+int main(int argc, char **argv) {
+  int sizes[] = {0, 1, 4, 5, 100, BLOCK_SIZE, CLUSTER_SIZE};
+  for (int ii = 0; ii < 7; ++ii) {
+    fill_random(sizes[ii]);
+    round_trip("random", sizes[ii]);
+    fill_repetitive(sizes[ii]);
+    round_trip("repetitive", sizes[ii]);
+    fill_incompressible(sizes[ii]);
+    round_trip("incompressible", sizes[ii]);
+  }
+
+  // repetitive data compresses well, random bytes not at all
+  fill_repetitive(CLUSTER_SIZE);
+  int small = round_trip("repetitive", CLUSTER_SIZE);
+  CHECK(small > 0 && small < CLUSTER_SIZE / 100);
+  fill_incompressible(CLUSTER_SIZE);
+  CHECK(round_trip("incompressible", CLUSTER_SIZE) >= CLUSTER_SIZE);
+
+  // a stream that does not fit in cap fails without writing past it
+  memset(packed, 0xA5, sizeof(packed));
+  CHECK(lz_compress(src, CLUSTER_SIZE, packed, CLUSTER_SIZE - BLOCK_SIZE) == -1);
+  CHECK(canary_intact(packed + CLUSTER_SIZE - BLOCK_SIZE));
+  fill_repetitive(CLUSTER_SIZE);
+  int exact = lz_compress(src, CLUSTER_SIZE, packed, sizeof(packed));
+  memset(packed, 0xA5, sizeof(packed));
+  CHECK(lz_compress(src, CLUSTER_SIZE, packed, exact - 1) == -1);
+  CHECK(canary_intact(packed + exact - 1));
+  CHECK(lz_compress(src, CLUSTER_SIZE, packed, exact) == exact);
+
+  // so does data that does not fit in the cap of lz_decompress
+  memset(unpacked, 0xA5, sizeof(unpacked));
+  CHECK(lz_decompress(packed, exact, unpacked, CLUSTER_SIZE - 1) == -1);
+  CHECK(canary_intact(unpacked + CLUSTER_SIZE - 1));
+
+  // a cut short stream gives either an error or a prefix of the data
+  for (int len = 0; len < exact; ++len) {
+    memset(unpacked, 0xA5, sizeof(unpacked));
+    int got = lz_decompress(packed, len, unpacked, CLUSTER_SIZE);
+    CHECK(got == -1 || (got <= CLUSTER_SIZE && memcmp(unpacked, src, got) == 0));
+    CHECK(canary_intact(unpacked + CLUSTER_SIZE));
+  }
+
+  // garbage never writes past cap
+  for (int round = 0; round < 20000; ++round) {
+    int len = next() % 512;
+    int cap = next() % BLOCK_SIZE;
+    for (int ii = 0; ii < len; ++ii) {
+      packed[ii] = next();
+    }
+    memset(unpacked, 0xA5, cap + CANARY);
+    int got = lz_decompress(packed, len, unpacked, cap);
+    CHECK(got >= -1 && got <= cap);
+    CHECK(canary_intact(unpacked + cap));
+  }
+
+  printf("compress_test: %d failures\n", failures);
+  return failures != 0;
+}
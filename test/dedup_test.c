@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../storage.h"
+
+#define IMAGE "test/dedup_test.img"
+#define BLOCKS 4 // blocks of the shared data
+
+static FILE *out;
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(out, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);    \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+static char data[BLOCKS * BLOCK_SIZE];
+static char got[BLOCKS * BLOCK_SIZE];
+
+// blocks taken in the bitmap
+static int used_blocks() {
+  int used = 0;
+  for (int ii = 1; ii < blocks_count(); ++ii) {
+    used += bitmap_get(get_blocks_bitmap(), ii);
+  }
+  return used;
+}
+
+static int bnum(const char *path, int index) {
+  return inode_get_bnum(get_inode(path_lookup(path)), index * BLOCK_SIZE);
+}
+
+static void write_file(const char *path, const char *buf) {
+  CHECK(storage_mknod(path, 0100644) == 0);
+  CHECK(storage_write(path, buf, sizeof(data), 0) == sizeof(data));
+  storage_flush_all();
+}
+
+// unlink, and free what the unlink orphaned right away
+static int unlink_now(const char *path) {
+  int rv = storage_unlink(path);
+  while (orphan_reclaim()) {
+  }
+  return rv;
+}
+
+static int same_data(const char *path, const char *want) {
+  return storage_read(path, got, sizeof(got), 0) == sizeof(got) &&
+         memcmp(got, want, sizeof(got)) == 0;
+}
+
+int main(int argc, char **argv) {
+  // the file system code logs to stdout, the results get the real one
+  out = fdopen(dup(STDOUT_FILENO), "w");
+  freopen("/dev/null", "w", stdout);
+
+  for (int ii = 0; ii < (int) sizeof(data); ++ii) {
+    data[ii] = 'a' + (ii / BLOCK_SIZE) * 3 + ii % 7;
+  }
+  unlink(IMAGE);
+  storage_options_t opts = {0};
+  opts.dedup = 1;
+  storage_init(IMAGE, &opts);
+  // held throughout, as the operations expect; no cleaner thread is started
+  storage_lock();
+  int base = used_blocks();
+
+  // the second copy takes no blocks, every block has one extra reference
+  write_file("/a", data);
+  CHECK(used_blocks() == base + BLOCKS);
+  write_file("/b", data);
+  CHECK(used_blocks() == base + BLOCKS);
+  for (int ii = 0; ii < BLOCKS; ++ii) {
+    CHECK(bnum("/b", ii) == bnum("/a", ii));
+    CHECK(blocks_refs(bnum("/a", ii)) == 1);
+  }
+
+  // a write to a shared block copies it first and leaves the other file alone
+  int shared = bnum("/a", 1);
+  char changed[BLOCK_SIZE];
+  memset(changed, 'z', sizeof(changed));
+  CHECK(storage_write("/b", changed, BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+  CHECK(bnum("/a", 1) == shared && bnum("/b", 1) != shared);
+  CHECK(blocks_refs(shared) == 0);
+  CHECK(used_blocks() == base + BLOCKS + 1);
+  CHECK(same_data("/a", data));
+  char want[sizeof(data)];
+  memcpy(want, data, sizeof(data));
+  memcpy(want + BLOCK_SIZE, changed, BLOCK_SIZE);
+  CHECK(same_data("/b", want));
+
+  // deleting one copy drops references and frees only its own block
+  CHECK(unlink_now("/b") == 0);
+  CHECK(used_blocks() == base + BLOCKS);
+  for (int ii = 0; ii < BLOCKS; ++ii) {
+    CHECK(blocks_refs(bnum("/a", ii)) == 0);
+  }
+  CHECK(same_data("/a", data));
+  CHECK(unlink_now("/a") == 0);
+  CHECK(used_blocks() == base);
+
+  blocks_free();
+  unlink(IMAGE);
+  fprintf(out, "dedup_test: %d failures\n", failures);
+  return failures != 0;
+}
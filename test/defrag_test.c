@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../storage.h"
+
+#define IMAGE "test/defrag_test.img"
+#define BLOCKS 4 // blocks of each piece
+
+static FILE *out;
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(out, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);    \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+static char data[3 * BLOCKS * BLOCK_SIZE];
+static char got[3 * BLOCKS * BLOCK_SIZE];
+
+static int same_data(const char *path, const char *want, int size) {
+  return storage_read(path, got, size, 0) == size && memcmp(got, want, size) == 0;
+}
+
+static int extents(const char *path) {
+  return inode_extents(get_inode(path_lookup(path)));
+}
+
+// append a piece to each file in turn, so their blocks interleave
+static void interleave(const char *a, const char *b) {
+  const int piece = BLOCKS * BLOCK_SIZE;
+  CHECK(storage_mknod(a, 0100644) == 0);
+  CHECK(storage_mknod(b, 0100644) == 0);
+  for (int ii = 0; ii < 3; ++ii) {
+    CHECK(storage_write(a, data + ii * piece, piece, ii * piece) == piece);
+    storage_flush_all();
+    CHECK(storage_write(b, data, piece, ii * piece) == piece);
+    storage_flush_all();
+  }
+}
+
+int main(int argc, char **argv) {
+  // the file system code logs to stdout, the results get the real one
+  out = fdopen(dup(STDOUT_FILENO), "w");
+  freopen("/dev/null", "w", stdout);
+  freopen("/dev/null", "w", stderr);
+
+  for (int ii = 0; ii < (int) sizeof(data); ++ii) {
+    data[ii] = 'a' + ii % 11 + ii / BLOCK_SIZE;
+  }
+  unlink(IMAGE);
+  storage_init(IMAGE, NULL);
+  // held throughout, as the operations expect; no cleaner thread is started
+  storage_lock();
+
+  // a fragmented file ends up in one run with the same data and no more blocks
+  interleave("/a", "/b");
+  int before = extents("/a");
+  CHECK(before > 1);
+  int free_blocks = blocks_free_count();
+  nufs_defrag_t res;
+  CHECK(storage_defrag("/a", &res) == 0);
+  CHECK(res.extents_before == before);
+  CHECK(res.extents_after == 1 && extents("/a") == 1);
+  CHECK(res.moved == 3 * BLOCKS);
+  CHECK(same_data("/a", data, sizeof(data)));
+  CHECK(blocks_free_count() == free_blocks);
+  // one in a single run stays where it is
+  CHECK(storage_defrag("/a", &res) == 0);
+  CHECK(res.moved == 0 && res.extents_after == 1);
+
+  // blocks a snapshot shares are left alone, and it still sees its data
+  CHECK(storage_snapshot_create("s1") == 0);
+  before = extents("/b");
+  CHECK(before > 1);
+  CHECK(storage_defrag("/b", &res) == 0);
+  CHECK(res.moved == 0 && extents("/b") == before);
+  for (int ii = 0; ii < 3; ++ii) {
+    CHECK(storage_read("/b", got, BLOCKS * BLOCK_SIZE, ii * BLOCKS * BLOCK_SIZE) ==
+          BLOCKS * BLOCK_SIZE);
+    CHECK(memcmp(got, data, BLOCKS * BLOCK_SIZE) == 0);
+  }
+  CHECK(defrag_get_stats()->files == 1 && defrag_get_stats()->skipped == 1);
+
+  blocks_free();
+  unlink(IMAGE);
+  fprintf(out, "defrag_test: %d failures\n", failures);
+  return failures != 0;
+}
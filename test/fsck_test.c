@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../storage.h"
+#include "../bitmap.h"
+
+// run from the top of the tree, after `make tools`
+#define IMAGE "test/fsck_test.img"
+#define CLEARED 3 // bitmap bits cleared
+
+static FILE *out;
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(out, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);    \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+static char tree[] = "/tmp/nufs-fsck-XXXXXX";
+static char data[5 * BLOCK_SIZE + 100];
+
+// run nufs-fsck; returns its exit code and keeps its report
+static int fsck(const char *flags, char *report, int size) {
+  char cmd[256];
+  snprintf(cmd, sizeof(cmd), "tools/nufs-fsck %s %s", flags, IMAGE);
+  FILE *pipe = popen(cmd, "r");
+  int len = fread(report, 1, size - 1, pipe);
+  report[len > 0 ? len : 0] = 0;
+  int status = pclose(pipe);
+  fprintf(out, "$ %s\n%s", cmd, report);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// clear the bitmap bits of the first blocks of /big, in a child so the
+// image is opened and closed as the tools do
+static void clear_bits(int *bnums) {
+  int pipefd[2];
+  pipe(pipefd);
+  if (fork() == 0) {
+    storage_init(IMAGE, NULL);
+    storage_lock();
+    inode_t *node = get_inode(path_lookup("/big"));
+    for (int ii = 0; ii < CLEARED; ++ii) {
+      bnums[ii] = inode_get_bnum(node, ii * BLOCK_SIZE);
+      bitmap_put(get_blocks_bitmap(), bnums[ii], 0);
+    }
+    storage_unlock();
+    blocks_free();
+    write(pipefd[1], bnums, CLEARED * sizeof(int));
+    _exit(0);
+  }
+  close(pipefd[1]);
+  CHECK(read(pipefd[0], bnums, CLEARED * sizeof(int)) == CLEARED * sizeof(int));
+  close(pipefd[0]);
+  wait(NULL);
+}
+
+// whether /big in the image still holds the data, checked in a child
+static int data_intact() {
+  if (fork() == 0) {
+    static char got[sizeof(data)];
+    storage_init(IMAGE, NULL);
+    storage_lock();
+    int len = storage_read("/big", got, sizeof(got), 0);
+    storage_unlock();
+    blocks_free();
+    _exit(len == sizeof(data) && memcmp(got, data, len) == 0 ? 0 : 1);
+  }
+  int status;
+  wait(&status);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char **argv) {
+  // the file system code logs to stdout, the results get the real one
+  out = fdopen(dup(STDOUT_FILENO), "w");
+  setvbuf(out, NULL, _IONBF, 0);
+  freopen("/dev/null", "w", stdout);
+
+  // a small tree for mkfs.nufs to copy in
+  CHECK(mkdtemp(tree) != NULL);
+  char path[64];
+  for (int ii = 0; ii < (int) sizeof(data); ++ii) {
+    data[ii] = 'a' + ii % 23;
+  }
+  snprintf(path, sizeof(path), "%s/big", tree);
+  FILE *file = fopen(path, "w");
+  fwrite(data, 1, sizeof(data), file);
+  fclose(file);
+  snprintf(path, sizeof(path), "%s/dir", tree);
+  mkdir(path, 0755);
+  snprintf(path, sizeof(path), "%s/dir/small", tree);
+  file = fopen(path, "w");
+  fputs("small\n", file);
+  fclose(file);
+
+  char cmd[256];
+  snprintf(cmd, sizeof(cmd), "tools/mkfs.nufs -F -d %s %s > /dev/null", tree, IMAGE);
+  CHECK(system(cmd) == 0);
+  snprintf(cmd, sizeof(cmd), "rm -r %s", tree);
+  system(cmd);
+
+  char report[8192];
+  CHECK(fsck("", report, sizeof(report)) == 0);
+  CHECK(strstr(report, ": 0 problems") != NULL);
+
+  int bnums[CLEARED];
+  clear_bits(bnums);
+
+  // every cleared bit is found, and nothing is changed without -r
+  for (int pass = 0; pass < 2; ++pass) {
+    CHECK(fsck("", report, sizeof(report)) == 4);
+    for (int ii = 0; ii < CLEARED; ++ii) {
+      char want[64];
+      snprintf(want, sizeof(want), "block %i is used but free in the bitmap", bnums[ii]);
+      CHECK(strstr(report, want) != NULL);
+    }
+    CHECK(strstr(report, " 0 fixed") != NULL);
+  }
+
+  // -r fixes all of them, then the image is clean and the data is there
+  int found = 0;
+  int fixed = -1;
+  CHECK(fsck("-r", report, sizeof(report)) == 1);
+  char *summary = strrchr(report, ':');
+  CHECK(summary && sscanf(summary, ": %i problems, %i fixed", &found, &fixed) == 2);
+  CHECK(found >= CLEARED && fixed == found);
+  CHECK(fsck("", report, sizeof(report)) == 0);
+  CHECK(strstr(report, ": 0 problems") != NULL);
+  CHECK(data_intact());
+
+  unlink(IMAGE);
+  fprintf(out, "fsck_test: %d failures\n", failures);
+  return failures != 0;
+}
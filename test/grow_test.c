@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../storage.h"
+#include "../bitmap.h"
+#include "../checksum.h"
+#include "../snapshot.h"
+
+// run from the top of the tree, after `make tools`
+#define IMAGE "test/grow_test.img"
+#define CHUNK (64 * 1024)
+#define MANY_DIRS 8
+#define MANY_FILES 40 // in each directory, more inodes in all than block 0 had room for
+
+static FILE *out;
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(out, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);    \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+// every block of a file tells which file and block it is
+static char data[4 << 20];
+static char got[sizeof(data)];
+
+static void fill(int seed, int size) {
+  for (int ii = 0; ii < size; ++ii) {
+    data[ii] = seed + ii / BLOCK_SIZE * 7 + ii % 251;
+  }
+}
+
+// write a new file in chunks, as a program would
+static int make_file(const char *path, int seed, int size) {
+  fill(seed, size);
+  if (storage_mknod(path, FILE_MODE | 0644) < 0) {
+    return -1;
+  }
+  for (int pos = 0; pos < size; pos += CHUNK) {
+    int len = (size - pos < CHUNK) ? size - pos : CHUNK;
+    if (storage_write(path, data + pos, len, pos) != len) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int file_intact(const char *path, int seed, int size) {
+  fill(seed, size);
+  return storage_read(path, got, sizeof(got), 0) == size && memcmp(got, data, size) == 0;
+}
+
+// whether a snapshot has an inode, from its bitmap
+static int snapshot_has(const char *name, int inum) {
+  for (int ii = 0; ii < SNAPSHOT_MAX; ++ii) {
+    snapshot_t *snap = &snapshot_table()[ii];
+    if (snap->table && !strcmp(snap->name, name)) {
+      return bitmap_get(snapshot_inodes(snap), inum);
+    }
+  }
+  return 0;
+}
+
+// create the files under /mD/fN that take the inode table past block 0
+static int make_many() {
+  char path[64];
+  for (int dd = 0; dd < MANY_DIRS; ++dd) {
+    sprintf(path, "/m%i", dd);
+    if (storage_mknod(path, DIR_MODE | 0755) < 0) {
+      return -1;
+    }
+    for (int ff = 0; ff < MANY_FILES; ++ff) {
+      sprintf(path, "/m%i/f%i", dd, ff);
+      if (storage_mknod(path, FILE_MODE | 0644) < 0) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+// the free block counter matches the bitmap
+static int counter_right() {
+  int counted = blocks_free_count();
+  blocks_recount();
+  return blocks_free_count() == counted;
+}
+
+int main(int argc, char **argv) {
+  out = fdopen(dup(STDOUT_FILENO), "w");
+  freopen("/dev/null", "w", stdout);
+  freopen("/dev/null", "w", stderr);
+
+  CHECK(system("tools/mkfs.nufs -F -s 64K " IMAGE " > /dev/null") == 0);
+  storage_init(IMAGE, NULL);
+  // held throughout, as the operations expect; no cleaner thread is started
+  storage_lock();
+  CHECK(blocks_count() == BLOCK_COUNT_MIN);
+  CHECK(make_file("/a", 1, 3 * BLOCK_SIZE) == 0);
+
+  // up to BLOCK_COUNT the tables stay in block 0
+  int len;
+  CHECK(blocks_grow(BLOCK_COUNT) == BLOCK_COUNT);
+  CHECK(blocks_tables(&len) == 0 && len == 0);
+  CHECK(blocks_capacity() == BLOCK_COUNT);
+
+  // past it they move to a run in the new blocks
+  CHECK(blocks_grow(4 * BLOCK_COUNT) == 4 * BLOCK_COUNT);
+  int first = blocks_tables(&len);
+  CHECK(first >= BLOCK_COUNT && len > 0);
+  CHECK(blocks_capacity() >= 4 * BLOCK_COUNT);
+  CHECK(bitmap_get(get_blocks_bitmap(), first) && blocks_is_table(first));
+  CHECK(counter_right());
+  CHECK(file_intact("/a", 1, 3 * BLOCK_SIZE));
+
+  // a file larger than the image was before
+  CHECK(make_file("/big", 2, 2 * NUFS_SIZE) == 0);
+  CHECK(file_intact("/big", 2, 2 * NUFS_SIZE));
+
+  // growing on its own moves them again once they are full
+  blocks_set_grow_step(BLOCK_COUNT);
+  CHECK(make_file("/huge", 3, sizeof(data)) == 0);
+  CHECK(blocks_count() > 4 * BLOCK_COUNT);
+  CHECK(blocks_tables(&len) != first && blocks_capacity() >= blocks_count());
+  CHECK(!bitmap_get(get_blocks_bitmap(), first));
+
+  // the inode bitmaps move out of block 0 too, snapshots' with them
+  int inum_a = path_lookup("/a");
+  CHECK(blocks_inode_capacity() == INODE_CHUNKS_BLOCK0 * INODES_PER_CHUNK);
+  CHECK(storage_snapshot_create("before") == 0);
+  CHECK(make_many() == 0);
+  CHECK(blocks_inode_capacity() > INODE_CHUNKS_BLOCK0 * INODES_PER_CHUNK);
+  CHECK(blocks_inode_tables(&len) > 0 && len > 0);
+  int last = path_lookup("/m7/f39");
+  CHECK(last >= INODE_CHUNKS_BLOCK0 * INODES_PER_CHUNK);
+  CHECK(storage_snapshot_create("after") == 0);
+  CHECK(snapshot_has("before", inum_a) && !snapshot_has("before", last));
+  CHECK(snapshot_has("after", inum_a) && snapshot_has("after", last));
+  CHECK(storage_flush_all() == 0); // as at unmount
+  CHECK(counter_right());
+  int count = blocks_count();
+  storage_unlock();
+  blocks_free();
+
+  // all of it is there after a remount, with checksums that match
+  storage_init(IMAGE, NULL);
+  storage_lock();
+  CHECK(blocks_count() == count);
+  CHECK(file_intact("/a", 1, 3 * BLOCK_SIZE));
+  CHECK(file_intact("/big", 2, 2 * NUFS_SIZE));
+  CHECK(file_intact("/huge", 3, sizeof(data)));
+  CHECK(checksum_scrub(count) == 0);
+  CHECK(checksum_get_stats()->errors == 0);
+  CHECK(path_lookup("/m7/f39") == last);
+  int room = blocks_inode_capacity();
+  CHECK(snapshot_has("before", inum_a) && !snapshot_has("before", last));
+  void *table = snapshot_open("after");
+  CHECK(table != NULL);
+  blocks_use_inode_table(table);
+  CHECK(path_lookup("/m7/f39") == last);
+  blocks_use_inode_table(NULL);
+  free(table);
+  storage_unlock();
+  blocks_free();
+  CHECK(system("tools/nufs-fsck " IMAGE " > /dev/null") == 0);
+  CHECK(system("tools/nufs-send " IMAGE " after > /dev/null 2>&1") == 0);
+
+  fprintf(out, "%d blocks and room for %d inodes after growing\n", count, room);
+  fprintf(out, "grow_test: %d failures\n", failures);
+  return failures != 0;
+}
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../storage.h"
+
+#define IMAGE "test/orphan_test.img"
+
+static FILE *out;
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(out, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);    \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+static char data[20 * BLOCK_SIZE];
+
+// blocks taken in the bitmap
+static int used_blocks() {
+  int used = 0;
+  for (int ii = 1; ii < blocks_count(); ++ii) {
+    used += bitmap_get(get_blocks_bitmap(), ii);
+  }
+  return used;
+}
+
+static void make_file(const char *path, int size) {
+  CHECK(storage_mknod(path, 0100644) == 0);
+  CHECK(storage_write(path, data, size, 0) == size);
+}
+
+// a tree with a file in an indirect block, one inline and one in a
+// directory of its own
+static void make_tree(const char *top) {
+  char path[64];
+  CHECK(storage_mknod(top, 040755) == 0);
+  snprintf(path, sizeof(path), "%s/big", top);
+  make_file(path, sizeof(data));
+  snprintf(path, sizeof(path), "%s/tiny", top);
+  make_file(path, 10);
+  snprintf(path, sizeof(path), "%s/sub", top);
+  CHECK(storage_mknod(path, 040755) == 0);
+  snprintf(path, sizeof(path), "%s/sub/small", top);
+  make_file(path, 3 * BLOCK_SIZE);
+  storage_flush_all();
+}
+
+// run the reclaimer to the end, checking every step frees at most a batch,
+// and the indirect block with the batch that empties it
+static int reclaim_all() {
+  int steps = 0;
+  int used = used_blocks();
+  while (orphan_reclaim() && steps < 1000) {
+    CHECK(used - used_blocks() <= ORPHAN_BATCH + 1);
+    used = used_blocks();
+    steps++;
+  }
+  return steps;
+}
+
+int main(int argc, char **argv) {
+  // the file system code logs to stdout, the results get the real one
+  out = fdopen(dup(STDOUT_FILENO), "w");
+  freopen("/dev/null", "w", stdout);
+  freopen("/dev/null", "w", stderr);
+
+  for (int ii = 0; ii < (int) sizeof(data); ++ii) {
+    data[ii] = 'a' + ii % 13;
+  }
+  unlink(IMAGE);
+  storage_init(IMAGE, NULL);
+  // held throughout, as the operations expect; no cleaner thread is started
+  storage_lock();
+  int base = used_blocks();
+  int free_blocks = blocks_free_count();
+  int free_inodes = blocks_free_inodes();
+
+  // removing a tree only takes it out of the namespace
+  make_tree("/d");
+  int full = used_blocks();
+  int top = path_lookup("/d");
+  CHECK(storage_unlink("/d") == 0);
+  CHECK(path_lookup("/d") < 0 && path_lookup("/d/sub/small") < 0);
+  CHECK(orphan_count() == 1);
+  CHECK(get_inode(top)->flags & INODE_ORPHAN);
+  CHECK(used_blocks() == full);
+
+  // the reclaimer gives everything back, a batch at a time
+  CHECK(reclaim_all() > 1);
+  CHECK(orphan_count() == 0);
+  CHECK(used_blocks() == base);
+  CHECK(blocks_free_count() == free_blocks);
+  CHECK(blocks_free_inodes() == free_inodes);
+  CHECK(!bitmap_get(get_inode_bitmap(), top));
+
+  // a reclaim cut short by an unmount goes on at the next mount
+  make_tree("/e");
+  CHECK(storage_unlink("/e") == 0);
+  CHECK(orphan_reclaim() && orphan_reclaim());
+  int left = orphan_count();
+  CHECK(left > 0);
+  blocks_free();
+  storage_init(IMAGE, NULL);
+  CHECK(orphan_count() == left);
+  CHECK(reclaim_all() > 0);
+  CHECK(orphan_count() == 0);
+  CHECK(used_blocks() == base);
+  CHECK(blocks_free_count() == free_blocks);
+  CHECK(blocks_free_inodes() == free_inodes);
+
+  blocks_free();
+  unlink(IMAGE);
+  fprintf(out, "orphan_test: %d failures\n", failures);
+  return failures != 0;
+}
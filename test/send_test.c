@@ -0,0 +1,216 @@
+#include <linux/falloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../storage.h"
+#include "../checksum.h"
+
+// run from the top of the tree, after `make tools`
+#define SOURCE "test/send_source.img"
+#define TARGET "test/send_target.img"
+#define FULL "test/send_full.stream"
+#define INCREMENTAL "test/send_incremental.stream"
+#define DUMP_SIZE 16384
+#define DIR_SLOTS (BLOCK_SIZE / (int) sizeof(dirent_t))
+
+static FILE *out;
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(out, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);    \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+static char data[12 * BLOCK_SIZE];
+
+static int by_name(const void *a, const void *b) {
+  return strcmp(*(char **) a, *(char **) b);
+}
+
+// one line per file and directory under path, in name order: the path,
+// mode, link count, size, mtime and the CRC of the data
+static void dump_tree(FILE *dump, const char *path) {
+  char *names[DIR_SLOTS];
+  int count = 0;
+  slist_t *list = storage_list(path);
+  for (slist_t *xs = list; xs && count < DIR_SLOTS; xs = xs->next) {
+    if (strcmp(xs->data, ".") && strcmp(xs->data, "..")) {
+      names[count++] = strdup(xs->data);
+    }
+  }
+  slist_free(list);
+  qsort(names, count, sizeof(names[0]), by_name);
+
+  for (int ii = 0; ii < count; ++ii) {
+    char child[256];
+    snprintf(child, sizeof(child), "%s/%s", strcmp(path, "/") ? path : "", names[ii]);
+    free(names[ii]);
+    struct stat st;
+    if (storage_stat(child, &st) < 0) {
+      continue;
+    }
+    uint32_t crc = 0;
+    if (S_ISREG(st.st_mode)) {
+      static char buf[sizeof(data) * 2];
+      int len = storage_read(child, buf, sizeof(buf), 0);
+      crc = crc32c(0, buf, len > 0 ? len : 0);
+    }
+    fprintf(dump, "%s %o %i %ld %ld.%09ld %08x\n", child, st.st_mode, (int) st.st_nlink,
+            (long) st.st_size, (long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec, crc);
+    if (S_ISDIR(st.st_mode)) {
+      dump_tree(dump, child);
+    }
+  }
+}
+
+// dump the live tree of an image, or a snapshot of it, from a child
+static void dump(const char *image, const char *snap, char *text) {
+  int pipefd[2];
+  pipe(pipefd);
+  if (fork() == 0) {
+    storage_options_t opts = {0};
+    opts.snapshot = snap;
+    FILE *dump = fdopen(pipefd[1], "w");
+    if (storage_init(image, &opts) == 0) {
+      storage_lock();
+      dump_tree(dump, "/");
+      storage_unlock();
+    }
+    fclose(dump);
+    _exit(0);
+  }
+  close(pipefd[1]);
+  int len = 0;
+  int got;
+  while ((got = read(pipefd[0], text + len, DUMP_SIZE - 1 - len)) > 0) {
+    len += got;
+  }
+  text[len] = 0;
+  close(pipefd[0]);
+  wait(NULL);
+}
+
+// the source: snapshot s1 of a first tree, then s2 after changing it
+static void make_source() {
+  if (fork() == 0) {
+    freopen("/dev/null", "w", stderr);
+    storage_init(SOURCE, NULL);
+    storage_lock();
+    storage_mknod("/small", 0100644);
+    storage_write("/small", "small\n", 6, 0);
+    storage_mknod("/big", 0100644);
+    storage_write("/big", data, 8 * BLOCK_SIZE, 0);
+    storage_mknod("/sparse", 0100600);
+    storage_truncate("/sparse", 6 * BLOCK_SIZE);
+    storage_write("/sparse", data, 100, 5 * BLOCK_SIZE);
+    storage_mknod("/dir", 040755);
+    storage_mknod("/dir/inner", 0100644);
+    storage_write("/dir/inner", data + 7, 3000, 0);
+    storage_snapshot_create("s1");
+    // the changes get a later ctime than the snapshot
+    sleep(1);
+
+    storage_write("/big", data + 1, BLOCK_SIZE, 2 * BLOCK_SIZE);
+    storage_write("/big", data, 4 * BLOCK_SIZE + 10, 8 * BLOCK_SIZE);
+    storage_fallocate("/big", FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 5 * BLOCK_SIZE,
+                      BLOCK_SIZE);
+    storage_unlink("/small");
+    storage_rename("/dir/inner", "/moved");
+    storage_mknod("/dir/new", 0100644);
+    storage_write("/dir/new", "new\n", 4, 0);
+    storage_snapshot_create("s2");
+    storage_flush_all();
+    storage_unlock();
+    blocks_free();
+    _exit(0);
+  }
+  wait(NULL);
+}
+
+static int run(const char *cmd) {
+  int status = system(cmd);
+  fprintf(out, "$ %s -> %i\n", cmd, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// run nufs-send into a stream; returns its exit code and the number of
+// blocks it reports sending
+static int send(const char *snaps, const char *stream, long *blocks) {
+  char cmd[256];
+  snprintf(cmd, sizeof(cmd), "tools/nufs-send " SOURCE " %s 2>&1 > %s", snaps, stream);
+  FILE *pipe = popen(cmd, "r");
+  char report[256] = "";
+  fgets(report, sizeof(report), pipe);
+  int status = pclose(pipe);
+  long inodes;
+  *blocks = -1;
+  sscanf(report, "nufs-send: %ld inodes, %ld blocks", &inodes, blocks);
+  fprintf(out, "$ %s -> %i\n%s", cmd, WIFEXITED(status) ? WEXITSTATUS(status) : -1, report);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int main(int argc, char **argv) {
+  // the file system code logs to stdout, the results get the real one
+  out = fdopen(dup(STDOUT_FILENO), "w");
+  setvbuf(out, NULL, _IONBF, 0);
+  freopen("/dev/null", "w", stdout);
+
+  for (int ii = 0; ii < (int) sizeof(data); ++ii) {
+    data[ii] = 'a' + ii % 23;
+  }
+  CHECK(run("tools/mkfs.nufs -F " SOURCE " > /dev/null") == 0);
+  CHECK(run("tools/mkfs.nufs -F " TARGET " > /dev/null") == 0);
+  make_source();
+
+  // a full stream of s1, then the changes up to s2
+  long full_blocks;
+  long blocks;
+  CHECK(send("s1", FULL, &full_blocks) == 0);
+  CHECK(run("tools/nufs-receive " TARGET " < " FULL) == 0);
+  CHECK(send("s2 s1", INCREMENTAL, &blocks) == 0);
+  CHECK(run("tools/nufs-receive " TARGET " < " INCREMENTAL) == 0);
+  // only the changed blocks go: one rewritten and five appended to /big,
+  // and the two directories that changed
+  CHECK(blocks == 8);
+  struct stat full_st;
+  struct stat incr_st;
+  CHECK(stat(FULL, &full_st) == 0 && stat(INCREMENTAL, &incr_st) == 0);
+  CHECK(incr_st.st_size < full_st.st_size);
+  // a stream only goes on top of its parent
+  CHECK(run("tools/nufs-receive " TARGET " < " INCREMENTAL " 2> /dev/null") != 0);
+
+  static char want[DUMP_SIZE];
+  static char got[DUMP_SIZE];
+  static char first[DUMP_SIZE];
+  const char *snaps[] = {"s1", "s2", NULL};
+  for (int ii = 0; ii < 3; ++ii) {
+    const char *name = snaps[ii] ? snaps[ii] : "live tree";
+    dump(SOURCE, snaps[ii], want);
+    dump(TARGET, snaps[ii], got);
+    fprintf(out, "%s:\n%s", name, want);
+    CHECK(strstr(want, "/dir/new") || strstr(want, "/dir/inner"));
+    if (strcmp(want, got)) {
+      fprintf(out, "received %s:\n%s", name, got);
+    }
+    CHECK(strcmp(want, got) == 0);
+    if (ii == 0) {
+      strcpy(first, want);
+    }
+  }
+  // the incremental stream had changes to carry
+  CHECK(strcmp(first, want) != 0);
+
+  unlink(SOURCE);
+  unlink(TARGET);
+  unlink(FULL);
+  unlink(INCREMENTAL);
+  fprintf(out, "send_test: %d failures\n", failures);
+  return failures != 0;
+}
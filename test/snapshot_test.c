@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../storage.h"
+
+#define IMAGE "test/snapshot_test.img"
+#define BLOCKS 3 // blocks of each file
+
+static FILE *out;
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(out, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);    \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+static char data[BLOCKS * BLOCK_SIZE];
+static char changed[BLOCKS * BLOCK_SIZE];
+static char got[BLOCKS * BLOCK_SIZE];
+
+// blocks taken in the bitmap
+static int used_blocks() {
+  int used = 0;
+  for (int ii = 1; ii < blocks_count(); ++ii) {
+    used += bitmap_get(get_blocks_bitmap(), ii);
+  }
+  return used;
+}
+
+// unlink, and free what the unlink orphaned right away
+static int unlink_now(const char *path) {
+  int rv = storage_unlink(path);
+  while (orphan_reclaim()) {
+  }
+  return rv;
+}
+
+static int same_data(const char *path, const char *want) {
+  return storage_read(path, got, sizeof(got), 0) == sizeof(got) &&
+         memcmp(got, want, sizeof(got)) == 0;
+}
+
+// read the files as the snapshot has them, from a copy of its inode table
+// as a snapshot mount does
+static void check_snapshot(const char *name) {
+  void *table = snapshot_open(name);
+  CHECK(table != NULL);
+  if (!table) {
+    return;
+  }
+  blocks_use_inode_table(table);
+  CHECK(same_data("/f", data));
+  CHECK(same_data("/g", changed));
+  CHECK(path_lookup("/h") < 0);
+  blocks_use_inode_table(NULL);
+  free(table);
+}
+
+int main(int argc, char **argv) {
+  // the file system code logs to stdout, the results get the real one
+  out = fdopen(dup(STDOUT_FILENO), "w");
+  freopen("/dev/null", "w", stdout);
+  freopen("/dev/null", "w", stderr);
+
+  for (int ii = 0; ii < (int) sizeof(data); ++ii) {
+    data[ii] = 'a' + ii % 7 + ii / BLOCK_SIZE;
+    changed[ii] = 'A' + ii % 5;
+  }
+  unlink(IMAGE);
+  storage_init(IMAGE, NULL);
+  // held throughout, as the operations expect; no cleaner thread is started
+  storage_lock();
+  int base = used_blocks();
+
+  CHECK(storage_mknod("/f", 0100644) == 0);
+  CHECK(storage_write("/f", data, sizeof(data), 0) == sizeof(data));
+  CHECK(storage_mknod("/g", 0100644) == 0);
+  CHECK(storage_write("/g", changed, sizeof(changed), 0) == sizeof(changed));
+  storage_flush_all();
+  int files = used_blocks();
+
+  // a snapshot takes only its copy of the inode table
+  CHECK(storage_snapshot_create("s1") == 0);
+  CHECK(storage_snapshot_create("s1") < 0);
+  int snapped = used_blocks();
+  CHECK(snapped > files);
+  nufs_snap_list_t list;
+  storage_snapshot_list(&list);
+  CHECK(list.count == 1 && strcmp(list.snaps[0].name, "s1") == 0);
+
+  // the live tree changes, the snapshot keeps the old blocks
+  CHECK(storage_write("/f", changed, BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+  CHECK(used_blocks() == snapped + 1);
+  // the root directory block is copied on its first change too
+  CHECK(unlink_now("/g") == 0);
+  CHECK(storage_mknod("/h", 0100644) == 0);
+  CHECK(used_blocks() == snapped + 2);
+  char want[sizeof(data)];
+  memcpy(want, data, sizeof(data));
+  memcpy(want + BLOCK_SIZE, changed, BLOCK_SIZE);
+  CHECK(same_data("/f", want));
+  CHECK(path_lookup("/g") < 0);
+  check_snapshot("s1");
+
+  // deleting it gives back what only it used
+  CHECK(storage_snapshot_delete("s1") == 0);
+  int steps = 0;
+  while (snapshot_reclaim() && steps < 10000) {
+    steps++;
+  }
+  CHECK(steps > 0 && steps < 10000);
+  CHECK(used_blocks() == files - BLOCKS);
+  CHECK(snapshot_open("s1") == NULL);
+  storage_snapshot_list(&list);
+  CHECK(list.count == 0);
+  CHECK(same_data("/f", want));
+  for (int ii = 0; ii < BLOCKS; ++ii) {
+    CHECK(blocks_refs(inode_get_bnum(get_inode(path_lookup("/f")), ii * BLOCK_SIZE)) == 0);
+  }
+  CHECK(unlink_now("/h") == 0);
+  CHECK(unlink_now("/f") == 0);
+  CHECK(used_blocks() == base);
+
+  blocks_free();
+  unlink(IMAGE);
+  fprintf(out, "snapshot_test: %d failures\n", failures);
+  return failures != 0;
+}
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../storage.h"
+
+#define IMAGE "test/verify_test.img"
+
+static FILE *out;
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(out, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);    \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
+
+// flip a byte behind the file system's back, as a bad disk would
+static void corrupt(void *byte) {
+  *(char *) byte ^= 0x40;
+}
+
+int main(int argc, char **argv) {
+  // the file system code logs to stdout, the results get the real one
+  out = fdopen(dup(STDOUT_FILENO), "w");
+  freopen("/dev/null", "w", stdout);
+  freopen("/dev/null", "w", stderr);
+
+  unlink(IMAGE);
+  storage_init(IMAGE, NULL);
+  storage_lock();
+  CHECK(storage_mknod("/f", 0100644) == 0);
+  CHECK(storage_write("/f", "data\n", 5, 0) == 5);
+  int inum = path_lookup("/f");
+  inode_t *node = get_inode(inum);
+  dirent_t *root = inode_get_block(get_inode(0), 0);
+  storage_unlock();
+
+  // a corrupt inode is not handed out, and operations through it fail
+  corrupt(&node->size);
+  storage_lock();
+  CHECK(get_inode(inum) == NULL);
+  CHECK(checksum_failed());
+  struct stat st;
+  CHECK(storage_stat("/f", &st) < 0);
+  CHECK(storage_write("/f", "more", 4, 5) < 0);
+  storage_unlock();
+  // the operations did not give it a checksum of what is in it now
+  storage_lock();
+  CHECK(!checksum_failed());
+  CHECK(get_inode(inum) == NULL);
+  storage_unlock();
+  corrupt(&node->size);
+  storage_lock();
+  CHECK(get_inode(inum) == node && node->size == 5);
+  CHECK(!checksum_failed());
+  storage_unlock();
+
+  // neither is a corrupt directory block written
+  corrupt(root[2].name);
+  storage_lock();
+  CHECK(storage_mknod("/g", 0100644) < 0);
+  CHECK(checksum_failed());
+  storage_unlock();
+  storage_lock();
+  CHECK(path_lookup("/f") < 0);
+  storage_unlock();
+  corrupt(root[2].name);
+  storage_lock();
+  CHECK(path_lookup("/f") == inum);
+  CHECK(path_lookup("/g") < 0);
+
+  blocks_free();
+  unlink(IMAGE);
+  fprintf(out, "verify_test: %d failures\n", failures);
+  return failures != 0;
+}
@@ -0,0 +1,388 @@
+/**
+ * @file mkfs.nufs.c
+ * @author Alston Liu
+ *
+ * Make an empty image, or one holding a copy of a directory on the host.
+ *
+ *   mkfs.nufs [-F] [-s SIZE] [-d DIR] [-j THREADS] IMAGE
+ *
+ * The image is a sparse file: only block 0, the root directory and the
+ * checksums are written, and the inode table stays a hole until inodes are
+ * allocated. An existing image is only replaced with -F. With -s the image
+ * has SIZE bytes (K and M suffixes work) instead of 1MB, up to 256MB, and
+ * grows when it is mounted with -o grow=STEP or through nufs-grow.
+ *
+ * With -d the files and directories under DIR go straight into the image,
+ * without mounting it. The tree is read one directory after the other, each
+ * directory gets its block filled in one go, and the blocks of every file
+ * are taken as one run right after its directory, so a directory and its
+ * files sit together. THREADS threads then read the files into their runs.
+ * Only regular files and directories are copied.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "storage.h"
+#include "bitmap.h"
+
+#define ROOT_INUM 0 // the root directory
+#define DIR_SLOTS (BLOCK_SIZE / (int) sizeof(dirent_t))
+
+// a file or directory of the host tree
+typedef struct source {
+  char *path;
+  char name[DIR_NAME_LENGTH];
+  struct stat st;
+  int parent;           // index of the directory it is in
+  int inum;             // its inode in the image
+  int *bnums;           // blocks of a file that does not fit inline
+  int got;              // bytes read
+  char data[INLINE_MAX]; // a file that fits inline
+} source_t;
+
+static FILE *out;
+static int jobs;
+static source_t *sources;
+static int count = 0;
+static int next_source;
+static int read_errors = 0;
+
+static int add_source(const char *path, const char *name, int parent) {
+  if (count == INODE_LIMIT) {
+    fprintf(out, "%s: more than %i files and directories\n", path, INODE_LIMIT);
+    return -1;
+  }
+  source_t *src = &sources[count];
+  memset(src, 0, sizeof(*src));
+  if (lstat(path, &src->st) < 0) {
+    fprintf(out, "%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if (!S_ISREG(src->st.st_mode) && !S_ISDIR(src->st.st_mode)) {
+    fprintf(out, "%s: skipped, not a file or directory\n", path);
+    return 0;
+  }
+  if (strlen(name) >= DIR_NAME_LENGTH) {
+    fprintf(out, "%s: skipped, name longer than %i bytes\n", path, DIR_NAME_LENGTH - 1);
+    return 0;
+  }
+  src->path = strdup(path);
+  strcpy(src->name, name);
+  src->parent = parent;
+  count++;
+  return 0;
+}
+
+static int by_name(const void *a, const void *b) {
+  return strcmp(((const source_t *) a)->name, ((const source_t *) b)->name);
+}
+
+// list the tree one directory after the other, so the entries of a
+// directory are next to each other
+static int list_tree(const char *root) {
+  if (add_source(root, "", ROOT_INUM) < 0 || count == 0 || !S_ISDIR(sources[0].st.st_mode)) {
+    fprintf(out, "%s: not a directory\n", root);
+    return -1;
+  }
+  for (int ii = 0; ii < count; ++ii) {
+    if (!S_ISDIR(sources[ii].st.st_mode)) {
+      continue;
+    }
+    DIR *dir = opendir(sources[ii].path);
+    if (!dir) {
+      fprintf(out, "%s: %s\n", sources[ii].path, strerror(errno));
+      return -1;
+    }
+    int first = count;
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+      if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+        continue;
+      }
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s/%s", sources[ii].path, ent->d_name);
+      if (add_source(path, ent->d_name, ii) < 0) {
+        closedir(dir);
+        return -1;
+      }
+    }
+    closedir(dir);
+    if (count - first > DIR_SLOTS - 2) {
+      fprintf(out, "%s: more than %i entries\n", sources[ii].path, DIR_SLOTS - 2);
+      return -1;
+    }
+    qsort(&sources[first], count - first, sizeof(source_t), by_name);
+  }
+  return 0;
+}
+
+// blocks the tree needs besides the root directory's
+static int blocks_needed() {
+  int total = 0;
+  for (int ii = 1; ii < count; ++ii) {
+    if (S_ISDIR(sources[ii].st.st_mode)) {
+      total++;
+    } else if (sources[ii].st.st_size > INLINE_MAX) {
+      int blocks = bytes_to_blocks(sources[ii].st.st_size);
+      total += blocks + (blocks > MAX_BLOCKS);
+    }
+  }
+  return total;
+}
+
+// give a file its blocks as one run, right after what came before
+static int place_file(source_t *src) {
+  inode_t *node = get_inode(src->inum);
+  if (src->st.st_size <= INLINE_MAX) {
+    return 0;
+  }
+  int blocks = bytes_to_blocks(src->st.st_size);
+  inode_clear_inline(node);
+  if (inode_extend(node, blocks) < 0 || inode_alloc_range(node, 0, blocks) < 0) {
+    return -1;
+  }
+  src->bnums = malloc(blocks * sizeof(int));
+  for (int ii = 0; ii < blocks; ++ii) {
+    src->bnums[ii] = inode_get_bnum(node, ii * BLOCK_SIZE);
+  }
+  return 0;
+}
+
+// fill the block of a directory with all its entries at once
+static int fill_dir(int index) {
+  inode_t *node = get_inode(sources[index].inum);
+  dirent_t *entries = inode_write_block(node, 0);
+  if (!entries) {
+    return -1;
+  }
+  int parent = sources[sources[index].parent].inum;
+  int used = 0;
+  memset(entries, 0, BLOCK_SIZE);
+  strcpy(entries[used].name, ".");
+  entries[used].inum = sources[index].inum;
+  entries[used++].used = 1;
+  strcpy(entries[used].name, "..");
+  entries[used].inum = parent;
+  entries[used++].used = 1;
+  for (int ii = index + 1; ii < count; ++ii) {
+    if (sources[ii].parent == index) {
+      strcpy(entries[used].name, sources[ii].name);
+      entries[used].inum = sources[ii].inum;
+      entries[used++].used = 1;
+    }
+  }
+  node->refs = used;
+  node->size = used * sizeof(dirent_t);
+  return 0;
+}
+
+// read a file into its run of blocks, or inline into its source
+static void read_file(source_t *src) {
+  int fd = open(src->path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(out, "%s: %s\n", src->path, strerror(errno));
+    __atomic_add_fetch(&read_errors, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  int size = src->st.st_size;
+  if (!src->bnums) {
+    int rv = pread(fd, src->data, size, 0);
+    src->got = (rv < 0) ? 0 : rv;
+    close(fd);
+    return;
+  }
+  // one read per run of blocks next to each other
+  int blocks = bytes_to_blocks(size);
+  for (int ii = 0; ii < blocks && src->got == ii * BLOCK_SIZE;) {
+    int len = 1;
+    while (ii + len < blocks && src->bnums[ii + len] == src->bnums[ii] + len) {
+      len++;
+    }
+    int want = (len * BLOCK_SIZE < size - ii * BLOCK_SIZE) ? len * BLOCK_SIZE : size - ii * BLOCK_SIZE;
+    int rv = pread(fd, blocks_get_block(src->bnums[ii]), want, (off_t) ii * BLOCK_SIZE);
+    src->got += (rv < 0) ? 0 : rv;
+    if (rv != want) {
+      break;
+    }
+    ii += len;
+  }
+  close(fd);
+}
+
+static void *reader(void *arg) {
+  for (;;) {
+    int ii = __atomic_fetch_add(&next_source, 1, __ATOMIC_RELAXED);
+    if (ii >= count) {
+      return NULL;
+    }
+    if (S_ISREG(sources[ii].st.st_mode) && sources[ii].st.st_size > 0) {
+      read_file(&sources[ii]);
+    }
+  }
+}
+
+// set what the copy of a file or directory keeps from the host
+static void finish(source_t *src) {
+  inode_t *node = get_inode(src->inum);
+  node->mode = (src->st.st_mode & ~S_IFMT) | (S_ISDIR(src->st.st_mode) ? DIR_MODE : FILE_MODE);
+  node->atime = src->st.st_atim.tv_sec;
+  node->atime_ns = src->st.st_atim.tv_nsec;
+  node->mtime = src->st.st_mtim.tv_sec;
+  node->mtime_ns = src->st.st_mtim.tv_nsec;
+  if (S_ISDIR(src->st.st_mode)) {
+    return;
+  }
+  if (!src->bnums) {
+    inode_set_inline(node, src->data, src->got);
+    node->size = src->got;
+    return;
+  }
+  // the blocks that were read hold data now
+  for (int ii = 0; ii < node->blocks; ++ii) {
+    if (ii * BLOCK_SIZE < src->got) {
+      inode_set_bnum(node, ii, src->bnums[ii]);
+    }
+  }
+  node->size = src->got;
+}
+
+// copy the tree under root into the image
+static int build(const char *root) {
+  sources = calloc(INODE_LIMIT, sizeof(source_t));
+  if (list_tree(root) < 0) {
+    return -1;
+  }
+  if (blocks_needed() > blocks_free_count()) {
+    fprintf(out, "%s: needs %i blocks, the image has %i free\n", root, blocks_needed(),
+            blocks_free_count());
+    return -1;
+  }
+
+  // inodes in the order of the listing, each near its directory
+  sources[0].inum = ROOT_INUM;
+  for (int ii = 1; ii < count; ++ii) {
+    int mode = S_ISDIR(sources[ii].st.st_mode) ? DIR_MODE : FILE_MODE;
+    sources[ii].inum = alloc_inode_near(sources[sources[ii].parent].inum, mode);
+    if (sources[ii].inum < 0) {
+      return -1;
+    }
+  }
+  // every directory's block, then the runs of its files
+  for (int ii = 0; ii < count; ++ii) {
+    if (!S_ISDIR(sources[ii].st.st_mode)) {
+      continue;
+    }
+    if (fill_dir(ii) < 0) {
+      return -1;
+    }
+    for (int jj = ii + 1; jj < count; ++jj) {
+      if (sources[jj].parent == ii && S_ISREG(sources[jj].st.st_mode) && place_file(&sources[jj]) < 0) {
+        return -1;
+      }
+    }
+  }
+
+  pthread_t threads[jobs];
+  next_source = 0;
+  for (int ii = 0; ii < jobs; ++ii) {
+    pthread_create(&threads[ii], NULL, reader, NULL);
+  }
+  for (int ii = 0; ii < jobs; ++ii) {
+    pthread_join(threads[ii], NULL);
+  }
+
+  long bytes = 0;
+  for (int ii = 0; ii < count; ++ii) {
+    finish(&sources[ii]);
+    bytes += sources[ii].got;
+    free(sources[ii].bnums);
+    free(sources[ii].path);
+  }
+  fprintf(out, "%s: %i files and directories, %ld bytes\n", root, count, bytes);
+  free(sources);
+  return read_errors ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+  jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *tree = NULL;
+  int force = 0;
+  long size = NUFS_SIZE;
+  int usage = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "Fs:d:j:")) != -1) {
+    if (opt == 'F') {
+      force = 1;
+    } else if (opt == 's') {
+      char *unit;
+      size = strtol(optarg, &unit, 0);
+      size <<= (*unit == 'K' || *unit == 'k') ? 10 : (*unit == 'M' || *unit == 'm') ? 20 : 0;
+      usage = size < (long) BLOCK_SIZE * BLOCK_COUNT_MIN || size > (long) BLOCK_SIZE * BLOCK_COUNT_MAX;
+    } else if (opt == 'd') {
+      tree = optarg;
+    } else if (opt == 'j' && atoi(optarg) > 0) {
+      jobs = atoi(optarg);
+    } else {
+      usage = 1;
+    }
+  }
+  if (usage || optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-F] [-s SIZE] [-d DIR] [-j THREADS] IMAGE\n", argv[0]);
+    fprintf(stderr, "SIZE is from %iK to %iK\n", BLOCK_SIZE * BLOCK_COUNT_MIN / 1024,
+            BLOCK_SIZE / 1024 * BLOCK_COUNT_MAX);
+    return 2;
+  }
+  const char *image = argv[optind];
+  if (jobs < 1) {
+    jobs = 1;
+  }
+
+  // start from an empty file of the right size, which blocks_init makes a
+  // sparse image of
+  struct stat st;
+  if (!force && stat(image, &st) == 0 && st.st_size > 0) {
+    fprintf(stderr, "%s: already exists, -F replaces it\n", image);
+    return 1;
+  }
+  int fd = open(image, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (fd < 0 || ftruncate(fd, bytes_to_blocks(size) * BLOCK_SIZE) < 0) {
+    perror(image);
+    return 1;
+  }
+  close(fd);
+
+  // the file system code logs to stdout, the report gets the real one
+  out = fdopen(dup(STDOUT_FILENO), "w");
+  if (!out || !freopen("/dev/null", "w", stdout)) {
+    perror("stdout");
+    return 1;
+  }
+  blocks_init(image);
+  checksum_init(0, 1);
+  // a new image has at most BLOCK_COUNT blocks, the rest are grown
+  if (blocks_grow(bytes_to_blocks(size)) < 0) {
+    return 1;
+  }
+  directory_init();
+  int rv = tree ? build(tree) : 0;
+  checksum_seal();
+
+  fprintf(out, "%s: %i blocks of %i bytes, up to %i inodes, %i blocks free\n", image,
+          blocks_count(), BLOCK_SIZE, INODE_LIMIT, blocks_free_count());
+  msync(blocks_get_block(0), (size_t) blocks_count() * BLOCK_SIZE, MS_SYNC);
+  if (fstat(blocks_get_fd(), &st) == 0) {
+    fprintf(out, "%s: %lli KB of %i KB written on the host\n", image,
+            (long long) st.st_blocks / 2, blocks_count() * BLOCK_SIZE / 1024);
+  }
+  fclose(out);
+  blocks_free();
+  return rv < 0;
+}
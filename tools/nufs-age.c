@@ -0,0 +1,292 @@
+/**
+ * @file nufs-age.c
+ * @author Alston Liu
+ *
+ * Age an image that is not mounted with a churn of file operations, and
+ * report how fragmented the files and the free space are.
+ *
+ *   nufs-age [-s SEED] [-c CYCLES] [-f FILL] IMAGE
+ *
+ * Every cycle creates, appends to, deletes or renames one file under
+ * /age, through the same storage calls a mount makes. File sizes, chunk
+ * sizes and names come from a generator seeded with SEED, and the image is
+ * kept around FILL percent full (70 by default): below it files mostly
+ * grow, above it they mostly go. The same seed on the same image gives the
+ * same files in the same blocks; only the times differ. -c 0 only reports.
+ *
+ * The report has a histogram of the extents each file is stored in and one
+ * of the free runs by length, as e2freefrag prints for ext4.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "storage.h"
+#include "bitmap.h"
+
+#define AGE_DIRS 8
+#define AGE_FILES 192    // files under /age at most, below INODE_LIMIT
+#define AGE_MAX_SIZE (160 * 1024)
+#define HIST_BUCKETS 8   // lengths 1, 2-3, 4-7, ... 128 and more
+
+static FILE *out;
+static uint64_t seed = 1;
+static char names[AGE_FILES][64]; // paths of the files under /age
+static int count = 0;
+static char buf[AGE_MAX_SIZE];
+
+enum { OP_CREATE, OP_APPEND, OP_DELETE, OP_RENAME, OP_COUNT };
+static const char *op_names[OP_COUNT] = {"create", "append", "delete", "rename"};
+static long done[OP_COUNT];
+static long failed[OP_COUNT];
+
+// splitmix64
+static uint64_t next() {
+  uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static int pick(int n) { return next() % n; }
+
+// a file size: mostly small files, some larger ones, a few big ones
+static int file_size() {
+  int roll = pick(100);
+  if (roll < 60) {
+    return 1 + pick(16 * 1024);
+  } else if (roll < 90) {
+    return 16 * 1024 + pick(48 * 1024);
+  }
+  return 64 * 1024 + pick(AGE_MAX_SIZE - 64 * 1024);
+}
+
+// a path under a random directory that is not taken
+static void new_name(char *path) {
+  do {
+    sprintf(path, "/age/d%i/f%05i", pick(AGE_DIRS), pick(100000));
+  } while (path_lookup(path) >= 0);
+}
+
+// write size bytes at offset in chunks of up to 32K, as a program would
+static int write_file(const char *path, int size, int offset) {
+  storage_file_t *file = storage_open(path);
+  int rv = file ? 0 : -1;
+  for (int pos = 0; rv == 0 && pos < size;) {
+    int chunk = 4096 + pick(28 * 1024);
+    chunk = (chunk < size - pos) ? chunk : size - pos;
+    rv = storage_write(path, buf, chunk, offset + pos) == chunk ? 0 : -1;
+    pos += chunk;
+  }
+  if (file) {
+    rv = (storage_flush(file) < 0) ? -1 : rv;
+    storage_release(file);
+  }
+  return rv;
+}
+
+// one operation, chosen by how full the image is
+static void cycle(int fill) {
+  struct statvfs st;
+  storage_statfs(&st);
+  int used = 100 - (int) (st.f_bfree * 100 / st.f_blocks);
+  static const int grow[OP_COUNT] = {40, 35, 10, 15};
+  static const int shrink[OP_COUNT] = {15, 15, 55, 15};
+  const int *weights = (used < fill) ? grow : shrink;
+  int roll = pick(100);
+  int op = 0;
+  while (roll >= weights[op]) {
+    roll -= weights[op++];
+  }
+  if (count == 0 || (op == OP_CREATE && count == AGE_FILES)) {
+    op = (count == 0) ? OP_CREATE : OP_DELETE;
+  }
+
+  int rv = 0;
+  int victim = count ? pick(count) : 0;
+  if (op == OP_CREATE) {
+    char *path = names[count];
+    new_name(path);
+    rv = storage_mknod(path, FILE_MODE | 0644);
+    if (rv == 0) {
+      count++;
+      rv = write_file(path, file_size(), 0);
+    }
+  } else if (op == OP_APPEND) {
+    struct stat sb;
+    int size = 1 + pick(16 * 1024);
+    rv = storage_stat(names[victim], &sb);
+    rv = (rv < 0 || sb.st_size + size > AGE_MAX_SIZE) ? -1 : write_file(names[victim], size, sb.st_size);
+  } else if (op == OP_DELETE) {
+    rv = storage_unlink(names[victim]);
+    strcpy(names[victim], names[--count]);
+    while (orphan_reclaim()) {
+      // freed at once, as the cleaner thread would soon after
+    }
+  } else {
+    char path[64];
+    new_name(path);
+    rv = storage_rename(names[victim], path);
+    if (rv == 0) {
+      strcpy(names[victim], path);
+    }
+  }
+  done[op]++;
+  failed[op] += rv < 0;
+}
+
+// the files already under /age
+static void load_names() {
+  storage_mknod("/age", DIR_MODE | 0755);
+  for (int dd = 0; dd < AGE_DIRS; ++dd) {
+    char dir[32];
+    sprintf(dir, "/age/d%i", dd);
+    if (path_lookup(dir) < 0) {
+      storage_mknod(dir, DIR_MODE | 0755);
+    }
+    slist_t *list = storage_list(dir);
+    for (slist_t *item = list; item; item = item->next) {
+      if (strcmp(item->data, ".") && strcmp(item->data, "..") && count < AGE_FILES) {
+        snprintf(names[count++], sizeof(names[0]), "%s/%s", dir, item->data);
+      }
+    }
+    slist_free(list);
+  }
+}
+
+static int bucket(int len) {
+  int bb = 0;
+  while (len > 1 && bb < HIST_BUCKETS - 1) {
+    len >>= 1;
+    bb++;
+  }
+  return bb;
+}
+
+static void print_bucket(int bb, const char *fmt, long first, long second, long total) {
+  char range[32];
+  if (bb == HIST_BUCKETS - 1) {
+    sprintf(range, "%i+", 1 << bb);
+  } else if (bb == 0) {
+    sprintf(range, "1");
+  } else {
+    sprintf(range, "%i-%i", 1 << bb, (2 << bb) - 1);
+  }
+  fprintf(out, fmt, range, first, second, total ? second * 100.0 / total : 0.0);
+}
+
+static void report() {
+  long files = 0;
+  long blocks = 0;
+  long extents = 0;
+  long by_extents[HIST_BUCKETS] = {0};
+  long blocks_by_extents[HIST_BUCKETS] = {0};
+  for (int inum = 0; inum < blocks_inode_capacity(); ++inum) {
+    inode_t *node = bitmap_get(get_inode_bitmap(), inum) ? get_inode(inum) : NULL;
+    if (!node || !S_ISREG(node->mode) || node->blocks == 0) {
+      continue;
+    }
+    int ext = inode_extents(node);
+    int bb = bucket(ext > 0 ? ext : 1);
+    files++;
+    blocks += node->blocks;
+    extents += ext;
+    by_extents[bb]++;
+    blocks_by_extents[bb] += node->blocks;
+  }
+  fprintf(out, "files: %ld with blocks, %ld blocks in %ld extents, %.2f extents per file\n",
+          files, blocks, extents, files ? (double) extents / files : 0.0);
+  fprintf(out, "%-10s %8s %8s %8s\n", "extents", "files", "blocks", "% blocks");
+  for (int bb = 0; bb < HIST_BUCKETS; ++bb) {
+    print_bucket(bb, "%-10s %8ld %8ld %7.1f%%\n", by_extents[bb], blocks_by_extents[bb], blocks);
+  }
+
+  void *bbm = get_blocks_bitmap();
+  long runs[HIST_BUCKETS] = {0};
+  long run_blocks[HIST_BUCKETS] = {0};
+  long free = 0;
+  int longest = 0;
+  for (int ii = 1; ii < blocks_count();) {
+    if (bitmap_get(bbm, ii)) {
+      ++ii;
+      continue;
+    }
+    int start = ii;
+    while (ii < blocks_count() && !bitmap_get(bbm, ii)) {
+      ++ii;
+    }
+    int len = ii - start;
+    runs[bucket(len)]++;
+    run_blocks[bucket(len)] += len;
+    free += len;
+    longest = (len > longest) ? len : longest;
+  }
+  fprintf(out, "free: %ld of %i blocks, longest run %i\n", free, blocks_count(), longest);
+  fprintf(out, "%-10s %8s %8s %8s\n", "run", "runs", "blocks", "% free");
+  for (int bb = 0; bb < HIST_BUCKETS; ++bb) {
+    print_bucket(bb, "%-10s %8ld %8ld %7.1f%%\n", runs[bb], run_blocks[bb], free);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  long cycles = 1000;
+  int fill = 70;
+  unsigned long long seeded;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:c:f:")) != -1) {
+    if (opt == 's') {
+      seed = strtoull(optarg, NULL, 0);
+    } else if (opt == 'c' && atol(optarg) >= 0) {
+      cycles = atol(optarg);
+    } else if (opt == 'f' && atoi(optarg) > 0 && atoi(optarg) < 100) {
+      fill = atoi(optarg);
+    } else {
+      optind = argc + 1;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-s SEED] [-c CYCLES] [-f FILL] IMAGE\n", argv[0]);
+    return 2;
+  }
+  seeded = seed;
+
+  // the file system code logs to stdout and stderr, and failed calls are
+  // part of the churn; the report gets the real stdout
+  out = fdopen(dup(STDOUT_FILENO), "w");
+  if (!out || !freopen("/dev/null", "w", stdout) || !freopen("/dev/null", "w", stderr)) {
+    perror("stdout");
+    return 1;
+  }
+  if (storage_init(argv[optind], NULL) < 0) {
+    return 1;
+  }
+
+  // held throughout; no cleaner thread is started, orphans are freed here
+  storage_lock();
+  while (orphan_reclaim()) {
+  }
+  for (int ii = 0; ii < (int) sizeof(buf); ++ii) {
+    buf[ii] = 'a' + next() % 26;
+  }
+  load_names();
+  for (long ii = 0; ii < cycles; ++ii) {
+    cycle(fill);
+  }
+  int rv = storage_flush_all();
+
+  fprintf(out, "%s: %ld cycles with seed %llu, %i files under /age\n", argv[optind], cycles,
+          seeded, count);
+  for (int op = 0; cycles && op < OP_COUNT; ++op) {
+    fprintf(out, "  %-7s %6ld, %ld failed\n", op_names[op], done[op], failed[op]);
+  }
+  report();
+  if (rv < 0) {
+    fprintf(out, "some appends could not be flushed, the image is full\n");
+  }
+  storage_unlock();
+  fclose(out);
+  blocks_free();
+  return rv < 0;
+}
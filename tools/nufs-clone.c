@@ -0,0 +1,91 @@
+/**
+ * @file nufs-clone.c
+ * @author Alston Liu
+ *
+ * Reflink copy for a mounted nufs: the destination shares the blocks of the
+ * source until either of them is written.
+ *
+ *   nufs-clone SRC DST                        clone the whole file
+ *   nufs-clone SRC DST SRC_OFF LEN DST_OFF    clone a block aligned range
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nufs_ioctl.h"
+
+// find the mount point holding the file, by walking up until the device
+// changes. Returns the length of its path, which is a prefix of real
+static int mount_root(const char *real) {
+  struct stat st;
+  if (stat(real, &st) < 0) {
+    return -1;
+  }
+  char dir[PATH_MAX];
+  strcpy(dir, real);
+  int len = strlen(dir);
+  for (;;) {
+    char *slash = strrchr(dir, '/');
+    if (!slash || slash == dir) {
+      return 0; // nufs mounted on / would be odd, but fine
+    }
+    *slash = '\0';
+    struct stat parent;
+    if (stat(dir, &parent) < 0 || parent.st_dev != st.st_dev) {
+      return len;
+    }
+    len = slash - dir;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3 && argc != 6) {
+    fprintf(stderr, "usage: %s SRC DST [SRC_OFF LEN DST_OFF]\n", argv[0]);
+    return 2;
+  }
+
+  nufs_clone_range_t req;
+  memset(&req, 0, sizeof(req));
+  if (argc == 6) {
+    req.src_offset = strtoull(argv[3], NULL, 0);
+    req.src_length = strtoull(argv[4], NULL, 0);
+    req.dest_offset = strtoull(argv[5], NULL, 0);
+  }
+
+  char real[PATH_MAX];
+  int root;
+  if (!realpath(argv[1], real) || (root = mount_root(real)) < 0) {
+    perror(argv[1]);
+    return 1;
+  }
+  if (strlen(real + root) >= NUFS_PATH_MAX) {
+    fprintf(stderr, "%s: path too long\n", argv[1]);
+    return 1;
+  }
+  strcpy(req.src_path, real + root);
+
+  // a whole file clone replaces what the destination held
+  int fd = open(argv[2], O_WRONLY | O_CREAT | (argc == 3 ? O_TRUNC : 0), 0644);
+  if (fd < 0) {
+    perror(argv[2]);
+    return 1;
+  }
+  struct stat src_st, dst_st;
+  if (stat(real, &src_st) < 0 || fstat(fd, &dst_st) < 0 || src_st.st_dev != dst_st.st_dev) {
+    fprintf(stderr, "%s: not on the same nufs mount as %s\n", argv[2], argv[1]);
+    close(fd);
+    return 1;
+  }
+  if (ioctl(fd, NUFS_IOC_CLONE_RANGE, &req) < 0) {
+    fprintf(stderr, "%s: clone failed: %s\n", argv[2], strerror(errno));
+    close(fd);
+    return 1;
+  }
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,135 @@
+/**
+ * @file nufs-defrag.c
+ * @author Alston Liu
+ *
+ * Defragment the files of a mounted nufs while it is in use.
+ *
+ *   nufs-defrag [-v] [-r BLOCKS] PATH...
+ *
+ * Every regular file under each PATH whose blocks are spread over several
+ * runs is moved into one free run, one file per NUFS_IOC_DEFRAG. The file
+ * system lock is only held for one file at a time, and the tool sleeps
+ * between files so no more than BLOCKS blocks (256 by default, 1MB) are
+ * copied per second, which leaves room for the I/O of everyone else.
+ * -r 0 does not wait. The extents of every file on the mount are counted
+ * before and after.
+ */
+#define _XOPEN_SOURCE 700
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nufs_ioctl.h"
+
+static int verbose = 0;
+static long rate = 256; // blocks per second, 0 for no limit
+static long files = 0;  // files looked at
+static long defragged = 0;
+static long moved = 0;
+static long before = 0; // extents of the files looked at
+static long after = 0;
+static int errors = 0;
+static struct timespec started;
+
+static double elapsed() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - started.tv_sec) + (now.tv_nsec - started.tv_nsec) / 1e9;
+}
+
+// sleep until the blocks moved so far fit in the rate
+static void throttle() {
+  if (rate <= 0) {
+    return;
+  }
+  double ahead = (double) moved / rate - elapsed();
+  if (ahead > 0) {
+    struct timespec pause = {(time_t) ahead, (long) ((ahead - (time_t) ahead) * 1e9)};
+    nanosleep(&pause, NULL);
+  }
+}
+
+static int defrag_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+  if (type != FTW_F || !S_ISREG(st->st_mode)) {
+    return 0;
+  }
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    errors++;
+    return 0;
+  }
+  nufs_defrag_t res;
+  if (ioctl(fd, NUFS_IOC_DEFRAG, &res) < 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    errors++;
+  } else {
+    files++;
+    before += res.extents_before;
+    after += res.extents_after;
+    defragged += res.moved > 0;
+    moved += res.moved;
+    if (verbose && res.moved > 0) {
+      printf("%s: %lli extents -> %lli, %lli blocks moved\n", path,
+             (long long) res.extents_before, (long long) res.extents_after, (long long) res.moved);
+    }
+  }
+  close(fd);
+  throttle();
+  return 0;
+}
+
+// the extents of every file on the mount holding path, or -1
+static long mount_extents(const char *path, long *count) {
+  int fd = open(path, O_RDONLY);
+  nufs_stats_t stats;
+  if (fd < 0 || ioctl(fd, NUFS_IOC_GET_STATS, &stats) < 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  close(fd);
+  *count = stats.files;
+  return stats.extents;
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "vr:")) != -1) {
+    if (opt == 'v') {
+      verbose = 1;
+    } else if (opt == 'r' && atol(optarg) >= 0) {
+      rate = atol(optarg);
+    } else {
+      optind = argc + 1;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-v] [-r BLOCKS] PATH...\n", argv[0]);
+    return 2;
+  }
+
+  long all_files;
+  long all_before = mount_extents(argv[optind], &all_files);
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  for (int ii = optind; ii < argc; ++ii) {
+    if (nftw(argv[ii], defrag_file, 16, FTW_PHYS | FTW_MOUNT) < 0) {
+      perror(argv[ii]);
+      errors++;
+    }
+  }
+
+  printf("%ld files in %ld extents, now %ld; %ld defragmented, %ld blocks moved in %.1fs\n",
+         files, before, after, defragged, moved, elapsed());
+  long all_after = mount_extents(argv[optind], &all_files);
+  if (all_before >= 0 && all_after >= 0) {
+    printf("mount: %ld files in %ld extents, %ld before\n", all_files, all_after, all_before);
+  }
+  return errors > 0;
+}
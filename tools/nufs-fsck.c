@@ -0,0 +1,858 @@
+/**
+ * @file nufs-fsck.c
+ * @author Alston Liu
+ *
+ * Check an image that is not mounted, and optionally repair it.
+ *
+ *   nufs-fsck [-r] [-j THREADS] IMAGE
+ *
+ * The inodes (live and in snapshots) are scanned for block map entries that
+ * point nowhere, then the directory tree is walked from the root. Both run
+ * on THREADS threads, one inode or directory at a time, and only gather
+ * facts; the problems are then reported in order. They are:
+ *
+ *   - chunks of the inode table outside the image
+ *   - inodes with a bad type, size, block count or indirect block, and
+ *     block map entries that point outside the image
+ *   - directory entries naming free or bad inodes, entries left unused by
+ *     a delete, entries lost past the end of a directory, and "." and ".."
+ *     that are not the first two entries
+ *   - link counts that do not match the entries naming a file
+ *   - a broken orphan list, and orphans a directory still names
+ *   - inodes no directory reaches, which go back to where a lost entry
+ *     names them or else to /lost+found
+ *   - blocks used but free in the bitmap, allocated but unused, with the
+ *     wrong reference count or fragment map
+ *   - blocks that do not match their checksum
+ *   - free block and inode counters that do not match the bitmaps
+ *
+ * With -r each kind of problem is fixed and the image checked again, since
+ * one repair can show the next problem (a dropped entry leaves its block
+ * unused). Exits with 0 if the image is clean, 1 if everything found was
+ * fixed and 4 if problems are left. A block that does not match its checksum
+ * gets a new one; what it held before cannot be told.
+ */
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "storage.h"
+#include "bitmap.h"
+
+#define ITEMS ((1 + SNAPSHOT_MAX) * INODE_LIMIT) // live inodes, then every snapshot's
+#define ROOT_INUM 0 // the root directory
+#define DIR_SLOTS (BLOCK_SIZE / (int) sizeof(dirent_t))
+
+// what the inode scan can find wrong with an inode
+#define BAD_TYPE 0x1     // neither a file nor a directory
+#define BAD_BLOCKS 0x2   // block count out of range
+#define BAD_SIZE 0x4     // size does not fit the inode
+#define BAD_INDIRECT 0x8 // indirect block missing, out of range or left over
+#define BAD_ENTRY 0x10   // block map entries that point nowhere
+
+#define DOTS_MISPLACED 0x4 // in dir_dots
+
+static FILE *out;
+static int jobs;
+static int repair = 0;
+static int found = 0; // problems found
+static int fixed = 0; // problems fixed
+
+// facts gathered by the threads
+static uint16_t uses[BLOCK_COUNT_MAX];      // references to every block
+static uint8_t frag_masks[BLOCK_COUNT_MAX]; // fragments used by live packed tails
+static uint8_t item_bad[ITEMS];         // BAD_* of every inode scanned
+static int links[INODE_LIMIT];          // entries naming each inode
+static int parent[INODE_LIMIT];         // directory an inode was reached from
+static uint8_t visited[INODE_LIMIT];    // directories reached from the root
+static uint64_t dir_bad[INODE_LIMIT];   // entries naming free or bad inodes
+static uint64_t dir_holes[INODE_LIMIT]; // unused entries before the end
+static uint64_t dir_lost[INODE_LIMIT];  // used entries past the end
+static uint8_t dir_dots[INODE_LIMIT];   // "." (bit 0) and ".." (bit 1) naming the wrong inode,
+                                        // DOTS_MISPLACED if they are not the first two entries
+static int csum_bad[BLOCK_COUNT_MAX];       // blocks that do not match their checksum
+
+// work handed out to the threads
+static int next_item;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_wake = PTHREAD_COND_INITIALIZER;
+static int queue[INODE_LIMIT];
+static int queue_len;
+static int busy; // directories being read; the walk ends at 0 with an empty queue
+
+static void problem(int fixable, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(out, fmt, ap);
+  va_end(ap);
+  found++;
+  if (repair && fixable) {
+    fprintf(out, " (fixed)");
+    fixed++;
+  }
+  fputc('\n', out);
+}
+
+static void run_threads(void *(*work)(void *)) {
+  pthread_t threads[jobs];
+  for (int ii = 0; ii < jobs; ++ii) {
+    pthread_create(&threads[ii], NULL, work, NULL);
+  }
+  for (int ii = 0; ii < jobs; ++ii) {
+    pthread_join(threads[ii], NULL);
+  }
+}
+
+// whether a block can hold file data
+static int data_block(int bnum) {
+  return bnum > 0 && bnum < blocks_count();
+}
+
+// whether a chunk of the inode table is there and fits in the image
+static int chunk_ok(int chunk) {
+  int first = ((int32_t *) get_inode_chunks())[chunk];
+  return data_block(first) && first + INODE_CHUNK_BLOCKS <= blocks_count();
+}
+
+// a live inode, or NULL if its chunk is missing
+static inode_t *live_inode(int inum) {
+  if (!chunk_ok(inum / INODES_PER_CHUNK)) {
+    return NULL;
+  }
+  inode_t *first = blocks_get_block(((int32_t *) get_inode_chunks())[inum / INODES_PER_CHUNK]);
+  return first + inum % INODES_PER_CHUNK;
+}
+
+// the inode of a scan item, or NULL if there is none
+static inode_t *item_inode(int item) {
+  int slot = item / INODE_LIMIT - 1;
+  int inum = item % INODE_LIMIT;
+  if (inum >= blocks_inode_capacity()) {
+    return NULL; // past the inode table as it is now
+  } else if (slot < 0) {
+    return bitmap_get(get_inode_bitmap(), inum) ? live_inode(inum) : NULL;
+  }
+  snapshot_t *snap = &snapshot_table()[slot];
+  if (!snap->table || !bitmap_get(snapshot_inodes(snap), inum) ||
+      inum >= snap->blocks * BLOCK_SIZE / (int) INODE_SIZE) {
+    return NULL;
+  }
+  return (inode_t *) blocks_get_block(snap->table) + inum;
+}
+
+// a block map entry, or BNUM_HOLE where the indirect block is unusable
+static int *entry_ptr(inode_t *node, int ii) {
+  if (ii < MAX_BLOCKS) {
+    return &node->block[ii];
+  } else if (!data_block(node->indirect)) {
+    return NULL;
+  }
+  return (int *) blocks_get_block(node->indirect) + ii - MAX_BLOCKS;
+}
+
+// whether a block map entry points somewhere sensible
+static int entry_ok(int entry, int last) {
+  if (entry == BNUM_HOLE) {
+    return 1;
+  } else if (entry < 0) {
+    return 0;
+  } else if (entry & BNUM_FRAG) {
+    int addr = FRAG_ENTRY_ADDR(entry);
+    int count = FRAG_ENTRY_COUNT(entry);
+    return last && count > 0 && addr % FRAGS_PER_BLOCK + count <= FRAGS_PER_BLOCK &&
+           data_block(addr / FRAGS_PER_BLOCK);
+  }
+  return data_block(entry & ~(BNUM_UNWRITTEN | BNUM_COMPR)) &&
+         !((entry & BNUM_UNWRITTEN) && (entry & BNUM_COMPR));
+}
+
+// check one inode and count the blocks it uses
+static int scan_inode(inode_t *node, int live) {
+  if (!S_ISREG(node->mode) && !S_ISDIR(node->mode)) {
+    return BAD_TYPE;
+  }
+  if (node->flags & INODE_INLINE) {
+    return (S_ISDIR(node->mode) || node->size < 0 || node->size > INLINE_MAX) ? BAD_SIZE : 0;
+  }
+  if (node->blocks < 0 || node->blocks > MAX_BLOCKS + (int) INDIRECT_COUNT ||
+      (S_ISDIR(node->mode) && node->blocks < 1)) {
+    return BAD_BLOCKS;
+  }
+
+  int bad = 0;
+  if (node->size < 0 || (S_ISDIR(node->mode) && node->size > BLOCK_SIZE) ||
+      (live && node->size > node->blocks * BLOCK_SIZE)) {
+    bad |= BAD_SIZE; // appends still buffered at a crash are gone
+  }
+  if ((node->indirect != -1 && !data_block(node->indirect)) ||
+      (node->blocks > MAX_BLOCKS && node->indirect == -1) ||
+      (node->blocks <= MAX_BLOCKS && node->indirect != -1)) {
+    bad |= BAD_INDIRECT;
+  } else if (node->indirect != -1) {
+    __atomic_add_fetch(&uses[node->indirect], 1, __ATOMIC_RELAXED);
+  }
+
+  for (int ii = 0; ii < node->blocks; ++ii) {
+    int *entry = entry_ptr(node, ii);
+    if (!entry || *entry == BNUM_HOLE) {
+      continue;
+    } else if (!entry_ok(*entry, ii == node->blocks - 1) ||
+               (S_ISDIR(node->mode) && (*entry & (BNUM_FRAG | BNUM_COMPR | BNUM_UNWRITTEN)))) {
+      bad |= BAD_ENTRY;
+    } else if ((*entry & BNUM_FRAG) && live) {
+      // live fragments are counted by the fragment map, not one by one
+      int addr = FRAG_ENTRY_ADDR(*entry);
+      uint8_t mask = ((1 << FRAG_ENTRY_COUNT(*entry)) - 1) << (addr % FRAGS_PER_BLOCK);
+      __atomic_or_fetch(&frag_masks[addr / FRAGS_PER_BLOCK], mask, __ATOMIC_RELAXED);
+    } else {
+      __atomic_add_fetch(&uses[inode_entry_block(*entry)], 1, __ATOMIC_RELAXED);
+    }
+  }
+  if (S_ISDIR(node->mode) && !(bad & BAD_ENTRY) && node->block[0] < 0) {
+    bad |= BAD_ENTRY; // a directory needs its block
+  }
+  return bad;
+}
+
+static void *scan_worker(void *arg) {
+  for (;;) {
+    int item = __atomic_fetch_add(&next_item, 1, __ATOMIC_RELAXED);
+    if (item >= ITEMS) {
+      return NULL;
+    }
+    inode_t *node = item_inode(item);
+    if (node) {
+      item_bad[item] = scan_inode(node, item < INODE_LIMIT);
+    }
+  }
+}
+
+// whether a live inode may be named by a directory entry
+static int inode_ok(int inum) {
+  return inum >= 0 && inum < blocks_inode_capacity() && bitmap_get(get_inode_bitmap(), inum) &&
+         live_inode(inum) && !(item_bad[inum] & (BAD_TYPE | BAD_BLOCKS));
+}
+
+// read the entries of one directory, queueing the directories it names
+static void walk_dir(int dir) {
+  inode_t *node = live_inode(dir);
+  if (!inode_ok(dir) || !S_ISDIR(node->mode) || (node->flags & INODE_INLINE) ||
+      (item_bad[dir] & BAD_ENTRY) || !data_block(node->block[0])) {
+    return;
+  }
+  dirent_t *entries = blocks_get_block(node->block[0]);
+  int count = (node->refs < 0) ? 0 : (node->refs > DIR_SLOTS) ? DIR_SLOTS : node->refs;
+  int slots = node->size / (int) sizeof(dirent_t);
+  slots = (slots < count) ? count : (slots > DIR_SLOTS) ? DIR_SLOTS : slots;
+
+  for (int ii = 0; ii < slots; ++ii) {
+    dirent_t *entry = &entries[ii];
+    if (!entry->used) {
+      dir_holes[dir] |= (ii < count) ? 1ULL << ii : 0;
+      continue;
+    } else if (ii >= count) {
+      dir_lost[dir] |= 1ULL << ii; // the last entry a delete dropped
+      continue;
+    }
+    int child = entry->inum;
+    if (!strcmp(entry->name, ".") || !strcmp(entry->name, "..")) {
+      // an orphaned directory has no parent to compare with
+      if (ii == (entry->name[1] == '.')) {
+        dir_dots[dir] |= (parent[dir] >= 0 && child != (ii ? parent[dir] : dir)) << ii;
+      }
+      continue;
+    } else if (child == dir) {
+      continue; // names itself, not a link
+    }
+    if (!inode_ok(child) || !memchr(entry->name, 0, DIR_NAME_LENGTH) || !entry->name[0]) {
+      dir_bad[dir] |= 1ULL << ii;
+      continue;
+    }
+    __atomic_add_fetch(&links[child], 1, __ATOMIC_RELAXED);
+    inode_t *cnode = live_inode(child);
+    if (S_ISDIR(cnode->mode) && !__atomic_test_and_set(&visited[child], __ATOMIC_RELAXED)) {
+      parent[child] = dir;
+      pthread_mutex_lock(&queue_lock);
+      queue[queue_len++] = child;
+      pthread_cond_signal(&queue_wake);
+      pthread_mutex_unlock(&queue_lock);
+    }
+  }
+
+  // mknod used to leave the link count of alloc_inode at 1 before adding
+  // "." and "..", so directories it made have them a slot late, and ".."
+  // past the end or written over by the next entry
+  if (parent[dir] >= 0 && !(count > 1 && entries[0].used && !strcmp(entries[0].name, ".") &&
+                            entries[1].used && !strcmp(entries[1].name, ".."))) {
+    dir_dots[dir] |= DOTS_MISPLACED;
+  }
+}
+
+// whether a directory entry is "." or ".."
+static int is_dots(dirent_t *entry) {
+  return !strcmp(entry->name, ".") || !strcmp(entry->name, "..");
+}
+
+static void *walk_worker(void *arg) {
+  pthread_mutex_lock(&queue_lock);
+  for (;;) {
+    while (queue_len == 0 && busy > 0) {
+      pthread_cond_wait(&queue_wake, &queue_lock);
+    }
+    if (queue_len == 0) {
+      pthread_cond_broadcast(&queue_wake);
+      pthread_mutex_unlock(&queue_lock);
+      return NULL;
+    }
+    int dir = queue[--queue_len];
+    busy++;
+    pthread_mutex_unlock(&queue_lock);
+    walk_dir(dir);
+    pthread_mutex_lock(&queue_lock);
+    busy--;
+  }
+}
+
+static void *csum_worker(void *arg) {
+  checksum_area_t *area = get_checksum_area();
+  uint32_t *sums = blocks_get_block(area->block);
+  for (;;) {
+    int bnum = __atomic_fetch_add(&next_item, 1, __ATOMIC_RELAXED);
+    if (bnum >= blocks_count()) {
+      return NULL;
+    }
+    // the tables are stale with block 0
+    int table = blocks_is_table(bnum);
+    csum_bad[bnum] = !checksum_holds(bnum) && !bitmap_get(get_checksum_stale(), table ? 0 : bnum) &&
+                     (table || bitmap_get(get_blocks_bitmap(), bnum)) &&
+                     crc32c(0, blocks_get_block(bnum), BLOCK_SIZE) != sums[bnum];
+  }
+}
+
+// gather the facts about the image
+static void gather() {
+  memset(uses, 0, sizeof(uses));
+  memset(frag_masks, 0, sizeof(frag_masks));
+  memset(item_bad, 0, sizeof(item_bad));
+  memset(links, 0, sizeof(links));
+  memset(visited, 0, sizeof(visited));
+  memset(dir_bad, 0, sizeof(dir_bad));
+  memset(dir_holes, 0, sizeof(dir_holes));
+  memset(dir_lost, 0, sizeof(dir_lost));
+  memset(dir_dots, 0, sizeof(dir_dots));
+
+  next_item = 0;
+  run_threads(scan_worker);
+
+  visited[ROOT_INUM] = 1;
+  parent[ROOT_INUM] = ROOT_INUM;
+  queue[0] = ROOT_INUM;
+  queue_len = 1;
+
+  // orphaned directories still name what the reclaimer has not reached
+  for (int inum = 0; inum < blocks_inode_capacity(); ++inum) {
+    inode_t *node = inode_ok(inum) ? live_inode(inum) : NULL;
+    if (node && S_ISDIR(node->mode) && (node->flags & INODE_ORPHAN)) {
+      visited[inum] = 1;
+      parent[inum] = -1;
+      queue[queue_len++] = inum;
+    }
+  }
+  busy = 0;
+  run_threads(walk_worker);
+}
+
+// report the inodes that are broken; returns how many were fixed
+static int check_inodes() {
+  int count = 0;
+  for (int item = 0; item < ITEMS; ++item) {
+    int bad = item_bad[item];
+    inode_t *node = item_inode(item);
+    if (!bad || !node) {
+      continue;
+    }
+    int slot = item / INODE_LIMIT - 1;
+    int inum = item % INODE_LIMIT;
+    char where[64];
+    if (slot < 0) {
+      snprintf(where, sizeof(where), "inode %i", inum);
+    } else {
+      snprintf(where, sizeof(where), "inode %i of snapshot %s", inum, snapshot_table()[slot].name);
+    }
+
+    if (bad & (BAD_TYPE | BAD_BLOCKS)) {
+      problem(slot >= 0 || inum != ROOT_INUM, "%s has a bad %s", where,
+              (bad & BAD_TYPE) ? "type" : "block count");
+      if (repair && slot < 0 && inum != ROOT_INUM) {
+        bitmap_put(get_inode_bitmap(), inum, 0); // its blocks become unused
+        count++;
+      } else if (repair && slot >= 0) {
+        bitmap_put(snapshot_inodes(&snapshot_table()[slot]), inum, 0);
+        count++;
+      }
+      continue;
+    }
+    if (bad & BAD_INDIRECT) {
+      problem(1, "%s has a bad indirect block %i", where, node->indirect);
+      if (repair) {
+        node->indirect = -1;
+        if (node->blocks > MAX_BLOCKS) {
+          node->blocks = MAX_BLOCKS;
+        }
+        count++;
+      }
+    }
+    if (bad & BAD_ENTRY) {
+      for (int ii = 0; ii < node->blocks; ++ii) {
+        int *entry = entry_ptr(node, ii);
+        if (entry && *entry != BNUM_HOLE &&
+            (!entry_ok(*entry, ii == node->blocks - 1) ||
+             (S_ISDIR(node->mode) && (*entry & (BNUM_FRAG | BNUM_COMPR | BNUM_UNWRITTEN))))) {
+          problem(!S_ISDIR(node->mode) || ii > 0, "%s: block %i points to %#x", where, ii, *entry);
+          if (repair && (!S_ISDIR(node->mode) || ii > 0)) {
+            *entry = BNUM_HOLE;
+            count++;
+          }
+        }
+      }
+      if (S_ISDIR(node->mode) && node->block[0] < 0) {
+        problem(0, "%s is a directory without a block", where);
+      }
+    }
+    if (bad & BAD_SIZE) {
+      int size = (node->flags & INODE_INLINE) ? INLINE_MAX : node->blocks * BLOCK_SIZE;
+      if (S_ISDIR(node->mode)) {
+        size = (node->flags & INODE_INLINE) ? 0 : BLOCK_SIZE;
+      }
+      problem(1, "%s has size %i, more than its %i bytes", where, node->size, size);
+      if (repair) {
+        node->size = (node->size < 0) ? 0 : size;
+        count++;
+      }
+    }
+  }
+  return count;
+}
+
+// whether an entry past the end of a directory can go back: it names an
+// inode no other entry names, and only the first such entry does
+static int restorable(dirent_t *entry) {
+  int inum = entry->inum;
+  if (!inode_ok(inum) || inum == ROOT_INUM || !memchr(entry->name, 0, DIR_NAME_LENGTH) ||
+      !entry->name[0] || links[inum] > 0) {
+    return 0;
+  }
+  links[inum] = 1;
+  return 1;
+}
+
+// report broken directory entries; returns how many directories were fixed
+static int check_dirs() {
+  int count = 0;
+  for (int dir = 0; dir < blocks_inode_capacity(); ++dir) {
+    uint64_t bad = dir_bad[dir];
+    uint64_t lost = dir_lost[dir];
+    if (!visited[dir] || !(bad | dir_holes[dir] | lost | dir_dots[dir])) {
+      continue;
+    }
+    inode_t *node = live_inode(dir);
+    dirent_t *entries = blocks_get_block(node->block[0]);
+    for (int ii = 0; ii < 2; ++ii) {
+      if (dir_dots[dir] & (1 << ii)) {
+        int want = ii ? parent[dir] : dir;
+        problem(1, "directory %i: %s names inode %i, not %i", dir, entries[ii].name,
+                entries[ii].inum, want);
+        if (repair) {
+          entries[ii].inum = want;
+          count++;
+        }
+      }
+    }
+    uint64_t back = 0;
+    for (int ii = 0; ii < DIR_SLOTS; ++ii) {
+      if (bad & (1ULL << ii)) {
+        problem(1, "directory %i: entry %i (%.*s) names inode %i", dir, ii,
+                DIR_NAME_LENGTH, entries[ii].name, entries[ii].inum);
+      } else if ((lost & (1ULL << ii)) && restorable(&entries[ii])) {
+        // a delete dropped the last entry instead of the one it removed
+        problem(1, "directory %i: entry %i (%s) is past the end", dir, ii, entries[ii].name);
+        back |= 1ULL << ii;
+      }
+    }
+    if (dir_holes[dir]) {
+      problem(1, "directory %i has %i unused entries", dir, __builtin_popcountll(dir_holes[dir]));
+    }
+    int dots = dir_dots[dir] & DOTS_MISPLACED;
+    if (dots) {
+      problem(1, "directory %i: \".\" and \"..\" are not its first entries", dir);
+    }
+    if (!repair || !(bad | dir_holes[dir] | back | dots)) {
+      continue;
+    }
+
+    // keep the good entries, in order and without gaps, after a new "."
+    // and ".." if they were out of place
+    dirent_t old[DIR_SLOTS];
+    memcpy(old, entries, sizeof(old));
+    memset(entries, 0, sizeof(old));
+    int kept = 0;
+    if (dots) {
+      strcpy(entries[0].name, ".");
+      entries[0].inum = dir;
+      strcpy(entries[1].name, "..");
+      entries[1].inum = parent[dir];
+      entries[0].used = entries[1].used = 1;
+      kept = 2;
+    }
+    for (int ii = 0; ii < DIR_SLOTS && kept < DIR_SLOTS; ++ii) {
+      int keep = (ii < node->refs && old[ii].used && !(bad & (1ULL << ii))) ||
+                 (back & (1ULL << ii));
+      if (keep && !(dots && is_dots(&old[ii]))) {
+        entries[kept++] = old[ii];
+      }
+    }
+    node->refs = kept;
+    node->size = kept * sizeof(dirent_t);
+    count++;
+  }
+  return count;
+}
+
+// the /lost+found directory, made if it is not there
+static int lost_found() {
+  inode_t *root = get_inode(ROOT_INUM);
+  int inum = directory_lookup(root, "lost+found");
+  if (inum >= 0) {
+    return inum;
+  }
+  inum = alloc_inode(DIR_MODE | 0700);
+  if (inum < 0) {
+    return -1;
+  }
+  inode_t *node = get_inode(inum);
+  node->refs = 0; // counts the entries of a directory
+  directory_put(node, ".", inum);
+  directory_put(node, "..", ROOT_INUM);
+  if (directory_put(root, "lost+found", inum) < 0) {
+    return -1;
+  }
+  return inum;
+}
+
+// put an inode back into a directory
+static int reconnect(int dir, const char *name, int inum) {
+  inode_t *node = get_inode(inum);
+  if (directory_put(get_inode(dir), name, inum) <= 0) {
+    return -1;
+  }
+  if (S_ISDIR(node->mode) && !(node->flags & INODE_INLINE) && node->refs >= 2) {
+    dirent_t *entries = inode_write_block(node, 0);
+    if (entries && !strcmp(entries[1].name, "..")) {
+      entries[1].inum = dir;
+    }
+  }
+  return 0;
+}
+
+// report a broken orphan list: an inode on it that is not an orphan, or
+// is named twice, and orphans that are not on it or that a directory
+// names. The list is made again from the orphans no directory names;
+// returns 1 if it was
+static int check_orphans() {
+  int32_t *head = get_orphan_list();
+  uint8_t listed[INODE_LIMIT] = {0};
+  int bad = 0;
+  for (int inum = *head; inum; inum = live_inode(inum)->orphan_next) {
+    if (inum == ROOT_INUM || !inode_ok(inum) || listed[inum] ||
+        !(live_inode(inum)->flags & INODE_ORPHAN)) {
+      problem(1, "the orphan list names inode %i", inum);
+      bad = 1;
+      break;
+    }
+    listed[inum] = 1;
+  }
+  for (int inum = 0; inum < blocks_inode_capacity(); ++inum) {
+    if (!inode_ok(inum) || !(live_inode(inum)->flags & INODE_ORPHAN)) {
+      continue;
+    }
+    if (inum == ROOT_INUM || links[inum] > 0) {
+      problem(1, "inode %i is an orphan, but a directory names it", inum);
+      bad = 1;
+    } else if (!listed[inum]) {
+      problem(1, "inode %i is an orphan, but not on the orphan list", inum);
+      bad = 1;
+    }
+  }
+  if (!repair || !bad) {
+    return 0;
+  }
+
+  *head = 0;
+  for (int inum = blocks_inode_capacity() - 1; inum >= 0; --inum) {
+    inode_t *node = inode_ok(inum) ? live_inode(inum) : NULL;
+    if (!node || !(node->flags & INODE_ORPHAN)) {
+      continue;
+    } else if (inum == ROOT_INUM || links[inum] > 0) {
+      node->flags &= ~INODE_ORPHAN;
+    } else {
+      node->orphan_next = *head;
+      *head = inum;
+    }
+  }
+  return 1;
+}
+
+// report inodes nothing reaches and wrong link counts; returns how many
+// inodes were fixed
+static int check_links() {
+  int count = 0;
+  for (int inum = 0; inum < blocks_inode_capacity(); ++inum) {
+    if (!inode_ok(inum) || inum == ROOT_INUM) {
+      continue;
+    }
+    inode_t *node = live_inode(inum);
+    if (node->flags & INODE_ORPHAN) {
+      continue; // waits for the reclaimer, see check_orphans
+    } else if (links[inum] == 0) {
+      problem(1, "inode %i is not in any directory", inum);
+      int lf = repair ? lost_found() : -1;
+      if (lf >= 0) {
+        char name[DIR_NAME_LENGTH];
+        snprintf(name, sizeof(name), "#%i", inum);
+        count += reconnect(lf, name, inum) == 0;
+      }
+    } else if (S_ISREG(node->mode) && node->refs != links[inum]) {
+      problem(1, "inode %i has %i links, but %i entries name it", inum, node->refs, links[inum]);
+      if (repair) {
+        node->refs = links[inum];
+        count++;
+      }
+    }
+  }
+  return count;
+}
+
+// report blocks whose bitmap, reference count or fragment map is wrong;
+// returns how many were fixed
+static int check_blocks() {
+  int count = 0;
+  void *bbm = get_blocks_bitmap();
+  uint16_t *refs = get_refcount_table();
+  uint8_t *map = get_frag_map();
+  uint64_t *hashes = get_dedup_hashes();
+  snapshot_t *snaps = snapshot_table();
+
+  // the inode table, snapshot tables, the checksums and the per-block
+  // tables are used too
+  static uint16_t want[BLOCK_COUNT_MAX];
+  memcpy(want, uses, sizeof(want));
+  for (int bnum = 0; bnum < blocks_count(); ++bnum) {
+    want[bnum] += checksum_holds(bnum) || blocks_is_table(bnum);
+  }
+  for (int ii = 0; ii < blocks_inode_capacity() / INODES_PER_CHUNK; ++ii) {
+    for (int jj = 0; chunk_ok(ii) && jj < (int) INODE_CHUNK_BLOCKS; ++jj) {
+      want[((int32_t *) get_inode_chunks())[ii] + jj]++;
+    }
+  }
+  for (int ii = 0; ii < SNAPSHOT_MAX; ++ii) {
+    for (int jj = 0; snaps[ii].table && jj < snaps[ii].blocks; ++jj) {
+      want[snaps[ii].table + jj]++;
+    }
+  }
+
+  for (int bnum = 1; bnum < blocks_count(); ++bnum) {
+    int total = want[bnum] + (frag_masks[bnum] != 0);
+    int used = bitmap_get(bbm, bnum);
+    if (total == 0 && used) {
+      problem(1, "block %i is allocated but unused", bnum);
+      if (repair) {
+        bitmap_put(bbm, bnum, 0);
+        refs[bnum] = 0;
+        map[bnum] = 0;
+        hashes[bnum] = 0;
+        count++;
+      }
+      continue;
+    } else if (total > 0 && !used) {
+      problem(1, "block %i is used but free in the bitmap", bnum);
+      if (repair) {
+        bitmap_put(bbm, bnum, 1);
+        count++;
+      }
+    }
+    if (total > 0 && refs[bnum] != total - 1) {
+      problem(1, "block %i has %i references, counted %i", bnum, refs[bnum] + 1, total);
+      if (repair) {
+        refs[bnum] = total - 1;
+        count++;
+      }
+    }
+    if (map[bnum] != frag_masks[bnum]) {
+      problem(1, "block %i has fragment map %#x, used %#x", bnum, map[bnum], frag_masks[bnum]);
+      if (repair) {
+        map[bnum] = frag_masks[bnum];
+        count++;
+      }
+    }
+  }
+  return count;
+}
+
+// report blocks that do not match their checksum, before anything is repaired
+static void check_sums() {
+  checksum_area_t *area = get_checksum_area();
+  if (!data_block(area->block) || !bitmap_get(get_blocks_bitmap(), area->block)) {
+    return;
+  }
+  next_item = 0;
+  run_threads(csum_worker);
+  for (int bnum = 0; bnum < blocks_count(); ++bnum) {
+    if (csum_bad[bnum]) {
+      problem(1, "block %i does not match its checksum", bnum);
+    }
+  }
+}
+
+// report free space counters that do not match the bitmaps, before anything
+// is repaired; repairs change the bitmaps, so the counters are counted
+// again at the end
+static void check_counters() {
+  blocks_counters_t *counters = get_blocks_counters();
+  int blocks = 0;
+  for (int bnum = 1; bnum < blocks_count(); ++bnum) {
+    blocks += !bitmap_get(get_blocks_bitmap(), bnum);
+  }
+  int inodes = 0;
+  for (int inum = 0; inum < blocks_inode_capacity(); ++inum) {
+    inodes += !bitmap_get(get_inode_bitmap(), inum);
+  }
+  if (counters->free_blocks != blocks) {
+    problem(1, "free block counter is %i, the bitmap has %i", counters->free_blocks, blocks);
+  }
+  if (counters->free_inodes != inodes) {
+    problem(1, "free inode counter is %i, the bitmap has %i", counters->free_inodes, inodes);
+  }
+}
+
+// report the snapshot records that make no sense; returns how many were dropped
+static int check_snapshots() {
+  int count = 0;
+  snapshot_t *snaps = snapshot_table();
+  for (int ii = 0; ii < SNAPSHOT_MAX; ++ii) {
+    snapshot_t *snap = &snaps[ii];
+    if (!snap->table) {
+      continue;
+    }
+    if ((snap->state != SNAPSHOT_ACTIVE && snap->state != SNAPSHOT_DELETING) ||
+        !data_block(snap->table) || snap->blocks < 1 || snap->table + snap->blocks > blocks_count() ||
+        !memchr(snap->name, 0, SNAPSHOT_NAME_LENGTH)) {
+      problem(1, "snapshot record %i is bad", ii);
+      if (repair) {
+        memset(snap, 0, sizeof(snapshot_t)); // its blocks become unused
+        count++;
+      }
+    }
+  }
+  return count;
+}
+
+// report chunks of the inode table that point nowhere and inodes allocated
+// in chunks the table does not have; returns how many were fixed
+static int check_chunks() {
+  int count = 0;
+  int32_t *chunks = get_inode_chunks();
+  void *ibm = get_inode_bitmap();
+  for (int ii = 0; ii < blocks_inode_capacity() / INODES_PER_CHUNK; ++ii) {
+    if (chunks[ii] && !chunk_ok(ii)) {
+      problem(ii > 0, "chunk %i of the inode table is at block %i", ii, chunks[ii]);
+      if (repair && ii > 0) {
+        chunks[ii] = 0; // its inodes are lost
+        count++;
+      }
+    }
+    int used = 0;
+    for (int inum = ii * INODES_PER_CHUNK; inum < (ii + 1) * INODES_PER_CHUNK; ++inum) {
+      used += bitmap_get(ibm, inum);
+    }
+    if (used && !chunks[ii]) {
+      problem(1, "%i inodes are allocated in chunk %i, which the table does not have", used, ii);
+      if (repair) {
+        memset((uint8_t *) ibm + ii * INODES_PER_CHUNK / 8, 0, INODES_PER_CHUNK / 8);
+        count++;
+      }
+    }
+  }
+  return count;
+}
+
+int main(int argc, char *argv[]) {
+  jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+  int usage = 0;
+  while ((opt = getopt(argc, argv, "rj:")) != -1) {
+    if (opt == 'r') {
+      repair = 1;
+    } else if (opt == 'j' && atoi(optarg) > 0) {
+      jobs = atoi(optarg);
+    } else {
+      usage = 1;
+    }
+  }
+  if (usage || optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-r] [-j THREADS] IMAGE\n", argv[0]);
+    return 8;
+  }
+  const char *image = argv[optind];
+  if (access(image, R_OK | W_OK) != 0) {
+    perror(image);
+    return 8;
+  }
+  if (jobs < 1) {
+    jobs = 1;
+  }
+
+  // the file system code logs to stdout and stderr, the report gets stdout
+  out = fdopen(dup(STDOUT_FILENO), "w");
+  if (!out || !freopen("/dev/null", "w", stdout) || !freopen("/dev/null", "w", stderr)) {
+    perror("stdout");
+    return 8;
+  }
+  blocks_init(image);
+  crc32c(0, NULL, 0); // builds the tables before the threads use them
+
+  if (!chunk_ok(0) || !bitmap_get(get_inode_bitmap(), ROOT_INUM) ||
+      !S_ISDIR(live_inode(ROOT_INUM)->mode)) {
+    fprintf(out, "%s: no root directory\n", image);
+    return 8;
+  }
+
+  // in repair mode every pass fixes one kind of problem, then looks again
+  check_sums();
+  check_counters();
+  for (int pass = 0; pass < 16; ++pass) {
+    gather();
+    if (!(check_chunks() || check_snapshots() || check_inodes() || check_dirs() ||
+          check_orphans() || check_links() || check_blocks())) {
+      break;
+    }
+  }
+
+  if (repair && fixed > 0) {
+    blocks_recount();
+
+    // every checksum matches what the blocks hold now
+    checksum_area_t *area = get_checksum_area();
+    if (data_block(area->block) && bitmap_get(get_blocks_bitmap(), area->block)) {
+      memset(get_checksum_stale(), 0xff, blocks_capacity() / 8);
+      checksum_init(0, 1);
+    }
+  }
+  blocks_free();
+
+  fprintf(out, "%s: %i problems, %i fixed\n", image, found, fixed);
+  fclose(out);
+  return found == 0 ? 0 : (found == fixed ? 1 : 4);
+}
@@ -0,0 +1,49 @@
+/**
+ * @file nufs-grow.c
+ * @author Alston Liu
+ *
+ * Grow a mounted nufs without unmounting it.
+ *
+ *   nufs-grow MNT SIZE    grow the image to SIZE bytes (K and M suffixes work)
+ *   nufs-grow MNT         print the size of the image
+ *
+ * The image file is extended and the new blocks are free at once. An image
+ * never shrinks, and never grows past the size nufs was compiled for; a
+ * mount with -o grow=STEP grows by STEP blocks on its own when it runs out.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nufs_ioctl.h"
+
+int main(int argc, char *argv[]) {
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "usage: %s MNT [SIZE]\n", argv[0]);
+    return 2;
+  }
+
+  nufs_grow_t req = {0};
+  if (argc == 3) {
+    char *unit;
+    req.size = strtoull(argv[2], &unit, 0);
+    req.size <<= (*unit == 'K' || *unit == 'k') ? 10 : (*unit == 'M' || *unit == 'm') ? 20 : 0;
+  }
+
+  int fd = open(argv[1], O_RDONLY);
+  if (fd < 0) {
+    perror(argv[1]);
+    return 1;
+  }
+  int rv = ioctl(fd, NUFS_IOC_GROW, &req);
+  if (rv < 0) {
+    fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+  } else {
+    printf("%s: %llu bytes\n", argv[1], (unsigned long long) req.size);
+  }
+  close(fd);
+  return rv < 0;
+}
@@ -0,0 +1,533 @@
+/**
+ * @file nufs-inspect.c
+ * @author Alston Liu
+ *
+ * Report how an image that is not mounted is laid out.
+ *
+ *   nufs-inspect [-J] [-s NAME] [-n TOP] [-w WIDTH] IMAGE
+ *
+ * One pass over the inode table and the directory tree gives:
+ *
+ *   - how full the image and the inode table are, chunk by chunk
+ *   - a histogram of the extents each file is stored in, and the TOP files
+ *     in the most pieces (10 by default)
+ *   - a histogram of the free runs by length
+ *   - the entries of every directory and how full its block is
+ *   - a map of the image, WIDTH blocks to a row (64 by default), with one
+ *     character for what each block holds; the data of a file shows the
+ *     number of extents it is in, so a fragmented file stands out
+ *
+ * With -s the tree of snapshot NAME is looked at instead of the live one.
+ * -J prints the same as one JSON object. Nothing is written to the image
+ * beyond what opening it always does (block 0 counters after a crash).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "storage.h"
+#include "bitmap.h"
+
+#define ROOT_INUM 0 // the root directory
+#define DIR_SLOTS (BLOCK_SIZE / (int) sizeof(dirent_t))
+#define HIST_BUCKETS 8 // lengths 1, 2-3, 4-7, ... 128 and more
+
+// what a block of the map holds, besides file data shown by its extents
+#define MAP_FREE '.'
+#define MAP_SUPER 'S'    // block 0 and the per-block tables: bitmaps, tables and counters
+#define MAP_INODES 'I'   // a chunk of the live inode table
+#define MAP_SNAPSHOT 'T' // the inode table of a snapshot
+#define MAP_CHECKSUM 'C'
+#define MAP_DIR 'D'
+#define MAP_INDIRECT 'X'
+#define MAP_TAILS 'P'    // packed tails of several files
+#define MAP_COMPR 'Z'    // a compressed cluster
+#define MAP_OTHER 'o'    // used, but not by the tree looked at
+
+static FILE *out;
+static int json = 0;
+static const char *snap_name = NULL;
+static snapshot_t *snap = NULL;
+static int top = 10;
+static int width = 64;
+
+static char map[BLOCK_COUNT_MAX];
+static int parent[INODE_LIMIT];  // directory an inode was first reached from, -1 if none
+static char names[INODE_LIMIT][DIR_NAME_LENGTH];
+static int extents[INODE_LIMIT]; // extents of every regular file
+
+// whether a block can hold file data
+static int data_block(int bnum) {
+  return bnum > 0 && bnum < blocks_count();
+}
+
+// an inode of the tree looked at, or NULL if it is free or out of reach
+static inode_t *tree_inode(int inum) {
+  if (snap) {
+    if (!bitmap_get(snapshot_inodes(snap), inum) || inum >= snap->blocks * BLOCK_SIZE / (int) INODE_SIZE) {
+      return NULL;
+    }
+    return (inode_t *) blocks_get_block(snap->table) + inum;
+  }
+  int first = ((int32_t *) get_inode_chunks())[inum / INODES_PER_CHUNK];
+  if (!bitmap_get(get_inode_bitmap(), inum) || !data_block(first) ||
+      first + INODE_CHUNK_BLOCKS > blocks_count()) {
+    return NULL;
+  }
+  return (inode_t *) blocks_get_block(first) + inum % INODES_PER_CHUNK;
+}
+
+// a block map entry, or BNUM_HOLE past a missing indirect block
+static int entry_at(inode_t *node, int ii) {
+  if (ii < MAX_BLOCKS) {
+    return node->block[ii];
+  } else if (!data_block(node->indirect)) {
+    return BNUM_HOLE;
+  }
+  return ((int *) blocks_get_block(node->indirect))[ii - MAX_BLOCKS];
+}
+
+// the block behind a block map entry, or -1 for a hole or nonsense
+static int entry_block(int entry) {
+  int bnum = inode_entry_block(entry);
+  return data_block(bnum) ? bnum : -1;
+}
+
+static int node_blocks(inode_t *node) {
+  if (node->flags & INODE_INLINE) {
+    return 0;
+  }
+  int max = MAX_BLOCKS + (int) INDIRECT_COUNT;
+  return (node->blocks < 0) ? 0 : (node->blocks > max) ? max : node->blocks;
+}
+
+// count the runs a file is stored in and mark its blocks on the map
+static int map_file(inode_t *node) {
+  int count = 0;
+  int prev = -2;
+  int blocks = node_blocks(node);
+  for (int ii = 0; ii < blocks; ++ii) {
+    int entry = entry_at(node, ii);
+    int bnum = entry_block(entry);
+    if (bnum >= 0 && bnum != prev + 1) {
+      count++;
+    }
+    prev = bnum;
+  }
+  char digit = (count > 9) ? '9' : '0' + count;
+  for (int ii = 0; ii < blocks; ++ii) {
+    int entry = entry_at(node, ii);
+    int bnum = entry_block(entry);
+    if (bnum >= 0) {
+      map[bnum] = (entry & BNUM_FRAG) ? MAP_TAILS : (entry & BNUM_COMPR) ? MAP_COMPR : digit;
+    }
+  }
+  if (blocks > MAX_BLOCKS && data_block(node->indirect)) {
+    map[node->indirect] = MAP_INDIRECT;
+  }
+  return count;
+}
+
+// the path of an inode reached from the root
+static void path_of(int inum, char *path, size_t len) {
+  if (inum == ROOT_INUM || parent[inum] < 0) {
+    snprintf(path, len, "%s", inum == ROOT_INUM ? "/" : "?");
+    return;
+  }
+  char up[len];
+  path_of(parent[inum], up, len);
+  snprintf(path, len, "%s%s%.*s", up, strcmp(up, "/") ? "/" : "", DIR_NAME_LENGTH, names[inum]);
+}
+
+// walk the tree from the root, breadth first, naming every inode
+static void walk() {
+  static int queue[INODE_LIMIT];
+  int len = 0;
+  for (int ii = 0; ii < INODE_LIMIT; ++ii) {
+    parent[ii] = -1;
+  }
+  queue[len++] = ROOT_INUM;
+  parent[ROOT_INUM] = ROOT_INUM;
+  for (int qq = 0; qq < len; ++qq) {
+    inode_t *dir = tree_inode(queue[qq]);
+    if (!dir || !S_ISDIR(dir->mode) || entry_block(dir->block[0]) < 0) {
+      continue;
+    }
+    dirent_t *entries = blocks_get_block(dir->block[0]);
+    for (int ii = 0; ii < dir->refs && ii < DIR_SLOTS; ++ii) {
+      int inum = entries[ii].inum;
+      if (!entries[ii].used || inum < 0 || inum >= blocks_inode_capacity() || parent[inum] >= 0 ||
+          !strcmp(entries[ii].name, ".") || !strcmp(entries[ii].name, "..")) {
+        continue;
+      }
+      parent[inum] = queue[qq];
+      memcpy(names[inum], entries[ii].name, DIR_NAME_LENGTH);
+      names[inum][DIR_NAME_LENGTH - 1] = '\0';
+      inode_t *node = tree_inode(inum);
+      if (node && S_ISDIR(node->mode)) {
+        queue[len++] = inum;
+      }
+    }
+  }
+}
+
+static int bucket(int len) {
+  int bb = 0;
+  while (len > 1 && bb < HIST_BUCKETS - 1) {
+    len >>= 1;
+    bb++;
+  }
+  return bb;
+}
+
+static void bucket_name(int bb, char *range) {
+  if (bb == HIST_BUCKETS - 1) {
+    sprintf(range, "%i+", 1 << bb);
+  } else if (bb == 0) {
+    sprintf(range, "1");
+  } else {
+    sprintf(range, "%i-%i", 1 << bb, (2 << bb) - 1);
+  }
+}
+
+static void json_string(const char *str) {
+  fputc('"', out);
+  for (; *str; ++str) {
+    if (*str == '"' || *str == '\\') {
+      fprintf(out, "\\%c", *str);
+    } else if ((unsigned char) *str < 0x20) {
+      fprintf(out, "\\u%04x", *str);
+    } else {
+      fputc(*str, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static void report_image() {
+  int used = 0;
+  for (int bb = 0; bb < blocks_count(); ++bb) {
+    used += bitmap_get(get_blocks_bitmap(), bb);
+  }
+
+  int chunks = 0;
+  int inodes = 0;
+  int room = blocks_inode_capacity() / INODES_PER_CHUNK; // chunks the table has room for
+  static int in_chunk[INODE_CHUNK_MAX];
+  for (int inum = 0; inum < room * INODES_PER_CHUNK; ++inum) {
+    int live = snap ? bitmap_get(snapshot_inodes(snap), inum) : bitmap_get(get_inode_bitmap(), inum);
+    in_chunk[inum / INODES_PER_CHUNK] += live;
+    inodes += live;
+  }
+  for (int cc = 0; cc < room; ++cc) {
+    chunks += snap ? cc * INODES_PER_CHUNK < snap->blocks * BLOCK_SIZE / (int) INODE_SIZE
+                   : ((int32_t *) get_inode_chunks())[cc] > 0;
+  }
+
+  if (json) {
+    fprintf(out, "\"blocks\": {\"total\": %i, \"used\": %i, \"free\": %i},\n", blocks_count(), used,
+            blocks_count() - used);
+    fprintf(out, "\"inodes\": {\"limit\": %i, \"chunks\": %i, \"chunks_max\": %i, \"used\": %i, "
+            "\"utilisation\": %.3f, \"per_chunk\": [", INODE_LIMIT, chunks, INODE_CHUNK_MAX,
+            inodes, chunks ? (double) inodes / (chunks * INODES_PER_CHUNK) : 0.0);
+    for (int cc = 0; cc < room; ++cc) {
+      fprintf(out, "%s%i", cc ? ", " : "", in_chunk[cc]);
+    }
+    fprintf(out, "]},\n");
+    return;
+  }
+  fprintf(out, "blocks: %i, %i used, %i free\n", blocks_count(), used, blocks_count() - used);
+  fprintf(out, "inodes: %i of %i in %i of %i chunks, %.1f%% of the table in use\n", inodes,
+          INODE_LIMIT, chunks, INODE_CHUNK_MAX,
+          chunks ? inodes * 100.0 / (chunks * INODES_PER_CHUNK) : 0.0);
+  for (int cc = 0; cc < room; ++cc) {
+    fprintf(out, "  chunk %i: %2i of %i\n", cc, in_chunk[cc], INODES_PER_CHUNK);
+  }
+}
+
+static int by_extents(const void *aa, const void *bb) {
+  int diff = extents[*(const int *) bb] - extents[*(const int *) aa];
+  return diff ? diff : *(const int *) aa - *(const int *) bb;
+}
+
+static void report_files() {
+  long files = 0;
+  long blocks = 0;
+  long total = 0;
+  long hist_files[HIST_BUCKETS] = {0};
+  long hist_blocks[HIST_BUCKETS] = {0};
+  static int order[INODE_LIMIT];
+  int count = 0;
+  for (int inum = 0; inum < blocks_inode_capacity(); ++inum) {
+    inode_t *node = tree_inode(inum);
+    if (!node || !S_ISREG(node->mode) || extents[inum] == 0) {
+      continue;
+    }
+    int bb = bucket(extents[inum]);
+    files++;
+    blocks += node_blocks(node);
+    total += extents[inum];
+    hist_files[bb]++;
+    hist_blocks[bb] += node_blocks(node);
+    order[count++] = inum;
+  }
+  qsort(order, count, sizeof(int), by_extents);
+  count = (count < top) ? count : top;
+
+  char range[32];
+  char path[1024];
+  if (json) {
+    fprintf(out, "\"files\": {\"count\": %ld, \"blocks\": %ld, \"extents\": %ld, "
+            "\"extents_per_file\": %.2f,\n  \"histogram\": [", files, blocks, total,
+            files ? (double) total / files : 0.0);
+    for (int bb = 0; bb < HIST_BUCKETS; ++bb) {
+      bucket_name(bb, range);
+      fprintf(out, "%s{\"extents\": \"%s\", \"files\": %ld, \"blocks\": %ld}", bb ? ", " : "",
+              range, hist_files[bb], hist_blocks[bb]);
+    }
+    fprintf(out, "],\n  \"most_fragmented\": [");
+    for (int ii = 0; ii < count; ++ii) {
+      path_of(order[ii], path, sizeof(path));
+      fprintf(out, "%s{\"inum\": %i, \"path\": ", ii ? ", " : "", order[ii]);
+      json_string(path);
+      fprintf(out, ", \"blocks\": %i, \"extents\": %i}", node_blocks(tree_inode(order[ii])),
+              extents[order[ii]]);
+    }
+    fprintf(out, "]},\n");
+    return;
+  }
+  fprintf(out, "files: %ld with blocks, %ld blocks in %ld extents, %.2f extents per file\n", files,
+          blocks, total, files ? (double) total / files : 0.0);
+  fprintf(out, "%-10s %8s %8s %8s\n", "extents", "files", "blocks", "% blocks");
+  for (int bb = 0; bb < HIST_BUCKETS; ++bb) {
+    bucket_name(bb, range);
+    fprintf(out, "%-10s %8ld %8ld %7.1f%%\n", range, hist_files[bb], hist_blocks[bb],
+            blocks ? hist_blocks[bb] * 100.0 / blocks : 0.0);
+  }
+  for (int ii = 0; ii < count && extents[order[ii]] > 1; ++ii) {
+    path_of(order[ii], path, sizeof(path));
+    fprintf(out, "  %3i extents %4i blocks  %s\n", extents[order[ii]],
+            node_blocks(tree_inode(order[ii])), path);
+  }
+}
+
+static void report_free() {
+  long runs[HIST_BUCKETS] = {0};
+  long run_blocks[HIST_BUCKETS] = {0};
+  long free = 0;
+  long count = 0;
+  int longest = 0;
+  void *bbm = get_blocks_bitmap();
+  for (int ii = 1; ii < blocks_count();) {
+    if (bitmap_get(bbm, ii)) {
+      ++ii;
+      continue;
+    }
+    int start = ii;
+    while (ii < blocks_count() && !bitmap_get(bbm, ii)) {
+      ++ii;
+    }
+    int len = ii - start;
+    runs[bucket(len)]++;
+    run_blocks[bucket(len)] += len;
+    free += len;
+    count++;
+    longest = (len > longest) ? len : longest;
+  }
+
+  char range[32];
+  if (json) {
+    fprintf(out, "\"free\": {\"blocks\": %ld, \"runs\": %ld, \"longest\": %i, \"histogram\": [",
+            free, count, longest);
+    for (int bb = 0; bb < HIST_BUCKETS; ++bb) {
+      bucket_name(bb, range);
+      fprintf(out, "%s{\"run\": \"%s\", \"runs\": %ld, \"blocks\": %ld}", bb ? ", " : "", range,
+              runs[bb], run_blocks[bb]);
+    }
+    fprintf(out, "]},\n");
+    return;
+  }
+  fprintf(out, "free: %ld blocks in %ld runs, longest %i\n", free, count, longest);
+  fprintf(out, "%-10s %8s %8s %8s\n", "run", "runs", "blocks", "% free");
+  for (int bb = 0; bb < HIST_BUCKETS; ++bb) {
+    bucket_name(bb, range);
+    fprintf(out, "%-10s %8ld %8ld %7.1f%%\n", range, runs[bb], run_blocks[bb],
+            free ? run_blocks[bb] * 100.0 / free : 0.0);
+  }
+}
+
+static void report_dirs() {
+  char path[1024];
+  int first = 1;
+  if (json) {
+    fprintf(out, "\"directories\": [");
+  } else {
+    fprintf(out, "directories: %-28s %8s %8s %6s\n", "", "entries", "bytes", "fill");
+  }
+  for (int inum = 0; inum < blocks_inode_capacity(); ++inum) {
+    inode_t *node = tree_inode(inum);
+    if (!node || !S_ISDIR(node->mode)) {
+      continue;
+    }
+    path_of(inum, path, sizeof(path));
+    double fill = (double) node->refs / DIR_SLOTS;
+    if (json) {
+      fprintf(out, "%s\n  {\"inum\": %i, \"path\": ", first ? "" : ",", inum);
+      json_string(path);
+      fprintf(out, ", \"entries\": %i, \"size\": %i, \"fill\": %.3f}", node->refs, node->size, fill);
+    } else {
+      fprintf(out, "  %-38s %8i %8i %5.1f%%\n", path, node->refs, node->size, fill * 100);
+    }
+    first = 0;
+  }
+  if (json) {
+    fprintf(out, "],\n");
+  }
+}
+
+static const char *legend[][2] = {
+  {".", "free"},
+  {"S", "block 0"},
+  {"I", "inode table"},
+  {"T", "snapshot inode table"},
+  {"C", "checksums"},
+  {"D", "directory"},
+  {"X", "indirect block"},
+  {"P", "packed tails"},
+  {"Z", "compressed cluster"},
+  {"1-9", "file data, by the extents of its file (9 for 9 or more)"},
+  {"o", "used, but not by this tree"},
+};
+
+static void report_map() {
+  int rows = (blocks_count() + width - 1) / width;
+  if (json) {
+    fprintf(out, "\"heatmap\": {\"width\": %i, \"legend\": {", width);
+  } else {
+    fprintf(out, "map: %i blocks to a row\n", width);
+  }
+  for (size_t ii = 0; ii < sizeof(legend) / sizeof(legend[0]); ++ii) {
+    if (json) {
+      fprintf(out, "%s\"%s\": \"%s\"", ii ? ", " : "", legend[ii][0], legend[ii][1]);
+    } else {
+      fprintf(out, "  %-3s %s\n", legend[ii][0], legend[ii][1]);
+    }
+  }
+  if (json) {
+    fprintf(out, "},\n  \"rows\": [");
+  }
+  for (int rr = 0; rr < rows; ++rr) {
+    int len = (blocks_count() - rr * width < width) ? blocks_count() - rr * width : width;
+    if (json) {
+      fprintf(out, "%s\n    \"%.*s\"", rr ? "," : "", len, map + rr * width);
+    } else {
+      fprintf(out, "%6i %.*s\n", rr * width, len, map + rr * width);
+    }
+  }
+  if (json) {
+    fprintf(out, "]}\n");
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "Js:n:w:")) != -1) {
+    if (opt == 'J') {
+      json = 1;
+    } else if (opt == 's') {
+      snap_name = optarg;
+    } else if (opt == 'n' && atoi(optarg) >= 0) {
+      top = atoi(optarg);
+    } else if (opt == 'w' && atoi(optarg) > 0) {
+      width = atoi(optarg);
+    } else {
+      optind = argc + 1;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-J] [-s NAME] [-n TOP] [-w WIDTH] IMAGE\n", argv[0]);
+    return 2;
+  }
+  const char *image = argv[optind];
+  if (access(image, R_OK | W_OK) != 0) {
+    perror(image);
+    return 1;
+  }
+
+  // the file system code logs to stdout and stderr, the report gets stdout
+  out = fdopen(dup(STDOUT_FILENO), "w");
+  if (!out || !freopen("/dev/null", "w", stdout) || !freopen("/dev/null", "w", stderr)) {
+    perror("stdout");
+    return 1;
+  }
+  blocks_init(image);
+
+  snapshot_t *snaps = snapshot_table();
+  for (int ii = 0; snap_name && ii < SNAPSHOT_MAX; ++ii) {
+    if (snaps[ii].table && snaps[ii].state == SNAPSHOT_ACTIVE &&
+        !strncmp(snaps[ii].name, snap_name, SNAPSHOT_NAME_LENGTH)) {
+      snap = &snaps[ii];
+    }
+  }
+  if (snap_name && (!snap || !data_block(snap->table))) {
+    fprintf(out, "%s: no snapshot %s\n", image, snap_name);
+    return 1;
+  }
+
+  // metadata first, then what the tree looked at uses; the rest of the
+  // used blocks belong to another tree, or to no one
+  for (int bb = 0; bb < blocks_count(); ++bb) {
+    map[bb] = bitmap_get(get_blocks_bitmap(), bb) ? MAP_OTHER : MAP_FREE;
+  }
+  for (int bb = 0; bb < blocks_count(); ++bb) {
+    map[bb] = blocks_is_table(bb) ? MAP_SUPER : checksum_holds(bb) ? MAP_CHECKSUM : map[bb];
+  }
+  for (int cc = 0; cc < blocks_inode_capacity() / INODES_PER_CHUNK; ++cc) {
+    int first = ((int32_t *) get_inode_chunks())[cc];
+    for (int bb = first; data_block(first) && bb < first + INODE_CHUNK_BLOCKS && data_block(bb); ++bb) {
+      map[bb] = MAP_INODES;
+    }
+  }
+  for (int ii = 0; ii < SNAPSHOT_MAX; ++ii) {
+    for (int bb = snaps[ii].table; snaps[ii].table && bb < snaps[ii].table + snaps[ii].blocks &&
+                                   data_block(bb); ++bb) {
+      map[bb] = MAP_SNAPSHOT;
+    }
+  }
+  for (int inum = 0; inum < blocks_inode_capacity(); ++inum) {
+    inode_t *node = tree_inode(inum);
+    if (!node) {
+      continue;
+    } else if (S_ISDIR(node->mode)) {
+      int bnum = entry_block(node->block[0]);
+      if (bnum >= 0) {
+        map[bnum] = MAP_DIR;
+      }
+    } else if (S_ISREG(node->mode)) {
+      extents[inum] = map_file(node);
+    }
+  }
+  walk();
+
+  if (json) {
+    fprintf(out, "{\n\"image\": ");
+    json_string(image);
+    fprintf(out, ",\n\"tree\": ");
+    json_string(snap ? snap_name : "live");
+    fprintf(out, ",\n");
+  } else {
+    fprintf(out, "%s: %s\n", image, snap ? snap_name : "live tree");
+  }
+  report_image();
+  report_files();
+  report_free();
+  report_dirs();
+  report_map();
+  if (json) {
+    fprintf(out, "}\n");
+  }
+  fclose(out);
+  blocks_free();
+  return 0;
+}
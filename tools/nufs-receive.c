@@ -0,0 +1,198 @@
+/**
+ * @file nufs-receive.c
+ * @author Alston Liu
+ *
+ * Apply a stream written by nufs-send to an image that is not mounted.
+ *
+ *   nufs-receive IMAGE < stream
+ *
+ * An incremental stream needs the parent snapshot on the image, and the
+ * image should not have changed since it was received. Once the stream is
+ * applied a snapshot with the name of the sent one is taken, so the next
+ * incremental stream has its parent.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+
+#include "storage.h"
+#include "bitmap.h"
+#include "nufs_stream.h"
+
+static FILE *in;
+
+static int take(void *data, size_t len) {
+  return fread(data, 1, len, in) == len ? 0 : -1;
+}
+
+// whether the image has a snapshot with this name
+static int has_snapshot(const char *name) {
+  snapshot_t *snaps = snapshot_table();
+  for (int ii = 0; ii < SNAPSHOT_MAX; ++ii) {
+    if (snaps[ii].table && !strncmp(snaps[ii].name, name, SNAPSHOT_NAME_LENGTH)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// give an inode the size and type it has in the stream
+static int apply_inode(int inum, nufs_rec_inode_t *meta) {
+  int used = bitmap_get(get_inode_bitmap(), inum);
+  if (used && meta->fresh) {
+    free_inode(inum);
+    used = 0;
+  }
+  if (!used && alloc_inode_at(inum, meta->mode) < 0) {
+    return -1;
+  }
+
+  inode_t *node = get_inode(inum);
+  if (!node) {
+    return -1;
+  }
+  if (meta->flags & INODE_COMPR) {
+    node->flags |= INODE_COMPR; // before the data, so it is compressed when flushed
+  } else {
+    node->flags &= ~INODE_COMPR;
+  }
+  if (S_ISDIR(meta->mode)) {
+    node->size = meta->size; // the blocks come as they are
+    return 0;
+  }
+  return storage_truncate_inode(inum, meta->size);
+}
+
+// set what writing the data changed back to what was sent
+static void finish_inode(int inum, nufs_rec_inode_t *meta) {
+  inode_t *node = get_inode(inum);
+  if (!node) {
+    return;
+  }
+  node->mode = meta->mode;
+  node->refs = meta->refs;
+  node->ctime = meta->ctime;
+  node->atime = meta->atime;
+  node->mtime = meta->mtime;
+  node->ctime_ns = meta->ctime_ns;
+  node->atime_ns = meta->atime_ns;
+  node->mtime_ns = meta->mtime_ns;
+}
+
+static int apply_data(nufs_rec_t *rec, const char *data) {
+  inode_t *node = get_inode(rec->inum);
+  if (!node) {
+    return -1;
+  } else if (S_ISDIR(node->mode)) {
+    void *block = inode_write_block(node, rec->index);
+    if (!block || rec->len != BLOCK_SIZE) {
+      return -1;
+    }
+    memcpy(block, data, BLOCK_SIZE);
+    return 0;
+  }
+  int rv = storage_write_inode(rec->inum, data, rec->len, (off_t) rec->index * BLOCK_SIZE);
+  return rv == (int) rec->len ? 0 : -1;
+}
+
+static int receive(const char *image) {
+  nufs_stream_header_t header;
+  if (take(&header, sizeof(header)) < 0 ||
+      memcmp(header.magic, NUFS_STREAM_MAGIC, sizeof(header.magic))) {
+    fprintf(stderr, "nufs-receive: not a nufs stream\n");
+    return -1;
+  }
+  header.snap[NUFS_SNAP_NAME_MAX - 1] = 0;
+  header.parent[NUFS_SNAP_NAME_MAX - 1] = 0;
+  if (*header.parent && !has_snapshot(header.parent)) {
+    fprintf(stderr, "%s: no parent snapshot %s\n", image, header.parent);
+    return -1;
+  }
+  if (has_snapshot(header.snap)) {
+    fprintf(stderr, "%s: snapshot %s is already there\n", image, header.snap);
+    return -1;
+  }
+
+  static char data[BLOCK_SIZE];
+  nufs_rec_inode_t meta;
+  int inum = -1; // inode whose records are being read
+  nufs_rec_t rec;
+  while (take(&rec, sizeof(rec)) == 0) {
+    if (rec.type != NUFS_REC_END && rec.inum >= INODE_LIMIT) {
+      break;
+    }
+    if (inum >= 0 && (rec.type != NUFS_REC_DATA && rec.type != NUFS_REC_HOLE)) {
+      finish_inode(inum, &meta);
+      inum = -1;
+    }
+
+    int rv = 0;
+    switch (rec.type) {
+    case NUFS_REC_INODE:
+      if (rec.len != sizeof(meta) || take(&meta, sizeof(meta)) < 0) {
+        rv = -1;
+        break;
+      }
+      inum = rec.inum;
+      rv = apply_inode(inum, &meta);
+      break;
+    case NUFS_REC_DATA:
+      if ((int) rec.inum != inum || rec.len > BLOCK_SIZE || take(data, rec.len) < 0) {
+        rv = -1;
+        break;
+      }
+      rv = apply_data(&rec, data);
+      break;
+    case NUFS_REC_HOLE:
+      if ((int) rec.inum != inum) {
+        rv = -1;
+        break;
+      }
+      rv = storage_fallocate_inode(inum, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                   (off_t) rec.index * BLOCK_SIZE, BLOCK_SIZE);
+      break;
+    case NUFS_REC_DELETE:
+      if (bitmap_get(get_inode_bitmap(), rec.inum)) {
+        free_inode(rec.inum);
+      }
+      break;
+    case NUFS_REC_END:
+      if (storage_flush_all() < 0 || storage_snapshot_create(header.snap) < 0) {
+        fprintf(stderr, "%s: cannot take snapshot %s\n", image, header.snap);
+        return -1;
+      }
+      return 0;
+    default:
+      rv = -1;
+    }
+    if (rv < 0) {
+      fprintf(stderr, "nufs-receive: record %u of inode %u failed\n", rec.type, rec.inum);
+      return -1;
+    }
+  }
+  fprintf(stderr, "nufs-receive: stream is cut short\n");
+  return -1;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s IMAGE < stream\n", argv[0]);
+    return 2;
+  }
+  in = stdin;
+  // the file system code logs to stdout
+  if (!freopen("/dev/null", "w", stdout)) {
+    perror("stdout");
+    return 1;
+  }
+
+  if (storage_init(argv[1], NULL) < 0) {
+    return 1;
+  }
+  storage_lock();
+  int rv = receive(argv[1]);
+  storage_unlock();
+  return rv < 0;
+}
@@ -0,0 +1,196 @@
+/**
+ * @file nufs-send.c
+ * @author Alston Liu
+ *
+ * Write what changed between two snapshots of an image as a stream.
+ *
+ *   nufs-send IMAGE SNAP [PARENT] > stream
+ *
+ * Without a parent everything in the snapshot is sent. The image may be
+ * mounted meanwhile, snapshots do not change.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "storage.h"
+#include "bitmap.h"
+#include "nufs_stream.h"
+
+static FILE *out;
+static long sent_inodes = 0;
+static long sent_blocks = 0;
+static long sent_bytes = 0;
+
+static void emit(const void *data, size_t len) {
+  fwrite(data, 1, len, out);
+  sent_bytes += len;
+}
+
+static void emit_rec(int type, int inum, int index, int len) {
+  nufs_rec_t rec = {type, inum, index, len};
+  emit(&rec, sizeof(rec));
+}
+
+// find the record of a snapshot that can be read
+static snapshot_t *find_snapshot(const char *name) {
+  snapshot_t *snaps = snapshot_table();
+  for (int ii = 0; ii < SNAPSHOT_MAX; ++ii) {
+    if (snaps[ii].table && snaps[ii].state == SNAPSHOT_ACTIVE &&
+        !strncmp(snaps[ii].name, name, SNAPSHOT_NAME_LENGTH)) {
+      return &snaps[ii];
+    }
+  }
+  return NULL;
+}
+
+// mark the blocks of cur that differ from par. A compressed cluster goes
+// whole, since its holes stay holes when only its stream changes
+static void changed_blocks(inode_t *cur, inode_t *par, char *changed) {
+  for (int ii = 0; ii < cur->blocks; ++ii) {
+    changed[ii] = !par || ii >= par->blocks ||
+                  inode_get_entry(cur, ii) != inode_get_entry(par, ii);
+  }
+  for (int first = 0; first < cur->blocks; first += CLUSTER_BLOCKS) {
+    int any = 0;
+    int compr = 0;
+    for (int ii = first; ii < first + CLUSTER_BLOCKS && ii < cur->blocks; ++ii) {
+      int a = inode_get_entry(cur, ii);
+      int b = par ? inode_get_entry(par, ii) : BNUM_HOLE;
+      any |= changed[ii];
+      compr |= (a >= 0 && (a & BNUM_COMPR)) || (b >= 0 && (b & BNUM_COMPR));
+    }
+    for (int ii = first; any && compr && ii < first + CLUSTER_BLOCKS && ii < cur->blocks; ++ii) {
+      changed[ii] = 1;
+    }
+  }
+}
+
+// send an inode of the snapshot if it is new or differs from the parent.
+// Only an inode number reused since the parent, with a new gen, or one
+// that changed type goes whole; otherwise only the changed blocks go
+static void send_inode(int inum, inode_t *cur, inode_t *par) {
+  int fresh = !par || par->gen != cur->gen || (par->mode & S_IFMT) != (cur->mode & S_IFMT);
+  int inline_data = cur->flags & INODE_INLINE;
+  int same_map = !fresh && !inline_data && !(par->flags & INODE_INLINE);
+
+  char *changed = calloc(cur->blocks + 1, 1);
+  int any = 0;
+  if (inline_data) {
+    any = fresh || !(par->flags & INODE_INLINE) || par->size != cur->size ||
+          memcmp(inode_inline_data(par), inode_inline_data(cur), cur->size);
+  } else {
+    changed_blocks(cur, same_map ? par : NULL, changed);
+    for (int ii = 0; ii < cur->blocks; ++ii) {
+      any |= changed[ii];
+    }
+  }
+  if (!any && par->mode == cur->mode && par->refs == cur->refs && par->size == cur->size &&
+      (par->flags & INODE_COMPR) == (cur->flags & INODE_COMPR) && par->mtime == cur->mtime &&
+      par->mtime_ns == cur->mtime_ns) {
+    free(changed);
+    return; // a new access time alone is not worth sending
+  }
+
+  nufs_rec_inode_t meta = {fresh, cur->mode, cur->refs, cur->flags & INODE_COMPR,
+                           cur->size, cur->ctime, cur->atime, cur->mtime,
+                           cur->ctime_ns, cur->atime_ns, cur->mtime_ns, 0};
+  emit_rec(NUFS_REC_INODE, inum, 0, sizeof(meta));
+  emit(&meta, sizeof(meta));
+  sent_inodes++;
+
+  char block[BLOCK_SIZE];
+  if (inline_data) {
+    if (any && cur->size > 0) {
+      emit_rec(NUFS_REC_DATA, inum, 0, cur->size);
+      emit(inode_inline_data(cur), cur->size);
+    }
+  } else if (S_ISDIR(cur->mode)) {
+    // directory blocks go as they are, the inode numbers match
+    for (int ii = 0; ii < cur->blocks; ++ii) {
+      if (changed[ii]) {
+        emit_rec(NUFS_REC_DATA, inum, ii, BLOCK_SIZE);
+        emit(inode_get_block(cur, ii), BLOCK_SIZE);
+        sent_blocks++;
+      }
+    }
+  } else {
+    for (int ii = 0; ii < cur->blocks && ii * BLOCK_SIZE < cur->size; ++ii) {
+      if (!changed[ii]) {
+        continue;
+      }
+      int entry = inode_get_entry(cur, ii);
+      int offset = ii * BLOCK_SIZE;
+      int hole = (entry < 0 || (entry & BNUM_UNWRITTEN)) && !compress_is_compressed(cur, offset);
+      if (hole) {
+        emit_rec(NUFS_REC_HOLE, inum, ii, 0);
+        continue;
+      }
+      int len = (cur->size - offset < BLOCK_SIZE) ? cur->size - offset : BLOCK_SIZE;
+      len = storage_read_inode(inum, block, len, offset);
+      emit_rec(NUFS_REC_DATA, inum, ii, len);
+      emit(block, len);
+      sent_blocks++;
+    }
+  }
+  free(changed);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr, "usage: %s IMAGE SNAP [PARENT] > stream\n", argv[0]);
+    return 2;
+  }
+  const char *parent = (argc == 4) ? argv[3] : "";
+
+  // the file system code logs to stdout, the stream gets the real one
+  out = fdopen(dup(STDOUT_FILENO), "w");
+  if (!out || !freopen("/dev/null", "w", stdout)) {
+    perror("stdout");
+    return 1;
+  }
+
+  storage_options_t opts = {0};
+  opts.snapshot = argv[2];
+  if (storage_init(argv[1], &opts) < 0) {
+    fprintf(stderr, "%s: no snapshot named %s\n", argv[1], argv[2]);
+    return 1;
+  }
+  snapshot_t *snap = find_snapshot(argv[2]);
+  snapshot_t *base = *parent ? find_snapshot(parent) : NULL;
+  inode_t *par_table = base ? snapshot_open(parent) : NULL;
+  if (*parent && !par_table) {
+    fprintf(stderr, "%s: no snapshot named %s\n", argv[1], parent);
+    return 1;
+  }
+
+  nufs_stream_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, NUFS_STREAM_MAGIC, sizeof(header.magic));
+  strncpy(header.snap, argv[2], NUFS_SNAP_NAME_MAX - 1);
+  strncpy(header.parent, parent, NUFS_SNAP_NAME_MAX - 1);
+  emit(&header, sizeof(header));
+
+  for (int inum = 0; inum < blocks_inode_capacity(); ++inum) {
+    int in_snap = bitmap_get(snapshot_inodes(snap), inum);
+    int in_base = base && bitmap_get(snapshot_inodes(base), inum);
+    inode_t *node = in_snap ? get_inode(inum) : NULL;
+    if (in_snap && !node) {
+      fprintf(stderr, "%s: inode %d of %s is corrupt\n", argv[1], inum, argv[2]);
+      return 1;
+    } else if (in_snap) {
+      send_inode(inum, node, in_base ? par_table + inum : NULL);
+    } else if (in_base) {
+      emit_rec(NUFS_REC_DELETE, inum, 0, 0);
+      sent_inodes++;
+    }
+  }
+  emit_rec(NUFS_REC_END, 0, 0, 0);
+
+  fclose(out);
+  fprintf(stderr, "nufs-send: %ld inodes, %ld blocks, %ld bytes\n",
+          sent_inodes, sent_blocks, sent_bytes);
+  free(par_table);
+  return 0;
+}
@@ -0,0 +1,70 @@
+/**
+ * @file nufs-snap.c
+ * @author Alston Liu
+ *
+ * Manage the snapshots of a mounted nufs.
+ *
+ *   nufs-snap create MNT NAME    take a snapshot of everything under MNT
+ *   nufs-snap delete MNT NAME    delete it; its blocks come back in the background
+ *   nufs-snap list MNT           list the snapshots
+ *
+ * A snapshot is mounted read only with ./nufs -o snapshot=NAME mnt2 data.nufs.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nufs_ioctl.h"
+
+static int usage(const char *prog) {
+  fprintf(stderr, "usage: %s create|delete MNT NAME\n       %s list MNT\n", prog, prog);
+  return 2;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    return usage(argv[0]);
+  }
+  const char *cmd = argv[1];
+  int list = !strcmp(cmd, "list");
+  if (list ? argc != 3 : (argc != 4 || (strcmp(cmd, "create") && strcmp(cmd, "delete")))) {
+    return usage(argv[0]);
+  }
+
+  int fd = open(argv[2], O_RDONLY);
+  if (fd < 0) {
+    perror(argv[2]);
+    return 1;
+  }
+
+  int rv;
+  if (list) {
+    nufs_snap_list_t snaps;
+    rv = ioctl(fd, NUFS_IOC_SNAP_LIST, &snaps);
+    for (int ii = 0; rv == 0 && ii < snaps.count; ++ii) {
+      char when[32];
+      time_t ctime = snaps.snaps[ii].ctime;
+      strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&ctime));
+      printf("%-24s %s%s\n", snaps.snaps[ii].name, when,
+             snaps.snaps[ii].deleting ? " (deleting)" : "");
+    }
+  } else {
+    nufs_snap_t snap;
+    memset(&snap, 0, sizeof(snap));
+    if (strlen(argv[3]) >= NUFS_SNAP_NAME_MAX) {
+      fprintf(stderr, "%s: name too long\n", argv[3]);
+      close(fd);
+      return 1;
+    }
+    strcpy(snap.name, argv[3]);
+    rv = ioctl(fd, !strcmp(cmd, "create") ? NUFS_IOC_SNAP_CREATE : NUFS_IOC_SNAP_DELETE, &snap);
+  }
+  if (rv < 0) {
+    fprintf(stderr, "%s %s: %s\n", cmd, argv[2], strerror(errno));
+  }
+  close(fd);
+  return rv < 0;
+}
@@ -0,0 +1,65 @@
+/**
+ * @file nufs-trim.c
+ * @author Alston Liu
+ *
+ * Give the free blocks of a mounted nufs back to the host, as fstrim does
+ * for a disk: they are punched out of the image file, which then only
+ * takes room on the host for the blocks in use.
+ *
+ *   nufs-trim [-v] [-o OFFSET] [-l LENGTH] [-m MINLEN] MNT
+ *
+ * OFFSET and LENGTH pick a byte range of the image, MINLEN skips free runs
+ * shorter than that many bytes. Mounting with -o discard does the same in
+ * the background for every block as it is freed.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nufs_ioctl.h"
+
+int main(int argc, char *argv[]) {
+  nufs_trim_t req = {0, UINT64_MAX, 0};
+  int verbose = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "vo:l:m:")) != -1) {
+    switch (opt) {
+    case 'v':
+      verbose = 1;
+      break;
+    case 'o':
+      req.start = strtoull(optarg, NULL, 0);
+      break;
+    case 'l':
+      req.len = strtoull(optarg, NULL, 0);
+      break;
+    case 'm':
+      req.minlen = strtoull(optarg, NULL, 0);
+      break;
+    default:
+      optind = argc;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-v] [-o OFFSET] [-l LENGTH] [-m MINLEN] MNT\n", argv[0]);
+    return 2;
+  }
+
+  const char *mnt = argv[optind];
+  int fd = open(mnt, O_RDONLY);
+  if (fd < 0) {
+    perror(mnt);
+    return 1;
+  }
+  int rv = ioctl(fd, NUFS_IOC_TRIM, &req);
+  if (rv < 0) {
+    fprintf(stderr, "%s: %s\n", mnt, strerror(errno));
+  } else if (verbose) {
+    printf("%s: %llu bytes trimmed\n", mnt, (unsigned long long) req.len);
+  }
+  close(fd);
+  return rv < 0;
+}
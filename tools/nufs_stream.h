@@ -0,0 +1,62 @@
+/**
+ * @file nufs_stream.h
+ * @author Alston Liu
+ *
+ * The stream written by nufs-send and read by nufs-receive.
+ *
+ * A header names the snapshot the stream recreates and the parent snapshot
+ * it is relative to (empty for a full stream). Records follow, each one a
+ * nufs_rec_t; an inode record is followed by a nufs_rec_inode_t and a data
+ * record by its bytes. Records of one inode come together, the inode
+ * record first. Inode numbers are kept, so directory blocks are sent as
+ * they are.
+ *
+ * Only what changed between the parent and the snapshot is sent: with
+ * copy-on-write every block written since the parent has a new address,
+ * so comparing the two block maps finds the changed blocks without any
+ * tracking while the file system runs.
+ */
+#ifndef NUFS_STREAM_H
+#define NUFS_STREAM_H
+
+#include <stdint.h>
+
+#include "nufs_ioctl.h"
+
+#define NUFS_STREAM_MAGIC "NUFSSND2" // 2: times to the nanosecond
+
+#define NUFS_REC_INODE 1  // metadata of a new or changed inode
+#define NUFS_REC_DATA 2   // len bytes of data of one block
+#define NUFS_REC_HOLE 3   // one block that reads as zeros
+#define NUFS_REC_DELETE 4 // an inode that is gone
+#define NUFS_REC_END 5    // end of the stream
+
+typedef struct nufs_stream_header {
+  char magic[8];
+  char snap[NUFS_SNAP_NAME_MAX];   // snapshot recreated by the stream
+  char parent[NUFS_SNAP_NAME_MAX]; // snapshot it is relative to, or empty
+} nufs_stream_header_t;
+
+typedef struct nufs_rec {
+  uint32_t type;  // NUFS_REC_*
+  uint32_t inum;  // inode the record is about
+  uint32_t index; // block index in the file, for data and holes
+  uint32_t len;   // bytes of data following a data record
+} nufs_rec_t;
+
+typedef struct nufs_rec_inode {
+  int32_t fresh; // 1 if any inode with this number on the receiver goes first
+  int32_t mode;
+  int32_t refs;
+  int32_t flags; // INODE_COMPR only
+  int64_t size;
+  int64_t ctime;
+  int64_t atime;
+  int64_t mtime;
+  int32_t ctime_ns;
+  int32_t atime_ns;
+  int32_t mtime_ns;
+  int32_t pad;
+} nufs_rec_inode_t;
+
+#endif